@@ -17,7 +17,10 @@
 #pragma once
 
 #define KEYMASTER_PORT "com.android.trusty.keymaster"
-#define KEYMASTER_MAX_BUFFER_LENGTH 4096
+// Must fit, together with the tipc header, into a single message buffer of
+// the NS driver (TIPC_MSG_BUF_MAX_SIZE, larger messages are sent as chains
+// of pages), and into a port buffer (IPC_CHAN_MAX_BUF_SIZE).
+#define KEYMASTER_MAX_BUFFER_LENGTH 12288
 
 // Commands
 enum keymaster_command {
@@ -24,8 +24,9 @@ trusty_app_manifest_t TRUSTY_APP_MANIFEST_ATTRS trusty_app_manifest =
 
 	/* optional configuration options here */
 	{
-		/* openssl need a larger heap */
-		TRUSTY_APP_CONFIG_MIN_HEAP_SIZE(24 * 4096),
+		/* openssl need a larger heap (plus request and response
+		   buffers of up to KEYMASTER_MAX_BUFFER_LENGTH) */
+		TRUSTY_APP_CONFIG_MIN_HEAP_SIZE(32 * 4096),
 
 		/* openssl need a larger stack */
 		TRUSTY_APP_CONFIG_MIN_STACK_SIZE(8 * 4096),
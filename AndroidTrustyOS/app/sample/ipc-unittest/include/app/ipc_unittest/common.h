@@ -20,7 +20,9 @@
 #define MAX_USER_HANDLES     64    /* max number of user handles */
 #define MAX_PORT_PATH_LEN    64    /* max length of port path name   */
 #define MAX_PORT_BUF_NUM     32    /* max number of per port buffers */
-#define MAX_PORT_BUF_SIZE  4096    /* max size of per port buffer    */
+#define MAX_PORT_BUF_SIZE  4096    /* default size of port buffer    */
+#define MAX_CHAN_BUF_SIZE 16384    /* max size of per port buffer    */
+#define LARGE_MSG_SIZE    12288    /* buffer size of echo_large port */
 
 #define TLOGI(fmt, ...) \
     fprintf(stderr, "%s: %d: " fmt, LOG_TAG, __LINE__,  ## __VA_ARGS__)
@@ -272,6 +272,11 @@ static void run_port_create_negative_test(void)
 	rc = port_create(path,  2, MAX_PORT_BUF_SIZE * 100, 0);
 	EXPECT_EQ (ERR_INVALID_ARGS, rc, "large buf size");
 
+	/* create port with buffer size just above the limit */
+	sprintf(path, "%s.port", SRV_PATH_BASE);
+	rc = port_create(path,  2, MAX_CHAN_BUF_SIZE + 1, 0);
+	EXPECT_EQ (ERR_INVALID_ARGS, rc, "buf size above limit");
+
 	/* create port with path oversized name */
 	int len = sprintf(path, "%s.port", SRV_PATH_BASE);
 	for (uint i = len; i < sizeof(path); i++) path[i] = 'a';
@@ -1445,6 +1450,653 @@ abort_test:
 	TEST_END
 }
 
+/*
+ *  Echo messages larger than a page. NS clients can run the same exchange
+ *  against the echo_large port over tipc.
+ */
+static uint8_t large_tx_buf[LARGE_MSG_SIZE];
+static uint8_t large_rx_buf[LARGE_MSG_SIZE];
+
+static void run_end_to_end_large_msg_test(void)
+{
+	int rc;
+	handle_t chan;
+	uevent_t uevt;
+	char path[MAX_PORT_PATH_LEN];
+	ipc_msg_info_t inf;
+	ipc_msg_t   tx_msg;
+	iovec_t     tx_iov;
+	ipc_msg_t   rx_msg;
+	iovec_t     rx_iov;
+
+	TEST_BEGIN(__func__);
+
+	tx_iov.base = large_tx_buf;
+	tx_iov.len  = sizeof(large_tx_buf);
+	tx_msg.num_iov = 1;
+	tx_msg.iov     = &tx_iov;
+	tx_msg.num_handles = 0;
+	tx_msg.handles = NULL;
+
+	rx_iov.base = large_rx_buf;
+	rx_iov.len  = sizeof(large_rx_buf);
+	rx_msg.num_iov = 1;
+	rx_msg.iov     = &rx_iov;
+	rx_msg.num_handles = 0;
+	rx_msg.handles = NULL;
+
+	for (uint i = 0; i < sizeof(large_tx_buf); i++)
+		large_tx_buf[i] = (uint8_t)(i * 7 + (i >> 8));
+	memset (large_rx_buf, 0xaa, sizeof(large_rx_buf));
+
+	sprintf(path, "%s.srv.%s", SRV_PATH_BASE,  "echo_large");
+	rc = sync_connect(path, 1000);
+	EXPECT_GE_ZERO (rc, "connect to echo_large");
+
+	if (rc >= 0) {
+		chan = (handle_t) rc;
+
+		rc = send_msg(chan, &tx_msg);
+		EXPECT_EQ (LARGE_MSG_SIZE, rc, "sending large msg to echo");
+
+		rc = wait(chan, &uevt, 1000);
+		EXPECT_EQ (NO_ERROR, rc, "waiting on echo response");
+		EXPECT_EQ (chan, uevt.handle, "wait on channel");
+
+		rc = get_msg(chan, &inf);
+		EXPECT_EQ (NO_ERROR, rc, "getting echo msg");
+		EXPECT_EQ (LARGE_MSG_SIZE, inf.len, "echo message reply length");
+
+		rc = read_msg(chan, inf.id, 0, &rx_msg);
+		EXPECT_EQ (LARGE_MSG_SIZE, rc, "reading large echo msg");
+
+		rc = memcmp(large_tx_buf, large_rx_buf, sizeof(large_rx_buf));
+		EXPECT_EQ (0, rc, "large echo msg content");
+
+		rc = put_msg(chan, inf.id);
+		EXPECT_EQ (NO_ERROR, rc, "putting echo msg");
+
+		rc = close(chan);
+		EXPECT_EQ (NO_ERROR, rc, "close channel");
+	}
+
+	TEST_END
+}
+
+
+/*
+ *  Send messages through mapped message buffers of a channel connected
+ *  to a port we created ourself.
+ */
+static void run_shared_bufs_test(void)
+{
+	int rc;
+	handle_t port;
+	handle_t cchan;
+	handle_t schan;
+	uuid_t peer_uuid;
+	char path[MAX_PORT_PATH_LEN];
+	ipc_msg_bufs_t cbufs;
+	ipc_msg_bufs_t sbufs;
+	ipc_msg_info_t inf;
+	uint8_t pattern[64];
+
+	TEST_BEGIN(__func__);
+
+	fill_test_buf(pattern, sizeof(pattern), 0x33);
+
+	sprintf(path, "%s.main.%s", SRV_PATH_BASE, "shared_bufs");
+	rc = port_create(path, 2, 64,
+	                 IPC_PORT_ALLOW_TA_CONNECT | IPC_PORT_SHARED_BUFS);
+	EXPECT_GE_ZERO (rc, "create shared port");
+	if (rc < 0)
+		goto err_port_create;
+	port = (handle_t) rc;
+
+	/* async connect attaches to the port right away */
+	rc = connect(path, IPC_CONNECT_ASYNC);
+	EXPECT_GE_ZERO (rc, "connect to shared port");
+	if (rc < 0)
+		goto err_connect;
+	cchan = (handle_t) rc;
+
+	rc = accept(port, &peer_uuid);
+	EXPECT_GE_ZERO (rc, "accept shared");
+	if (rc < 0)
+		goto err_accept;
+	schan = (handle_t) rc;
+
+	rc = get_send_buf(cchan, &inf);
+	EXPECT_EQ (ERR_NOT_READY, rc, "get_send_buf before map");
+
+	rc = map_msg_bufs(cchan, &cbufs);
+	EXPECT_EQ (NO_ERROR, rc, "map client bufs");
+	rc = map_msg_bufs(schan, &sbufs);
+	EXPECT_EQ (NO_ERROR, rc, "map server bufs");
+	rc = map_msg_bufs(schan, &sbufs);
+	EXPECT_EQ (ERR_ALREADY_EXISTS, rc, "map server bufs twice");
+	if (!_all_ok)
+		goto abort_test;
+
+	EXPECT_EQ (2, cbufs.num_bufs, "num_bufs");
+	EXPECT_EQ (64, cbufs.buf_size, "buf_size");
+
+	for (uint i = 0; i < 100; i++) {
+		/* client fills a buffer in place and sends it */
+		rc = get_send_buf(cchan, &inf);
+		EXPECT_EQ (NO_ERROR, rc, "get_send_buf");
+		EXPECT_EQ (64, inf.len, "get_send_buf");
+		if (rc != NO_ERROR)
+			break;
+		memcpy((uint8_t *)cbufs.tx_base + inf.id * cbufs.buf_size,
+		       pattern, sizeof(pattern));
+		rc = send_buf(cchan, inf.id, sizeof(pattern));
+		EXPECT_EQ (64, rc, "send_buf");
+
+		/* server reads it from its receive mapping */
+		rc = get_msg(schan, &inf);
+		EXPECT_EQ (NO_ERROR, rc, "get_msg");
+		EXPECT_EQ (64, inf.len, "get_msg");
+		if (rc != NO_ERROR)
+			break;
+		rc = memcmp((const uint8_t *)sbufs.rx_base +
+		            inf.id * sbufs.buf_size, pattern, sizeof(pattern));
+		EXPECT_EQ (0, rc, "shared data");
+		rc = put_msg(schan, inf.id);
+		EXPECT_EQ (NO_ERROR, rc, "put_msg");
+
+		if (!_all_ok)
+			break;
+	}
+
+	/* run out of buffers, then return one that was never sent */
+	rc = get_send_buf(cchan, &inf);
+	EXPECT_EQ (NO_ERROR, rc, "get_send_buf");
+	rc = get_send_buf(cchan, &inf);
+	EXPECT_EQ (NO_ERROR, rc, "get_send_buf");
+	rc = get_send_buf(cchan, &inf);
+	EXPECT_EQ (ERR_NOT_ENOUGH_BUFFER, rc, "get_send_buf when full");
+	rc = send_buf(cchan, inf.id, 65);
+	EXPECT_EQ (ERR_INVALID_ARGS, rc, "send_buf too big");
+	rc = send_buf(cchan, 2, 0);
+	EXPECT_EQ (ERR_INVALID_ARGS, rc, "send_buf invalid id");
+
+abort_test:
+	rc = close(schan);
+	EXPECT_EQ (NO_ERROR, rc, "close server chan");
+err_accept:
+	rc = close(cchan);
+	EXPECT_EQ (NO_ERROR, rc, "close client chan");
+err_connect:
+	rc = close(port);
+	EXPECT_EQ (NO_ERROR, rc, "close shared port");
+err_port_create:
+	TEST_END
+}
+
+/*
+ *  Collect events for several channels with a single wait_many call
+ */
+static void run_wait_many_test(void)
+{
+	int rc;
+	handle_t port;
+	handle_t cchan[2];
+	handle_t schan[2];
+	uuid_t peer_uuid;
+	char path[MAX_PORT_PATH_LEN];
+	uint8_t buf[32];
+	iovec_t iov;
+	ipc_msg_t msg;
+	ipc_msg_info_t inf;
+	uevent_t events[8];
+	uint i, found;
+
+	TEST_BEGIN(__func__);
+
+	for (i = 0; i < countof(cchan); i++) {
+		cchan[i] = INVALID_IPC_HANDLE;
+		schan[i] = INVALID_IPC_HANDLE;
+	}
+
+	fill_test_buf(buf, sizeof(buf), 0x21);
+	iov.base = buf;
+	iov.len  = sizeof(buf);
+	msg.num_handles = 0;
+	msg.handles = NULL;
+	msg.num_iov = 1;
+	msg.iov = &iov;
+
+	rc = wait_many(events, 0, 0);
+	EXPECT_EQ (ERR_INVALID_ARGS, rc, "wait_many for no events");
+
+	sprintf(path, "%s.main.%s", SRV_PATH_BASE, "wait_many");
+	rc = port_create(path, 2, 64, IPC_PORT_ALLOW_TA_CONNECT);
+	EXPECT_GE_ZERO (rc, "create port");
+	if (rc < 0)
+		goto err_port_create;
+	port = (handle_t) rc;
+
+	for (i = 0; i < countof(cchan); i++) {
+		rc = connect(path, IPC_CONNECT_ASYNC);
+		EXPECT_GE_ZERO (rc, "connect");
+		if (rc < 0)
+			goto abort_test;
+		cchan[i] = (handle_t) rc;
+
+		rc = accept(port, &peer_uuid);
+		EXPECT_GE_ZERO (rc, "accept");
+		if (rc < 0)
+			goto abort_test;
+		schan[i] = (handle_t) rc;
+
+		rc = send_msg(cchan[i], &msg);
+		EXPECT_EQ ((int) sizeof(buf), rc, "send_msg");
+	}
+	if (!_all_ok)
+		goto abort_test;
+
+	/*
+	 * Both server channels have a message pending. Events are level
+	 * triggered, so they are reported again until messages are retired.
+	 */
+	for (uint pass = 0; pass < 2; pass++) {
+		found = 0;
+		for (uint tries = 0; tries < 8 && found != 0x3; tries++) {
+			rc = wait_many(events, countof(events), 1000);
+			EXPECT_GT_ZERO (rc, "wait_many");
+			if (rc <= 0)
+				break;
+			for (int j = 0; j < rc; j++) {
+				for (i = 0; i < countof(schan); i++) {
+					if (events[j].handle == schan[i] &&
+					    (events[j].event &
+					     IPC_HANDLE_POLL_MSG))
+						found |= 1U << i;
+				}
+			}
+		}
+		EXPECT_EQ (0x3, found, "wait_many reports all channels");
+	}
+
+	for (i = 0; i < countof(schan); i++) {
+		rc = get_msg(schan[i], &inf);
+		EXPECT_EQ (NO_ERROR, rc, "get_msg");
+		if (rc == NO_ERROR) {
+			rc = put_msg(schan[i], inf.id);
+			EXPECT_EQ (NO_ERROR, rc, "put_msg");
+		}
+	}
+
+abort_test:
+	for (i = 0; i < countof(cchan); i++) {
+		if (schan[i] != INVALID_IPC_HANDLE) {
+			rc = close(schan[i]);
+			EXPECT_EQ (NO_ERROR, rc, "close server chan");
+		}
+		if (cchan[i] != INVALID_IPC_HANDLE) {
+			rc = close(cchan[i]);
+			EXPECT_EQ (NO_ERROR, rc, "close client chan");
+		}
+	}
+	rc = close(port);
+	EXPECT_EQ (NO_ERROR, rc, "close port");
+err_port_create:
+	TEST_END
+}
+
+/*
+ *  Pass a memory object to ourself over a channel and map it
+ */
+static void run_send_handle_test(void)
+{
+	int rc;
+	handle_t port;
+	handle_t cchan;
+	handle_t schan;
+	handle_t memref;
+	handle_t rx_handle = INVALID_IPC_HANDLE;
+	uuid_t peer_uuid;
+	char path[MAX_PORT_PATH_LEN];
+	static uint8_t obj_buf[256];
+	uint8_t data[8];
+	iovec_t iov;
+	ipc_msg_t msg;
+	ipc_msg_info_t inf;
+
+	TEST_BEGIN(__func__);
+
+	fill_test_buf(obj_buf, sizeof(obj_buf), 0x11);
+
+	rc = memref_create(obj_buf, sizeof(obj_buf), MMAP_FLAG_PROT_READ);
+	if (rc == ERR_NOT_SUPPORTED) {
+		TLOGI("%s: memory objects are not supported\n", __func__);
+		goto err_memref_create;
+	}
+	EXPECT_GE_ZERO (rc, "memref_create");
+	if (rc < 0)
+		goto err_memref_create;
+	memref = (handle_t) rc;
+
+	sprintf(path, "%s.main.%s", SRV_PATH_BASE, "send_handle");
+	rc = port_create(path, 2, sizeof(data), IPC_PORT_ALLOW_TA_CONNECT);
+	EXPECT_GE_ZERO (rc, "create port");
+	if (rc < 0)
+		goto err_port_create;
+	port = (handle_t) rc;
+
+	rc = connect(path, IPC_CONNECT_ASYNC);
+	EXPECT_GE_ZERO (rc, "connect");
+	if (rc < 0)
+		goto err_connect;
+	cchan = (handle_t) rc;
+
+	rc = accept(port, &peer_uuid);
+	EXPECT_GE_ZERO (rc, "accept");
+	if (rc < 0)
+		goto err_accept;
+	schan = (handle_t) rc;
+
+	iov.base = data;
+	iov.len = sizeof(data);
+	msg.num_iov = 1;
+	msg.iov = &iov;
+	msg.num_handles = 1;
+
+	/* only memory objects can be sent */
+	msg.handles = &cchan;
+	rc = send_msg(cchan, &msg);
+	EXPECT_EQ (ERR_NOT_SUPPORTED, rc, "send channel handle");
+
+	msg.handles = &memref;
+	rc = send_msg(cchan, &msg);
+	EXPECT_EQ ((int)sizeof(data), rc, "send memref");
+
+
+	rc = get_msg(schan, &inf);
+	EXPECT_EQ (NO_ERROR, rc, "get_msg");
+	EXPECT_EQ (1, inf.num_handles, "get_msg");
+
+	msg.handles = &rx_handle;
+	rc = read_msg(schan, inf.id, 0, &msg);
+	EXPECT_EQ ((int)sizeof(data), rc, "read_msg");
+	EXPECT_EQ (false, rx_handle == INVALID_IPC_HANDLE, "received memref");
+
+	rc = put_msg(schan, inf.id);
+	EXPECT_EQ (NO_ERROR, rc, "put_msg");
+
+	if (rx_handle != INVALID_IPC_HANDLE) {
+		long va;
+
+		/* write access was not granted */
+		va = mmap(NULL, sizeof(obj_buf),
+		          MMAP_FLAG_MEMREF | MMAP_FLAG_PROT_WRITE, rx_handle);
+		EXPECT_EQ (ERR_ACCESS_DENIED, (int)va, "mmap memref writable");
+
+		va = mmap(NULL, sizeof(obj_buf), MMAP_FLAG_MEMREF, rx_handle);
+		EXPECT_GT_ZERO (va, "mmap memref");
+		if (va > 0) {
+			rc = memcmp((void *)va, obj_buf, sizeof(obj_buf));
+			EXPECT_EQ (0, rc, "memref contents");
+			rc = munmap((void *)va, sizeof(obj_buf));
+			EXPECT_EQ (NO_ERROR, rc, "munmap memref");
+		}
+
+		rc = close(rx_handle);
+		EXPECT_EQ (NO_ERROR, rc, "close received memref");
+	}
+
+	rc = close(schan);
+	EXPECT_EQ (NO_ERROR, rc, "close server chan");
+err_accept:
+	rc = close(cchan);
+	EXPECT_EQ (NO_ERROR, rc, "close client chan");
+err_connect:
+	rc = close(port);
+	EXPECT_EQ (NO_ERROR, rc, "close port");
+err_port_create:
+	rc = close(memref);
+	EXPECT_EQ (NO_ERROR, rc, "close memref");
+err_memref_create:
+	TEST_END
+}
+
+/*
+ *  Closing a memory object on either side unmaps the receiver's mappings
+ */
+static void run_memref_revoke_test(void)
+{
+	int rc;
+	handle_t port;
+	handle_t cchan;
+	handle_t schan;
+	handle_t memref;
+	handle_t rx_handle;
+	uuid_t peer_uuid;
+	char path[MAX_PORT_PATH_LEN];
+	static uint8_t obj_buf[256];
+	uint8_t data[8];
+	iovec_t iov;
+	ipc_msg_t msg;
+	ipc_msg_info_t inf;
+	long va;
+
+	TEST_BEGIN(__func__);
+
+	sprintf(path, "%s.main.%s", SRV_PATH_BASE, "memref_revoke");
+	rc = port_create(path, 2, sizeof(data), IPC_PORT_ALLOW_TA_CONNECT);
+	EXPECT_GE_ZERO (rc, "create port");
+	if (rc < 0)
+		goto err_port_create;
+	port = (handle_t) rc;
+
+	rc = connect(path, IPC_CONNECT_ASYNC);
+	EXPECT_GE_ZERO (rc, "connect");
+	if (rc < 0)
+		goto err_connect;
+	cchan = (handle_t) rc;
+
+	rc = accept(port, &peer_uuid);
+	EXPECT_GE_ZERO (rc, "accept");
+	if (rc < 0)
+		goto err_accept;
+	schan = (handle_t) rc;
+
+	iov.base = data;
+	iov.len = sizeof(data);
+	msg.num_iov = 1;
+	msg.iov = &iov;
+	msg.num_handles = 1;
+
+	/* the receiver closes its handle first in round 0, the sender in 1 */
+	for (uint i = 0; i < 2; i++) {
+		rc = memref_create(obj_buf, sizeof(obj_buf),
+		                   MMAP_FLAG_PROT_READ);
+		if (rc == ERR_NOT_SUPPORTED) {
+			TLOGI("%s: memory objects are not supported\n",
+			      __func__);
+			break;
+		}
+		EXPECT_GE_ZERO (rc, "memref_create");
+		if (rc < 0)
+			break;
+		memref = (handle_t) rc;
+
+		msg.handles = &memref;
+		rc = send_msg(cchan, &msg);
+		EXPECT_EQ ((int)sizeof(data), rc, "send memref");
+
+		rx_handle = INVALID_IPC_HANDLE;
+		rc = get_msg(schan, &inf);
+		EXPECT_EQ (NO_ERROR, rc, "get_msg");
+		msg.handles = &rx_handle;
+		rc = read_msg(schan, inf.id, 0, &msg);
+		EXPECT_EQ ((int)sizeof(data), rc, "read_msg");
+		rc = put_msg(schan, inf.id);
+		EXPECT_EQ (NO_ERROR, rc, "put_msg");
+
+		va = mmap(NULL, sizeof(obj_buf), MMAP_FLAG_MEMREF, rx_handle);
+		EXPECT_GT_ZERO (va, "mmap memref");
+
+		if (i == 0) {
+			rc = close(rx_handle);
+			EXPECT_EQ (NO_ERROR, rc, "close received memref");
+		} else {
+			rc = close(memref);
+			EXPECT_EQ (NO_ERROR, rc, "close memref");
+
+			/* the receiver's handle can no longer be mapped */
+			rc = mmap(NULL, sizeof(obj_buf), MMAP_FLAG_MEMREF,
+			          rx_handle);
+			EXPECT_EQ (ERR_CHANNEL_CLOSED, rc, "mmap revoked");
+		}
+
+		/* the mapping is gone */
+		if (va > 0) {
+			rc = munmap((void *)va, sizeof(obj_buf));
+			EXPECT_EQ (ERR_NOT_FOUND, rc, "munmap revoked");
+		}
+
+		rc = close(i == 0 ? memref : rx_handle);
+		EXPECT_EQ (NO_ERROR, rc, "close memref");
+	}
+
+	rc = close(schan);
+	EXPECT_EQ (NO_ERROR, rc, "close server chan");
+err_accept:
+	rc = close(cchan);
+	EXPECT_EQ (NO_ERROR, rc, "close client chan");
+err_connect:
+	rc = close(port);
+	EXPECT_EQ (NO_ERROR, rc, "close port");
+err_port_create:
+	TEST_END
+}
+
+/*
+ *  Message buffers of regular ports cannot be mapped
+ */
+static void run_map_msg_bufs_negative_test(void)
+{
+	int rc;
+	handle_t chan;
+	char path[MAX_PORT_PATH_LEN];
+	ipc_msg_bufs_t bufs;
+
+	TEST_BEGIN(__func__);
+
+	rc = map_msg_bufs(INVALID_IPC_HANDLE, &bufs);
+	EXPECT_EQ (ERR_BAD_HANDLE, rc, "map invalid handle");
+
+	sprintf(path, "%s.srv.%s", SRV_PATH_BASE, "echo");
+	rc = sync_connect(path, 1000);
+	EXPECT_GE_ZERO (rc, "connect to echo");
+
+	if (rc >= 0) {
+		chan = (handle_t) rc;
+
+		rc = map_msg_bufs(chan, &bufs);
+		EXPECT_EQ (ERR_NOT_SUPPORTED, rc, "map regular chan");
+
+		rc = close(chan);
+		EXPECT_EQ (NO_ERROR, rc, "close channel");
+	}
+
+	TEST_END
+}
+
+/*
+ *  Memory objects can only be created on app image, heap and stack mappings
+ */
+static void run_memref_create_negative_test(void)
+{
+	int rc;
+	long va;
+	handle_t port;
+	handle_t cchan;
+	handle_t schan;
+	handle_t memref;
+	uuid_t peer_uuid;
+	char path[MAX_PORT_PATH_LEN];
+	ipc_msg_bufs_t bufs;
+	static uint8_t obj_buf[256];
+
+	TEST_BEGIN(__func__);
+
+	rc = memref_create(obj_buf, sizeof(obj_buf), MMAP_FLAG_PROT_READ);
+	if (rc == ERR_NOT_SUPPORTED) {
+		TLOGI("%s: memory objects are not supported\n", __func__);
+		goto err_memref_create;
+	}
+	EXPECT_GE_ZERO (rc, "memref_create");
+	if (rc < 0)
+		goto err_memref_create;
+	memref = (handle_t) rc;
+
+	/* not on the mapping of another memory object */
+	va = mmap(NULL, sizeof(obj_buf), MMAP_FLAG_MEMREF, memref);
+	EXPECT_GT_ZERO (va, "mmap memref");
+	if (va > 0) {
+		rc = memref_create((void *)va, sizeof(obj_buf),
+		                   MMAP_FLAG_PROT_READ);
+		EXPECT_EQ (ERR_NOT_ALLOWED, rc, "memref_create on memref");
+		if (rc >= 0)
+			close((handle_t) rc);
+		rc = munmap((void *)va, sizeof(obj_buf));
+		EXPECT_EQ (NO_ERROR, rc, "munmap memref");
+	}
+
+	/* not on shared message buffers of the peer */
+	sprintf(path, "%s.main.%s", SRV_PATH_BASE, "memref_bufs");
+	rc = port_create(path, 1, 64,
+	                 IPC_PORT_ALLOW_TA_CONNECT | IPC_PORT_SHARED_BUFS);
+	EXPECT_GE_ZERO (rc, "create shared port");
+	if (rc < 0)
+		goto err_port_create;
+	port = (handle_t) rc;
+
+	rc = connect(path, IPC_CONNECT_ASYNC);
+	EXPECT_GE_ZERO (rc, "connect to shared port");
+	if (rc < 0)
+		goto err_connect;
+	cchan = (handle_t) rc;
+
+	rc = accept(port, &peer_uuid);
+	EXPECT_GE_ZERO (rc, "accept shared");
+	if (rc < 0)
+		goto err_accept;
+	schan = (handle_t) rc;
+
+	rc = map_msg_bufs(cchan, &bufs);
+	EXPECT_EQ (NO_ERROR, rc, "map client bufs");
+	if (rc == NO_ERROR) {
+		rc = memref_create(bufs.tx_base, bufs.buf_size,
+		                   MMAP_FLAG_PROT_READ | MMAP_FLAG_PROT_WRITE);
+		EXPECT_EQ (ERR_NOT_ALLOWED, rc, "memref_create on tx bufs");
+		if (rc >= 0)
+			close((handle_t) rc);
+
+		rc = memref_create((void *)bufs.rx_base, bufs.buf_size,
+		                   MMAP_FLAG_PROT_READ);
+		EXPECT_EQ (ERR_NOT_ALLOWED, rc, "memref_create on rx bufs");
+		if (rc >= 0)
+			close((handle_t) rc);
+	}
+
+	rc = close(schan);
+	EXPECT_EQ (NO_ERROR, rc, "close server chan");
+err_accept:
+	rc = close(cchan);
+	EXPECT_EQ (NO_ERROR, rc, "close client chan");
+err_connect:
+	rc = close(port);
+	EXPECT_EQ (NO_ERROR, rc, "close port");
+err_port_create:
+	rc = close(memref);
+	EXPECT_EQ (NO_ERROR, rc, "close memref");
+err_memref_create:
+	TEST_END
+}
 
 /****************************************************************************/
 
@@ -1467,6 +2119,11 @@ static void run_all_tests (void)
 	run_accept_test();
 	run_send_msg_test();
 	run_end_to_end_msg_test();
+	run_end_to_end_large_msg_test();
+	run_shared_bufs_test();
+	run_send_handle_test();
+	run_memref_revoke_test();
+	run_wait_many_test();
 
 	run_connect_close_by_peer_test("closer1");
 	run_connect_close_by_peer_test("closer2");
@@ -1485,6 +2142,8 @@ static void run_all_tests (void)
 	run_put_msg_negative_test();
 	run_send_msg_negative_test();
 	run_read_msg_negative_test();
+	run_map_msg_bufs_negative_test();
+	run_memref_create_negative_test();
 
 	TLOGI("Conditions checked: %d\n", _tests_total);
 	TLOGI("Conditions failed:  %d\n", _tests_failed);
@@ -187,6 +187,15 @@ static const struct tipc_srv _services[] =
 		.port_handler = echo_handle_port,
 		.chan_handler = echo_handle_chan,
 	},
+	/* echo messages larger than a page */
+	{
+		.name = SRV_NAME("echo_large"),
+		.msg_num = 2,
+		.msg_size = LARGE_MSG_SIZE,
+		.port_flags = IPC_PORT_ALLOW_ALL,
+		.port_handler = echo_handle_port,
+		.chan_handler = echo_handle_chan,
+	},
 	/* uuid  test */
 	{
 		.name = SRV_NAME("uuid"),
@@ -604,7 +613,7 @@ static void datasink_handle_port(const uevent_t *ev)
 
 /******************************   echo service    **************************/
 
-static uint8_t echo_msg_buf[MAX_PORT_BUF_SIZE];
+static uint8_t echo_msg_buf[LARGE_MSG_SIZE];
 
 static int _echo_handle_msg(const uevent_t *ev, int delay)
 {
@@ -1048,6 +1048,49 @@ test_abort:
 }
 
 
+TEST_P(WriteReadLongAtOffset)
+{
+    int rc;
+    file_handle_t handle;
+    size_t wc = 10000;
+    storage_off_t off = 3 * sizeof(uint32_t);
+    size_t skip = 100 * sizeof(uint32_t);
+    const char *fname = "test_write_read_long_offset";
+
+    TEST_BEGIN(__func__);
+
+    uint32_t *test_buf_ = malloc(wc * sizeof(uint32_t));
+    ASSERT_NE(NULL, test_buf_);
+
+    rc = storage_open_file(ss, &handle, fname,
+                           STORAGE_FILE_OPEN_CREATE | STORAGE_FILE_OPEN_TRUNCATE,
+                           STORAGE_OP_COMPLETE);
+    ASSERT_EQ(0, rc);
+
+    // write at an offset that is not block aligned
+    fill_pattern32(test_buf_, wc * sizeof(uint32_t), off);
+    rc = storage_write(handle, off, test_buf_, wc * sizeof(uint32_t), STORAGE_OP_COMPLETE);
+    ASSERT_EQ((int)(wc * sizeof(uint32_t)), rc);
+
+    // read past end of file, expect a short read
+    memset(test_buf_, 0, wc * sizeof(uint32_t));
+    rc = storage_read(handle, off + skip, test_buf_, wc * sizeof(uint32_t));
+    ASSERT_EQ((int)(wc * sizeof(uint32_t) - skip), rc);
+
+    bool res = check_pattern32(test_buf_, wc * sizeof(uint32_t) - skip, off + skip);
+    ASSERT_EQ(true, res);
+
+    // cleanup
+    storage_close_file(handle);
+    storage_delete_file(ss, fname, STORAGE_OP_COMPLETE);
+
+test_abort:
+    if (test_buf_)
+        free(test_buf_);
+    TEST_END;
+}
+
+
 // Negative tests
 
 TEST_P(OpenInvalidFileName)
@@ -2699,6 +2742,7 @@ void run_all_tests(const char *port)
     RUN_TEST_P(port, ReadPersistent32k);
     RUN_TEST_P(port, CleanUpPersistent32K);
     RUN_TEST_P(port, WriteReadLong);
+    RUN_TEST_P(port, WriteReadLongAtOffset);
     RUN_TEST_P(port, OpenInvalidFileName);
     RUN_TEST_P(port, BadFileHandle);
     RUN_TEST_P(port, ClosedFileHandle);
@@ -18,6 +18,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "block_allocator.h"
@@ -32,6 +33,13 @@
 #define BLOCK_ALLOCATOR_QUEUE_LEN \
     (BLOCK_SET_MAX_DEPTH * 2 * BLOCK_SET_MAX_DEPTH * 2)
 
+/*
+ * BLOCK_ALLOCATE_RANGE_MAX_SEARCH:
+ * Number of free ranges block_allocate_range checks before it settles for the
+ * largest one seen. Each check walks every set the allocator tracks.
+ */
+#define BLOCK_ALLOCATE_RANGE_MAX_SEARCH (16)
+
 /**
  * struct block_allocator_queue_entry - pending block allocation set update
  * @block:      block number to free or allocate.
@@ -229,15 +237,49 @@ block_allocator_queue_find_free_block(struct block_allocator_queue *q,
     }
 }
 
+/**
+ * block_allocator_queue_find_allocated_block - Search allocator queue for
+ *                                              allocated block
+ * @q:          Queue object.
+ * @start:      First block to search.
+ * @end:        Last block to search plus one.
+ *
+ * Return: First block in range @start to @end that is in @q as an allocated
+ * block, or @end if no such block is found.
+ */
+static data_block_t
+block_allocator_queue_find_allocated_block(struct block_allocator_queue *q,
+                                           data_block_t start,
+                                           data_block_t end)
+{
+    uint i;
+
+    for (i = q->head; i != q->tail; i = (i + 1) % countof(q->entry)) {
+        if (q->entry[i].removed || q->entry[i].free) {
+            continue;
+        }
+        if (q->entry[i].block >= start && q->entry[i].block < end) {
+            end = q->entry[i].block;
+        }
+    }
+    return end;
+}
+
 static struct block_allocator_queue block_allocator_queue;
 
+/*
+ * Range being added to the allocated set by block_allocate_range. Blocks in
+ * this range must not be handed out by allocations made by the set update.
+ */
+static struct block_range block_allocator_reserving_range;
+
 /**
  * find_free_block - Search for a free block
  * @tr:             Transaction object.
  * @min_block_in:   Block number to start search at.
  *
- * Return: Block number that is in commited free set and not already allocated
- * by any transaction.
+ * Return: Block number that is in commited free set, free in every pinned
+ * snapshot and not already allocated by any transaction.
  */
 static data_block_t find_free_block(struct transaction *tr,
                                     data_block_t min_block_in)
@@ -245,6 +287,7 @@ static data_block_t find_free_block(struct transaction *tr,
     data_block_t block;
     data_block_t min_block = min_block_in;
     struct block_set *set;
+    struct transaction *snapshot;
 
     assert(list_in_list(&tr->node)); /* transaction must be active */
 
@@ -293,7 +336,38 @@ static data_block_t find_free_block(struct transaction *tr,
             }
             assert(block >= min_block);
         };
+        if (tr->fs->committed_free) {
+            /*
+             * A commit group has updated the in-memory free set, but blocks
+             * freed by it are still referenced by the on-disk super block.
+             */
+            block = block_set_find_next_block(tr, tr->fs->committed_free,
+                                              block, true);
+            if (tr->failed) {
+                return 0;
+            }
+            if (!block) {
+                pr_read("no space in committed free set\n");
+                return 0;
+            }
+        }
+        list_for_every_entry(&tr->fs->snapshots, snapshot, struct transaction,
+                             node) {
+            /* Blocks used by the pinned state must not be overwritten */
+            block = block_set_find_next_block(tr, &snapshot->snapshot_free,
+                                              block, true);
+            if (tr->failed) {
+                return 0;
+            }
+            if (!block) {
+                pr_read("no space in snapshot free set\n");
+                return 0;
+            }
+        }
         block = block_allocator_queue_find_free_block(&block_allocator_queue, block);
+        if (block_in_range(block_allocator_reserving_range, block)) {
+            block = block_allocator_reserving_range.end;
+        }
     } while (block != min_block);
 
     pr_read("found free block %lld\n", block);
@@ -302,17 +376,20 @@ static data_block_t find_free_block(struct transaction *tr,
 }
 
 /**
- * block_allocate_etc - Allocate a block
+ * block_allocate_hint - Allocate a block (internal)
  * @tr:         Transaction object.
  * @is_tmp:     %true if allocated block should be automatically freed when
  *              transaction completes, %false if allocated block should be added
  *              to free set when transaction completes.
+ * @hint:       Block number to start search at, or 0 to use the default
+ *              search start.
  *
  * Find a free block and add queue a set update.
  *
  * Return: Allocated block number.
  */
-data_block_t block_allocate_etc(struct transaction *tr, bool is_tmp)
+static data_block_t block_allocate_hint(struct transaction *tr, bool is_tmp,
+                                        data_block_t hint)
 {
     data_block_t block;
     data_block_t min_block;
@@ -332,6 +409,9 @@ data_block_t block_allocate_etc(struct transaction *tr, bool is_tmp)
         tr->last_free_block = 0;
     }
     min_block = is_tmp ? tr->last_tmp_free_block : tr->last_free_block;
+    if (hint) {
+        min_block = hint;
+    }
 
     block = find_free_block(tr, min_block);
     if (!block) {
@@ -359,6 +439,212 @@ data_block_t block_allocate_etc(struct transaction *tr, bool is_tmp)
     return block;
 }
 
+/**
+ * block_allocate_etc - Allocate a block
+ * @tr:         Transaction object.
+ * @is_tmp:     %true if allocated block should be automatically freed when
+ *              transaction completes, %false if allocated block should be added
+ *              to free set when transaction completes.
+ *
+ * Return: Allocated block number.
+ */
+data_block_t block_allocate_etc(struct transaction *tr, bool is_tmp)
+{
+    return block_allocate_hint(tr, is_tmp, 0);
+}
+
+/**
+ * block_allocate_after - Allocate a block close after another block
+ * @tr:         Transaction object.
+ * @prev:       Block that the new block should follow, or 0 for no preference.
+ *
+ * Allocate a non-tmp block, preferring @prev + 1 or the first free block after
+ * it, so blocks that are read in sequence are also contiguous on disk. Falls
+ * back to any free block.
+ *
+ * Return: Allocated block number.
+ */
+data_block_t block_allocate_after(struct transaction *tr, data_block_t prev)
+{
+    return block_allocate_hint(tr, false, prev ? prev + 1 : 0);
+}
+
+/**
+ * find_free_range_end - Find end of free block run (internal)
+ * @tr:         Transaction object.
+ * @start:      Block returned by find_free_block.
+ *
+ * Return: First block after @start that is not available for allocation.
+ */
+static data_block_t find_free_range_end(struct transaction *tr,
+                                        data_block_t start)
+{
+    data_block_t end;
+    data_block_t next;
+    struct block_set *set;
+    struct transaction *snapshot;
+
+    end = block_set_find_next_block(tr, &tr->fs->free, start, false);
+    list_for_every_entry(&tr->fs->allocated, set, struct block_set, node) {
+        next = block_set_find_next_block(tr, set, start, true);
+        if (next && next < end) {
+            end = next;
+        }
+    }
+    if (tr->fs->committed_free) {
+        next = block_set_find_next_block(tr, tr->fs->committed_free, start,
+                                         false);
+        if (next < end) {
+            end = next;
+        }
+    }
+    list_for_every_entry(&tr->fs->snapshots, snapshot, struct transaction,
+                         node) {
+        next = block_set_find_next_block(tr, &snapshot->snapshot_free, start,
+                                         false);
+        if (next < end) {
+            end = next;
+        }
+    }
+    end = block_allocator_queue_find_allocated_block(&block_allocator_queue,
+                                                     start, end);
+    assert(end > start);
+
+    return end;
+}
+
+/**
+ * block_allocate_range - Allocate a contiguous range of blocks
+ * @tr:         Transaction object.
+ * @count:      Number of blocks to allocate.
+ *
+ * Check up to BLOCK_ALLOCATE_RANGE_MAX_SEARCH free ranges, starting where the
+ * previous range allocation on the file system ended and wrapping around to
+ * the start of the device. Add the first @count blocks of the smallest range
+ * checked that can hold @count blocks to the allocated set in a single set
+ * update. If none of them is large enough, allocate the largest one checked
+ * instead, or a single block from block_allocate if that would not be more
+ * than one block. Allocated blocks are freed with block_free like blocks
+ * returned by block_allocate.
+ *
+ * Return: Allocated range. This can be smaller than @count blocks, and is
+ * empty if the transaction failed.
+ */
+struct block_range block_allocate_range(struct transaction *tr,
+                                        data_block_t count)
+{
+    struct block_range range = BLOCK_RANGE_INITIAL_VALUE(range);
+    struct block_range best = BLOCK_RANGE_INITIAL_VALUE(best);
+    data_block_t block;
+    data_block_t end;
+    data_block_t size;
+    data_block_t best_size;
+    data_block_t next = tr->fs->range_search_start;
+    bool wrapped = !next;
+    uint i;
+
+    if (tr->failed) {
+        pr_warn("transaction failed, abort\n");
+
+        return range;
+    }
+    assert(transaction_is_active(tr));
+    assert(count);
+    assert(!tr->min_free_block);
+
+    if (count == 1 || !block_allocator_queue_empty(&block_allocator_queue)) {
+        goto allocate_block;
+    }
+
+    for (i = 0; i < BLOCK_ALLOCATE_RANGE_MAX_SEARCH; i++) {
+        block = find_free_block(tr, next);
+        if (!block && !wrapped && !tr->failed) {
+            wrapped = true;
+            block = find_free_block(tr, 0);
+        }
+        if (!block) {
+            break;
+        }
+        end = find_free_range_end(tr, block);
+        if (tr->failed) {
+            return range;
+        }
+        pr_read("free range %lld-%lld\n", block, end - 1);
+        size = end - block;
+        best_size = best.end - best.start;
+        /* Pick the smallest range that fits, or the largest if none fit */
+        if (size >= count ? (best_size < count || size < best_size) :
+                            size > best_size) {
+            best.start = block;
+            best.end = end;
+            if (size == count) {
+                break;
+            }
+        }
+        next = end;
+    }
+    if (tr->failed) {
+        return range;
+    }
+    if (best.end - best.start < 2) {
+        goto allocate_block;
+    }
+
+    range.start = best.start;
+    range.end = MIN(best.end, best.start + count);
+    tr->fs->range_search_start = range.end;
+    pr_write("allocate range %lld-%lld\n", range.start, range.end - 1);
+
+    block_allocator_reserving_range = range;
+    block_allocator_suspend_set_updates(tr);
+    block_set_add_range(tr, &tr->allocated, range);
+    block_allocator_process_queue(tr);
+    block_range_clear(&block_allocator_reserving_range);
+
+    full_assert(tr->failed || find_free_block(tr, range.start) != range.start);
+    if (tr->failed) {
+        block_range_clear(&range);
+    }
+
+    return range;
+
+allocate_block:
+    range.start = block_allocate(tr);
+    range.end = range.start ? range.start + 1 : 0;
+    return range;
+}
+
+/**
+ * block_allocator_get_free_stats - Get free space fragmentation info
+ * @tr:         Transaction object.
+ * @stats:      Object to return free space info in.
+ *
+ * Walk the committed free set and report how many separate ranges the free
+ * blocks are split into. Blocks allocated by active transactions are counted
+ * as free.
+ */
+void block_allocator_get_free_stats(struct transaction *tr,
+                                    struct block_allocator_free_stats *stats)
+{
+    struct block_range range;
+    data_block_t next = 0;
+    struct block_set_iter iter;
+
+    memset(stats, 0, sizeof(*stats));
+    block_set_iter_init(&iter, &tr->fs->free);
+    while (true) {
+        range = block_set_iter_next_range(tr, &iter, next);
+        if (tr->failed || block_range_empty(range)) {
+            break;
+        }
+        stats->free_blocks += range.end - range.start;
+        stats->free_ranges++;
+        stats->largest_free_range = MAX(stats->largest_free_range,
+                                        range.end - range.start);
+        next = range.end;
+    }
+}
+
 /**
  * block_allocator_add_allocated - Update block sets with new allocated block
  * @tr:         Transaction object.
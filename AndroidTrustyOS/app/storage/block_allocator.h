@@ -20,10 +20,28 @@
 #include <stdbool.h>
 
 #include "block_cache.h"
+#include "block_range.h"
 
 struct transaction;
 
+/**
+ * struct block_allocator_free_stats - Free space fragmentation info
+ * @free_blocks:        Number of free blocks.
+ * @free_ranges:        Number of separate ranges @free_blocks are split into.
+ * @largest_free_range: Number of blocks in largest free range.
+ */
+struct block_allocator_free_stats {
+    data_block_t free_blocks;
+    data_block_t free_ranges;
+    data_block_t largest_free_range;
+};
+
 data_block_t block_allocate_etc(struct transaction *tr, bool is_tmp);
+data_block_t block_allocate_after(struct transaction *tr, data_block_t prev);
+struct block_range block_allocate_range(struct transaction *tr,
+                                        data_block_t count);
+void block_allocator_get_free_stats(struct transaction *tr,
+                                    struct block_allocator_free_stats *stats);
 void block_free_etc(struct transaction *tr, data_block_t block, bool is_tmp);
 bool block_allocator_allocation_queued(struct transaction *tr,
                                        data_block_t block,
@@ -43,11 +43,219 @@ static bool print_clean_transaction = false;
 static bool print_mac_update = false;
 static bool print_cache_get_ref_block_count = true;
 
+static unsigned int block_cache_flush_threshold = BLOCK_CACHE_FLUSH_THRESHOLD;
+
 #define BLOCK_CACHE_GUARD_1 (0xdead0001dead0003)
 #define BLOCK_CACHE_GUARD_2 (0xdead0005dead0007)
 
+/* Max number of cache entries encrypted with one key schedule setup */
+#define BLOCK_CACHE_CRYPT_BATCH_SIZE (16)
+
+STATIC_ASSERT(BLOCK_CACHE_MAX_WRITES >= 1);
+
+/*
+ * Eviction candidate classes. An unreferenced cache entry is in exactly one
+ * of the evict lists of its pool, selected by block_cache_entry_evict_class.
+ */
+enum {
+    BLOCK_CACHE_EVICT_UNUSED,
+    BLOCK_CACHE_EVICT_CLEAN,
+    BLOCK_CACHE_EVICT_DIRTY,
+    BLOCK_CACHE_EVICT_DIRTY_TMP,
+    BLOCK_CACHE_EVICT_CLASS_COUNT,
+};
+
+/**
+ * struct block_cache_pool - Cache entries for one range of block sizes
+ * @block_size:     Size of data buffer in each entry. Devices use the pool
+ *                  with the smallest @block_size that fits their blocks.
+ * @initial_count:  Number of entries allocated by block_cache_init.
+ * @count:          Number of entries in pool, including entries added by
+ *                  block_cache_pool_grow.
+ * @evict:          Eviction candidate lists, indexed by eviction class.
+ * @evict_count:    Number of entries in each @evict list.
+ */
+struct block_cache_pool {
+    size_t block_size;
+    uint initial_count;
+    uint count;
+    struct list_node evict[BLOCK_CACHE_EVICT_CLASS_COUNT];
+    uint evict_count[BLOCK_CACHE_EVICT_CLASS_COUNT];
+};
+
+STATIC_ASSERT(BLOCK_CACHE_SMALL_BLOCK_SIZE <= MAX_BLOCK_SIZE);
+STATIC_ASSERT(BLOCK_CACHE_SMALL_BLOCK_SIZE % sizeof(uint64_t) == 0);
+STATIC_ASSERT(MAX_BLOCK_SIZE % sizeof(uint64_t) == 0);
+
+static struct block_cache_pool block_cache_pools[] = {
+    {
+        .block_size = BLOCK_CACHE_SMALL_BLOCK_SIZE,
+        .initial_count = BLOCK_CACHE_SMALL_SIZE,
+    },
+    {
+        .block_size = MAX_BLOCK_SIZE,
+        .initial_count = BLOCK_CACHE_SIZE,
+    },
+};
+
 static struct list_node block_cache_lru = LIST_INITIAL_VALUE(block_cache_lru);
-static struct block_cache_entry *block_cache_entries;
+static struct list_node block_cache_hash[BLOCK_CACHE_HASH_SIZE];
+static uint64_t block_cache_evict_seq;
+static struct block_cache_prefetch_stats block_cache_prefetch_stats;
+static bool block_cache_initialized;
+static uint block_cache_entry_count;
+static size_t block_cache_growth_bytes;
+static struct block_cache_entry **block_cache_flush_list;
+
+/**
+ * block_cache_entry_guard2 - Get guard value stored after entry data
+ * @entry:      Cache entry.
+ *
+ * Return: Pointer to guard value following the data buffer of @entry.
+ */
+static uint64_t *block_cache_entry_guard2(struct block_cache_entry *entry)
+{
+    return (uint64_t *)(entry->data + entry->pool->block_size);
+}
+
+/**
+ * block_cache_entry_check_guards - Check for out of bound writes to entry data
+ * @entry:      Cache entry.
+ */
+static void block_cache_entry_check_guards(struct block_cache_entry *entry)
+{
+    assert(entry->guard1 == BLOCK_CACHE_GUARD_1);
+    assert(*block_cache_entry_guard2(entry) == BLOCK_CACHE_GUARD_2);
+}
+
+/**
+ * block_cache_dev_pool - Get pool used for blocks of a block device
+ * @dev:        Block device.
+ *
+ * Return: Pool with the smallest entries that can hold @dev blocks.
+ */
+static struct block_cache_pool *block_cache_dev_pool(struct block_device *dev)
+{
+    uint i;
+
+    for (i = 0; i < countof(block_cache_pools); i++) {
+        if (dev->block_size <= block_cache_pools[i].block_size) {
+            return &block_cache_pools[i];
+        }
+    }
+    assert(0); /* block size larger than MAX_BLOCK_SIZE */
+    return NULL;
+}
+
+/**
+ * block_cache_hash_bucket - Get hash bucket for a block
+ * @dev:        Block device.
+ * @block:      Block number.
+ *
+ * Return: List head of hash bucket that contains cache entries matching @dev
+ * and @block.
+ */
+static struct list_node *block_cache_hash_bucket(struct block_device *dev,
+                                                 data_block_t block)
+{
+    uint64_t hash = block ^ ((uintptr_t)dev >> 4);
+
+    hash *= 0x9e3779b97f4a7c15ULL;
+    return &block_cache_hash[(hash >> 32) % BLOCK_CACHE_HASH_SIZE];
+}
+
+/**
+ * block_cache_hash_add - Add cache entry to hash index
+ * @entry:      Cache entry with valid dev and block.
+ */
+static void block_cache_hash_add(struct block_cache_entry *entry)
+{
+    assert(entry->dev);
+    assert(!list_in_list(&entry->hash_node));
+
+    list_add_head(block_cache_hash_bucket(entry->dev, entry->block),
+                  &entry->hash_node);
+}
+
+/**
+ * block_cache_hash_remove - Remove cache entry from hash index if needed
+ * @entry:      Cache entry.
+ */
+static void block_cache_hash_remove(struct block_cache_entry *entry)
+{
+    if (list_in_list(&entry->hash_node)) {
+        list_delete(&entry->hash_node);
+    }
+}
+
+/**
+ * block_cache_entry_evict_class - Get eviction candidate class of cache entry
+ * @entry:      Cache entry.
+ *
+ * Return: BLOCK_CACHE_EVICT_UNUSED if @entry contains no data and no data is
+ * being prefetched into it, BLOCK_CACHE_EVICT_CLEAN if @entry can be reused
+ * without writing it back,
+ * BLOCK_CACHE_EVICT_DIRTY_TMP or BLOCK_CACHE_EVICT_DIRTY otherwise.
+ */
+static uint block_cache_entry_evict_class(struct block_cache_entry *entry)
+{
+    if (!entry->dev || (!entry->loaded && !entry->prefetched)) {
+        assert(!entry->dirty);
+        return BLOCK_CACHE_EVICT_UNUSED;
+    }
+    if (!entry->dirty) {
+        return BLOCK_CACHE_EVICT_CLEAN;
+    }
+    return entry->dirty_tmp ? BLOCK_CACHE_EVICT_DIRTY_TMP :
+                              BLOCK_CACHE_EVICT_DIRTY;
+}
+
+/**
+ * block_cache_evict_add - Add unreferenced cache entry to eviction candidates
+ * @entry:      Cache entry.
+ *
+ * Add @entry to the head of the eviction candidate list for its current class.
+ */
+static void block_cache_evict_add(struct block_cache_entry *entry)
+{
+    uint evict_class = block_cache_entry_evict_class(entry);
+
+    assert(!list_in_list(&entry->evict_node));
+
+    entry->evict_seq = ++block_cache_evict_seq;
+    entry->evict_class = evict_class;
+    entry->pool->evict_count[evict_class]++;
+    list_add_head(&entry->pool->evict[evict_class], &entry->evict_node);
+}
+
+/**
+ * block_cache_evict_remove - Remove cache entry from eviction candidates
+ * @entry:      Cache entry.
+ */
+static void block_cache_evict_remove(struct block_cache_entry *entry)
+{
+    assert(list_in_list(&entry->evict_node));
+    assert(entry->pool->evict_count[entry->evict_class]);
+
+    entry->pool->evict_count[entry->evict_class]--;
+    list_delete(&entry->evict_node);
+}
+
+/**
+ * block_cache_evict_update - Update eviction class of cache entry
+ * @entry:      Cache entry.
+ *
+ * Must be called after changing the state used by
+ * block_cache_entry_evict_class. Does nothing if @entry is referenced.
+ */
+static void block_cache_evict_update(struct block_cache_entry *entry)
+{
+    if (!list_in_list(&entry->evict_node)) {
+        return;
+    }
+    block_cache_evict_remove(entry);
+    block_cache_evict_add(entry);
+}
 
 /**
  * block_cache_queue_io_op - Helper function to start a read or write operation
@@ -160,7 +368,6 @@ void block_cache_complete_read(struct block_device *dev,
     int ret;
     struct block_cache_entry *entry;
 
-    assert(data_size <= sizeof(entry->data));
     assert(data_size == dev->block_size);
 
     entry = block_cache_pop_io_op(dev, block, BLOCK_CACHE_IO_OP_READ);
@@ -168,6 +375,8 @@ void block_cache_complete_read(struct block_device *dev,
     if (failed) {
         printf("%s: load block %lld failed\n",
                __func__, entry->block);
+        entry->prefetched = false;
+        block_cache_evict_update(entry);
         return;
     }
     assert(!failed);
@@ -212,7 +421,10 @@ void block_cache_complete_write(struct block_device *dev,
     assert(entry->dirty_tr);
     if (failed) {
         pr_err("write block %lld failed, fail transaction\n", entry->block);
-        transaction_fail(entry->dirty_tr);
+        if (!entry->dirty_tr->failed) {
+            /* Several queued writes can fail together */
+            transaction_fail(entry->dirty_tr);
+        }
     }
     entry->dirty_tr = NULL;
 }
@@ -275,56 +487,99 @@ static void block_cache_entry_decrypt(struct block_cache_entry *entry)
 }
 
 /**
- * block_cache_entry_encrypt - Encrypt cache entry and update mac
- * @entry:          Cache entry
+ * block_cache_entries_encrypt - Encrypt cache entries and update macs
+ * @entries:        Cache entries. Entries that are already encrypted are
+ *                  skipped.
+ * @count:          Number of entries in @entries. Must not exceed
+ *                  BLOCK_CACHE_CRYPT_BATCH_SIZE.
+ *
+ * Consecutive entries that use the same key are encrypted with a single call
+ * to encrypt_and_mac_blocks.
  */
-static void block_cache_entry_encrypt(struct block_cache_entry *entry)
+static void block_cache_entries_encrypt(struct block_cache_entry **entries,
+                                        unsigned int count)
 {
     int ret;
-    void *encrypt_data;
-    size_t encrypt_size;
-    struct mac mac;
+    unsigned int i;
+    unsigned int batch_count;
+    struct block_cache_entry *entry;
+    struct block_cache_entry *batch[BLOCK_CACHE_CRYPT_BATCH_SIZE];
+    struct crypt_block crypt_blocks[BLOCK_CACHE_CRYPT_BATCH_SIZE];
+    struct mac old_mac[BLOCK_CACHE_CRYPT_BATCH_SIZE];
     struct iv *iv = NULL; /* TODO: support external iv */
 
-    assert(entry->dirty);
-    assert(!entry->encrypted);
-    assert(!block_cache_entry_has_refs(entry));
+    assert(count <= BLOCK_CACHE_CRYPT_BATCH_SIZE);
 
-    encrypt_data = entry->data;
-    encrypt_size = entry->block_size;
-    if (!iv) {
-        iv = (void *)entry->data;
-        assert(encrypt_size > sizeof(*iv));
-        encrypt_data += sizeof(*iv);
-        encrypt_size -= sizeof(*iv);
-    }
+    while (count) {
+        batch_count = 0;
+        for (i = 0; i < count; i++) {
+            entry = entries[i];
+            if (entry->encrypted) {
+                continue;
+            }
+            if (batch_count && entry->key != batch[0]->key) {
+                break;
+            }
+            assert(entry->dirty);
+            assert(!block_cache_entry_has_refs(entry));
 
-    stats_timer_start(STATS_FS_WRITE_BLOCK_ENCRYPT);
-    ret = encrypt(entry->key, encrypt_data, encrypt_size, iv);
-    stats_timer_stop(STATS_FS_WRITE_BLOCK_ENCRYPT);
-    assert(!ret);
-    entry->encrypted = true;
-    if (print_block_decrypt_encrypt) {
-        printf("%s: encrypt block %lld complete\n",
-               __func__, entry->block);
-    }
+            crypt_blocks[batch_count].data = entry->data;
+            crypt_blocks[batch_count].data_size = entry->block_size;
+            crypt_blocks[batch_count].iv = iv;
+            if (!iv) {
+                crypt_blocks[batch_count].iv = (void *)entry->data;
+                assert(entry->block_size > sizeof(*iv));
+                crypt_blocks[batch_count].data += sizeof(*iv);
+                crypt_blocks[batch_count].data_size -= sizeof(*iv);
+            }
+            crypt_blocks[batch_count].mac_data = entry->data;
+            crypt_blocks[batch_count].mac_data_size = entry->block_size;
+            crypt_blocks[batch_count].mac = &entry->mac;
+            if (!entry->dirty_mac) {
+                old_mac[batch_count] = entry->mac;
+            }
+            batch[batch_count++] = entry;
+        }
+        entries += i;
+        count -= i;
+        if (!batch_count) {
+            continue;
+        }
+
+        stats_timer_start(STATS_FS_WRITE_BLOCK_ENCRYPT_MAC);
+        ret = encrypt_and_mac_blocks(batch[0]->key, crypt_blocks, batch_count);
+        stats_timer_stop(STATS_FS_WRITE_BLOCK_ENCRYPT_MAC);
+        assert(!ret);
 
-    if (!entry->dirty_mac) {
-        mac = entry->mac;
+        for (i = 0; i < batch_count; i++) {
+            entry = batch[i];
+            entry->encrypted = true;
+            if (print_block_decrypt_encrypt) {
+                printf("%s: encrypt block %lld complete\n",
+                       __func__, entry->block);
+            }
+            if (!entry->dirty_mac) {
+                assert(!CRYPTO_memcmp(&old_mac[i], &entry->mac,
+                                      sizeof(old_mac[i])));
+            }
+            entry->dirty_mac = false;
+            //assert(!entry->parent || entry->parent->ref_count);
+            //assert(!entry->parent || entry->parent->dirty_ref);
+        }
     }
+}
 
-    stats_timer_start(STATS_FS_WRITE_BLOCK_CALC_MAC);
-    ret = calculate_mac(entry->key, &entry->mac,
-                        entry->data, entry->block_size);
-    stats_timer_stop(STATS_FS_WRITE_BLOCK_CALC_MAC);
-    assert(!ret);
+/**
+ * block_cache_entry_encrypt - Encrypt cache entry and update mac
+ * @entry:          Cache entry
+ */
+static void block_cache_entry_encrypt(struct block_cache_entry *entry)
+{
+    assert(entry->dirty);
+    assert(!entry->encrypted);
 
-    if (!entry->dirty_mac) {
-        assert(!CRYPTO_memcmp(&mac, &entry->mac, sizeof(mac)));
-    }
-    entry->dirty_mac = false;
-    //assert(!entry->parent || entry->parent->ref_count);
-    //assert(!entry->parent || entry->parent->dirty_ref);
+    block_cache_entries_encrypt(&entry, 1);
+    assert(entry->encrypted);
 }
 
 /**
@@ -343,7 +598,7 @@ static void block_cache_entry_clean(struct block_cache_entry *entry)
         printf("%s: encrypt block %lld\n", __func__, entry->block);
     }
 
-    assert(entry->block_size <= sizeof(entry->data));
+    assert(entry->block_size <= entry->pool->block_size);
     if (!entry->encrypted) {
         block_cache_entry_encrypt(entry);
     }
@@ -352,22 +607,330 @@ static void block_cache_entry_clean(struct block_cache_entry *entry)
 
     block_cache_queue_write(entry, entry->data);
     entry->dirty = false;
+    block_cache_evict_update(entry);
+}
+
+/**
+ * block_cache_entries_clean - Write dirty cache entries to disc
+ * @entries:        Dirty cache entries.
+ * @count:          Number of entries in @entries. Must not exceed
+ *                  BLOCK_CACHE_CRYPT_BATCH_SIZE.
+ *
+ * Encrypt all entries as a batch, then start writing them in order. Does not
+ * wait for the writes to complete.
+ */
+static void block_cache_entries_clean(struct block_cache_entry **entries,
+                                      unsigned int count)
+{
+    unsigned int i;
+    struct block_cache_entry *entry;
+
+    stats_timer_start(STATS_CACHE_CLEAN_TRANSACTION_ENT_CLN);
+    block_cache_entries_encrypt(entries, count);
+    for (i = 0; i < count; i++) {
+        entry = entries[i];
+        assert(entry->dirty);
+        assert(entry->encrypted);
+        if (print_block_store) {
+            printf("%s: write block %lld\n", __func__, entry->block);
+        }
+        block_cache_queue_write(entry, entry->data);
+        entry->dirty = false;
+        block_cache_evict_update(entry);
+        assert(!entry->dirty_tr || entry->io_op == BLOCK_CACHE_IO_OP_WRITE);
+    }
+    stats_timer_stop(STATS_CACHE_CLEAN_TRANSACTION_ENT_CLN);
+}
+
+/**
+ * block_cache_entry_write_order - Compare cache entries by write order
+ * @a:          Pointer to first cache entry pointer.
+ * @b:          Pointer to second cache entry pointer.
+ *
+ * Entries on block devices without tamper detection sort before entries on
+ * tamper detecting devices, so file system data on the non-secure device is
+ * written before blocks on rpmb. Entries on the same device are sorted by
+ * block number, so the block device can merge adjacent blocks into a single
+ * request.
+ *
+ * Return: negative, zero or positive value for qsort.
+ */
+static int block_cache_entry_write_order(const void *a, const void *b)
+{
+    const struct block_cache_entry *entry_a =
+        *(struct block_cache_entry * const *)a;
+    const struct block_cache_entry *entry_b =
+        *(struct block_cache_entry * const *)b;
+
+    if (entry_a->dev != entry_b->dev) {
+        if (entry_a->dev->tamper_detecting != entry_b->dev->tamper_detecting) {
+            return entry_a->dev->tamper_detecting ? 1 : -1;
+        }
+        return entry_a->dev < entry_b->dev ? -1 : 1;
+    }
+    if (entry_a->block != entry_b->block) {
+        return entry_a->block < entry_b->block ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * block_cache_entries_flush - Write dirty cache entries to disc in block order
+ * @entries:        Dirty, unreferenced cache entries. Reordered by this
+ *                  function.
+ * @count:          Number of entries in @entries.
+ *
+ * Sort @entries with block_cache_entry_write_order and write them in batches
+ * of up to BLOCK_CACHE_CRYPT_BATCH_SIZE entries. Waits for outstanding writes
+ * before switching to another block device and whenever
+ * BLOCK_CACHE_MAX_WRITES writes have been queued.
+ *
+ * Return: Block device that still has writes in progress, or %NULL if
+ * @count is 0. The caller must call block_cache_complete_io on it before the
+ * entries can be reused.
+ */
+static struct block_device *block_cache_entries_flush(
+        struct block_cache_entry **entries, unsigned int count)
+{
+    unsigned int i;
+    unsigned int batch_count;
+    unsigned int in_flight = 0;
+    struct block_device *dev = NULL;
+
+    qsort(entries, count, sizeof(entries[0]), block_cache_entry_write_order);
+
+    for (i = 0; i < count; i += batch_count) {
+        if (entries[i]->dev != dev || in_flight >= BLOCK_CACHE_MAX_WRITES) {
+            if (dev) {
+                block_cache_complete_io(dev);
+            }
+            dev = entries[i]->dev;
+            in_flight = 0;
+        }
+        batch_count = MIN(count - i, BLOCK_CACHE_CRYPT_BATCH_SIZE);
+        batch_count = MIN(batch_count, BLOCK_CACHE_MAX_WRITES - in_flight);
+        while (entries[i + batch_count - 1]->dev != dev) {
+            batch_count--;
+        }
+        block_cache_entries_clean(&entries[i], batch_count);
+        in_flight += batch_count;
+    }
+    return dev;
+}
+
+/**
+ * block_cache_entry_drop_prefetched - Account for unused prefetched data
+ * @entry:      Cache entry that is about to be reused.
+ */
+static void block_cache_entry_drop_prefetched(struct block_cache_entry *entry)
+{
+    if (entry->prefetched) {
+        block_cache_prefetch_stats.wasted++;
+        stats_counter_inc(STATS_CACHE_PREFETCH_WASTED);
+        entry->prefetched = false;
+    }
 }
 
 /**
  * block_cache_entry_score - Get a keep score
  * @entry:      Block cache entry to check
- * @index:      Number of available entries before @entry in lru.
+ * @age:        Number of entries added to eviction candidate lists after
+ *              @entry.
  *
  * Return: A score value indicating in what order entries that are close in the
  * lru should be replaced.
  */
-static uint block_cache_entry_score(struct block_cache_entry *entry, uint index)
+static uint64_t block_cache_entry_score(struct block_cache_entry *entry,
+                                        uint64_t age)
 {
     if (!entry->dev) {
-        return ~0;
+        return ~0ULL;
     }
-    return (entry->dirty ? (entry->dirty_tmp ? 1 : 2) : 4) * index;
+    return (entry->dirty ? (entry->dirty_tmp ? 1 : 2) : 4) * age;
+}
+
+/**
+ * block_cache_find_evict_entry - Find cache entry to reuse
+ * @pool:       Pool to pick entry from.
+ *
+ * Only the oldest entry of each eviction candidate class needs to be checked,
+ * since all entries in a class share the same score multiplier.
+ *
+ * Return: Unreferenced cache entry to reuse, or %NULL if all entries are
+ * referenced.
+ */
+static struct block_cache_entry *block_cache_find_evict_entry(
+        struct block_cache_pool *pool)
+{
+    uint i;
+    uint64_t score;
+    uint64_t best_score = 0;
+    struct block_cache_entry *entry;
+    struct block_cache_entry *best_entry = NULL;
+
+    entry = list_peek_tail_type(&pool->evict[BLOCK_CACHE_EVICT_UNUSED],
+                                struct block_cache_entry, evict_node);
+    if (entry) {
+        return entry;
+    }
+
+    for (i = BLOCK_CACHE_EVICT_CLEAN; i < countof(pool->evict); i++) {
+        entry = list_peek_tail_type(&pool->evict[i],
+                                    struct block_cache_entry, evict_node);
+        if (!entry) {
+            continue;
+        }
+        assert(entry->evict_seq <= block_cache_evict_seq);
+        score = block_cache_entry_score(entry,
+                                        block_cache_evict_seq - entry->evict_seq);
+        if (print_cache_lookup_verbose) {
+            printf("%s: cache entry %u, block %lld, class %d, score %lld\n",
+                   __func__, entry->index, entry->block, i,
+                   (unsigned long long)score);
+        }
+        if (!best_entry || score >= best_score) {
+            best_entry = entry;
+            best_score = score;
+        }
+    }
+    return best_entry;
+}
+
+/**
+ * block_cache_flush_dirty - Write back unreferenced dirty cache entries
+ * @fs:         File system state object.
+ * @pool:       Pool used by @fs->dev.
+ *
+ * Write all dirty cache entries on @fs->dev that are not in use to disc, so
+ * later evictions and the final block_cache_clean_transaction call find clean
+ * entries instead of writing one block at a time. Super blocks are skipped,
+ * they must only be written after all the blocks they reference. Waits for
+ * the writes to complete.
+ */
+static void block_cache_flush_dirty(struct fs *fs,
+                                    struct block_cache_pool *pool)
+{
+    struct block_cache_entry *entry;
+    struct block_device *dev;
+    unsigned int count = 0;
+
+    stats_timer_start(STATS_CACHE_FLUSH_BACKGROUND);
+    list_for_every_entry(&pool->evict[BLOCK_CACHE_EVICT_DIRTY], entry,
+                         struct block_cache_entry, evict_node) {
+        assert(entry->dirty && !entry->dirty_tmp);
+        if (entry->dev != fs->dev || entry->io_op != BLOCK_CACHE_IO_OP_NONE) {
+            continue;
+        }
+        if (entry->dev == fs->super_dev &&
+            (entry->block == fs->super_block[0] ||
+             entry->block == fs->super_block[1])) {
+            continue;
+        }
+        assert(count < block_cache_entry_count);
+        block_cache_flush_list[count++] = entry;
+    }
+    if (print_clean_transaction) {
+        printf("%s: flush %u dirty entries\n", __func__, count);
+    }
+    dev = block_cache_entries_flush(block_cache_flush_list, count);
+    if (dev) {
+        block_cache_complete_io(dev);
+    }
+    stats_timer_stop(STATS_CACHE_FLUSH_BACKGROUND);
+}
+
+/**
+ * block_cache_entry_destroy - Callback function for obj_del_ref
+ * @obj:        Pointer to obj member of cache entry.
+ *
+ * Callback called by reference tracking code when the last reference to a
+ * cache entry has been released. Since this is a cache, and not a normal heap
+ * allocated object, the cache entry is not destroyed here. It is instead left
+ * in a state where block_cache_lookup can reuse it.
+ */
+static void block_cache_entry_destroy(obj_t *obj)
+{
+    struct block_cache_entry *entry = containerof(obj, struct block_cache_entry, obj);
+
+    list_delete(&entry->lru_node);
+    list_add_head(&block_cache_lru, &entry->lru_node);
+
+    if (entry->dirty_mac) {
+        block_cache_entry_encrypt(entry);
+    }
+    block_cache_evict_add(entry);
+}
+
+/**
+ * block_cache_entry_init - Initialize new cache entry
+ * @entry:      Cache entry.
+ * @pool:       Pool @entry belongs to.
+ *
+ * Add @entry to the lru list and, by releasing its initial reference, to the
+ * unused list of @pool.
+ */
+static void block_cache_entry_init(struct block_cache_entry *entry,
+                                   struct block_cache_pool *pool)
+{
+    obj_ref_t ref;
+
+    full_assert(memset(entry, 1, BLOCK_CACHE_ENTRY_SIZE(pool->block_size)));
+    entry->pool = pool;
+    entry->index = block_cache_entry_count++;
+    entry->guard1 = BLOCK_CACHE_GUARD_1;
+    *block_cache_entry_guard2(entry) = BLOCK_CACHE_GUARD_2;
+    entry->dev = NULL;
+    entry->block = ~0;
+    entry->dirty = false;
+    entry->dirty_ref = false;
+    entry->dirty_mac = false;
+    entry->dirty_tr = NULL;
+    entry->prefetched = false;
+    entry->io_op = BLOCK_CACHE_IO_OP_NONE;
+    obj_init(&entry->obj, &ref);
+    list_clear_node(&entry->io_op_node);
+    list_clear_node(&entry->hash_node);
+    list_clear_node(&entry->evict_node);
+    list_add_head(&block_cache_lru, &entry->lru_node);
+    pool->count++;
+    obj_del_ref(&entry->obj, &ref, block_cache_entry_destroy);
+}
+
+/**
+ * block_cache_pool_grow - Allocate an extra cache entry for a pool
+ * @pool:       Pool to add entry to.
+ *
+ * Pools start out with the number of entries selected at build time. When a
+ * pool has no unused entries left, it may grow one entry at a time as long
+ * as the entries added this way stay within BLOCK_CACHE_GROWTH_BYTES. This
+ * lets the pool used by the busiest device take the memory not needed by the
+ * others, instead of evicting entries early.
+ *
+ * Return: New unused cache entry, or %NULL if the pool could not grow.
+ */
+static struct block_cache_entry *block_cache_pool_grow(
+        struct block_cache_pool *pool)
+{
+    size_t entry_size = BLOCK_CACHE_ENTRY_SIZE(pool->block_size);
+    struct block_cache_entry *entry;
+
+    if (block_cache_growth_bytes + entry_size > BLOCK_CACHE_GROWTH_BYTES) {
+        return NULL;
+    }
+    entry = malloc(entry_size);
+    if (!entry) {
+        return NULL;
+    }
+    block_cache_growth_bytes += entry_size;
+    assert(block_cache_entry_count < BLOCK_CACHE_MAX_ENTRIES);
+    block_cache_entry_init(entry, pool);
+
+    if (print_cache_lookup) {
+        printf("%s: block size %zd, new cache entry %u, %zd growth bytes used\n",
+               __func__, pool->block_size, entry->index,
+               block_cache_growth_bytes);
+    }
+    return entry;
 }
 
 /**
@@ -389,67 +952,76 @@ static struct block_cache_entry *block_cache_lookup(struct fs *fs,
                                                     bool allocate)
 {
     struct block_cache_entry *entry;
-    struct block_cache_entry *unused_entry = NULL;
-    uint unused_entry_score = 0;
-    uint score;
-    uint available = 0;
-    uint in_use = 0;
+
+    struct block_cache_pool *pool;
 
     assert(dev);
     assert(fs || !allocate);
 
     stats_timer_start(STATS_CACHE_LOOKUP);
-    list_for_every_entry(&block_cache_lru, entry, struct block_cache_entry, lru_node) {
-        assert(entry->guard1 == BLOCK_CACHE_GUARD_1);
-        assert(entry->guard2 == BLOCK_CACHE_GUARD_2);
+    list_for_every_entry(block_cache_hash_bucket(dev, block), entry,
+                         struct block_cache_entry, hash_node) {
+        block_cache_entry_check_guards(entry);
         if (entry->dev == dev && entry->block == block) {
             if (print_cache_lookup) {
-                printf("%s: block %lld, found cache entry %zd, loaded %d, dirty %d\n",
-                       __func__, block, entry - block_cache_entries,
+                printf("%s: block %lld, found cache entry %u, loaded %d, dirty %d\n",
+                       __func__, block, entry->index,
                        entry->loaded, entry->dirty);
             }
-            stats_timer_start(STATS_CACHE_LOOKUP_FOUND);
-            stats_timer_stop(STATS_CACHE_LOOKUP_FOUND);
+            stats_counter_inc(STATS_CACHE_LOOKUP_FOUND);
             goto done;
         }
-        if (!block_cache_entry_has_refs(entry)) {
-            score = block_cache_entry_score(entry, available);
-            available++;
-            if (score >= unused_entry_score) {
-                unused_entry = entry;
-                unused_entry_score = score;
-            }
-            if (print_cache_lookup_verbose) {
-                printf("%s: block %lld, cache entry %zd available last used for %lld\n",
-                       __func__, block, entry - block_cache_entries, entry->block);
-            }
-        } else {
-            if (print_cache_lookup_verbose) {
-                printf("%s: block %lld, cache entry %zd in use for %lld\n",
-                       __func__, block, entry - block_cache_entries, entry->block);
-            }
-            in_use++;
-        }
     }
-    entry = unused_entry;
+    stats_counter_inc(STATS_CACHE_LOOKUP_NOT_FOUND);
 
-    if (!entry || !allocate) {
+    if (!allocate) {
+        entry = NULL;
+        goto done;
+    }
+
+    pool = block_cache_dev_pool(dev);
+    if (block_cache_flush_threshold &&
+        pool == block_cache_dev_pool(fs->dev) &&
+        pool->evict_count[BLOCK_CACHE_EVICT_DIRTY] >=
+        block_cache_flush_threshold) {
+        block_cache_flush_dirty(fs, pool);
+    }
+
+    entry = NULL;
+    if (!pool->evict_count[BLOCK_CACHE_EVICT_UNUSED]) {
+        entry = block_cache_pool_grow(pool);
+    }
+    if (!entry) {
+        entry = block_cache_find_evict_entry(pool);
+    }
+    if (!entry) {
         if (print_cache_lookup) {
-            printf("%s: block %lld, no available entries, %u in use, allocate %d\n",
-                   __func__, block, in_use, allocate);
+            printf("%s: block %lld, no available entries, allocate %d\n",
+                   __func__, block, allocate);
         }
-        entry = NULL;
         goto done;
     }
 
+    block_cache_entry_check_guards(entry);
+    assert(!block_cache_entry_has_refs(entry));
+
     if (print_cache_lookup) {
-        printf("%s: block %lld, use cache entry %zd, dirty %d, %u available, %u in_use\n",
-               __func__, block, entry - block_cache_entries,
-               entry->dirty, available, in_use);
+        printf("%s: block %lld, use cache entry %u, last used for %lld, dirty %d\n",
+               __func__, block, entry->index,
+               entry->block, entry->dirty);
     }
 
     assert(!entry->dirty_ref);
 
+    if (entry->dev) {
+        stats_counter_inc(STATS_CACHE_LOOKUP_EVICT);
+    }
+    if (entry->io_op != BLOCK_CACHE_IO_OP_NONE) {
+        /* Read started by block_prefetch has not completed yet */
+        assert(entry->io_op == BLOCK_CACHE_IO_OP_READ);
+        block_cache_complete_io(entry->dev);
+    }
+    block_cache_entry_drop_prefetched(entry);
     if (entry->dirty) {
         stats_timer_start(STATS_CACHE_LOOKUP_CLEAN);
         block_cache_entry_clean(entry);
@@ -460,13 +1032,16 @@ static struct block_cache_entry *block_cache_lookup(struct fs *fs,
     assert(!entry->dirty_mac);
     assert(!entry->dirty_tr);
 
+    block_cache_hash_remove(entry);
     entry->dev = dev;
     entry->block = block;
-    assert(dev->block_size <= sizeof(entry->data));
+    assert(dev->block_size <= pool->block_size);
     entry->block_size = dev->block_size;
     entry->key = fs->key;
     entry->loaded = false;
     entry->encrypted = false;
+    block_cache_hash_add(entry);
+    block_cache_evict_update(entry);
 
 done:
     stats_timer_stop(STATS_CACHE_LOOKUP);
@@ -558,17 +1133,86 @@ static struct block_cache_entry *block_cache_get(struct fs *fs,
             return NULL;
         }
     }
+    if (entry->prefetched) {
+        block_cache_prefetch_stats.hits++;
+        stats_counter_inc(STATS_CACHE_PREFETCH_HIT);
+        entry->prefetched = false;
+    }
 
     assert(!entry->dirty_ref);
+    if (!block_cache_entry_has_refs(entry)) {
+        block_cache_evict_remove(entry);
+    }
     obj_add_ref(&entry->obj, ref);
     if (print_block_ops) {
-        printf("%s: block %lld, cache entry %zd, loaded %d, dirty %d\n",
-               __func__, block, entry - block_cache_entries,
+        printf("%s: block %lld, cache entry %u, loaded %d, dirty %d\n",
+               __func__, block, entry->index,
                entry->loaded, entry->dirty);
     }
     return entry;
 }
 
+/**
+ * block_prefetch - Start loading blocks into the cache
+ * @tr:         Transaction to get device from.
+ * @blocks:     Block numbers to load.
+ * @count:      Number of entries in @blocks.
+ *
+ * Start reads for all blocks in @blocks that are not already cached, then wait
+ * for them as a group so the block device can combine them. The data is not
+ * validated here; the mac is checked when the block is later read with
+ * block_get.
+ */
+void block_prefetch(struct transaction *tr,
+                    const data_block_t *blocks,
+                    unsigned int count)
+{
+    unsigned int i;
+    bool started = false;
+    struct block_cache_entry *entry;
+    struct block_device *dev = tr->fs->dev;
+
+    if (tr->failed) {
+        return;
+    }
+
+    stats_timer_start(STATS_CACHE_PREFETCH);
+    for (i = 0; i < count; i++) {
+        if (blocks[i] >= dev->block_count) {
+            pr_warn("bad block num %lld >= %lld\n",
+                    blocks[i], dev->block_count);
+            continue;
+        }
+        entry = block_cache_lookup(tr->fs, dev, blocks[i], true);
+        if (!entry || entry->loaded || entry->io_op != BLOCK_CACHE_IO_OP_NONE) {
+            continue;
+        }
+        assert(!block_cache_entry_has_refs(entry));
+        if (print_block_load) {
+            printf("%s: request prefetch block %lld\n", __func__, entry->block);
+        }
+        entry->prefetched = true;
+        block_cache_evict_update(entry);
+        block_cache_prefetch_stats.issued++;
+        stats_counter_inc(STATS_CACHE_PREFETCH_ISSUED);
+        block_cache_queue_read(entry);
+        started = true;
+    }
+    if (started) {
+        block_cache_complete_io(dev);
+    }
+    stats_timer_stop(STATS_CACHE_PREFETCH);
+}
+
+/**
+ * block_cache_get_prefetch_stats - Get read-ahead counters
+ * @stats:      Pointer to store counters in.
+ */
+void block_cache_get_prefetch_stats(struct block_cache_prefetch_stats *stats)
+{
+    *stats = block_cache_prefetch_stats;
+}
+
 /**
  * block_cache_get_data - Call block_cache_get and return data pointer
  * @fs:         File system state object.
@@ -609,9 +1253,8 @@ static struct block_cache_entry *data_to_block_cache_entry(const void *data)
 
     assert(data);
     entry = containerof(data, struct block_cache_entry, data);
-    assert(entry >= block_cache_entries);
-    assert(entry < &block_cache_entries[BLOCK_CACHE_SIZE]);
-    assert(((uintptr_t)entry - (uintptr_t)entry) % sizeof(entry[0]) == 0);
+    block_cache_entry_check_guards(entry);
+    assert(entry->index < block_cache_entry_count);
     return entry;
 }
 
@@ -626,57 +1269,42 @@ static struct block_cache_entry *data_to_block_cache_entry_or_null(const void *d
     return data ? data_to_block_cache_entry(data) : NULL;
 }
 
-/**
- * block_cache_entry_destroy - Callback function for obj_del_ref
- * @obj:        Pointer to obj member of cache entry.
- *
- * Callback called by reference tracking code when the last reference to a
- * cache entry has been released. Since this is a cache, and not a normal heap
- * allocated object, the cache entry is not destroyed here. It is instead left
- * in a state where block_cache_lookup can reuse it.
- */
-static void block_cache_entry_destroy(obj_t *obj)
-{
-    struct block_cache_entry *entry = containerof(obj, struct block_cache_entry, obj);
-
-    list_delete(&entry->lru_node);
-    list_add_head(&block_cache_lru, &entry->lru_node);
-
-    if (entry->dirty_mac) {
-        block_cache_entry_encrypt(entry);
-    }
-}
-
 /**
  * block_cache_init - Allocate and initialize block cache
  */
 void block_cache_init(void)
 {
-    int i;
-    obj_ref_t ref;
-    struct block_cache_entry *entry;
+    uint i;
+    uint j;
+    struct block_cache_pool *pool;
+    size_t entry_size;
+    uint8_t *entries;
 
-    assert(!block_cache_entries);
+    assert(!block_cache_initialized);
+    block_cache_initialized = true;
 
-    entry = malloc(sizeof(block_cache_entries[0]) * BLOCK_CACHE_SIZE);
-    assert(entry);
-    full_assert(memset(entry, 1, sizeof(block_cache_entries[0]) * BLOCK_CACHE_SIZE));
-    block_cache_entries = entry;
+    for (i = 0; i < BLOCK_CACHE_HASH_SIZE; i++) {
+        list_initialize(&block_cache_hash[i]);
+    }
 
-    for (i = 0; i < BLOCK_CACHE_SIZE; i++, entry++) {
-        entry->guard1 = BLOCK_CACHE_GUARD_1;
-        entry->guard2 = BLOCK_CACHE_GUARD_2;
-        entry->dev = NULL;
-        entry->block = ~0;
-        entry->dirty = false;
-        entry->dirty_ref = false;
-        entry->dirty_mac = false;
-        entry->dirty_tr = NULL;
-        entry->io_op = BLOCK_CACHE_IO_OP_NONE;
-        obj_init(&entry->obj, &ref);
-        list_clear_node(&entry->io_op_node);
-        list_add_head(&block_cache_lru, &entry->lru_node);
-        obj_del_ref(&entry->obj, &ref, block_cache_entry_destroy);
+    block_cache_flush_list = malloc(sizeof(block_cache_flush_list[0]) *
+                                    BLOCK_CACHE_MAX_ENTRIES);
+    assert(block_cache_flush_list);
+
+    for (i = 0; i < countof(block_cache_pools); i++) {
+        pool = &block_cache_pools[i];
+        for (j = 0; j < BLOCK_CACHE_EVICT_CLASS_COUNT; j++) {
+            list_initialize(&pool->evict[j]);
+        }
+        if (!pool->initial_count) {
+            continue;
+        }
+        entry_size = BLOCK_CACHE_ENTRY_SIZE(pool->block_size);
+        entries = malloc(entry_size * pool->initial_count);
+        assert(entries);
+        for (j = 0; j < pool->initial_count; j++) {
+            block_cache_entry_init((void *)(entries + entry_size * j), pool);
+        }
     }
 }
 
@@ -688,16 +1316,22 @@ void block_cache_clean_transaction(struct transaction *tr)
 {
     struct block_cache_entry *entry;
     struct block_device *dev = NULL;
+    unsigned int count = 0;
 
     stats_timer_start(STATS_CACHE_CLEAN_TRANSACTION);
 
     list_for_every_entry(&block_cache_lru, entry, struct block_cache_entry, lru_node) {
-        assert(entry->guard1 == BLOCK_CACHE_GUARD_1);
-        assert(entry->guard2 == BLOCK_CACHE_GUARD_2);
+        block_cache_entry_check_guards(entry);
         if (entry->dirty_tr != tr) {
             continue;
         }
 
+        if (entry->io_op == BLOCK_CACHE_IO_OP_WRITE) {
+            /* Already cleaned by a previous batch */
+            assert(!entry->dirty);
+            continue;
+        }
+
         assert(entry->dirty);
 
         assert(!entry->dirty_ref);
@@ -718,13 +1352,11 @@ void block_cache_clean_transaction(struct transaction *tr)
         }
 
         assert(!block_cache_entry_has_refs(entry));
-        stats_timer_start(STATS_CACHE_CLEAN_TRANSACTION_ENT_CLN);
-        block_cache_entry_clean(entry);
-        stats_timer_stop(STATS_CACHE_CLEAN_TRANSACTION_ENT_CLN);
-        assert(!entry->dirty);
-        assert(!entry->dirty_tr);
+        assert(count < block_cache_entry_count);
+        block_cache_flush_list[count++] = entry;
     }
 
+    dev = block_cache_entries_flush(block_cache_flush_list, count);
     if (dev) {
         stats_timer_start(STATS_CACHE_CLEAN_TRANSACTION_WAIT_IO);
         block_cache_complete_io(dev);
@@ -748,8 +1380,7 @@ void block_cache_discard_transaction(struct transaction *tr, bool discard_all)
     struct block_device *dev = NULL;
 
     list_for_every_entry(&block_cache_lru, entry, struct block_cache_entry, lru_node) {
-        assert(entry->guard1 == BLOCK_CACHE_GUARD_1);
-        assert(entry->guard2 == BLOCK_CACHE_GUARD_2);
+        block_cache_entry_check_guards(entry);
         if (entry->dirty_tr != tr) {
             continue;
         }
@@ -760,6 +1391,12 @@ void block_cache_discard_transaction(struct transaction *tr, bool discard_all)
         }
 
         assert(entry->dev == dev);
+
+        if (entry->io_op == BLOCK_CACHE_IO_OP_WRITE) {
+            /* Write already started, block_cache_complete_write clears it */
+            assert(!entry->dirty);
+            continue;
+        }
         assert(entry->dirty);
 
         if (print_clean_transaction) {
@@ -780,6 +1417,7 @@ void block_cache_discard_transaction(struct transaction *tr, bool discard_all)
         entry->dirty = false;
         entry->dirty_tr = NULL;
         entry->loaded = false;
+        block_cache_evict_update(entry);
         assert(!entry->dirty);
         assert(!entry->dirty_tr);
     }
@@ -943,6 +1581,24 @@ bool block_is_clean(struct block_device *dev, data_block_t block)
     return !entry || !entry->dirty;
 }
 
+/**
+ * block_is_dirty_in_transaction - Check if transaction modified block
+ * @tr:         Transaction object.
+ * @block:      Block number on @tr->fs->dev.
+ *
+ * Return: %true if the cache contains non-tmp changes to @block made by @tr
+ * that have not finished writing, %false otherwise. Since a transaction only
+ * modifies committed blocks after copying them, a %true return value means
+ * @block was allocated by @tr.
+ */
+bool block_is_dirty_in_transaction(struct transaction *tr, data_block_t block)
+{
+    struct block_cache_entry *entry;
+
+    entry = block_cache_lookup(NULL, tr->fs->dev, block, false);
+    return entry && entry->dirty_tr == tr && !entry->dirty_tmp;
+}
+
 /**
  * block_discard_dirty - Discard dirty cache data.
  * @data:       Block data pointer
@@ -953,11 +1609,13 @@ void block_discard_dirty(const void *data)
 
     if (entry->dirty) {
         assert(entry->dev);
+        block_cache_hash_remove(entry);
         entry->loaded = false;
         entry->dev = NULL;
         entry->block = ~0;
         entry->dirty = false;
         entry->dirty_tr = NULL;
+        block_cache_evict_update(entry);
     }
 }
 
@@ -1013,8 +1671,7 @@ static void block_put_dirty_etc(struct transaction *tr,
     } else {
         assert(!block_mac);
     }
-    assert(entry->guard1 == BLOCK_CACHE_GUARD_1);
-    assert(entry->guard2 == BLOCK_CACHE_GUARD_2);
+    block_cache_entry_check_guards(entry);
 
     entry->dirty_ref = false;
     if (entry->dirty) {
@@ -1149,7 +1806,7 @@ void *block_get_cleared(struct transaction *tr,
                         obj_ref_t *ref)
 {
     void *data = block_get_write_no_read(tr, block, is_tmp, ref);
-    memset(data, 0, MAX_BLOCK_SIZE);
+    memset(data, 0, data_to_block_cache_entry(data)->pool->block_size);
     return data;
 }
 
@@ -1226,8 +1883,8 @@ void *block_move(struct transaction *tr,
     assert(entry->dev == tr->fs->dev);
 
     if (print_block_move) {
-        printf("%s: move cache entry %zd, from block %lld to %lld\n",
-               __func__, entry - block_cache_entries, entry->block, block);
+        printf("%s: move cache entry %u, from block %lld to %lld\n",
+               __func__, entry->index, entry->block, block);
     }
 
     dest_entry = block_cache_lookup(NULL, tr->fs->dev, block, false);
@@ -1238,17 +1895,22 @@ void *block_move(struct transaction *tr,
         assert(!list_in_list(&dest_entry->io_op_node));
         assert(dest_entry->block == block);
         if (print_block_move) {
-            printf("%s: clear old cache entry for block %lld, %zd\n",
-                   __func__, block, dest_entry - block_cache_entries);
+            printf("%s: clear old cache entry for block %lld, %u\n",
+                   __func__, block, dest_entry->index);
         }
+        block_cache_hash_remove(dest_entry);
+        block_cache_entry_drop_prefetched(dest_entry);
         dest_entry->loaded = false;
         dest_entry->dev = NULL;
         dest_entry->block = ~0;
         dest_entry->dirty = false;
         dest_entry->dirty_tr = NULL;
+        block_cache_evict_update(dest_entry);
     }
 
+    block_cache_hash_remove(entry);
     entry->block = block;
+    block_cache_hash_add(entry);
     return block_dirty(tr, data, is_tmp);
 }
 
@@ -1262,8 +1924,8 @@ void block_put(const void *data, obj_ref_t *ref)
     struct block_cache_entry *entry = data_to_block_cache_entry(data);
 
     if (print_block_ops) {
-        printf("%s: block %lld, cache entry %zd, loaded %d, dirty %d\n",
-               __func__, entry->block, entry - block_cache_entries,
+        printf("%s: block %lld, cache entry %u, loaded %d, dirty %d\n",
+               __func__, entry->block, entry->index,
                entry->loaded, entry->dirty);
     }
 
@@ -1300,12 +1962,11 @@ uint block_cache_debug_get_ref_block_count(void)
     struct block_cache_entry *entry;
 
     list_for_every_entry(&block_cache_lru, entry, struct block_cache_entry, lru_node) {
-        assert(entry->guard1 == BLOCK_CACHE_GUARD_1);
-        assert(entry->guard2 == BLOCK_CACHE_GUARD_2);
+        block_cache_entry_check_guards(entry);
         if (block_cache_entry_has_refs(entry)) {
             if (print_cache_get_ref_block_count) {
-                printf("%s: cache entry %zd in use for %lld, dev %p\n",
-                       __func__, entry - block_cache_entries,
+                printf("%s: cache entry %u in use for %lld, dev %p\n",
+                       __func__, entry->index,
                        entry->block, entry->dev);
             }
             count++;
@@ -1313,3 +1974,22 @@ uint block_cache_debug_get_ref_block_count(void)
     }
     return count;
 }
+
+#if BUILD_STORAGE_TEST
+/**
+ * block_cache_debug_set_flush_threshold - Override BLOCK_CACHE_FLUSH_THRESHOLD
+ * @threshold:  Number of dirty entries in a pool that triggers a flush, or 0
+ *              to only write back dirty entries on eviction and commit.
+ *
+ * Only used for test code.
+ *
+ * Return: previous threshold.
+ */
+unsigned int block_cache_debug_set_flush_threshold(unsigned int threshold)
+{
+    unsigned int old_threshold = block_cache_flush_threshold;
+
+    block_cache_flush_threshold = threshold;
+    return old_threshold;
+}
+#endif
@@ -38,6 +38,24 @@ void block_cache_complete_write(struct block_device *dev,
 
 void block_cache_init(void);
 
+/**
+ * struct block_cache_prefetch_stats - Read-ahead counters
+ * @issued:     Number of block reads started by block_prefetch.
+ * @hits:       Number of prefetched blocks that were later used.
+ * @wasted:     Number of prefetched blocks evicted before they were used.
+ */
+struct block_cache_prefetch_stats {
+    uint64_t issued;
+    uint64_t hits;
+    uint64_t wasted;
+};
+
+void block_cache_get_prefetch_stats(struct block_cache_prefetch_stats *stats);
+
+void block_prefetch(struct transaction *tr,
+                    const data_block_t *blocks,
+                    unsigned int count);
+
 void block_cache_clean_transaction(struct transaction *tr);
 
 void block_cache_discard_transaction(struct transaction *tr, bool discard_all);
@@ -64,6 +82,8 @@ void *block_dirty(struct transaction *tr, const void *data, bool is_tmp);
 
 bool block_is_clean(struct block_device *dev, data_block_t block);
 
+bool block_is_dirty_in_transaction(struct transaction *tr, data_block_t block);
+
 void block_discard_dirty(const void *data);
 
 void block_discard_dirty_by_block(struct block_device *dev, data_block_t block);
@@ -111,3 +131,7 @@ void block_put(const void *data, obj_ref_t *ref);
 data_block_t data_to_block_num(const void *data); /* test api, remove ? */
 
 uint block_cache_debug_get_ref_block_count(void);
+
+#if BUILD_STORAGE_TEST
+unsigned int block_cache_debug_set_flush_threshold(unsigned int threshold);
+#endif
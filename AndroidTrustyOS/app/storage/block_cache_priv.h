@@ -23,24 +23,56 @@
 #include "block_device.h"
 #include "crypt.h"
 
+/*
+ * The cache has two pools of entries. Blocks up to BLOCK_CACHE_SMALL_BLOCK_SIZE
+ * bytes (rpmb) use the small pool, larger blocks (non-secure file) use the main
+ * pool. BLOCK_CACHE_SIZE and BLOCK_CACHE_SMALL_SIZE are the number of entries
+ * allocated at init. A pool that runs out of unused entries allocates more,
+ * one entry sized for that pool at a time, until the entries added this way
+ * use BLOCK_CACHE_GROWTH_BYTES.
+ */
 #ifdef APP_STORAGE_BLOCK_CACHE_SIZE
 #define BLOCK_CACHE_SIZE (APP_STORAGE_BLOCK_CACHE_SIZE)
 #else
 #define BLOCK_CACHE_SIZE (64)
 #endif
+#ifdef APP_STORAGE_BLOCK_CACHE_SMALL_SIZE
+#define BLOCK_CACHE_SMALL_SIZE (APP_STORAGE_BLOCK_CACHE_SMALL_SIZE)
+#else
+#define BLOCK_CACHE_SMALL_SIZE (20)
+#endif
+#ifdef APP_STORAGE_RPMB_BLOCK_SIZE
+#define BLOCK_CACHE_SMALL_BLOCK_SIZE (APP_STORAGE_RPMB_BLOCK_SIZE)
+#else
+#define BLOCK_CACHE_SMALL_BLOCK_SIZE (512)
+#endif
+#ifdef APP_STORAGE_BLOCK_CACHE_HASH_SIZE
+#define BLOCK_CACHE_HASH_SIZE (APP_STORAGE_BLOCK_CACHE_HASH_SIZE)
+#else
+#define BLOCK_CACHE_HASH_SIZE (BLOCK_CACHE_SIZE + BLOCK_CACHE_SMALL_SIZE)
+#endif
+#ifdef APP_STORAGE_BLOCK_CACHE_MAX_WRITES
+#define BLOCK_CACHE_MAX_WRITES (APP_STORAGE_BLOCK_CACHE_MAX_WRITES)
+#else
+#define BLOCK_CACHE_MAX_WRITES (32) /* writes queued before waiting */
+#endif
+#ifdef APP_STORAGE_BLOCK_CACHE_FLUSH_THRESHOLD
+#define BLOCK_CACHE_FLUSH_THRESHOLD (APP_STORAGE_BLOCK_CACHE_FLUSH_THRESHOLD)
+#else
+#define BLOCK_CACHE_FLUSH_THRESHOLD (BLOCK_CACHE_SIZE / 2) /* per pool, 0 to disable */
+#endif
 #ifdef APP_STORAGE_MAIN_BLOCK_SIZE
 #define MAX_BLOCK_SIZE  (APP_STORAGE_MAIN_BLOCK_SIZE)
 #else
 #define MAX_BLOCK_SIZE (2048)
 #endif
 
+struct block_cache_pool;
+
 /**
  * struct block_cache_entry - block cache entry
- * @guard1:                 Set to BLOCK_CACHE_GUARD_1 to detect out of bound
- *                          writes to data.
- * @data:                   Decrypted block data.
- * @guard2:                 Set to BLOCK_CACHE_GUARD_2 to detect out of bound
- *                          writes to data.
+ * @pool:                   Pool entry was allocated from.
+ * @index:                  Entry number, only used for debug output.
  * @key:                    Key to use for encrypt, decrypt and calculate_mac.
  * @dev:                    Device that block was read from and will be written
  *                          to.
@@ -57,18 +89,30 @@
  * @dirty_tmp:              Data can be discarded by
  *                          block_cache_discard_transaction.
  * @dirty_tr:               Transaction that modified block.
+ * @prefetched:             Data was loaded by block_prefetch and has not been
+ *                          used yet.
  * @obj:                    Reference tracking struct.
  * @lru_node:               List node for tracking least recently used cache
  *                          entries.
+ * @hash_node:              List node for (@dev, @block) hash bucket. Only in a
+ *                          bucket while @dev is not %NULL.
+ * @evict_node:             List node for eviction candidate list. In a list
+ *                          if and only if the entry has no references.
+ * @evict_seq:              Value of eviction sequence counter when entry was
+ *                          last added to an eviction candidate list.
+ * @evict_class:            Eviction candidate list @evict_node is in.
  * @io_op_node:             List node for tracking active read and write
  *                          operations.
  * @io_op:                  Currently active io operation.
+ * @guard1:                 Set to BLOCK_CACHE_GUARD_1 to detect out of bound
+ *                          writes to data.
+ * @data:                   Decrypted block data. @pool->block_size bytes
+ *                          followed by a second guard value,
+ *                          BLOCK_CACHE_GUARD_2.
  */
 struct block_cache_entry {
-    uint64_t guard1;
-    uint8_t data[MAX_BLOCK_SIZE];
-    uint64_t guard2;
-
+    struct block_cache_pool *pool;
+    uint index;
     const struct key *key;
     struct block_device *dev;
     data_block_t block;
@@ -81,15 +125,40 @@ struct block_cache_entry {
     bool dirty_mac;
     bool dirty_tmp;
     struct transaction *dirty_tr;
+    bool prefetched;
 
     obj_t obj;
     struct list_node lru_node;
+    struct list_node hash_node;
+    struct list_node evict_node;
+    uint64_t evict_seq;
+    uint evict_class;
     struct list_node io_op_node;
     enum {
         BLOCK_CACHE_IO_OP_NONE,
         BLOCK_CACHE_IO_OP_READ,
         BLOCK_CACHE_IO_OP_WRITE,
     } io_op;
+
+    uint64_t guard1;
+    uint8_t data[];
 };
 
-#define BLOCK_CACHE_SIZE_BYTES (sizeof(struct block_cache_entry[BLOCK_CACHE_SIZE]))
+#define BLOCK_CACHE_ENTRY_SIZE(block_size) \
+    (sizeof(struct block_cache_entry) + (block_size) + sizeof(uint64_t))
+
+#define BLOCK_CACHE_SIZE_BYTES \
+    (BLOCK_CACHE_SIZE * BLOCK_CACHE_ENTRY_SIZE(MAX_BLOCK_SIZE) + \
+     BLOCK_CACHE_SMALL_SIZE * BLOCK_CACHE_ENTRY_SIZE(BLOCK_CACHE_SMALL_BLOCK_SIZE))
+
+#ifdef APP_STORAGE_BLOCK_CACHE_GROWTH_BYTES
+#define BLOCK_CACHE_GROWTH_BYTES (APP_STORAGE_BLOCK_CACHE_GROWTH_BYTES)
+#else
+#define BLOCK_CACHE_GROWTH_BYTES (4 * BLOCK_CACHE_ENTRY_SIZE(MAX_BLOCK_SIZE))
+#endif
+
+/* Upper bound on entry count, if all growth goes to the small pool */
+#define BLOCK_CACHE_MAX_ENTRIES \
+    (BLOCK_CACHE_SIZE + BLOCK_CACHE_SMALL_SIZE + \
+     BLOCK_CACHE_GROWTH_BYTES / \
+     BLOCK_CACHE_ENTRY_SIZE(BLOCK_CACHE_SMALL_BLOCK_SIZE))
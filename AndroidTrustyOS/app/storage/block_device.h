@@ -25,6 +25,9 @@ typedef unsigned long long data_block_t;
  * struct block_device - Block device functions and state
  * @start_read:         Function to start a read operation from block device.
  * @start_write:        Function to start a write operation to block device.
+ *                      The data buffer is not modified or freed until
+ *                      block_cache_complete_write has been called for the
+ *                      block, so the block device does not need to copy it.
  * @wait_for_io:        Function to wait for read or write operations to
  *                      complete. If @start_read and @start_write always call
  *                      block_cache_complete_read and block_cache_complete_write
@@ -14,10 +14,12 @@
  * limitations under the License.
  */
 
+#include <assert.h>
 #include <err.h>
 #include <errno.h>
 #include <compiler.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <trusty_ipc.h>
 
@@ -62,6 +64,41 @@ STATIC_ASSERT(BLOCK_SIZE_MAIN >= 256);
 STATIC_ASSERT(BLOCK_COUNT_MAIN >= 8);
 STATIC_ASSERT(BLOCK_SIZE_MAIN >= BLOCK_SIZE_RPMB);
 
+STATIC_ASSERT(BLOCK_DEVICE_TIPC_NS_IO_QUEUE_SIZE >= 1);
+STATIC_ASSERT(BLOCK_DEVICE_TIPC_RPMB_WRITE_QUEUE_SIZE >= 1);
+STATIC_ASSERT(BLOCK_DEVICE_TIPC_NS_MAX_IO_SIZE >= BLOCK_SIZE_MAIN);
+
+/* Blocks that fit in a proxy message of io_size bytes, at least 1 */
+#define NS_READ_BLOCKS(io_size) \
+    ((io_size) - sizeof(struct storage_msg) < BLOCK_SIZE_MAIN ? 1 : \
+     ((io_size) - sizeof(struct storage_msg)) / BLOCK_SIZE_MAIN)
+#define NS_WRITE_HEADER_SIZE (sizeof(struct storage_msg) + \
+                              sizeof(struct storage_file_write_req))
+#define NS_WRITE_BLOCKS(io_size) \
+    ((io_size) - NS_WRITE_HEADER_SIZE < BLOCK_SIZE_MAIN ? 1 : \
+     ((io_size) - NS_WRITE_HEADER_SIZE) / BLOCK_SIZE_MAIN)
+#define NS_WRITE_MAX_BLOCKS NS_WRITE_BLOCKS(BLOCK_DEVICE_TIPC_NS_MAX_IO_SIZE)
+
+STATIC_ASSERT(NS_WRITE_MAX_BLOCKS <= NS_WRITE_MAX_IOVS);
+
+/*
+ * Max rpmb blocks in one authenticated write: the device reliable write size,
+ * limited by what fits in one proxy message next to the result read request.
+ */
+#define RPMB_WRITE_HEADER_SIZE (sizeof(struct storage_msg) + \
+                                sizeof(struct storage_rpmb_send_req) + \
+                                RPMB_PACKET_SIZE)
+#define RPMB_WRITE_BLOCKS(io_size) \
+    (MIN(RPMB_MAX_WRITE_COUNT, \
+         ((io_size) - RPMB_WRITE_HEADER_SIZE) / RPMB_PACKET_SIZE) / \
+     BLOCK_SIZE_RPMB_BLOCKS)
+
+STATIC_ASSERT(BLOCK_DEVICE_TIPC_NS_DEFAULT_IO_SIZE <=
+              BLOCK_DEVICE_TIPC_NS_MAX_IO_SIZE);
+STATIC_ASSERT(RPMB_WRITE_BLOCKS(BLOCK_DEVICE_TIPC_NS_DEFAULT_IO_SIZE) >= 1);
+STATIC_ASSERT(RPMB_WRITE_BLOCKS(BLOCK_DEVICE_TIPC_NS_MAX_IO_SIZE) *
+              BLOCK_SIZE_RPMB <= BLOCK_DEVICE_TIPC_NS_MAX_IO_SIZE);
+
 #define SS_ERR(args...)  fprintf(stderr, "ss: " args)
 #define SS_WARN(args...)  fprintf(stderr, "ss: " args)
 #define SS_DBG_IO(args...)  do {} while(0)
@@ -112,6 +149,94 @@ static struct block_device_rpmb *dev_rpmb_to_state(struct block_device *dev)
     return containerof(dev, struct block_device_rpmb, dev);
 }
 
+/**
+ * block_device_tipc_rpmb_write_run - Write consecutive queued blocks
+ * @dev_rpmb:   Device state.
+ * @order:      Indices in @dev_rpmb->write_queue sorted by block number.
+ * @start:      Index in @order of first write to send.
+ * @count:      Number of entries in @order.
+ *
+ * Send queued writes of consecutive blocks starting at @order[@start] as one
+ * multi-frame authenticated write.
+ *
+ * Return: Number of writes sent.
+ */
+static unsigned int block_device_tipc_rpmb_write_run(struct block_device_rpmb *dev_rpmb,
+                                                     const unsigned int *order,
+                                                     unsigned int start,
+                                                     unsigned int count)
+{
+    int ret;
+    unsigned int i;
+    unsigned int run = 1;
+    uint16_t rpmb_block;
+    struct block_device_rpmb_write *first = &dev_rpmb->write_queue[order[start]];
+    uint8_t *buf = dev_rpmb->state->rpmb_write_buf;
+
+    while (run < dev_rpmb->state->rpmb_write_max_blocks && start + run < count &&
+           dev_rpmb->write_queue[order[start + run]].block == first->block + run) {
+        run++;
+    }
+
+    for (i = 0; i < run; i++) {
+        memcpy(buf + i * BLOCK_SIZE_RPMB,
+               dev_rpmb->write_queue[order[start + i]].data, BLOCK_SIZE_RPMB);
+    }
+
+    rpmb_block = first->block + dev_rpmb->base;
+
+    ret = rpmb_write(dev_rpmb->state->rpmb_state, buf,
+                     rpmb_block * BLOCK_SIZE_RPMB_BLOCKS,
+                     run * BLOCK_SIZE_RPMB_BLOCKS, true);
+
+    SS_DBG_IO("%s: block %lld, count %u, base %d, rpmb_block %d, ret %d\n",
+              __func__, first->block, run, dev_rpmb->base, rpmb_block, ret);
+
+    for (i = 0; i < run; i++) {
+        dev_rpmb->write_queue[order[start + i]].failed = !!ret;
+    }
+    return run;
+}
+
+/**
+ * block_device_tipc_rpmb_flush - Send queued rpmb writes
+ * @dev_rpmb:   Device state.
+ *
+ * Send all queued writes, combining writes of consecutive blocks, then report
+ * their completion to the block cache in the order they were started.
+ */
+static void block_device_tipc_rpmb_flush(struct block_device_rpmb *dev_rpmb)
+{
+    unsigned int i;
+    unsigned int j;
+    unsigned int tmp;
+    unsigned int count = dev_rpmb->write_count;
+    unsigned int order[BLOCK_DEVICE_TIPC_RPMB_WRITE_QUEUE_SIZE];
+
+    /* writes are all pending at once, so they can be sent in block order */
+    for (i = 0; i < count; i++) {
+        order[i] = i;
+        for (j = i; j > 0 && dev_rpmb->write_queue[order[j - 1]].block >
+                             dev_rpmb->write_queue[order[j]].block; j--) {
+            tmp = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = tmp;
+        }
+    }
+
+    for (i = 0; i < count;) {
+        i += block_device_tipc_rpmb_write_run(dev_rpmb, order, i, count);
+    }
+
+    assert(dev_rpmb->write_count == count);
+    dev_rpmb->write_count = 0;
+    for (i = 0; i < count; i++) {
+        block_cache_complete_write(&dev_rpmb->dev,
+                                   dev_rpmb->write_queue[i].block,
+                                   dev_rpmb->write_queue[i].failed);
+    }
+}
+
 static void block_device_tipc_rpmb_start_read(struct block_device *dev,
                                               data_block_t block)
 {
@@ -123,6 +248,11 @@ static void block_device_tipc_rpmb_start_read(struct block_device *dev,
     assert(block < dev->block_count);
     rpmb_block = block + dev_rpmb->base;
 
+    /* complete queued writes first, the block cache expects in-order io */
+    if (dev_rpmb->write_count) {
+        block_device_tipc_rpmb_flush(dev_rpmb);
+    }
+
     ret = rpmb_read(dev_rpmb->state->rpmb_state, tmp,
                     rpmb_block * BLOCK_SIZE_RPMB_BLOCKS,
                     BLOCK_SIZE_RPMB_BLOCKS);
@@ -138,28 +268,30 @@ static void block_device_tipc_rpmb_start_write(struct block_device *dev,
                                                const void *data,
                                                size_t data_size)
 {
-    int ret;
-    uint16_t rpmb_block;
     struct block_device_rpmb *dev_rpmb = dev_rpmb_to_state(dev);
 
     assert(data_size == BLOCK_SIZE_RPMB);
     assert(block < dev->block_count);
+    assert(data);
 
-    rpmb_block = block + dev_rpmb->base;
-
-    ret = rpmb_write(dev_rpmb->state->rpmb_state, data,
-                     rpmb_block * BLOCK_SIZE_RPMB_BLOCKS,
-                     BLOCK_SIZE_RPMB_BLOCKS, true);
-
-    SS_DBG_IO("%s: block %lld, base %d, rpmb_block %d, ret %d\n",
-              __func__, block, dev_rpmb->base, rpmb_block, ret);
+    SS_DBG_IO("%s: block %lld\n", __func__, block);
 
-    block_cache_complete_write(dev, block, !!ret);
+    if (dev_rpmb->write_count == countof(dev_rpmb->write_queue)) {
+        block_device_tipc_rpmb_flush(dev_rpmb);
+    }
+    assert(dev_rpmb->write_count < countof(dev_rpmb->write_queue));
+    dev_rpmb->write_queue[dev_rpmb->write_count].block = block;
+    dev_rpmb->write_queue[dev_rpmb->write_count].data = data;
+    dev_rpmb->write_queue[dev_rpmb->write_count].failed = false;
+    dev_rpmb->write_count++;
 }
 
 static void block_device_tipc_rpmb_wait_for_io(struct block_device *dev)
 {
-    assert(0); /* TODO: use async read/write */
+    struct block_device_rpmb *dev_rpmb = dev_rpmb_to_state(dev);
+
+    assert(dev_rpmb->write_count);
+    block_device_tipc_rpmb_flush(dev_rpmb);
 }
 
 
@@ -169,17 +301,168 @@ static struct block_device_tipc *dev_ns_to_state(struct block_device *dev)
     return containerof(dev, struct block_device_tipc, dev_ns);
 }
 
-static void block_device_tipc_ns_start_read(struct block_device *dev, data_block_t block)
+/**
+ * block_device_tipc_ns_run_length - Count queued operations for one request
+ * @state:      Device state.
+ * @start:      Index of first operation in @state->ns_io_queue.
+ * @max_blocks: Maximum number of blocks to return.
+ *
+ * Return: Number of operations starting at @start that are all reads or all
+ * writes of consecutive blocks, up to @max_blocks.
+ */
+static unsigned int block_device_tipc_ns_run_length(struct block_device_tipc *state,
+                                                    unsigned int start,
+                                                    unsigned int max_blocks)
+{
+    unsigned int count = 1;
+    struct block_device_tipc_ns_io *first = &state->ns_io_queue[start];
+    struct block_device_tipc_ns_io *io;
+
+    while (count < max_blocks && start + count < state->ns_io_count) {
+        io = &state->ns_io_queue[start + count];
+        if (!io->data != !first->data || io->block != first->block + count) {
+            break;
+        }
+        count++;
+    }
+    return count;
+}
+
+/**
+ * block_device_tipc_ns_read_run - Read consecutive blocks with one request
+ * @state:      Device state.
+ * @start:      Index of first read operation in @state->ns_io_queue.
+ *
+ * Return: Number of read operations completed.
+ */
+static unsigned int block_device_tipc_ns_read_run(struct block_device_tipc *state,
+                                                  unsigned int start)
 {
     int ret;
-    uint8_t tmp[BLOCK_SIZE_MAIN]; /* TODO: pass data in? */
-    struct block_device_tipc *state = dev_ns_to_state(dev);
+    unsigned int i;
+    unsigned int count;
+    data_block_t block = state->ns_io_queue[start].block;
+
+    count = block_device_tipc_ns_run_length(state, start,
+                                             state->ns_read_max_blocks);
 
     ret = ns_read_pos(state->ipc_handle, state->ns_handle,
-                      block * BLOCK_SIZE_MAIN, tmp, BLOCK_SIZE_MAIN);
-    SS_DBG_IO("%s: block %lld, ret %d\n", __func__, block, ret);
-    block_cache_complete_read(dev, block, tmp,
-                              BLOCK_SIZE_MAIN, ret != BLOCK_SIZE_MAIN);
+                      block * BLOCK_SIZE_MAIN, state->ns_read_buf,
+                      count * BLOCK_SIZE_MAIN);
+    SS_DBG_IO("%s: block %lld, count %u, ret %d\n", __func__, block, count, ret);
+
+    for (i = 0; i < count; i++) {
+        block_cache_complete_read(&state->dev_ns,
+                                  state->ns_io_queue[start + i].block,
+                                  state->ns_read_buf + i * BLOCK_SIZE_MAIN,
+                                  BLOCK_SIZE_MAIN,
+                                  ret != (int)(count * BLOCK_SIZE_MAIN));
+    }
+    return count;
+}
+
+/**
+ * block_device_tipc_ns_write_run - Write queued blocks with batched requests
+ * @state:      Device state.
+ * @start:      Index of first write operation in @state->ns_io_queue.
+ *
+ * Send all write operations from @start up to the next read operation or the
+ * end of the queue. Consecutive blocks are combined into one request, and all
+ * but the last request are sent with STORAGE_MSG_FLAG_BATCH so only a single
+ * response has to be waited for.
+ *
+ * Return: Number of write operations completed.
+ */
+static unsigned int block_device_tipc_ns_write_run(struct block_device_tipc *state,
+                                                   unsigned int start)
+{
+    int ret = 0;
+    unsigned int i;
+    unsigned int j;
+    unsigned int end;
+    unsigned int count;
+    bool batch;
+    iovec_t data_iov[NS_WRITE_MAX_BLOCKS];
+
+    for (end = start; end < state->ns_io_count; end++) {
+        if (!state->ns_io_queue[end].data) {
+            break;
+        }
+    }
+
+    for (i = start; i < end && ret >= 0; i += count) {
+        count = block_device_tipc_ns_run_length(state, i,
+                                                 state->ns_write_max_blocks);
+        for (j = 0; j < count; j++) {
+            /* TODO: use const API */
+            data_iov[j].base = (void *)state->ns_io_queue[i + j].data;
+            data_iov[j].len = BLOCK_SIZE_MAIN;
+        }
+        batch = i + count < end;
+        ret = ns_write_pos_iov(state->ipc_handle, state->ns_handle,
+                               state->ns_io_queue[i].block * BLOCK_SIZE_MAIN,
+                               data_iov, count, batch);
+        SS_DBG_IO("%s: block %lld, count %u, batch %d, ret %d\n", __func__,
+                  state->ns_io_queue[i].block, count, batch, ret);
+    }
+
+    for (i = start; i < end; i++) {
+        block_cache_complete_write(&state->dev_ns, state->ns_io_queue[i].block,
+                                   ret < 0);
+    }
+    return end - start;
+}
+
+/**
+ * block_device_tipc_ns_flush - Send queued operations to the proxy
+ * @state:      Device state.
+ *
+ * Send all queued operations and report their completion to the block cache
+ * in the order they were started.
+ */
+static void block_device_tipc_ns_flush(struct block_device_tipc *state)
+{
+    unsigned int start = 0;
+    unsigned int count = state->ns_io_count;
+
+    while (start < count) {
+        if (state->ns_io_queue[start].data) {
+            start += block_device_tipc_ns_write_run(state, start);
+        } else {
+            start += block_device_tipc_ns_read_run(state, start);
+        }
+    }
+    assert(state->ns_io_count == count);
+    state->ns_io_count = 0;
+}
+
+/**
+ * block_device_tipc_ns_queue_io - Add operation to the non-secure io queue
+ * @state:      Device state.
+ * @block:      Block number.
+ * @data:       Data to write or %NULL to read @block.
+ *
+ * If the queue is full, the operations already in it are completed first.
+ */
+static void block_device_tipc_ns_queue_io(struct block_device_tipc *state,
+                                          data_block_t block,
+                                          const void *data)
+{
+    if (state->ns_io_count == countof(state->ns_io_queue)) {
+        block_device_tipc_ns_flush(state);
+    }
+    assert(state->ns_io_count < countof(state->ns_io_queue));
+    state->ns_io_queue[state->ns_io_count].block = block;
+    state->ns_io_queue[state->ns_io_count].data = data;
+    state->ns_io_count++;
+}
+
+static void block_device_tipc_ns_start_read(struct block_device *dev, data_block_t block)
+{
+    struct block_device_tipc *state = dev_ns_to_state(dev);
+
+    SS_DBG_IO("%s: block %lld\n", __func__, block);
+    block_device_tipc_ns_queue_io(state, block, NULL);
 }
 
 static void block_device_tipc_ns_start_write(struct block_device *dev,
@@ -187,20 +470,51 @@ static void block_device_tipc_ns_start_write(struct block_device *dev,
                                              const void *data,
                                              size_t data_size)
 {
-    int ret;
     struct block_device_tipc *state = dev_ns_to_state(dev);
 
     assert(data_size == BLOCK_SIZE_MAIN);
+    assert(data);
 
-    ret = ns_write_pos(state->ipc_handle, state->ns_handle,
-                       block * BLOCK_SIZE_MAIN, data, data_size);
-    SS_DBG_IO("%s: block %lld, ret %d\n", __func__, block, ret);
-    block_cache_complete_write(dev, block, ret != BLOCK_SIZE_MAIN);
+    SS_DBG_IO("%s: block %lld\n", __func__, block);
+    block_device_tipc_ns_queue_io(state, block, data);
 }
 
 static void block_device_tipc_ns_wait_for_io(struct block_device *dev)
 {
-    assert(0); /* TODO: use async read/write */
+    struct block_device_tipc *state = dev_ns_to_state(dev);
+
+    assert(state->ns_io_count);
+    block_device_tipc_ns_flush(state);
+}
+
+/**
+ * block_device_tipc_negotiate - Select proxy message size
+ * @state:      Device state.
+ *
+ * Ask the proxy for messages of up to %BLOCK_DEVICE_TIPC_NS_MAX_IO_SIZE bytes
+ * and set the per request block limits from the size it accepts. Proxies that
+ * do not support STORAGE_NEGOTIATE keep the default message size.
+ */
+static void block_device_tipc_negotiate(struct block_device_tipc *state)
+{
+    int ret;
+    uint32_t io_size;
+
+    ret = ns_negotiate(state->ipc_handle, BLOCK_DEVICE_TIPC_NS_MAX_IO_SIZE,
+                       &io_size);
+    if (ret < 0) {
+        io_size = BLOCK_DEVICE_TIPC_NS_DEFAULT_IO_SIZE;
+    }
+    io_size = MAX(io_size, BLOCK_DEVICE_TIPC_NS_DEFAULT_IO_SIZE);
+    io_size = MIN(io_size, BLOCK_DEVICE_TIPC_NS_MAX_IO_SIZE);
+
+    state->ns_io_size = io_size;
+    state->ns_read_max_blocks = NS_READ_BLOCKS(io_size);
+    state->ns_write_max_blocks = NS_WRITE_BLOCKS(io_size);
+    state->rpmb_write_max_blocks = RPMB_WRITE_BLOCKS(io_size);
+    SS_DBG_IO("%s: io size %u, read %u, write %u, rpmb write %u blocks\n",
+              __func__, io_size, state->ns_read_max_blocks,
+              state->ns_write_max_blocks, state->rpmb_write_max_blocks);
 }
 
 static void block_device_tipc_init_dev_rpmb(struct block_device_rpmb *dev_rpmb,
@@ -219,6 +533,7 @@ static void block_device_tipc_init_dev_rpmb(struct block_device_rpmb *dev_rpmb,
     list_initialize(&dev_rpmb->dev.io_ops);
     dev_rpmb->state = state;
     dev_rpmb->base = base;
+    dev_rpmb->write_count = 0;
 }
 
 int block_device_tipc_init(struct block_device_tipc *state,
@@ -236,6 +551,8 @@ int block_device_tipc_init(struct block_device_tipc *state,
 
     state->ipc_handle = ipc_handle;
 
+    block_device_tipc_negotiate(state);
+
     /* init rpmb */
     ret = rpmb_init(&state->rpmb_state, &state->ipc_handle, rpmb_key);
     if (ret < 0) {
@@ -293,6 +610,7 @@ int block_device_tipc_init(struct block_device_tipc *state,
     state->dev_ns.block_num_size = sizeof(data_block_t);
     state->dev_ns.mac_size = sizeof(struct mac);
     list_initialize(&state->dev_ns.io_ops);
+    state->ns_io_count = 0;
 
     ret = ns_open_file(state->ipc_handle, "0", &state->ns_handle, true);
     if (ret < 0) {
@@ -343,6 +661,7 @@ err_rpmb_init:
 void block_device_tipc_uninit(struct block_device_tipc *state)
 {
     if (state->dev_ns.block_count) {
+        assert(!state->ns_io_count);
         ipc_port_destroy(&state->fs_ns.client_ctx);
         /* undo fs_init */
         ns_close_file(state->ipc_handle, state->ns_handle);
@@ -25,16 +25,56 @@
 struct rpmb_key;
 struct block_device_tipc;
 
+#ifdef APP_STORAGE_NS_IO_QUEUE_SIZE
+#define BLOCK_DEVICE_TIPC_NS_IO_QUEUE_SIZE (APP_STORAGE_NS_IO_QUEUE_SIZE)
+#else
+#define BLOCK_DEVICE_TIPC_NS_IO_QUEUE_SIZE (16)
+#endif
+/*
+ * Largest proxy message. The size actually used is negotiated with the proxy
+ * when the device is initialized, proxies without STORAGE_NEGOTIATE get
+ * 4096 byte messages.
+ */
+#ifdef APP_STORAGE_NS_MAX_IO_SIZE
+#define BLOCK_DEVICE_TIPC_NS_MAX_IO_SIZE (APP_STORAGE_NS_MAX_IO_SIZE)
+#else
+#define BLOCK_DEVICE_TIPC_NS_MAX_IO_SIZE (12288)
+#endif
+#define BLOCK_DEVICE_TIPC_NS_DEFAULT_IO_SIZE (4096)
+#ifdef APP_STORAGE_RPMB_WRITE_QUEUE_SIZE
+#define BLOCK_DEVICE_TIPC_RPMB_WRITE_QUEUE_SIZE (APP_STORAGE_RPMB_WRITE_QUEUE_SIZE)
+#else
+#define BLOCK_DEVICE_TIPC_RPMB_WRITE_QUEUE_SIZE (16)
+#endif
+
+/**
+ * struct block_device_rpmb_write - Queued rpmb block device write
+ * @block:      Block number.
+ * @data:       Encrypted data to write. Owned by the block cache, which leaves
+ *              it unchanged until the write is completed.
+ * @failed:     Write failed, set when the queue is flushed.
+ */
+struct block_device_rpmb_write {
+    data_block_t block;
+    const void *data;
+    bool failed;
+};
+
 /**
  * struct block_device_rpmb
- * @state:      Pointer to shared state containing ipc_handle and rpmb_state
- * @dev:        Block device state
- * @base:       First block to use in rpmb partition
+ * @state:          Pointer to shared state containing ipc_handle and rpmb_state
+ * @dev:            Block device state
+ * @base:           First block to use in rpmb partition
+ * @write_queue:    Writes started on @dev that have not been sent yet, in the
+ *                  order they were started.
+ * @write_count:    Number of entries in @write_queue.
  */
 struct block_device_rpmb {
     struct block_device dev;
     struct block_device_tipc *state;
     uint16_t base;
+    struct block_device_rpmb_write write_queue[BLOCK_DEVICE_TIPC_RPMB_WRITE_QUEUE_SIZE];
+    unsigned int write_count;
 };
 
 struct client_port_context {
@@ -42,9 +82,30 @@ struct client_port_context {
     struct ipc_port_context client_ctx;
 };
 
+/**
+ * struct block_device_tipc_ns_io - Queued non-secure block device operation
+ * @block:      Block number.
+ * @data:       Encrypted data to write, or %NULL for a read operation. Owned by
+ *              the block cache, which leaves it unchanged until the write is
+ *              completed.
+ */
+struct block_device_tipc_ns_io {
+    data_block_t block;
+    const void *data;
+};
+
 /**
  * struct block_device_tipc
  * @ipc_handle
+ * @ns_io_queue:    Read and write operations started on @dev_ns, in the order
+ *                  they were started, that have not been sent to the proxy yet.
+ * @ns_io_count:    Number of entries in @ns_io_queue.
+ * @ns_io_size:     Proxy message size negotiated by block_device_tipc_init.
+ * @ns_read_max_blocks:     Max blocks read from @dev_ns with one request.
+ * @ns_write_max_blocks:    Max blocks written to @dev_ns with one request.
+ * @rpmb_write_max_blocks:  Max blocks in one authenticated rpmb write.
+ * @ns_read_buf:    Buffer for coalesced reads from @dev_ns.
+ * @rpmb_write_buf: Buffer for multi-block writes to @dev_rpmb or @dev_ns_rpmb.
  */
 
 struct block_device_tipc {
@@ -61,6 +122,15 @@ struct block_device_tipc {
     struct block_device_rpmb dev_ns_rpmb;
     struct fs tr_state_ns;
     struct client_port_context fs_ns;
+
+    struct block_device_tipc_ns_io ns_io_queue[BLOCK_DEVICE_TIPC_NS_IO_QUEUE_SIZE];
+    unsigned int ns_io_count;
+    size_t ns_io_size;
+    unsigned int ns_read_max_blocks;
+    unsigned int ns_write_max_blocks;
+    unsigned int rpmb_write_max_blocks;
+    uint8_t ns_read_buf[BLOCK_DEVICE_TIPC_NS_MAX_IO_SIZE];
+    uint8_t rpmb_write_buf[BLOCK_DEVICE_TIPC_NS_MAX_IO_SIZE];
 };
 
 int block_device_tipc_init(struct block_device_tipc *state,
@@ -79,6 +79,56 @@ bool block_map_get(struct transaction *tr,
     return true;
 }
 
+/**
+ * block_map_get_range - Lookup consecutive blocks
+ * @tr:         Transaction object.
+ * @block_map:  Block map object.
+ * @index:      Index of first block to get.
+ * @block_macs: Array to return block_macs in.
+ * @count:      Maximum number of entries to return in @block_macs.
+ *
+ * Look up the blocks at @index, @index + 1, ... with a single tree walk,
+ * stopping at the first index that has no block_mac.
+ *
+ * Return: Number of entries filled in @block_macs.
+ */
+size_t block_map_get_range(struct transaction *tr,
+                           struct block_map *block_map,
+                           data_block_t index,
+                           struct block_mac *block_macs,
+                           size_t count)
+{
+    size_t i;
+    struct block_tree_path path;
+
+    index++; /* 0 is not a valid block tree key */
+
+    if (!count) {
+        return 0;
+    }
+
+    block_tree_walk(tr, &block_map->tree, index, false, &path);
+    for (i = 0; i < count; i++) {
+        if (tr->failed) {
+            pr_warn("transaction failed, abort\n");
+            break;
+        }
+        if (block_tree_path_get_key(&path) != index + i) {
+            if (print_block_map) {
+                printf("%s: %lld not found (next key %lld)\n",
+                       __func__, index + i, block_tree_path_get_key(&path));
+            }
+            break;
+        }
+        block_macs[i] = block_tree_path_get_data_block_mac(&path);
+        if (i + 1 < count) {
+            block_tree_path_next(&path);
+        }
+    }
+
+    return i;
+}
+
 /**
  * block_map_set - Store a block_mac
  * @tr:         Transaction object.
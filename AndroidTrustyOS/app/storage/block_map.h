@@ -40,6 +40,12 @@ bool block_map_get(struct transaction *tr,
                    data_block_t index,
                    struct block_mac *block_mac);
 
+size_t block_map_get_range(struct transaction *tr,
+                           struct block_map *block_map,
+                           data_block_t index,
+                           struct block_mac *block_macs,
+                           size_t count);
+
 void block_map_set(struct transaction *tr, struct block_map *block_map,
                    data_block_t index, const struct block_mac *block_mac);
 
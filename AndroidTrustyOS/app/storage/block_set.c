@@ -25,6 +25,7 @@
 #include "array.h"
 #include "block_allocator.h"
 #include "block_set.h"
+#include "debug_stats.h"
 #include "debug.h"
 #include "transaction.h"
 
@@ -318,6 +319,71 @@ struct block_range block_set_find_next_range(struct transaction *tr,
     return range;
 }
 
+/**
+ * block_set_iter_init - Initialize block set iterator
+ * @iter:       Iterator object.
+ * @set:        Block-set object to iterate over.
+ */
+void block_set_iter_init(struct block_set_iter *iter, struct block_set *set)
+{
+    iter->set = set;
+    iter->path.tree = NULL;
+    iter->path.count = 0;
+    iter->min_block = 0;
+}
+
+/**
+ * block_set_iter_next_range - find next range in set
+ * @tr:         Transaction object.
+ * @iter:       Iterator object.
+ * @min_block:  Block number to start search at. Must not be smaller than
+ *              the value passed in the previous call.
+ *
+ * Same as block_set_find_next_range, but continues from the tree path found
+ * by the previous call if the set has not been modified since then.
+ *
+ * Return: First block range in set >= @min_block, or an empty range if no
+ * match is found.
+ */
+struct block_range block_set_iter_next_range(struct transaction *tr,
+                                             struct block_set_iter *iter,
+                                             data_block_t min_block)
+{
+    struct block_set *set = iter->set;
+    struct block_tree_path *path = &iter->path;
+    struct block_range range;
+
+    assert(min_block >= iter->min_block);
+    iter->min_block = min_block;
+
+    if (!block_range_empty(set->initial_range) ||
+        path->tree != &set->block_tree ||
+        path->tree_update_count != set->block_tree.update_count) {
+        stats_counter_inc(STATS_SET_ITER_WALK);
+        block_tree_walk(tr, &set->block_tree, min_block, true, path);
+    } else {
+        stats_counter_inc(STATS_SET_ITER_REUSE);
+    }
+    block_range_init_from_path(&range, path);
+    while (!block_range_empty(range) && range.end <= min_block) {
+        block_tree_path_next(path);
+        block_range_init_from_path(&range, path);
+    }
+    if (tr->failed) {
+        block_range_clear(&range);
+        path->tree = NULL;
+        return range;
+    }
+    if (block_range_empty(range)) {
+        /* Let block_set_find_next_range handle @set->initial_range */
+        return block_set_find_next_range(tr, set, min_block);
+    }
+    if (range.start < min_block) {
+        range.start = min_block;
+    }
+    return range;
+}
+
 /**
  * block_set_block_in_set - Check if block is in set
  * @tr:         Transaction object.
@@ -425,6 +491,7 @@ void block_set_add_range(struct transaction *tr,
     struct block_range new_tree_range;
     bool extended;
     struct block_tree_path path;
+    struct block_tree_path prev_path;
     bool extend_left = false;
     bool merge;
 
@@ -450,13 +517,14 @@ void block_set_add_range(struct transaction *tr,
     block_range_init_from_path(&tree_range, &path);
 
     if (!block_range_empty(tree_range) && tree_range.end < range.start) {
+        prev_path = path;
         block_tree_path_next(&path);
         block_range_init_from_path(&tree_range, &path);
         if (tree_range.start == range.end) {
             extend_left = true;
         } else {
-            /* rewind */
-            block_tree_walk(tr, &set->block_tree, range.start - 1, true, &path);
+            /* rewind, tree has not been modified since prev_path was found */
+            path = prev_path;
             block_range_init_from_path(&tree_range, &path);
         }
     }
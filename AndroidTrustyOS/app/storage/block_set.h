@@ -63,6 +63,23 @@ struct block_set {
     .updating = 0, \
 }
 
+/**
+ * struct block_set_iter - Ordered range iterator for a block set
+ * @set:        Block-set object.
+ * @path:       Tree path of last range returned. Only reused if the tree
+ *              has not been modified since @path was created.
+ * @min_block:  Last min_block value passed to block_set_iter_next_range.
+ *
+ * Allows walking a block set in block order with one tree descent instead of
+ * one per range, as long as the set is not modified during the walk. If the
+ * set is modified, the next call walks the tree again.
+ */
+struct block_set_iter {
+    struct block_set *set;
+    struct block_tree_path path;
+    data_block_t min_block;
+};
+
 struct transaction;
 struct fs;
 
@@ -88,6 +105,12 @@ struct block_range block_set_find_next_range(struct transaction *tr,
                                              struct block_set *set,
                                              data_block_t min_block);
 
+void block_set_iter_init(struct block_set_iter *iter, struct block_set *set);
+
+struct block_range block_set_iter_next_range(struct transaction *tr,
+                                             struct block_set_iter *iter,
+                                             data_block_t min_block);
+
 bool block_set_overlap(struct transaction *tr,
                        struct block_set *set_a,
                        struct block_set *set_b);
@@ -28,6 +28,7 @@
 #include "block_tree.h"
 #include "crypt.h"
 #include "debug.h"
+#include "debug_stats.h"
 #include "transaction.h"
 
 #if BUILD_STORAGE_TEST
@@ -1279,6 +1280,8 @@ void block_tree_walk(struct transaction *tr,
     assert(tree);
     assert(tree->block_size <= tr->fs->dev->block_size);
 
+    stats_counter_inc(STATS_TREE_WALK);
+
     path->count = 0;
     memset(&path->data, 0, sizeof(path->data));
     path->tr = tr;
@@ -2763,10 +2766,14 @@ void block_tree_update_block_mac(struct transaction *tr, struct block_tree *tree
 
     tree->updating = true;
 
-    block_tree_walk(tr, tree, old_key - 1, true, &path);
-    prev_key = block_tree_path_get_key(&path);
-    if (prev_key == old_key && block_mac_same_block(tr, &path.data, &old_data)) { /* modify leftmost entry in tree */
-        prev_key = 0;
+    prev_key = 0;
+    if (old_key != new_key) {
+        /* prev_key is only needed to check that a new key does not move the entry */
+        block_tree_walk(tr, tree, old_key - 1, true, &path);
+        prev_key = block_tree_path_get_key(&path);
+        if (prev_key == old_key && block_mac_same_block(tr, &path.data, &old_data)) { /* modify leftmost entry in tree */
+            prev_key = 0;
+        }
     }
 
     block_tree_walk(tr, tree, old_key, false, &path); /* TODO: make writeable */
@@ -16,14 +16,35 @@
 
 #pragma once
 
+#include <list.h>
+#include <stdbool.h>
 #include <stdint.h>
 
+#include <interface/storage/storage.h>
+
+#include "file.h"
 #include "ipc.h"
 #include "transaction.h"
 
 #define STORAGE_CLIENT_SESSION_MAGIC 0x53435343 // SCSC (Storage Client Session Context)
 
-struct file_handle;
+/**
+ * struct storage_read_stream - STORAGE_FILE_READ request sent in parts
+ * @active:     %true while there are responses left to send.
+ * @msg:        Header of the request, used for all responses.
+ * @handle:     File handle of the request.
+ * @offset:     File offset of the data for the next response.
+ * @bytes_left: Number of bytes left to send.
+ * @snapshot:   %true if the data is read from the session snapshot.
+ */
+struct storage_read_stream {
+	bool active;
+	struct storage_msg msg;
+	uint32_t handle;
+	uint64_t offset;
+	uint64_t bytes_left;
+	bool snapshot;
+};
 
 /*
  * Structure that tracks state associated with a session.
@@ -35,5 +56,22 @@ struct storage_client_session {
 	struct file_handle **files;
 	size_t files_count;
 
+	/* request waiting for a group commit of tr, see session_queue_commit */
+	struct list_node commit_node;
+	struct storage_msg commit_msg;
+
+	/* negotiated with STORAGE_NEGOTIATE, see storage_negotiate */
+	uint32_t max_msg_size;
+	uint32_t features;
+
+	/* first error in the current batch of STORAGE_MSG_FLAG_BATCH requests */
+	enum storage_err batch_result;
+
+	struct storage_read_stream read_stream;
+
+	/* read-only view of the last commit, see session_snapshot_open */
+	struct transaction snapshot_tr;
+	struct file_handle snapshot_file;
+
 	struct ipc_channel_context context;
 };
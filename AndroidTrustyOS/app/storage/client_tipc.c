@@ -28,8 +28,10 @@
 
 #include <interface/storage/storage.h>
 
+#include "array.h"
 #include "client_tipc.h"
 #include "client_session_tipc.h"
+#include "debug_stats.h"
 #include "file.h"
 #include "ipc.h"
 #include "session.h"
@@ -46,11 +48,45 @@
 #define SS_INFO(args...) do {} while(0)
 #endif
 
+/*
+ * STORAGE_GROUP_COMMIT_WINDOW_MS:
+ * Maximum time a commit request waits for the message queue to drain, so
+ * commits from other sessions can share its super block update.
+ */
+#ifdef APP_STORAGE_GROUP_COMMIT_WINDOW_MS
+#define STORAGE_GROUP_COMMIT_WINDOW_MS (APP_STORAGE_GROUP_COMMIT_WINDOW_MS)
+#else
+#define STORAGE_GROUP_COMMIT_WINDOW_MS (5)
+#endif
+
+/*
+ * STORAGE_GROUP_COMMIT_MAX:
+ * Maximum number of commit requests to queue before committing them.
+ */
+#ifdef APP_STORAGE_GROUP_COMMIT_MAX
+#define STORAGE_GROUP_COMMIT_MAX (APP_STORAGE_GROUP_COMMIT_MAX)
+#else
+#define STORAGE_GROUP_COMMIT_MAX (8)
+#endif
+
 static int client_handle_msg(struct ipc_channel_context *ctx, void *msg, size_t msg_size);
 static void client_disconnect(struct ipc_channel_context *context);
+static void commit_sessions_complete(struct ipc_deferred *deferred);
+
+/* sessions waiting for a group commit, in the order they were queued */
+static struct list_node commit_sessions = LIST_INITIAL_VALUE(commit_sessions);
+static struct ipc_deferred commit_deferred;
 static int send_response(struct storage_client_session *session,
                          enum storage_err result, struct storage_msg *msg,
                          void *out, size_t out_size);
+static int session_read_stream_start(struct storage_client_session *session,
+                                     struct storage_msg *msg, uint32_t handle,
+                                     uint64_t offset, uint64_t size,
+                                     bool snapshot);
+static void session_read_stream_stop(struct storage_client_session *session);
+
+/* Buffer for the responses of a streamed STORAGE_FILE_READ request */
+static uint8_t read_stream_buf[STORAGE_MAX_MSG_SIZE];
 
 /*
  * Legal secure storage directory and file names contain only
@@ -113,6 +149,21 @@ static int get_path(char *path_out, size_t path_out_size,
 	return STORAGE_NO_ERROR;
 }
 
+#if APP_STORAGE_STATS
+/**
+ * is_ns_client - Check if a client connected from the non-secure side
+ * @uuid:   Peer uuid of the client.
+ *
+ * Return: %true if @uuid is the all zero uuid used for non-secure clients.
+ */
+static bool is_ns_client(const uuid_t *uuid)
+{
+	static const uuid_t zero_uuid;
+
+	return !memcmp(uuid, &zero_uuid, sizeof(zero_uuid));
+}
+#endif
+
 static enum storage_err session_set_files_count(struct storage_client_session *session,
                                                 size_t files_count)
 {
@@ -123,6 +174,14 @@ static enum storage_err session_set_files_count(struct storage_client_session *s
 		return STORAGE_ERR_NOT_VALID;
 	}
 
+	if (!files_count) {
+		/* realloc may free the table and return NULL for size 0 */
+		free(session->files);
+		session->files = NULL;
+		session->files_count = 0;
+		return STORAGE_NO_ERROR;
+	}
+
 	files = realloc(session->files, sizeof(files[0]) * files_count);
 	if (!files) {
 		SS_ERR("%s: out of memory\n", __func__);
@@ -282,15 +341,6 @@ static enum storage_err storage_file_delete(struct storage_msg *msg,
 		return STORAGE_ERR_NOT_FOUND;
 	}
 
-	if (msg->flags & STORAGE_MSG_FLAG_TRANSACT_COMPLETE) {
-		transaction_complete(&session->tr);
-		if (session->tr.failed) {
-			SS_ERR("%s: transaction commit failed\n", __func__);
-			return STORAGE_ERR_GENERIC;
-		}
-		return STORAGE_NO_ERROR;
-	}
-
 	return STORAGE_NO_ERROR;
 }
 
@@ -427,13 +477,102 @@ static enum storage_err storage_file_close(struct storage_msg *msg,
 
 	free_file_handle(session, req->handle);
 
-	if (msg->flags & STORAGE_MSG_FLAG_TRANSACT_COMPLETE) {
-		transaction_complete(&session->tr);
-		if (session->tr.failed) {
-			SS_ERR("%s: transaction commit failed\n", __func__);
+	return STORAGE_NO_ERROR;
+}
+
+/**
+ * session_snapshot_open - Open a file in the session snapshot
+ * @session:    Client session.
+ * @file:       File handle opened in @session->tr.
+ *
+ * Pin the last committed file system state in @session->snapshot_tr and open
+ * the committed version of @file in it as @session->snapshot_file. Reads from
+ * there never fail @session->tr when other sessions commit changes to the
+ * file, and the blocks they read are not reused until the snapshot is closed.
+ * Not possible if @session->tr has modified @file.
+ *
+ * Return: Snapshot file handle, or %NULL if @file should be read from
+ * @session->tr instead.
+ */
+static struct file_handle *session_snapshot_open(
+        struct storage_client_session *session, struct file_handle *file)
+{
+	if (session->tr.fs->committed_free) {
+		/* a group commit is updating the super block */
+		return NULL;
+	}
+
+	transaction_init_snapshot(&session->snapshot_tr, session->tr.fs);
+	if (!file_open_snapshot(&session->snapshot_tr, &session->snapshot_file,
+	                        &session->tr, file)) {
+		transaction_free(&session->snapshot_tr);
+		return NULL;
+	}
+	return &session->snapshot_file;
+}
+
+/**
+ * session_snapshot_close - Close file opened by session_snapshot_open
+ * @session:    Client session.
+ * @file:       File handle passed to session_snapshot_open.
+ *
+ * Release the blocks pinned by @session->snapshot_tr.
+ */
+static void session_snapshot_close(struct storage_client_session *session,
+                                   struct file_handle *file)
+{
+	file_close_snapshot(&session->snapshot_file, file);
+	transaction_free(&session->snapshot_tr);
+}
+
+/**
+ * session_read_file - Copy file data to a buffer
+ * @tr:         Transaction @file was opened in.
+ * @file:       File handle.
+ * @offset:     File offset to read from.
+ * @bufp:       Buffer to copy data to.
+ * @bytes_left: Number of bytes to read. Must not read past the end of @file.
+ *
+ * Return: STORAGE_NO_ERROR on success, error code otherwise.
+ */
+static enum storage_err session_read_file(struct transaction *tr,
+                                          struct file_handle *file,
+                                          uint64_t offset, uint8_t *bufp,
+                                          size_t bytes_left)
+{
+	size_t len;
+	size_t block_size = get_file_block_size(tr->fs);
+	data_block_t block_num;
+	const uint8_t *block_data;
+	obj_ref_t block_data_ref = OBJ_REF_INITIAL_VALUE(block_data_ref);
+	size_t block_offset;
+
+	SS_INFO("%s: start 0x%x cnt %d\n", __func__, offset, bytes_left);
+
+	if (bytes_left) {
+		block_num = offset / block_size;
+		file_read_ahead(tr, file, block_num,
+		                (offset + bytes_left - 1) / block_size - block_num + 1);
+	}
+
+	while (bytes_left) {
+		block_num = offset / block_size;
+		block_data = file_get_block(tr, file, block_num, &block_data_ref);
+		if (!block_data) {
+			SS_ERR("error reading block %lld\n", block_num);
 			return STORAGE_ERR_GENERIC;
 		}
-		return STORAGE_NO_ERROR;
+
+		block_offset = offset % block_size;
+		len = (block_offset + bytes_left > block_size) ?
+		      block_size - block_offset : bytes_left;
+
+		memcpy(bufp, block_data + block_offset, len);
+		file_block_put(block_data, &block_data_ref);
+
+		bytes_left -= len;
+		offset += len;
+		bufp += len;
 	}
 
 	return STORAGE_NO_ERROR;
@@ -444,18 +583,13 @@ static int storage_file_read(struct storage_msg *msg,
                              struct storage_client_session *session)
 {
 	enum storage_err result = STORAGE_NO_ERROR;
-	void *bufp = NULL;
 	size_t buflen;
-	size_t bytes_left, len;
+	size_t max_buflen = session->max_msg_size - sizeof(*msg);
 	uint64_t offset;
 	struct file_handle *file;
+	struct file_handle *snapshot_file;
 	void *out = NULL;
 	size_t out_size = 0;
-	size_t block_size = get_file_block_size(session->tr.fs);
-	data_block_t block_num;
-	const uint8_t *block_data;
-	obj_ref_t block_data_ref = OBJ_REF_INITIAL_VALUE(block_data_ref);
-	size_t block_offset;
 
 	if (req_size < sizeof(*req)) {
 		SS_ERR("%s: invalid request size (%zd)\n", __func__, req_size);
@@ -471,9 +605,10 @@ static int storage_file_read(struct storage_msg *msg,
 	}
 
 	buflen = req->size;
-	if (buflen > STORAGE_MAX_BUFFER_SIZE - sizeof(*msg)) {
-		SS_ERR("can't read more than %d bytes, requested %zd\n",
-		       STORAGE_MAX_BUFFER_SIZE, buflen);
+	if (buflen > max_buflen &&
+	    !(session->features & STORAGE_NEGOTIATE_STREAM)) {
+		SS_ERR("can't read more than %zd bytes, requested %zd\n",
+		       max_buflen, buflen);
 		result = STORAGE_ERR_NOT_VALID;
 		goto err_invalid_input;
 	}
@@ -481,48 +616,35 @@ static int storage_file_read(struct storage_msg *msg,
 	offset = req->offset;
 	if (offset > file->size) {
 		SS_ERR("can't read past end of file (%lld > %lld)\n",
-		       offset, file->size);
+		       (long long)offset, file->size);
 		result = STORAGE_ERR_NOT_VALID;
 		goto err_invalid_input;
 	}
 
-	// reuse the input buffer
-	bufp = (uint8_t *)(msg + 1);
-
 	/* calc number of bytes to read */
 	if ((offset + buflen) > file->size) {
-		bytes_left = (size_t)(file->size - offset);
-	} else {
-		bytes_left = buflen;
+		buflen = (size_t)(file->size - offset);
 	}
-	buflen = bytes_left; /* save to return it to caller */
-
-	SS_INFO("%s: start 0x%x cnt %d\n", __func__, offset, bytes_left);
 
-	result = STORAGE_NO_ERROR;
-	while (bytes_left) {
-		block_num = offset / block_size;
-		block_data = file_get_block(&session->tr, file, block_num,
-		                            &block_data_ref);
-		if (!block_data) {
-			SS_ERR("error reading block %lld\n", block_num);
-			result = STORAGE_ERR_GENERIC;
-			goto err_get_block;
-		}
+	snapshot_file = session_snapshot_open(session, file);
 
-		block_offset = offset % block_size;
-		len = (block_offset + bytes_left > block_size) ?
-		      block_size - block_offset : bytes_left;
-
-		memcpy(bufp, block_data + block_offset, len);
-		file_block_put(block_data, &block_data_ref);
-
-		bytes_left -= len;
-		offset += len;
-		bufp += len;
+	if (buflen > max_buflen) {
+		return session_read_stream_start(session, msg, req->handle,
+		                                 offset, buflen, !!snapshot_file);
 	}
 
+	// reuse the input buffer
 	out = (uint8_t *)(msg + 1);
+	if (snapshot_file) {
+		result = session_read_file(&session->snapshot_tr, snapshot_file,
+		                           offset, out, buflen);
+		session_snapshot_close(session, file);
+	} else {
+		result = session_read_file(&session->tr, file, offset, out, buflen);
+	}
+	if (result != STORAGE_NO_ERROR) {
+		goto err_get_block;
+	}
 	out_size = buflen;
 
 err_get_block:
@@ -560,7 +682,7 @@ static enum storage_err storage_file_write(struct storage_msg *msg,
 	offset = req->offset;
 	if (offset > file->size) {
 		SS_ERR("%s: can't start writing past end of file (%lld > %lld) \n",
-		       __func__, offset, file->size);
+		       __func__, (long long)offset, file->size);
 		return STORAGE_ERR_NOT_VALID;
 	}
 
@@ -570,6 +692,10 @@ static enum storage_err storage_file_write(struct storage_msg *msg,
 	end_offset = offset + buflen - 1;
 	bytes_left = end_offset - offset + 1;
 
+	/* allocate new blocks for the whole write as one contiguous range */
+	file_reserve_blocks(&session->tr, file, offset / block_size,
+	                    end_offset / block_size - offset / block_size + 1);
+
 	/* transfer data one ss block at a time */
 	while (bytes_left) {
 		block_num = offset / block_size;
@@ -597,6 +723,8 @@ static enum storage_err storage_file_write(struct storage_msg *msg,
 		bufp += len;
 	}
 
+	file_release_blocks(&session->tr, file);
+
 	if (offset > file->size) {
 		file_set_size(&session->tr, file, offset);
 	}
@@ -606,21 +734,13 @@ static enum storage_err storage_file_write(struct storage_msg *msg,
 		return STORAGE_ERR_GENERIC;
 	}
 
-	if (msg->flags & STORAGE_MSG_FLAG_TRANSACT_COMPLETE) {
-		transaction_complete(&session->tr);
-		if (session->tr.failed) {
-			SS_ERR("%s: transaction commit failed\n", __func__);
-			return STORAGE_ERR_GENERIC;
-		}
-	}
-
 	return STORAGE_NO_ERROR;
 
 err_write:
 	if (!session->tr.failed) {
 		transaction_fail(&session->tr);
 	}
-err_transaction_complete:
+	file_release_blocks(&session->tr, file);
 	return result;
 }
 
@@ -648,12 +768,14 @@ static int storage_file_get_size(struct storage_msg *msg,
 	}
 
 	struct storage_file_get_size_resp resp;
+	data_block_t size;
 
-	valid = file_get_size(&session->tr, file, &resp.size);
+	valid = file_get_size(&session->tr, file, &size);
 	if (!valid) {
 		result = STORAGE_ERR_NOT_VALID;
 		goto err_invalid_input;
 	}
+	resp.size = size;
 
 	out = &resp;
 	out_size = sizeof(resp);
@@ -683,11 +805,12 @@ static enum storage_err storage_file_set_size(struct storage_msg *msg,
 	}
 
 	SS_INFO("%s: new size 0x%llx, old size 0x%llx\n",
-	        __func__, new_size, file->size);
+	        __func__, (unsigned long long)new_size, file->size);
 
 	/* for now we only support shrinking the file */
 	if (new_size > file->size) {
-		SS_ERR("%s: bad trunc length 0x%llx\n", __func__, new_size);
+		SS_ERR("%s: bad trunc length 0x%llx\n", __func__,
+		       (unsigned long long)new_size);
 		return STORAGE_ERR_NOT_VALID;
 	}
 
@@ -697,11 +820,6 @@ static enum storage_err storage_file_set_size(struct storage_msg *msg,
 		file_set_size(&session->tr, file, new_size);
 	}
 
-	/* try to commit */
-	if (msg->flags & STORAGE_MSG_FLAG_TRANSACT_COMPLETE) {
-		transaction_complete(&session->tr);
-	}
-
 	if (session->tr.failed) {
 		SS_ERR("%s: transaction failed\n", __func__);
 		return STORAGE_ERR_GENERIC;
@@ -727,10 +845,13 @@ static struct client_port_context *port_context_to_client_port_context(struct ip
 	return containerof(context, struct client_port_context, client_ctx);
 }
 
+static int client_send_unblocked(struct ipc_channel_context *context);
+
 static void client_channel_ops_init(struct ipc_channel_ops *ops)
 {
 	ops->on_handle_msg = client_handle_msg;
 	ops->on_disconnect = client_disconnect;
+	ops->on_send_unblocked = client_send_unblocked;
 }
 
 static struct ipc_channel_context *client_connect(struct ipc_port_context *parent_ctx,
@@ -752,6 +873,11 @@ static struct ipc_channel_context *client_connect(struct ipc_port_context *paren
 
 	client_session->files = NULL;
 	client_session->files_count = 0;
+	list_clear_node(&client_session->commit_node);
+	client_session->max_msg_size = STORAGE_MAX_BUFFER_SIZE;
+	client_session->features = 0;
+	client_session->batch_result = STORAGE_NO_ERROR;
+	client_session->read_stream.active = false;
 
 	transaction_init(&client_session->tr, client_port_context->tr_state,
 	                 false);
@@ -761,11 +887,6 @@ static struct ipc_channel_context *client_connect(struct ipc_port_context *paren
 
 	client_channel_ops_init(&client_session->context.ops);
 	return &client_session->context;
-
-err_derive_master_key:
-err_init_metadata:
-	free(client_session);
-	return NULL;
 }
 
 static void client_disconnect(struct ipc_channel_context *context)
@@ -774,6 +895,16 @@ static void client_disconnect(struct ipc_channel_context *context)
 
 	session = chan_context_to_client_session(context);
 
+	if (list_in_list(&session->commit_node)) {
+		/* nobody is waiting for the result anymore */
+		list_delete(&session->commit_node);
+		if (list_is_empty(&commit_sessions)) {
+			ipc_defer_cancel(&commit_deferred);
+		}
+	}
+	if (session->read_stream.active) {
+		session_read_stream_stop(session);
+	}
 	if (list_in_list(&session->tr.allocated.node) && !session->tr.failed) {
 		transaction_fail(&session->tr); /* discard partial transaction */
 	}
@@ -784,9 +915,20 @@ static void client_disconnect(struct ipc_channel_context *context)
 	free(session);
 }
 
-static int send_response(struct storage_client_session *session,
-                         enum storage_err result, struct storage_msg *msg,
-                         void *out, size_t out_size)
+/**
+ * send_response_etc - Send response message
+ * @session:    Client session.
+ * @result:     Result of request.
+ * @msg:        Request message header. Updated and sent as response header.
+ * @out:        Response payload, only sent if @result is STORAGE_NO_ERROR.
+ * @out_size:   Size of @out.
+ * @flags:      Flags for response header.
+ *
+ * Return: Result of send_msg.
+ */
+static int send_response_etc(struct storage_client_session *session,
+                             enum storage_err result, struct storage_msg *msg,
+                             void *out, size_t out_size, uint32_t flags)
 {
 	size_t resp_buf_count = 1;
 	if (result == STORAGE_NO_ERROR && out != NULL && out_size != 0) {
@@ -796,7 +938,7 @@ static int send_response(struct storage_client_session *session,
 	iovec_t resp_bufs[resp_buf_count];
 
 	msg->cmd |= STORAGE_RESP_BIT;
-	msg->flags = 0;
+	msg->flags = flags;
 	msg->size = sizeof(struct storage_msg) + out_size;
 	msg->result = result;
 
@@ -816,12 +958,448 @@ static int send_response(struct storage_client_session *session,
 	return send_msg(session->context.common.handle, &resp_ipc_msg);
 }
 
+static int send_response(struct storage_client_session *session,
+                         enum storage_err result, struct storage_msg *msg,
+                         void *out, size_t out_size)
+{
+	return send_response_etc(session, result, msg, out, out_size, 0);
+}
+
 static int send_result(struct storage_client_session *session,
                        struct storage_msg *msg, enum storage_err result)
 {
 	return send_response(session, result, msg, NULL, 0);
 }
 
+/**
+ * send_commit_result - Send response to request that completed a transaction
+ * @session:    Client session.
+ * @msg:        Request message that completed @session->tr.
+ *
+ * Return: Result of sending response.
+ */
+static int send_commit_result(struct storage_client_session *session,
+                              struct storage_msg *msg)
+{
+	if (!session->tr.failed) {
+		return send_result(session, msg, STORAGE_NO_ERROR);
+	}
+	if (msg->cmd == STORAGE_END_TRANSACTION) {
+		SS_ERR("%s: failed to complete transaction\n", __func__);
+		/* clear transaction failed state */
+		session->tr.failed = false;
+		return send_result(session, msg, STORAGE_ERR_TRANSACT);
+	}
+	SS_ERR("%s: transaction commit failed\n", __func__);
+	return send_result(session, msg, STORAGE_ERR_GENERIC);
+}
+
+/**
+ * commit_sessions_complete - Commit all queued transactions
+ * @deferred:   Deferred work object, unused.
+ *
+ * Complete the transactions of all sessions in commit_sessions, one group per
+ * file system, and send the responses.
+ */
+static void commit_sessions_complete(struct ipc_deferred *deferred)
+{
+	int rc;
+	size_t count;
+	struct fs *fs;
+	struct storage_client_session *session;
+	struct storage_client_session *tmp;
+	struct transaction *trs[STORAGE_GROUP_COMMIT_MAX];
+	struct list_node group = LIST_INITIAL_VALUE(group);
+
+	ipc_defer_cancel(&commit_deferred);
+
+	while (!list_is_empty(&commit_sessions)) {
+		session = list_peek_head_type(&commit_sessions,
+		                              struct storage_client_session,
+		                              commit_node);
+		fs = session->tr.fs;
+		count = 0;
+		list_for_every_entry_safe(&commit_sessions, session, tmp,
+		                          struct storage_client_session,
+		                          commit_node) {
+			if (session->tr.fs != fs) {
+				continue;
+			}
+			assert(count < countof(trs));
+			trs[count++] = &session->tr;
+			list_delete(&session->commit_node);
+			list_add_tail(&group, &session->commit_node);
+		}
+
+		SS_INFO("%s: commit %zd transactions\n", __func__, count);
+		transaction_complete_group(trs, count);
+
+		while ((session = list_remove_head_type(&group,
+		                                        struct storage_client_session,
+		                                        commit_node))) {
+			rc = send_commit_result(session, &session->commit_msg);
+			if (rc < 0) {
+				SS_ERR("%s: failed to send response (%d)\n",
+				       __func__, rc);
+			}
+		}
+	}
+}
+
+/**
+ * session_queue_commit - Complete transaction of session as part of a group
+ * @session:    Client session.
+ * @msg:        Request message that completes @session->tr.
+ *
+ * Queue @session->tr for a group commit. The response to @msg is sent once
+ * the group is committed, which happens when there are no more pending
+ * messages, after STORAGE_GROUP_COMMIT_WINDOW_MS or when
+ * STORAGE_GROUP_COMMIT_MAX requests are queued, whichever comes first.
+ *
+ * Return: NO_ERROR if the response was deferred, otherwise the result of
+ * sending the response.
+ */
+static int session_queue_commit(struct storage_client_session *session,
+                                struct storage_msg *msg)
+{
+	if (!transaction_is_active(&session->tr)) {
+		return send_commit_result(session, msg);
+	}
+
+	assert(!list_in_list(&session->commit_node));
+	session->commit_msg = *msg;
+	list_add_tail(&commit_sessions, &session->commit_node);
+
+	if (list_length(&commit_sessions) >= STORAGE_GROUP_COMMIT_MAX) {
+		commit_sessions_complete(&commit_deferred);
+	} else {
+		ipc_defer(&commit_deferred, commit_sessions_complete,
+		          STORAGE_GROUP_COMMIT_WINDOW_MS);
+	}
+	return NO_ERROR;
+}
+
+/**
+ * session_read_stream_stop - Stop sending responses for a streamed read
+ * @session:    Client session.
+ */
+static void session_read_stream_stop(struct storage_client_session *session)
+{
+	struct storage_read_stream *stream = &session->read_stream;
+
+	assert(stream->active);
+
+	stream->active = false;
+	if (stream->snapshot) {
+		session_snapshot_close(session,
+		                       get_file_handle(session, stream->handle));
+	}
+}
+
+/**
+ * session_read_stream_continue - Send remaining responses of a streamed read
+ * @session:    Client session.
+ *
+ * Send responses for @session->read_stream until all data has been sent, an
+ * error has been sent, or the channel is full. In the last case sending
+ * resumes from client_send_unblocked once the client has read a response.
+ *
+ * Return: NO_ERROR on success, error code < 0 if a response could not be sent.
+ */
+static int session_read_stream_continue(struct storage_client_session *session)
+{
+	int rc;
+	size_t len;
+	uint32_t flags;
+	enum storage_err result;
+	struct transaction *tr;
+	struct file_handle *file;
+	struct storage_read_stream *stream = &session->read_stream;
+	struct storage_msg *msg = (struct storage_msg *)read_stream_buf;
+	size_t max_len = session->max_msg_size - sizeof(*msg);
+
+	assert(session->max_msg_size <= sizeof(read_stream_buf));
+
+	while (stream->active) {
+		len = stream->bytes_left > max_len ? max_len : stream->bytes_left;
+		if (stream->snapshot) {
+			tr = &session->snapshot_tr;
+			file = &session->snapshot_file;
+		} else {
+			tr = &session->tr;
+			file = get_file_handle(session, stream->handle);
+		}
+		if (tr->failed) {
+			result = STORAGE_ERR_TRANSACT;
+		} else if (!file || stream->offset + len > file->size) {
+			result = STORAGE_ERR_NOT_VALID;
+		} else {
+			result = session_read_file(tr, file, stream->offset,
+			                           msg->payload, len);
+		}
+		flags = 0;
+		if (result == STORAGE_NO_ERROR && len < stream->bytes_left) {
+			flags = STORAGE_MSG_FLAG_BATCH;
+		}
+
+		*msg = stream->msg;
+		rc = send_response_etc(session, result, msg, msg->payload, len,
+		                       flags);
+		if (rc == ERR_NOT_ENOUGH_BUFFER) {
+			/* client has not read the previous response yet */
+			return NO_ERROR;
+		}
+		if (rc < 0 || !flags) {
+			session_read_stream_stop(session);
+			return rc < 0 ? rc : NO_ERROR;
+		}
+		stream->offset += len;
+		stream->bytes_left -= len;
+	}
+	return NO_ERROR;
+}
+
+/**
+ * session_read_stream_start - Start a streamed read
+ * @session:    Client session.
+ * @msg:        Request message.
+ * @handle:     File handle.
+ * @offset:     File offset to read from.
+ * @size:       Number of bytes to read, more than fits in one response.
+ * @snapshot:   %true if @handle was opened in the session snapshot with
+ *              session_snapshot_open. The snapshot stays pinned until the
+ *              last response has been sent.
+ *
+ * Return: NO_ERROR on success, error code < 0 if a response could not be sent.
+ */
+static int session_read_stream_start(struct storage_client_session *session,
+                                     struct storage_msg *msg, uint32_t handle,
+                                     uint64_t offset, uint64_t size,
+                                     bool snapshot)
+{
+	struct storage_read_stream *stream = &session->read_stream;
+
+	assert(!stream->active);
+
+	stream->active = true;
+	stream->msg = *msg;
+	stream->handle = handle;
+	stream->offset = offset;
+	stream->bytes_left = size;
+	stream->snapshot = snapshot;
+
+	return session_read_stream_continue(session);
+}
+
+static int client_send_unblocked(struct ipc_channel_context *context)
+{
+	struct storage_client_session *session;
+
+	session = chan_context_to_client_session(context);
+
+	return session_read_stream_continue(session);
+}
+
+/**
+ * storage_negotiate - Handle STORAGE_NEGOTIATE
+ * @msg:        Request message. Reused as response buffer.
+ * @req:        Request payload.
+ * @req_size:   Size of @req.
+ * @session:    Client session.
+ *
+ * Return: Result of sending response.
+ */
+static int storage_negotiate(struct storage_msg *msg,
+                             struct storage_negotiate_req *req, size_t req_size,
+                             struct storage_client_session *session)
+{
+	struct storage_negotiate_resp resp;
+
+	if (req_size != sizeof(*req)) {
+		SS_ERR("%s: invalid request size (%zd)\n", __func__, req_size);
+		return send_result(session, msg, STORAGE_ERR_NOT_VALID);
+	}
+
+	if (req->max_msg_size < STORAGE_MAX_BUFFER_SIZE) {
+		SS_ERR("%s: invalid message size (%d)\n", __func__,
+		       req->max_msg_size);
+		return send_result(session, msg, STORAGE_ERR_NOT_VALID);
+	}
+
+	session->max_msg_size = req->max_msg_size < STORAGE_MAX_MSG_SIZE ?
+	                        req->max_msg_size : STORAGE_MAX_MSG_SIZE;
+	session->features = req->flags & STORAGE_NEGOTIATE_STREAM;
+
+	resp.max_msg_size = session->max_msg_size;
+	resp.flags = session->features;
+
+	return send_response(session, STORAGE_NO_ERROR, msg, &resp, sizeof(resp));
+}
+
+/**
+ * session_handle_batch_msg - Handle request with STORAGE_MSG_FLAG_BATCH set
+ * @session:        Client session.
+ * @msg:            Request message.
+ * @payload:        Request payload.
+ * @payload_len:    Size of @payload.
+ *
+ * No response is sent. The first error is saved in @session->batch_result
+ * and returned for the next request without STORAGE_MSG_FLAG_BATCH. Requests
+ * after a failed request in the same batch are ignored.
+ *
+ * Return: NO_ERROR.
+ */
+static int session_handle_batch_msg(struct storage_client_session *session,
+                                    struct storage_msg *msg,
+                                    void *payload, size_t payload_len)
+{
+	enum storage_err result;
+
+	if (session->batch_result != STORAGE_NO_ERROR) {
+		return NO_ERROR;
+	}
+
+	if (msg->cmd != STORAGE_FILE_WRITE ||
+	    (msg->flags & STORAGE_MSG_FLAG_TRANSACT_COMPLETE) ||
+	    !(session->features & STORAGE_NEGOTIATE_STREAM)) {
+		SS_ERR("%s: unsupported batch command 0x%x, flags 0x%x\n",
+		       __func__, msg->cmd, msg->flags);
+		result = STORAGE_ERR_NOT_VALID;
+	} else if (session->tr.failed) {
+		result = STORAGE_ERR_TRANSACT;
+	} else {
+		if (!transaction_is_active(&session->tr)) {
+			transaction_activate(&session->tr);
+		}
+		result = storage_file_write(msg, payload, payload_len, session);
+	}
+
+	session->batch_result = result;
+	return NO_ERROR;
+}
+
+/**
+ * storage_debug_get_stats - Handle STORAGE_DEBUG_GET_STATS
+ * @msg:        Request message. Reused as response buffer.
+ * @req:        Request payload.
+ * @req_size:   Size of @req.
+ * @session:    Client session.
+ *
+ * Only available in builds with APP_STORAGE_STATS enabled, and only to
+ * secure side clients. Non-secure clients can neither read nor reset the
+ * counters.
+ *
+ * Return: Result of sending response.
+ */
+static int storage_debug_get_stats(struct storage_msg *msg,
+                                   struct storage_debug_get_stats_req *req,
+                                   size_t req_size,
+                                   struct storage_client_session *session)
+{
+#if APP_STORAGE_STATS
+	uint32_t i;
+	uint32_t first;
+	uint32_t flags;
+	size_t max_count;
+	size_t count;
+	struct stats_timer timer;
+	struct storage_stats_counter *counter;
+	struct storage_debug_get_stats_resp *resp;
+
+	STATIC_ASSERT(STATS_HIST_SIZE == STORAGE_STATS_HIST_SIZE);
+
+	if (is_ns_client(&session->uuid)) {
+		SS_ERR("%s: not allowed for non-secure clients\n", __func__);
+		return send_result(session, msg, STORAGE_ERR_ACCESS);
+	}
+
+	if (req_size != sizeof(*req)) {
+		SS_ERR("%s: invalid request size (%zd)\n", __func__, req_size);
+		return send_result(session, msg, STORAGE_ERR_NOT_VALID);
+	}
+
+	first = req->first;
+	count = req->count;
+	flags = req->flags;
+	if (first > STATS_COUNTER_COUNT) {
+		SS_ERR("%s: invalid counter index (%d)\n", __func__, first);
+		return send_result(session, msg, STORAGE_ERR_NOT_VALID);
+	}
+
+	// reuse the input buffer
+	resp = (void *)(msg + 1);
+	resp->total_count = STATS_COUNTER_COUNT;
+	max_count = (STORAGE_MAX_BUFFER_SIZE - sizeof(*msg) - sizeof(*resp)) /
+	            sizeof(resp->counters[0]);
+	if (count > max_count) {
+		count = max_count;
+	}
+	if (count > STATS_COUNTER_COUNT - first) {
+		count = STATS_COUNTER_COUNT - first;
+	}
+	resp->count = count;
+
+	for (i = 0; i < resp->count; i++) {
+		counter = &resp->counters[i];
+		stats_timer_get(first + i, &timer);
+		memset(counter->name, 0, sizeof(counter->name));
+		strncpy(counter->name, stats_timer_name(first + i),
+		        sizeof(counter->name) - 1);
+		counter->count = timer.count;
+		counter->total_ns = timer.total;
+		counter->min_ns = timer.min;
+		counter->max_ns = timer.max;
+		memcpy(counter->hist, timer.hist, sizeof(counter->hist));
+	}
+
+	if (flags & STORAGE_DEBUG_GET_STATS_RESET) {
+		stats_timer_reset();
+	}
+
+	return send_response(session, STORAGE_NO_ERROR, msg, resp,
+	                     sizeof(*resp) + resp->count * sizeof(resp->counters[0]));
+#else
+	return send_result(session, msg, STORAGE_ERR_UNIMPLEMENTED);
+#endif
+}
+
+/**
+ * storage_debug_set_read_ahead - Handle STORAGE_DEBUG_SET_READ_AHEAD
+ * @msg:        Request message.
+ * @req:        Request payload.
+ * @req_size:   Size of @req.
+ * @session:    Client session.
+ *
+ * Only available to secure side clients, as the window applies to every
+ * client of the server.
+ *
+ * Return: Result of request.
+ */
+static enum storage_err storage_debug_set_read_ahead(
+        struct storage_msg *msg,
+        struct storage_debug_set_read_ahead_req *req,
+        size_t req_size,
+        struct storage_client_session *session)
+{
+	if (is_ns_client(&session->uuid)) {
+		SS_ERR("%s: not allowed for non-secure clients\n", __func__);
+		return STORAGE_ERR_ACCESS;
+	}
+
+	if (req_size != sizeof(*req)) {
+		SS_ERR("%s: invalid request size (%zd)\n", __func__, req_size);
+		return STORAGE_ERR_NOT_VALID;
+	}
+
+	if (!file_set_read_ahead_blocks(req->blocks)) {
+		SS_ERR("%s: invalid read-ahead window (%d)\n", __func__,
+		       req->blocks);
+		return STORAGE_ERR_NOT_VALID;
+	}
+
+	return STORAGE_NO_ERROR;
+}
+
 static int client_handle_msg(struct ipc_channel_context *ctx, void *msg_buf, size_t msg_size)
 {
 	struct storage_client_session *session;
@@ -842,20 +1420,41 @@ static int client_handle_msg(struct ipc_channel_context *ctx, void *msg_buf, siz
 	payload_len = msg_size - sizeof(struct storage_msg);
 	payload = msg->payload;
 
+	if (list_in_list(&session->commit_node)) {
+		/* client did not wait for the commit result */
+		commit_sessions_complete(&commit_deferred);
+	}
+
+	if (session->read_stream.active) {
+		/* client did not wait for the rest of the read */
+		SS_ERR("%s: abort streamed read\n", __func__);
+		session_read_stream_stop(session);
+	}
+
+	if (msg->flags & STORAGE_MSG_FLAG_BATCH) {
+		return session_handle_batch_msg(session, msg, payload, payload_len);
+	}
+
+	if (session->batch_result != STORAGE_NO_ERROR) {
+		/* a request in this batch failed, fail the rest of the batch */
+		result = session->batch_result;
+		session->batch_result = STORAGE_NO_ERROR;
+		if (transaction_is_active(&session->tr) && !session->tr.failed) {
+			transaction_fail(&session->tr);
+		}
+		if (msg->cmd == STORAGE_END_TRANSACTION ||
+		    (msg->flags & STORAGE_MSG_FLAG_TRANSACT_COMPLETE)) {
+			/* clear transaction failed state */
+			session->tr.failed = false;
+		}
+		return send_result(session, msg, result);
+	}
+
 	/* abort transaction and clear sticky transaction error */
 	if (msg->cmd == STORAGE_END_TRANSACTION) {
 		if (msg->flags & STORAGE_MSG_FLAG_TRANSACT_COMPLETE) {
 			/* try to complete current transaction */
-			if (transaction_is_active(&session->tr)) {
-				transaction_complete(&session->tr);
-			}
-			if (session->tr.failed) {
-				SS_ERR("%s: failed to complete transaction\n", __func__);
-				/* clear transaction failed state */
-				session->tr.failed = false;
-				return send_result(session, msg, STORAGE_ERR_TRANSACT);
-			}
-			return send_result(session, msg, STORAGE_NO_ERROR);
+			return session_queue_commit(session, msg);
 		} else {
 			/* discard current transaction */
 			if (transaction_is_active(&session->tr)) {
@@ -867,6 +1466,10 @@ static int client_handle_msg(struct ipc_channel_context *ctx, void *msg_buf, siz
 		}
 	}
 
+	if (msg->cmd == STORAGE_NEGOTIATE) {
+		return storage_negotiate(msg, payload, payload_len, session);
+	}
+
 	if (session->tr.failed) {
 		if (msg->flags & STORAGE_MSG_FLAG_TRANSACT_COMPLETE) {
 			/* last command in current trunsaction: reset failed state and return error */
@@ -875,6 +1478,16 @@ static int client_handle_msg(struct ipc_channel_context *ctx, void *msg_buf, siz
 		return send_result(session, msg, STORAGE_ERR_TRANSACT);
 	}
 
+	/* debug commands are not part of any transaction */
+	if (msg->cmd == STORAGE_DEBUG_GET_STATS) {
+		return storage_debug_get_stats(msg, payload, payload_len, session);
+	}
+	if (msg->cmd == STORAGE_DEBUG_SET_READ_AHEAD) {
+		result = storage_debug_set_read_ahead(msg, payload, payload_len,
+		                                      session);
+		return send_result(session, msg, result);
+	}
+
 	if (!transaction_is_active(&session->tr)) {
 		/* previous transaction complete */
 		transaction_activate(&session->tr);
@@ -905,6 +1518,12 @@ static int client_handle_msg(struct ipc_channel_context *ctx, void *msg_buf, siz
 		break;
 	}
 
+	if (result == STORAGE_NO_ERROR &&
+	    (msg->flags & STORAGE_MSG_FLAG_TRANSACT_COMPLETE)) {
+		/* try to commit */
+		return session_queue_commit(session, msg);
+	}
+
 	return send_result(session, msg, result);
 }
 
@@ -916,7 +1535,7 @@ int client_create_port(struct ipc_port_context *client_ctx,
 	/* start accepting client connections */
 	client_ctx->ops.on_connect = client_connect;
 	ret = ipc_port_create(client_ctx, port_name,
-	                      1, STORAGE_MAX_BUFFER_SIZE,
+	                      STORAGE_CLIENT_RECV_BUFS, STORAGE_MAX_MSG_SIZE,
 	                      IPC_PORT_ALLOW_NS_CONNECT | IPC_PORT_ALLOW_TA_CONNECT);
 	if (ret < 0) {
 		SS_ERR("%s: failure initializing client port (%d)\n", __func__,
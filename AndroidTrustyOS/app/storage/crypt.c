@@ -26,22 +26,23 @@
 #include "crypt.h"
 
 /**
- * crypt - Helper function for encrypt and decrypt.
+ * crypt_init - Helper function to set up a cipher context.
+ * @ctx:            Cipher context. Must be cleaned up by caller, even on error.
  * @key:            Key object.
- * @data_in_out:    Data to encrypt or decrypt.
- * @data_size:      Number of bytes in @data_in_out.
- * @iv:             Initialization vector to use for Cipher Block Chaining.
+ * @iv:             Initialization vector, or %NULL to set it later with
+ *                  crypt_update.
  * @encrypt:        %true to select encrypt, %false to select decrypt.
  *
- * Return: 0 on success, -1 if an error was detected.
+ * Expands the key schedule for @key once, so @ctx can be used for multiple
+ * blocks.
+ *
+ * Return: 1 on success, 0 if an error was detected.
  */
-static int crypt(const struct key *key, void *data_in_out, size_t data_size,
-                 const struct iv *iv, bool encrypt)
+static int crypt_init(EVP_CIPHER_CTX *ctx, const struct key *key,
+                      const struct iv *iv, bool encrypt)
 {
     int evp_ret;
     const EVP_CIPHER *cipher;
-    EVP_CIPHER_CTX ctx;
-    int out_data_size;
     size_t key_len;
 
     /*
@@ -52,51 +53,100 @@ static int crypt(const struct key *key, void *data_in_out, size_t data_size,
      */
     STATIC_ASSERT(sizeof(*iv) >= EVP_MAX_IV_LENGTH);
 
+    EVP_CIPHER_CTX_init(ctx);
+
     cipher = EVP_aes_128_ctr();
     key_len = EVP_CIPHER_key_length(cipher);
     if (key_len > sizeof(*key)) {
         fprintf(stderr, "key too small for selected cipher, %zd < %zd\n",
                 sizeof(*key), key_len);
-        evp_ret = 0;
-        goto err_bad_key_len;
+        return 0;
     }
 
-    EVP_CIPHER_CTX_init(&ctx);
-    evp_ret = EVP_CipherInit_ex(&ctx, cipher, NULL,
-                                key->byte, iv->byte, encrypt);
+    evp_ret = EVP_CipherInit_ex(ctx, cipher, NULL,
+                                key->byte, iv ? iv->byte : NULL, encrypt);
     if (!evp_ret) {
         fprintf(stderr, "EVP_CipherInit_ex failed\n");
-        goto err;
+        return 0;
     }
 
-    evp_ret = EVP_CIPHER_CTX_set_padding(&ctx, 0);
+    evp_ret = EVP_CIPHER_CTX_set_padding(ctx, 0);
     if (!evp_ret) {
         fprintf(stderr, "EVP_CIPHER_CTX_set_padding failed\n");
-        goto err;
+        return 0;
     }
 
-    evp_ret = EVP_CipherUpdate(&ctx, data_in_out, &out_data_size,
+    return 1;
+}
+
+/**
+ * crypt_update - Helper function to encrypt or decrypt one block.
+ * @ctx:            Cipher context initialized by crypt_init.
+ * @data_in_out:    Data to encrypt or decrypt.
+ * @data_size:      Number of bytes in @data_in_out.
+ * @iv:             Initialization vector to use for this block, or %NULL to
+ *                  use the one passed to crypt_init.
+ *
+ * Return: 1 on success, 0 if an error was detected.
+ */
+static int crypt_update(EVP_CIPHER_CTX *ctx, void *data_in_out,
+                        size_t data_size, const struct iv *iv)
+{
+    int evp_ret;
+    int out_data_size;
+
+    if (iv) {
+        /* Only reset the iv, keep the expanded key */
+        evp_ret = EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv->byte, -1);
+        if (!evp_ret) {
+            fprintf(stderr, "EVP_CipherInit_ex failed\n");
+            return 0;
+        }
+    }
+
+    evp_ret = EVP_CipherUpdate(ctx, data_in_out, &out_data_size,
                                 data_in_out, data_size);
     if (!evp_ret) {
         fprintf(stderr, "EVP_CipherUpdate failed\n");
-        goto err;
+        return 0;
     }
     if (out_data_size != (int)data_size) {
         fprintf(stderr, "bad output data size %d != %zd\n",
                 out_data_size, data_size);
-        evp_ret = 0;
-        goto err;
+        return 0;
     }
 
-    evp_ret = EVP_CipherFinal_ex(&ctx, NULL, &out_data_size);
+    evp_ret = EVP_CipherFinal_ex(ctx, NULL, &out_data_size);
     if (!evp_ret) {
         fprintf(stderr, "EVP_CipherFinal_ex failed\n");
-        goto err;
+        return 0;
     }
 
-err:
+    return 1;
+}
+
+/**
+ * crypt - Helper function for encrypt and decrypt.
+ * @key:            Key object.
+ * @data_in_out:    Data to encrypt or decrypt.
+ * @data_size:      Number of bytes in @data_in_out.
+ * @iv:             Initialization vector to use for Cipher Block Chaining.
+ * @encrypt:        %true to select encrypt, %false to select decrypt.
+ *
+ * Return: 0 on success, -1 if an error was detected.
+ */
+static int crypt(const struct key *key, void *data_in_out, size_t data_size,
+                 const struct iv *iv, bool encrypt)
+{
+    int evp_ret;
+    EVP_CIPHER_CTX ctx;
+
+    evp_ret = crypt_init(&ctx, key, iv, encrypt);
+    if (evp_ret) {
+        evp_ret = crypt_update(&ctx, data_in_out, data_size, NULL);
+    }
     EVP_CIPHER_CTX_cleanup(&ctx);
-err_bad_key_len:
+
     return evp_ret ? 0 : -1;
 }
 
@@ -124,54 +174,187 @@ uint64_t str_hash(const char *str)
     return ret;
 }
 
+#define SIPHASH_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPHASH_ROUND(v0, v1, v2, v3) do { \
+    v0 += v1; v1 = SIPHASH_ROTL(v1, 13); v1 ^= v0; v0 = SIPHASH_ROTL(v0, 32); \
+    v2 += v3; v3 = SIPHASH_ROTL(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = SIPHASH_ROTL(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = SIPHASH_ROTL(v1, 17); v1 ^= v2; v2 = SIPHASH_ROTL(v2, 32); \
+} while (0)
+
 /**
- * calculate_mac - Calulate keyed-hash message authentication code (HMAC SHA256)
+ * siphash_load - Helper function to read a little endian 64 bit value.
+ * @p:          Pointer to 8 bytes.
+ *
+ * Return: value at @p.
+ */
+static uint64_t siphash_load(const uint8_t *p)
+{
+    uint64_t ret = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--) {
+        ret = (ret << 8) | p[i];
+    }
+    return ret;
+}
+
+/**
+ * keyed_hash - Calculate a keyed 64-bit hash (SipHash-2-4).
+ * @key:        Hash key object.
+ * @data:       Data to hash.
+ * @data_size:  Number of bytes in @data.
+ *
+ * Much cheaper than str_hash for short inputs. Since the hash key is secret,
+ * hash values can not be predicted by someone that chooses @data.
+ *
+ * Return: 64-bit hash of @data.
+ */
+uint64_t keyed_hash(const struct hash_key *key, const void *data,
+                    size_t data_size)
+{
+    const uint8_t *in = data;
+    const uint8_t *end = in + data_size - data_size % 8;
+    uint64_t k0 = siphash_load(key->byte);
+    uint64_t k1 = siphash_load(key->byte + 8);
+    uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+    uint64_t m;
+    uint64_t b = (uint64_t)data_size << 56;
+    int i;
+
+    for (; in != end; in += 8) {
+        m = siphash_load(in);
+        v3 ^= m;
+        SIPHASH_ROUND(v0, v1, v2, v3);
+        SIPHASH_ROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    for (i = data_size % 8 - 1; i >= 0; i--) {
+        b |= (uint64_t)in[i] << (i * 8);
+    }
+    v3 ^= b;
+    SIPHASH_ROUND(v0, v1, v2, v3);
+    SIPHASH_ROUND(v0, v1, v2, v3);
+    v0 ^= b;
+    v2 ^= 0xff;
+    for (i = 0; i < 4; i++) {
+        SIPHASH_ROUND(v0, v1, v2, v3);
+    }
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/**
+ * mac_init - Helper function to set up a hmac context.
+ * @hmac_ctx:       Hmac context. Must be cleaned up by caller, even on error.
  * @key:            Key object.
- * @mac:            Mac object to return calulated mac in.
- * @data:           Data to calculate mac for.
- * @data_size:      Number of bytes in @data.
  *
- * Return: 0 on success, -1 if an error was detected.
+ * Return: 1 on success, 0 if an error was detected.
  */
-int calculate_mac(const struct key *key, struct mac *mac,
-                  const void *data, size_t data_size)
+static int mac_init(HMAC_CTX *hmac_ctx, const struct key *key)
 {
     int hmac_ret;
-    unsigned int md_len;
-    unsigned char mac_buf[EVP_MAX_MD_SIZE];
-    HMAC_CTX hmac_ctx;
 
-    HMAC_CTX_init(&hmac_ctx);
+    HMAC_CTX_init(hmac_ctx);
 
-    hmac_ret = HMAC_Init_ex(&hmac_ctx, key, sizeof(*key), EVP_sha256(), NULL);
+    hmac_ret = HMAC_Init_ex(hmac_ctx, key, sizeof(*key), EVP_sha256(), NULL);
     if (!hmac_ret) {
         fprintf(stderr, "HMAC_Init_ex failed\n");
-        goto err;
     }
+    return hmac_ret;
+}
 
-    hmac_ret = HMAC_Update(&hmac_ctx, data, data_size);
+/**
+ * mac_update - Helper function to calculate the mac of one block.
+ * @hmac_ctx:       Hmac context initialized by mac_init.
+ * @mac:            Mac object to return calulated mac in.
+ * @data:           Data to calculate mac for.
+ * @data_size:      Number of bytes in @data.
+ *
+ * @hmac_ctx is left ready for the next block, using the same key.
+ *
+ * Return: 1 on success, 0 if an error was detected.
+ */
+static int mac_update(HMAC_CTX *hmac_ctx, struct mac *mac,
+                      const void *data, size_t data_size)
+{
+    int hmac_ret;
+    unsigned int md_len;
+    unsigned char mac_buf[EVP_MAX_MD_SIZE];
+
+    hmac_ret = HMAC_Update(hmac_ctx, data, data_size);
     if (!hmac_ret) {
         fprintf(stderr, "HMAC_Update failed\n");
-        goto err;
+        return 0;
     }
 
-    hmac_ret = HMAC_Final(&hmac_ctx, mac_buf, &md_len);
+    hmac_ret = HMAC_Final(hmac_ctx, mac_buf, &md_len);
     if (!hmac_ret) {
         fprintf(stderr, "HMAC_Final failed\n");
-        goto err;
+        return 0;
     }
     if (md_len < sizeof(*mac)) {
         fprintf(stderr, "bad md_len %d < %zd\n", md_len, sizeof(*mac));
-        hmac_ret = 0;
-        goto err;
+        return 0;
     }
     memcpy(mac, mac_buf, sizeof(*mac));
 
-err:
+    /* Restart with the same key without recomputing the padded key state */
+    hmac_ret = HMAC_Init_ex(hmac_ctx, NULL, 0, NULL, NULL);
+    if (!hmac_ret) {
+        fprintf(stderr, "HMAC_Init_ex failed\n");
+    }
+    return hmac_ret;
+}
+
+/**
+ * calculate_mac - Calulate keyed-hash message authentication code (HMAC SHA256)
+ * @key:            Key object.
+ * @mac:            Mac object to return calulated mac in.
+ * @data:           Data to calculate mac for.
+ * @data_size:      Number of bytes in @data.
+ *
+ * Return: 0 on success, -1 if an error was detected.
+ */
+int calculate_mac(const struct key *key, struct mac *mac,
+                  const void *data, size_t data_size)
+{
+    int hmac_ret;
+    HMAC_CTX hmac_ctx;
+
+    hmac_ret = mac_init(&hmac_ctx, key);
+    if (hmac_ret) {
+        hmac_ret = mac_update(&hmac_ctx, mac, data, data_size);
+    }
     HMAC_CTX_cleanup(&hmac_ctx);
+
     return hmac_ret ? 0 : -1;
 }
 
+/**
+ * derive_hash_key - Derive a key for keyed_hash
+ * @key:            Key object.
+ * @hash_key:       Hash key object to return derived key in.
+ * @label:          String that identifies what the hash key is used for.
+ *
+ * Return: 0 on success, -1 if an error was detected.
+ */
+int derive_hash_key(const struct key *key, struct hash_key *hash_key,
+                    const char *label)
+{
+    struct mac mac;
+
+    STATIC_ASSERT(sizeof(*hash_key) <= sizeof(mac));
+    if (calculate_mac(key, &mac, label, strlen(label))) {
+        return -1;
+    }
+    memcpy(hash_key, &mac, sizeof(*hash_key));
+    return 0;
+}
+
 /**
  * generate_iv - Generate a random iv value.
  * @iv_out:     IV object.
@@ -220,3 +403,50 @@ int decrypt(const struct key *key, void *data_in_out, size_t data_size,
 {
     return crypt(key, data_in_out, data_size, iv_in, false);
 }
+
+/**
+ * encrypt_and_mac_blocks - Encrypt blocks and calculate their macs.
+ * @key:            Key object used for all blocks.
+ * @blocks:         Blocks to process.
+ * @count:          Number of entries in @blocks.
+ *
+ * Encrypt @blocks[i].data in place using AES-128-CTR with @blocks[i].iv, then
+ * calculate the HMAC SHA256 of @blocks[i].mac_data into @blocks[i].mac. The
+ * cipher key schedule and hmac key state are set up once for all blocks,
+ * which is cheaper than calling encrypt and calculate_mac for each block.
+ *
+ * Return: 0 on success, -1 if an error was detected.
+ */
+int encrypt_and_mac_blocks(const struct key *key,
+                           const struct crypt_block *blocks,
+                           size_t count)
+{
+    int ret;
+    size_t i;
+    EVP_CIPHER_CTX ctx;
+    HMAC_CTX hmac_ctx;
+
+    ret = crypt_init(&ctx, key, NULL, true);
+    if (!ret) {
+        goto err_crypt_init;
+    }
+    ret = mac_init(&hmac_ctx, key);
+    if (!ret) {
+        goto err_mac_init;
+    }
+
+    for (i = 0; i < count && ret; i++) {
+        ret = crypt_update(&ctx, blocks[i].data, blocks[i].data_size,
+                           blocks[i].iv);
+        if (ret) {
+            ret = mac_update(&hmac_ctx, blocks[i].mac, blocks[i].mac_data,
+                             blocks[i].mac_data_size);
+        }
+    }
+
+err_mac_init:
+    HMAC_CTX_cleanup(&hmac_ctx);
+err_crypt_init:
+    EVP_CIPHER_CTX_cleanup(&ctx);
+    return ret ? 0 : -1;
+}
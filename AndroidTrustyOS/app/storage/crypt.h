@@ -16,6 +16,7 @@
 
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define DEBUG_MAC_VALUES 0
@@ -31,6 +32,10 @@ struct mac {
 struct iv {
     uint8_t byte[16];
 };
+
+struct hash_key {
+    uint8_t byte[16];
+};
 #define IV_INITIAL_ZERO_VALUE(iv) {{0}}
 
 #if DEBUG_MAC_VALUES
@@ -48,11 +53,34 @@ struct iv {
 #define IV_PRINTF_STR UINT8_16_PRINTF_STR
 #define IV_PRINTF_ARGS(var) UINT8_16_PRINTF_ARGS((var)->byte)
 
+/**
+ * struct crypt_block - Block to process with encrypt_and_mac_blocks
+ * @data:           Data to encrypt in place.
+ * @data_size:      Number of bytes in @data.
+ * @iv:             Initialization vector to encrypt @data with.
+ * @mac_data:       Data to calculate mac for after @data has been encrypted.
+ * @mac_data_size:  Number of bytes in @mac_data.
+ * @mac:            Mac object to return calculated mac in.
+ */
+struct crypt_block {
+    void *data;
+    size_t data_size;
+    const struct iv *iv;
+    const void *mac_data;
+    size_t mac_data_size;
+    struct mac *mac;
+};
+
 uint64_t str_hash(const char *str);
+uint64_t keyed_hash(const struct hash_key *key, const void *data,
+                    size_t data_size);
 
 int calculate_mac(const struct key *key, struct mac *mac,
                   const void *data, size_t data_size);
 
+int derive_hash_key(const struct key *key, struct hash_key *hash_key,
+                    const char *label);
+
 int generate_iv(struct iv *iv_out);
 
 int encrypt(const struct key *key,
@@ -64,3 +92,7 @@ int decrypt(const struct key *key,
             void *data_in_out,
             size_t data_size,
             const struct iv *iv_in);
+
+int encrypt_and_mac_blocks(const struct key *key,
+                           const struct crypt_block *blocks,
+                           size_t count);
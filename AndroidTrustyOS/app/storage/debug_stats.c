@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <trusty_std.h>
+
+#include "debug_stats.h"
+
+#if APP_STORAGE_STATS
+
+static const char *stats_timer_names[STATS_COUNTER_COUNT] = {
+    [STATS_CACHE_LOOKUP] = "cache_lookup",
+    [STATS_CACHE_LOOKUP_FOUND] = "cache_lookup_found",
+    [STATS_CACHE_LOOKUP_NOT_FOUND] = "cache_lookup_not_found",
+    [STATS_CACHE_LOOKUP_EVICT] = "cache_lookup_evict",
+    [STATS_CACHE_LOOKUP_CLEAN] = "cache_lookup_clean",
+    [STATS_CACHE_START_READ] = "cache_start_read",
+    [STATS_CACHE_START_WRITE] = "cache_start_write",
+    [STATS_CACHE_PREFETCH] = "cache_prefetch",
+    [STATS_CACHE_PREFETCH_ISSUED] = "cache_prefetch_issued",
+    [STATS_CACHE_PREFETCH_HIT] = "cache_prefetch_hit",
+    [STATS_CACHE_PREFETCH_WASTED] = "cache_prefetch_wasted",
+    [STATS_CACHE_CLEAN_TRANSACTION] = "cache_clean_transaction",
+    [STATS_CACHE_CLEAN_TRANSACTION_ENT_CLN] = "cache_clean_transaction_ent_cln",
+    [STATS_CACHE_CLEAN_TRANSACTION_WAIT_IO] = "cache_clean_transaction_wait_io",
+    [STATS_CACHE_FLUSH_BACKGROUND] = "cache_flush_background",
+    [STATS_FS_READ_BLOCK_CALC_MAC] = "fs_read_block_calc_mac",
+    [STATS_FS_READ_BLOCK_DECRYPT] = "fs_read_block_decrypt",
+    [STATS_FS_WRITE_BLOCK_ENCRYPT_MAC] = "fs_write_block_encrypt_mac",
+    [STATS_FS_COMMIT_GROUP] = "fs_commit_group",
+    [STATS_TREE_WALK] = "tree_walk",
+    [STATS_SET_ITER_WALK] = "set_iter_walk",
+    [STATS_SET_ITER_REUSE] = "set_iter_reuse",
+};
+
+static struct stats_timer stats_timers[STATS_COUNTER_COUNT];
+static int64_t stats_timer_start_time[STATS_COUNTER_COUNT];
+static uint stats_timer_depth[STATS_COUNTER_COUNT];
+
+/**
+ * stats_timer_now - Get current time
+ *
+ * Return: Current time in ns.
+ */
+static int64_t stats_timer_now(void)
+{
+    int64_t now = 0;
+
+    gettime(0, 0, &now);
+    return now;
+}
+
+/**
+ * stats_timer_hist_index - Get histogram bucket for a duration
+ * @duration:   Duration in ns.
+ *
+ * Return: floor(log2(@duration)), clamped to the histogram size.
+ */
+static uint stats_timer_hist_index(uint64_t duration)
+{
+    uint index = 0;
+
+    while (duration >>= 1) {
+        index++;
+    }
+    return index < STATS_HIST_SIZE ? index : STATS_HIST_SIZE - 1;
+}
+
+/**
+ * stats_timer_start_counter - Start timing a code path
+ * @counter:    Counter to start.
+ */
+void stats_timer_start_counter(enum stats_counter counter)
+{
+    assert(counter < STATS_COUNTER_COUNT);
+
+    if (!stats_timer_depth[counter]++) {
+        stats_timer_start_time[counter] = stats_timer_now();
+    }
+}
+
+/**
+ * stats_timer_stop_counter - Stop timing a code path and record duration
+ * @counter:    Counter to stop. Must match a previous stats_timer_start call.
+ */
+void stats_timer_stop_counter(enum stats_counter counter)
+{
+    uint64_t duration;
+    struct stats_timer *timer;
+
+    assert(counter < STATS_COUNTER_COUNT);
+    assert(stats_timer_depth[counter]);
+
+    if (--stats_timer_depth[counter]) {
+        return;
+    }
+
+    duration = stats_timer_now() - stats_timer_start_time[counter];
+    timer = &stats_timers[counter];
+    if (!timer->count || duration < timer->min) {
+        timer->min = duration;
+    }
+    if (duration > timer->max) {
+        timer->max = duration;
+    }
+    timer->count++;
+    timer->total += duration;
+    timer->hist[stats_timer_hist_index(duration)]++;
+}
+
+/**
+ * stats_counter_inc - Count an event
+ * @counter:    Counter to increment. Only @count of its statistics is updated.
+ */
+void stats_counter_inc(enum stats_counter counter)
+{
+    assert(counter < STATS_COUNTER_COUNT);
+
+    stats_timers[counter].count++;
+}
+
+/**
+ * stats_timer_reset - Clear all recorded statistics
+ *
+ * Timers that are currently running are not affected.
+ */
+void stats_timer_reset(void)
+{
+    memset(stats_timers, 0, sizeof(stats_timers));
+}
+
+/**
+ * stats_timer_name - Get counter name
+ * @counter:    Counter.
+ *
+ * Return: Name of @counter.
+ */
+const char *stats_timer_name(enum stats_counter counter)
+{
+    assert(counter < STATS_COUNTER_COUNT);
+    return stats_timer_names[counter];
+}
+
+/**
+ * stats_timer_get - Get recorded statistics for a counter
+ * @counter:    Counter.
+ * @timer:      Pointer to store statistics in.
+ */
+void stats_timer_get(enum stats_counter counter, struct stats_timer *timer)
+{
+    assert(counter < STATS_COUNTER_COUNT);
+    *timer = stats_timers[counter];
+}
+
+/**
+ * stats_timer_print - Print recorded statistics for all used counters
+ */
+void stats_timer_print(void)
+{
+    uint i;
+    uint j;
+    struct stats_timer *timer;
+
+    printf("%-32s %10s %12s %10s %10s %10s\n",
+           "counter", "count", "total us", "avg ns", "min ns", "max ns");
+    for (i = 0; i < STATS_COUNTER_COUNT; i++) {
+        timer = &stats_timers[i];
+        if (!timer->count) {
+            continue;
+        }
+        printf("%-32s %10llu %12llu %10llu %10llu %10llu\n",
+               stats_timer_names[i],
+               (unsigned long long)timer->count,
+               (unsigned long long)timer->total / 1000,
+               (unsigned long long)(timer->total / timer->count),
+               (unsigned long long)timer->min,
+               (unsigned long long)timer->max);
+        printf("%-32s", "");
+        for (j = 0; j < STATS_HIST_SIZE; j++) {
+            if (timer->hist[j]) {
+                printf(" 2^%u:%u", j, timer->hist[j]);
+            }
+        }
+        printf("\n");
+    }
+}
+
+#endif
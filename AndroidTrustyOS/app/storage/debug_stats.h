@@ -16,8 +16,88 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * enum stats_counter - Timed code paths and event counters
+ *
+ * Counters may nest. If a counter is started again before it is stopped, only
+ * the outermost start/stop pair is recorded. Event counters
+ * (%STATS_CACHE_LOOKUP_FOUND, %STATS_CACHE_LOOKUP_NOT_FOUND,
+ * %STATS_CACHE_LOOKUP_EVICT, %STATS_CACHE_PREFETCH_ISSUED,
+ * %STATS_CACHE_PREFETCH_HIT, %STATS_CACHE_PREFETCH_WASTED,
+ * %STATS_TREE_WALK, %STATS_SET_ITER_WALK and %STATS_SET_ITER_REUSE) are only
+ * updated with stats_counter_inc.
+ */
+enum stats_counter {
+    STATS_CACHE_LOOKUP,
+    STATS_CACHE_LOOKUP_FOUND,
+    STATS_CACHE_LOOKUP_NOT_FOUND,
+    STATS_CACHE_LOOKUP_EVICT,
+    STATS_CACHE_LOOKUP_CLEAN,
+    STATS_CACHE_START_READ,
+    STATS_CACHE_START_WRITE,
+    STATS_CACHE_PREFETCH,
+    STATS_CACHE_PREFETCH_ISSUED,
+    STATS_CACHE_PREFETCH_HIT,
+    STATS_CACHE_PREFETCH_WASTED,
+    STATS_CACHE_CLEAN_TRANSACTION,
+    STATS_CACHE_CLEAN_TRANSACTION_ENT_CLN,
+    STATS_CACHE_CLEAN_TRANSACTION_WAIT_IO,
+    STATS_CACHE_FLUSH_BACKGROUND,
+    STATS_FS_READ_BLOCK_CALC_MAC,
+    STATS_FS_READ_BLOCK_DECRYPT,
+    STATS_FS_WRITE_BLOCK_ENCRYPT_MAC,
+    STATS_FS_COMMIT_GROUP,
+    STATS_TREE_WALK,
+    STATS_SET_ITER_WALK,
+    STATS_SET_ITER_REUSE,
+    STATS_COUNTER_COUNT,
+};
+
+#define STATS_HIST_SIZE (32)
+
+/**
+ * struct stats_timer - Recorded statistics for one counter
+ * @count:      Number of completed start/stop pairs, or number of
+ *              stats_counter_inc calls for event counters.
+ * @total:      Sum of all durations in ns.
+ * @min:        Shortest duration in ns. Only valid if @count is not 0.
+ * @max:        Longest duration in ns.
+ * @hist:       Log2 histogram. @hist[i] counts durations d where
+ *              2^i <= d < 2^(i+1) ns. @hist[0] also counts 0 ns and the last
+ *              entry counts everything longer.
+ */
+struct stats_timer {
+    uint64_t count;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    uint32_t hist[STATS_HIST_SIZE];
+};
+
+#if APP_STORAGE_STATS
+
+void stats_timer_start_counter(enum stats_counter counter);
+void stats_timer_stop_counter(enum stats_counter counter);
+void stats_counter_inc(enum stats_counter counter);
+
+#define stats_timer_start(counter) stats_timer_start_counter(counter)
+#define stats_timer_stop(counter) stats_timer_stop_counter(counter)
+
+void stats_timer_reset(void);
+void stats_timer_print(void);
+const char *stats_timer_name(enum stats_counter counter);
+void stats_timer_get(enum stats_counter counter, struct stats_timer *timer);
+
+#else
+
 #define stats_timer_start(counter) do {} while(0)
 #define stats_timer_stop(counter) do {} while(0)
+#define stats_counter_inc(counter) do {} while(0)
 
 static inline void stats_timer_reset(void) {}
 static inline void stats_timer_print(void) {}
+
+#endif
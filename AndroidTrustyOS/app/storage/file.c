@@ -32,6 +32,17 @@
 
 #define FILE_ENTRY_MAGIC (0x0066797473757274) /* trustyf\0 */
 
+/* Max blocks prefetched by file_read_ahead, read request plus window */
+#define FILE_READ_AHEAD_MAX_BLOCKS (16 + FILE_READ_AHEAD_MAX_WINDOW)
+
+STATIC_ASSERT(FILE_READ_AHEAD_BLOCKS <= FILE_READ_AHEAD_MAX_WINDOW);
+
+/* Blocks prefetched past a sequential read, see file_set_read_ahead_blocks */
+static data_block_t file_read_ahead_blocks = FILE_READ_AHEAD_BLOCKS;
+
+/* Max blocks reserved by file_reserve_blocks */
+#define FILE_RESERVE_MAX_BLOCKS (16)
+
 /**
  * struct file_entry - On-disk file entry
  * @iv:         initial value used for encrypt/decrypt
@@ -67,7 +78,13 @@ static bool file_tree_lookup(struct block_mac *block_mac_out,
  */
 static data_block_t path_hash(struct transaction *tr, const char *path)
 {
-    data_block_t hash = str_hash(path);
+    data_block_t hash;
+
+    if (tr->fs->keyed_path_hash) {
+        hash = keyed_hash(&tr->fs->path_hash_key, path, strlen(path));
+    } else {
+        hash = str_hash(path);
+    }
 
     hash &= BIT_MASK(tr->fs->block_num_size * 8);
     if (!hash) {
@@ -304,6 +321,38 @@ size_t get_file_block_size(struct fs *fs)
     return fs->dev->block_size - sizeof(struct iv);
 }
 
+/**
+ * file_check_snapshot_read - Check for conflicts before modifying a file
+ * @tr:         Transaction object.
+ * @file:       File handle object that is about to be modified.
+ *
+ * Reads served by file_open_snapshot do not set @file->used_by_tr, so commits
+ * by other transactions do not fail @tr. If @tr modifies @file after such a
+ * read, fail @tr if another transaction committed a new version of @file
+ * since the first read. Otherwise the normal @file->used_by_tr conflict
+ * detection takes over from here.
+ *
+ * Return: %false if @tr was failed, %true otherwise.
+ */
+static bool file_check_snapshot_read(struct transaction *tr,
+                                     struct file_handle *file)
+{
+    if (!file->snapshot_read) {
+        return true;
+    }
+    file->snapshot_read = false;
+    if (!block_mac_same_block(tr, &file->snapshot_block_mac,
+                              &file->committed_block_mac)) {
+        pr_warn("file handle %p, conflict with snapshot read %lld != %lld\n",
+                file, block_mac_to_block(tr, &file->snapshot_block_mac),
+                block_mac_to_block(tr, &file->committed_block_mac));
+        transaction_fail(tr);
+        return false;
+    }
+    file->used_by_tr = true;
+    return true;
+}
+
 /**
  * file_get_block_etc - Helper function to get a file block for read or write
  * @tr:         Transaction object.
@@ -327,6 +376,7 @@ static const void *file_get_block_etc(struct transaction *tr,
     const void *data = NULL;
     struct block_map block_map;
     struct block_mac block_mac;
+    struct block_mac prev_block_mac;
     data_block_t old_disk_block;
     data_block_t new_block;
     bool dirty = false;
@@ -336,6 +386,10 @@ static const void *file_get_block_etc(struct transaction *tr,
         goto err;
     }
 
+    if (write && !file_check_snapshot_read(tr, file)) {
+        goto err;
+    }
+
     file_block_map_init(tr, &block_map, &file->block_mac);
     if (tr->failed) {
         pr_warn("transaction failed, abort\n");
@@ -356,7 +410,17 @@ static const void *file_get_block_etc(struct transaction *tr,
 
     old_disk_block = found ? block_mac_to_block(tr, &block_mac) : 0;
     if (write && (!found || transaction_block_need_copy(tr, old_disk_block))) {
-        new_block = block_allocate(tr);
+        if (!block_range_empty(file->reserved)) {
+            new_block = file->reserved.start++;
+        } else {
+            /* keep file data contiguous on disk to allow batched reads */
+            if (!file_block || !block_map_get(tr, &block_map, file_block - 1,
+                                              &prev_block_mac)) {
+                block_mac_clear(tr, &prev_block_mac);
+            }
+            new_block = block_allocate_after(tr,
+                                             block_mac_to_block(tr, &prev_block_mac));
+        }
         if (tr->failed) {
             pr_warn("transaction failed, abort\n");
             goto err;
@@ -437,9 +501,169 @@ const void *file_get_block(struct transaction *tr, struct file_handle *file,
 void *file_get_block_write(struct transaction *tr, struct file_handle *file,
                            data_block_t file_block, bool read, obj_ref_t *ref)
 {
+     assert(!tr->snapshot);
      return (void *)file_get_block_etc(tr, file, file_block, read, true, ref);
 }
 
+/**
+ * file_read_ahead - Prefetch file blocks before a read
+ * @tr:         Transaction object.
+ * @file:       File handle object.
+ * @file_block: First file block that is about to be read. 0 based.
+ * @count:      Number of file blocks that are about to be read.
+ *
+ * Prefetch the disk blocks backing @count file blocks starting at @file_block
+ * so they are loaded with a single batched device request. If the read
+ * continues where the previous read on @file ended, also prefetch the next
+ * file_read_ahead_blocks blocks. Blocks past the end of the file or already
+ * prefetched for @file are skipped.
+ */
+void file_read_ahead(struct transaction *tr, struct file_handle *file,
+                     data_block_t file_block, data_block_t count)
+{
+    struct block_map block_map;
+    struct block_mac block_macs[FILE_READ_AHEAD_MAX_BLOCKS];
+    data_block_t blocks[FILE_READ_AHEAD_MAX_BLOCKS];
+    unsigned int block_count;
+    unsigned int i;
+    data_block_t start;
+    data_block_t end;
+    data_block_t file_block_count;
+
+    if (tr->failed || !count) {
+        return;
+    }
+
+    start = file_block;
+    end = file_block + count;
+    if (file_block == file->read_ahead_next) {
+        end += file_read_ahead_blocks;
+        if (start < file->read_ahead_end) {
+            start = file->read_ahead_end;
+        }
+    } else {
+        file->read_ahead_end = 0;
+    }
+    file->read_ahead_next = file_block + count;
+
+    file_block_count = DIV_ROUND_UP(file->size, get_file_block_size(tr->fs));
+    if (end > file_block_count) {
+        end = file_block_count;
+    }
+    if (end > start + countof(blocks)) {
+        end = start + countof(blocks);
+    }
+    if (start >= end) {
+        return;
+    }
+
+    file_block_map_init(tr, &block_map, &file->block_mac);
+    if (tr->failed) {
+        pr_warn("transaction failed, abort\n");
+        return;
+    }
+    file->used_by_tr = true;
+
+    block_count = block_map_get_range(tr, &block_map, start, block_macs,
+                                      end - start);
+    for (i = 0; i < block_count; i++) {
+        blocks[i] = block_mac_to_block(tr, &block_macs[i]);
+    }
+    file->read_ahead_end = start + block_count;
+
+    block_prefetch(tr, blocks, block_count);
+}
+
+/**
+ * file_set_read_ahead_blocks - Set read-ahead window
+ * @blocks:     Number of blocks file_read_ahead prefetches past the end of a
+ *              sequential read. 0 disables read-ahead past the requested
+ *              blocks. Starts out as FILE_READ_AHEAD_BLOCKS.
+ *
+ * Return: %true if the window was changed, %false if @blocks is larger than
+ * FILE_READ_AHEAD_MAX_WINDOW.
+ */
+bool file_set_read_ahead_blocks(data_block_t blocks)
+{
+    if (blocks > FILE_READ_AHEAD_MAX_WINDOW) {
+        return false;
+    }
+    file_read_ahead_blocks = blocks;
+    return true;
+}
+
+/**
+ * file_reserve_blocks - Allocate contiguous blocks before a write
+ * @tr:         Transaction object.
+ * @file:       File handle object.
+ * @file_block: First file block that is about to be written. 0 based.
+ * @count:      Number of file blocks that are about to be written.
+ *
+ * Count the file blocks in the write that will need a new disk block, either
+ * because they are not mapped yet or because they are still used by the
+ * committed file system, and allocate a single contiguous range for them.
+ * file_get_block_write takes new blocks from this range until it is used up.
+ * Call file_release_blocks after the write to free any unused blocks.
+ */
+void file_reserve_blocks(struct transaction *tr, struct file_handle *file,
+                         data_block_t file_block, data_block_t count)
+{
+    struct block_map block_map;
+    struct block_mac block_macs[FILE_RESERVE_MAX_BLOCKS];
+    size_t block_count;
+    size_t i;
+    data_block_t needed;
+
+    assert(!tr->snapshot);
+    file_release_blocks(tr, file);
+
+    if (count > countof(block_macs)) {
+        count = countof(block_macs);
+    }
+    if (tr->failed || count < 2) {
+        return;
+    }
+
+    file_block_map_init(tr, &block_map, &file->block_mac);
+    if (tr->failed) {
+        pr_warn("transaction failed, abort\n");
+        return;
+    }
+    file->used_by_tr = true;
+
+    block_count = block_map_get_range(tr, &block_map, file_block, block_macs,
+                                      count);
+    needed = count - block_count;
+    for (i = 0; i < block_count; i++) {
+        if (transaction_block_need_copy(tr,
+                                        block_mac_to_block(tr, &block_macs[i]))) {
+            needed++;
+        }
+    }
+    if (needed < 2) {
+        return;
+    }
+
+    file->reserved = block_allocate_range(tr, needed);
+}
+
+/**
+ * file_release_blocks - Free blocks reserved by file_reserve_blocks
+ * @tr:         Transaction object.
+ * @file:       File handle object.
+ */
+void file_release_blocks(struct transaction *tr, struct file_handle *file)
+{
+    data_block_t block;
+
+    if (!tr->failed) {
+        for (block = file->reserved.start; block < file->reserved.end; block++) {
+            block_free(tr, block);
+        }
+    }
+    block_range_clear(&file->reserved);
+}
+
 /**
  * file_block_put - Release reference to a block returned by file_get_block
  * @data:       File block data pointer
@@ -521,10 +745,14 @@ void file_set_size(struct transaction *tr,
     struct block_map block_map;
     size_t file_block_size = get_file_block_size(tr->fs);
 
+    assert(!tr->snapshot);
     if (tr->failed) {
         pr_warn("transaction failed, ignore\n");
         return;
     }
+    if (!file_check_snapshot_read(tr, file)) {
+        return;
+    }
 
     file_block_map_init(tr, &block_map, &file->block_mac);
     if (tr->failed) {
@@ -679,6 +907,175 @@ err:
     return false;
 }
 
+/**
+ * file_path_cache_find - Find path cache entry
+ * @tr:         Transaction object.
+ * @hash:       Path hash.
+ * @path:       File path string.
+ *
+ * Return: Entry for @path that is in use or staged, or %NULL if @path is not
+ * in the cache.
+ */
+static struct file_path_cache_entry *file_path_cache_find(struct transaction *tr,
+                                                          data_block_t hash,
+                                                          const char *path)
+{
+    struct file_path_cache_entry *entry;
+    struct file_path_cache *cache = &tr->fs->path_cache;
+
+    for (entry = cache->entry; entry < cache->entry + countof(cache->entry);
+         entry++) {
+        if ((block_mac_valid(tr, &entry->block_mac) || entry->staged) &&
+            entry->hash == hash && !strcmp(entry->path, path)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * file_path_cache_alloc - Get path cache entry for a new path
+ * @tr:         Transaction object.
+ * @hash:       Path hash.
+ * @path:       File path string.
+ *
+ * Return: Unused entry, or the least recently used entry that is not staged,
+ * initialized for @path, or %NULL if every entry is staged.
+ */
+static struct file_path_cache_entry *file_path_cache_alloc(struct transaction *tr,
+                                                           data_block_t hash,
+                                                           const char *path)
+{
+    struct file_path_cache_entry *entry;
+    struct file_path_cache_entry *victim = NULL;
+    struct file_path_cache *cache = &tr->fs->path_cache;
+
+    assert(strlen(path) < sizeof(entry->path));
+
+    for (entry = cache->entry; entry < cache->entry + countof(cache->entry);
+         entry++) {
+        if (entry->staged) {
+            continue;
+        }
+        if (!block_mac_valid(tr, &entry->block_mac)) {
+            victim = entry;
+            break;
+        }
+        if (!victim || entry->last_used < victim->last_used) {
+            victim = entry;
+        }
+    }
+    if (!victim) {
+        return NULL;
+    }
+    block_mac_clear(tr, &victim->block_mac);
+    victim->hash = hash;
+    victim->last_used = cache->lookups;
+    strcpy(victim->path, path);
+    return victim;
+}
+
+/**
+ * file_path_cache_lookup - Search for a committed file
+ * @block_mac_out:  Block-mac object to return block number and mac in.
+ * @tr:             Transaction object.
+ * @tree_path:      Tree path object.
+ * @file_path:      File path string.
+ *
+ * Same as file_tree_lookup in @tr->fs->files, but remembers where recently
+ * used files were found so opening them again does not need to search the
+ * file tree or read file entries with other paths. The cache only contains
+ * committed state, file_transaction_complete stages changes to it that are
+ * applied by file_transaction_success or dropped by
+ * file_transaction_complete_failed.
+ *
+ * Return: %true if @file_path was found in @tr->fs->files, %false otherwise.
+ */
+static bool file_path_cache_lookup(struct block_mac *block_mac_out,
+                                   struct transaction *tr,
+                                   struct block_tree_path *tree_path,
+                                   const char *file_path)
+{
+    bool found;
+    data_block_t hash = path_hash(tr, file_path);
+    struct file_path_cache_entry *entry;
+    struct file_path_cache *cache = &tr->fs->path_cache;
+
+    cache->lookups++;
+    entry = file_path_cache_find(tr, hash, file_path);
+    if (entry) {
+        assert(!entry->staged);
+        entry->last_used = cache->lookups;
+        cache->hits++;
+        *block_mac_out = entry->block_mac;
+        pr_read("file %s, %lld, found in path cache\n",
+                file_path, block_mac_to_block(tr, block_mac_out));
+        return true;
+    }
+
+    found = file_tree_lookup(block_mac_out, tr, &tr->fs->files, tree_path,
+                             file_path, false);
+    if (found) {
+        entry = file_path_cache_alloc(tr, hash, file_path);
+        if (entry) {
+            entry->block_mac = *block_mac_out;
+        }
+    }
+    return found;
+}
+
+/**
+ * file_path_cache_stage - Stage path cache update for a file being committed
+ * @tr:             Transaction object.
+ * @hash:           Path hash.
+ * @path:           File path string.
+ * @new_block_mac:  Block and mac of file entry in new file tree, or a cleared
+ *                  block-mac if the file is deleted.
+ */
+static void file_path_cache_stage(struct transaction *tr,
+                                  data_block_t hash,
+                                  const char *path,
+                                  const struct block_mac *new_block_mac)
+{
+    struct file_path_cache_entry *entry;
+
+    entry = file_path_cache_find(tr, hash, path);
+    if (!entry) {
+        if (!block_mac_valid(tr, new_block_mac)) {
+            return;
+        }
+        entry = file_path_cache_alloc(tr, hash, path);
+        if (!entry) {
+            return;
+        }
+    }
+    entry->to_commit_block_mac = *new_block_mac;
+    entry->staged = true;
+}
+
+/**
+ * file_path_cache_finish - Apply or drop staged path cache updates
+ * @tr:         Transaction object.
+ * @apply:      %true if the staged changes were committed, %false if the
+ *              transaction failed.
+ */
+static void file_path_cache_finish(struct transaction *tr, bool apply)
+{
+    struct file_path_cache_entry *entry;
+    struct file_path_cache *cache = &tr->fs->path_cache;
+
+    for (entry = cache->entry; entry < cache->entry + countof(cache->entry);
+         entry++) {
+        if (!entry->staged) {
+            continue;
+        }
+        if (apply) {
+            entry->block_mac = entry->to_commit_block_mac;
+        }
+        entry->staged = false;
+    }
+}
+
 /**
  * file_is_removed - Helper function to check if transaction deletes file
  * @tr:         Transaction object.
@@ -705,7 +1102,8 @@ static bool file_is_removed(struct transaction *tr, data_block_t block)
  * @tree_path:                  Tree path object.
  * @file_path:                  File path string.
  *
- * Helper function to search for a file that existed before @tr was activated.
+ * Helper function to search for a file that existed before @tr was activated,
+ * or in the pinned file tree if @tr is a snapshot.
  *
  * Return: %true if @file_path was found in @tr->fs->files but not found in
  * @tr->files_removed, %false otherwise.
@@ -719,8 +1117,12 @@ static bool file_lookup_not_removed(struct block_mac *block_mac_out,
     bool found;
     struct block_mac block_mac;
 
-    found = file_tree_lookup(&block_mac, tr, &tr->fs->files, tree_path,
-                             file_path, false);
+    if (tr->snapshot) {
+        found = file_tree_lookup(&block_mac, tr, &tr->snapshot_files,
+                                 tree_path, file_path, false);
+    } else {
+        found = file_path_cache_lookup(&block_mac, tr, tree_path, file_path);
+    }
     if (!found || file_is_removed(tr, block_mac_to_block(tr, &block_mac))) {
         if (found) {
             pr_read("file %s, %lld in removed\n",
@@ -780,7 +1182,8 @@ static struct file_handle *file_find_open(struct transaction *tr,
  * @path:       Path to find or create file at.
  * @file:       File handle object.
  * @create:     FILE_OPEN_NO_CREATE, FILE_OPEN_CREATE or
- *              FILE_OPEN_CREATE_EXCLUSIVE.
+ *              FILE_OPEN_CREATE_EXCLUSIVE. Files are never created in a
+ *              snapshot transaction.
  *
  * Return: %true if file was opened, %false if file could not be opeened.
  */
@@ -808,7 +1211,7 @@ bool file_open(struct transaction *tr, const char *path,
         goto found;
     }
 
-    if (create != FILE_OPEN_NO_CREATE) {
+    if (create != FILE_OPEN_NO_CREATE && !tr->snapshot) {
         found = file_create(&block_mac, tr, path);
     }
     if (found) {
@@ -838,6 +1241,10 @@ created:
     file->block_mac = block_mac;
     file->size = file_entry_ro->size;
     file->used_by_tr = false;
+    file->snapshot_read = false;
+    file->read_ahead_next = 0;
+    file->read_ahead_end = 0;
+    block_range_clear(&file->reserved);
     block_put(file_entry_ro, &file_entry_ref);
 
     return true;
@@ -851,9 +1258,67 @@ created:
  */
 void file_close(struct file_handle *file)
 {
+    assert(block_range_empty(file->reserved));
     list_delete(&file->node);
 }
 
+/**
+ * file_open_snapshot - Open committed version of an open file in a snapshot
+ * @snapshot:   Snapshot transaction, pinned after the last commit.
+ * @file:       File handle object to open.
+ * @tr:         Transaction @src was opened in.
+ * @src:        Open file handle.
+ *
+ * Open the committed version of @src in @snapshot, so it can be read without
+ * @tr being failed when other transactions commit changes to the file. Only
+ * possible if @tr has not modified @src. Read-ahead state is taken from @src
+ * and returned to it by file_close_snapshot.
+ *
+ * Return: %true if @file was opened, %false if @tr has created or modified
+ * @src.
+ */
+bool file_open_snapshot(struct transaction *snapshot, struct file_handle *file,
+                        struct transaction *tr, struct file_handle *src)
+{
+    assert(snapshot->snapshot);
+    assert(!tr->snapshot);
+
+    if (!block_mac_valid(tr, &src->committed_block_mac) ||
+        !block_mac_same_block(tr, &src->block_mac,
+                              &src->committed_block_mac)) {
+        return false;
+    }
+    if (!src->snapshot_read) {
+        src->snapshot_read = true;
+        src->snapshot_block_mac = src->committed_block_mac;
+    }
+
+    list_add_head(&snapshot->open_files, &file->node);
+    file->to_commit_block_mac = src->committed_block_mac;
+    file->committed_block_mac = src->committed_block_mac;
+    file->block_mac = src->committed_block_mac;
+    file->size = src->size;
+    file->used_by_tr = false;
+    file->snapshot_read = false;
+    file->read_ahead_next = src->read_ahead_next;
+    file->read_ahead_end = src->read_ahead_end;
+    block_range_clear(&file->reserved);
+
+    return true;
+}
+
+/**
+ * file_close_snapshot - Close file opened by file_open_snapshot
+ * @file:       File handle object.
+ * @src:        File handle passed to file_open_snapshot.
+ */
+void file_close_snapshot(struct file_handle *file, struct file_handle *src)
+{
+    src->read_ahead_next = file->read_ahead_next;
+    src->read_ahead_end = file->read_ahead_end;
+    file_close(file);
+}
+
 /**
  * file_delete - Delete file
  * @tr:         Transaction object.
@@ -873,6 +1338,11 @@ bool file_delete(struct transaction *tr, const char *path)
     struct block_tree_path tree_path;
     struct file_handle *open_file;
 
+    if (tr->snapshot) {
+        pr_warn("can't delete %s in read-only snapshot\n", path);
+        return false;
+    }
+
     found = file_tree_lookup(&block_mac, tr, &tr->files_added, &tree_path,
                              path, true);
     if (!found) {
@@ -992,6 +1462,7 @@ static void file_apply_to_commit(struct transaction *tr,
 
     if (tr == file_tr) {
         file->used_by_tr = false;
+        file->snapshot_read = false;
     }
 
     if (block_mac_same_block(tr, src, dest)) {
@@ -1035,11 +1506,12 @@ static void file_apply_to_commit(struct transaction *tr,
  * file_transaction_complete_failed - Restore open files state
  * @tr:                     Transaction object.
  *
- * Revert open file changes done by file_transaction_complete.
+ * Revert open file and path cache changes done by file_transaction_complete.
  */
 void file_transaction_complete_failed(struct transaction *tr)
 {
     file_for_each_open(tr, file_restore_to_commit);
+    file_path_cache_finish(tr, false);
 }
 
 /**
@@ -1162,6 +1634,7 @@ void file_transaction_complete(struct transaction *tr,
                                   &file, file_entry_ro->size);
 
         hash = path_hash(tr, file_entry_ro->path);
+        file_path_cache_stage(tr, hash, file_entry_ro->path, &file);
 
         block_put(file_entry_ro, &file_entry_ref);
 
@@ -1202,6 +1675,9 @@ void file_transaction_complete(struct transaction *tr,
 
         file_update_block_mac_all(tr, &file, false, &clear_block_mac, 0);
 
+        file_path_cache_stage(tr, path_hash(tr, file_entry_ro->path),
+                              file_entry_ro->path, &clear_block_mac);
+
         found = file_tree_lookup(&old_file, tr, &new_files,
                                  &tmp_tree_path, file_entry_ro->path, true);
         block_put(file_entry_ro, &file_entry_ref);
@@ -1245,6 +1721,7 @@ void file_transaction_complete(struct transaction *tr,
                                  &file, file_entry_ro->size);
 
         hash = path_hash(tr, file_entry_ro->path);
+        file_path_cache_stage(tr, hash, file_entry_ro->path, &file);
         block_put(file_entry_ro, &file_entry_ref);
 
         if (tr->failed) {
@@ -1277,12 +1754,13 @@ static bool transaction_changed_file(struct transaction *tr,
 }
 
 /**
- * file_transaction_success - Update all file handles modified by transaction
+ * file_transaction_success - Update file handles and path cache after commit
  * @tr:         Transaction object.
  */
 void file_transaction_success(struct transaction *tr)
 {
     file_for_each_open(tr, file_apply_to_commit);
+    file_path_cache_finish(tr, true);
 }
 
 /**
@@ -1328,6 +1806,7 @@ void file_transaction_failed(struct transaction *tr)
 
     list_for_every_entry(&tr->open_files, file, struct file_handle, node) {
         file->used_by_tr = false;
+        file->snapshot_read = false;
         if (transaction_changed_file(tr, file)) {
             file->block_mac = file->committed_block_mac;
             success = file_read_size(tr, &file->block_mac, &file->size);
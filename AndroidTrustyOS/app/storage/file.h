@@ -17,14 +17,65 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 #include "block_cache.h"
 #include "block_mac.h"
+#include "block_range.h"
 
+struct block_map;
 struct fs;
 struct transaction;
 
 #define FS_PATH_MAX (64 + 128)
 
+#ifdef APP_STORAGE_READ_AHEAD_BLOCKS
+#define FILE_READ_AHEAD_BLOCKS (APP_STORAGE_READ_AHEAD_BLOCKS)
+#else
+#define FILE_READ_AHEAD_BLOCKS (4)
+#endif
+/* Largest window file_set_read_ahead_blocks accepts */
+#define FILE_READ_AHEAD_MAX_WINDOW (16)
+
+#ifdef APP_STORAGE_PATH_CACHE_SIZE
+#define FILE_PATH_CACHE_SIZE (APP_STORAGE_PATH_CACHE_SIZE)
+#else
+#define FILE_PATH_CACHE_SIZE (8)
+#endif
+
+/**
+ * struct file_path_cache_entry - Cached file lookup
+ * @hash:                   Path hash.
+ * @block_mac:              Block and mac of file entry in the committed file
+ *                          tree. Not valid if entry is unused.
+ * @to_commit_block_mac:    Block and mac of file entry in the file tree that
+ *                          is being committed. Only used if @staged is %true.
+ * @staged:                 %true if a transaction that changes this file is
+ *                          being completed.
+ * @last_used:              Lookup count value when entry was last used.
+ * @path:                   File path.
+ */
+struct file_path_cache_entry {
+    data_block_t hash;
+    struct block_mac block_mac;
+    struct block_mac to_commit_block_mac;
+    bool staged;
+    uint64_t last_used;
+    char path[FS_PATH_MAX];
+};
+
+/**
+ * struct file_path_cache - Cache of committed file locations by path
+ * @entry:          Cache entries.
+ * @lookups:        Number of lookups.
+ * @hits:           Number of lookups that did not need to search the file
+ *                  tree.
+ */
+struct file_path_cache {
+    struct file_path_cache_entry entry[FILE_PATH_CACHE_SIZE];
+    uint64_t lookups;
+    uint64_t hits;
+};
+
 struct file_handle {
     struct list_node node;
     struct block_mac to_commit_block_mac;
@@ -33,6 +84,11 @@ struct file_handle {
     data_block_t to_commit_size;
     data_block_t size;
     bool used_by_tr;
+    bool snapshot_read; /* read through a snapshot, see file_open_snapshot */
+    struct block_mac snapshot_block_mac; /* committed version first read */
+    data_block_t read_ahead_next; /* block following last read */
+    data_block_t read_ahead_end; /* first block not prefetched yet */
+    struct block_range reserved; /* allocated blocks for upcoming writes */
 };
 
 size_t get_file_block_size(struct fs *fs);
@@ -41,10 +97,19 @@ const void *file_get_block(struct transaction *tr, struct file_handle *file,
 void *file_get_block_write(struct transaction *tr, struct file_handle *file,
                            data_block_t file_block, bool read,
                            obj_ref_t *ref);
+void file_read_ahead(struct transaction *tr, struct file_handle *file,
+                     data_block_t file_block, data_block_t count);
+bool file_set_read_ahead_blocks(data_block_t blocks);
+void file_reserve_blocks(struct transaction *tr, struct file_handle *file,
+                         data_block_t file_block, data_block_t count);
+void file_release_blocks(struct transaction *tr, struct file_handle *file);
 void file_block_put(const void *data, obj_ref_t *data_ref);
 void file_block_put_dirty(struct transaction *tr,
                           struct file_handle *file, data_block_t file_block,
                           void *data, obj_ref_t *data_ref);
+void file_block_map_init(struct transaction *tr,
+                         struct block_map *block_map,
+                         const struct block_mac *file);
 bool file_get_size(struct transaction *tr,
                    struct file_handle *file,
                    data_block_t *size);
@@ -73,4 +138,7 @@ bool file_open(struct transaction *tr,
                struct file_handle *file,
                enum file_create_mode create);
 void file_close(struct file_handle *file);
+bool file_open_snapshot(struct transaction *snapshot, struct file_handle *file,
+                        struct transaction *tr, struct file_handle *src);
+void file_close_snapshot(struct file_handle *file, struct file_handle *src);
 bool file_delete(struct transaction *tr, const char *path); /* returns true if path was found */
@@ -33,11 +33,16 @@
 #include "block_mac.h"
 #include "block_set.h"
 #include "block_tree.h"
+#include "crypt.h"
+#include "file.h"
 
 /**
  * struct fs - File system state
  * @dev:                            Main block device.
  * @transactions:                   Transaction list.
+ * @snapshots:                      List of snapshot transactions. Blocks that
+ *                                  are not free in the free set pinned by a
+ *                                  snapshot are not allocated.
  * @allocated:                      List of block sets containing blocks
  *                                  allocated by active transactions.
  * @free:                           Block set of free blocks.
@@ -55,11 +60,26 @@
  *                                  Must be 16 if @dev is not tamper_detecting.
  * @reserved_count:                 Number of free blocks reserved for active
  *                                  transactions.
+ * @committed_free:                 Free set referenced by the last written
+ *                                  super block while a commit group is being
+ *                                  completed, %NULL otherwise. Blocks that are
+ *                                  not in this set are not allocated until the
+ *                                  super block has been updated.
+ * @fs_version:                     File system version from super block.
+ * @keyed_path_hash:                %true if file tree keys are computed with
+ *                                  keyed_hash and @path_hash_key, %false if
+ *                                  they are computed with str_hash.
+ * @path_hash_key:                  Key used for path hashes.
+ * @path_cache:                     Committed file locations by path.
+ * @range_search_start:             Block block_allocate_range starts searching
+ *                                  for free ranges at. Follows the last
+ *                                  allocated range.
  */
 
 struct fs {
     struct block_device *dev;
     struct list_node transactions;
+    struct list_node snapshots;
     struct list_node allocated;
     struct block_set free;
     struct block_tree files;
@@ -72,6 +92,12 @@ struct fs {
     size_t block_num_size;
     size_t mac_size;
     data_block_t reserved_count;
+    struct block_set *committed_free;
+    uint32_t fs_version;
+    bool keyed_path_hash;
+    struct hash_key path_hash_key;
+    struct file_path_cache path_cache;
+    data_block_t range_search_start;
 };
 
 bool update_super_block(struct transaction *tr,
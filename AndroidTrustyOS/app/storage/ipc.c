@@ -23,13 +23,13 @@
 
 #include "ipc.h"
 
-#define MSG_BUF_MAX_SIZE 4096
-
 #define TLOGE(args...) 	fprintf(stderr, "ipc: " args)
 
 static void *msg_buf;
 static size_t msg_buf_size;
 
+static struct list_node deferred_list = LIST_INITIAL_VALUE(deferred_list);
+
 static void handle_channel(struct ipc_context *ctx, const struct uevent *ev);
 static void handle_port(struct ipc_context *ctx, const struct uevent *ev);
 
@@ -158,8 +158,8 @@ static int do_handle_msg(struct ipc_channel_context *ctx, const uevent_t *ev)
 		return rc;
 	}
 
-	if (msg_inf.len > MSG_BUF_MAX_SIZE) {
-		TLOGE("%s: message too large %d\n", __func__, msg_inf.len);
+	if (msg_inf.len > msg_buf_size) {
+		TLOGE("%s: message too large %zu\n", __func__, msg_inf.len);
 		put_msg(chan, msg_inf.id);
 		return ERR_NOT_ENOUGH_BUFFER;
 	}
@@ -188,8 +188,6 @@ static int do_handle_msg(struct ipc_channel_context *ctx, const uevent_t *ev)
 
 	rc = ctx->ops.on_handle_msg(ctx, msg_buf, msg_inf.len);
 
-err_handle_msg:
-err_read_msg:
 	return rc;
 }
 
@@ -216,6 +214,17 @@ static void handle_channel(struct ipc_context *ctx, const struct uevent *ev)
 
 	handle_chan_errors(ev);
 
+	if ((ev->event & IPC_HANDLE_POLL_SEND_UNBLOCKED) &&
+	    channel_ctx->ops.on_send_unblocked != NULL) {
+		int rc = channel_ctx->ops.on_send_unblocked(channel_ctx);
+		if (rc < 0) {
+			TLOGE("error (%d) in channel, disconnecting "
+			      "peer\n", rc);
+			do_disconnect(channel_ctx, ev);
+			return;
+		}
+	}
+
 	if (ev->event & IPC_HANDLE_POLL_MSG) {
 
 		if (channel_ctx->ops.on_handle_msg != NULL) {
@@ -301,8 +310,8 @@ static int wait_to_send(handle_t session, struct ipc_msg *msg)
 	return rc;
 }
 
-int sync_ipc_send_msg(handle_t session, iovec_t *tx_iovecs, size_t tx_iovec_count,
-                      iovec_t *rx_iovecs, size_t rx_iovec_count)
+int sync_ipc_send_msg(handle_t session, iovec_t *tx_iovecs, uint tx_iovec_count,
+                      iovec_t *rx_iovecs, uint rx_iovec_count)
 {
 	struct ipc_msg tx_msg = {
 		.iov = tx_iovecs,
@@ -334,7 +343,7 @@ int sync_ipc_send_msg(handle_t session, iovec_t *tx_iovecs, size_t tx_iovec_coun
 
 	size_t min_len = rx_iovecs[0].len;
 	if (inf.len < min_len) {
-		TLOGE("%s: invalid response length (%d)\n", __func__, inf.len);
+		TLOGE("%s: invalid response length (%zu)\n", __func__, inf.len);
 		put_msg(session, inf.id);
 		return ERR_NOT_VALID;
 	}
@@ -346,7 +355,7 @@ int sync_ipc_send_msg(handle_t session, iovec_t *tx_iovecs, size_t tx_iovec_coun
 	}
 
 	if (resp_size < inf.len) {
-		TLOGE("%s: response buffer too short (%d < %d) \n", __func__,
+		TLOGE("%s: response buffer too short (%zu < %zu) \n", __func__,
 		      resp_size, inf.len);
 		put_msg(session, inf.id);
 		return ERR_BAD_LEN;
@@ -362,7 +371,7 @@ int sync_ipc_send_msg(handle_t session, iovec_t *tx_iovecs, size_t tx_iovec_coun
 	size_t read_len = (size_t) rc;
 	if (read_len != inf.len) {
 		// data read in does not match message length
-		TLOGE("%s: invalid response length (%d)\n", __func__, read_len);
+		TLOGE("%s: invalid response length (%zu)\n", __func__, read_len);
 		return ERR_IO;
 	}
 
@@ -428,6 +437,75 @@ int ipc_port_destroy(struct ipc_port_context *ctx)
 	return NO_ERROR;
 }
 
+static int64_t ipc_now_ns(void)
+{
+	int64_t now;
+
+	gettime(0, 0, &now);
+	return now;
+}
+
+/**
+ * ipc_defer - run a handler once all pending events have been handled
+ * @deferred:     deferred work object
+ * @handler:      function to call
+ * @max_delay_ms: maximum time to wait for the event queue to drain
+ *
+ * @handler runs from ipc_loop when there are no more pending events, or after
+ * an event has been handled if @max_delay_ms has passed. If @deferred is
+ * already pending, its original deadline is kept.
+ */
+void ipc_defer(struct ipc_deferred *deferred, ipc_deferred_handler_t handler,
+               uint32_t max_delay_ms)
+{
+	assert(handler);
+
+	deferred->handler = handler;
+	if (list_in_list(&deferred->node)) {
+		return;
+	}
+	deferred->deadline = ipc_now_ns() + (int64_t)max_delay_ms * 1000000;
+	list_add_tail(&deferred_list, &deferred->node);
+}
+
+/**
+ * ipc_defer_cancel - cancel deferred work
+ * @deferred: deferred work object passed to ipc_defer
+ */
+void ipc_defer_cancel(struct ipc_deferred *deferred)
+{
+	if (list_in_list(&deferred->node)) {
+		list_delete(&deferred->node);
+	}
+}
+
+/**
+ * run_deferred - run deferred work
+ * @idle: %true if there are no pending events, %false to only run deferred
+ *        work that has reached its deadline
+ */
+static void run_deferred(bool idle)
+{
+	int64_t now = ipc_now_ns();
+	struct ipc_deferred *deferred;
+	struct ipc_deferred *tmp;
+	struct list_node ready = LIST_INITIAL_VALUE(ready);
+
+	list_for_every_entry_safe(&deferred_list, deferred, tmp,
+	                          struct ipc_deferred, node) {
+		if (idle || deferred->deadline <= now) {
+			list_delete(&deferred->node);
+			list_add_tail(&ready, &deferred->node);
+		}
+	}
+
+	/* handlers may defer or cancel work, including entries in ready */
+	while ((deferred = list_remove_head_type(&ready, struct ipc_deferred,
+	                                         node))) {
+		deferred->handler(deferred);
+	}
+}
+
 void ipc_loop(void)
 {
 	int rc;
@@ -437,7 +515,16 @@ void ipc_loop(void)
 		event.handle = INVALID_IPC_HANDLE;
 		event.event = 0;
 		event.cookie = NULL;
-		rc = wait_any(&event, -1);
+		/* don't block while there is deferred work */
+		rc = wait_any(&event, list_is_empty(&deferred_list) ? -1 : 0);
+		if (rc == ERR_TIMED_OUT) {
+			run_deferred(true);
+			continue;
+		}
+		if (rc == ERR_CANCELLED) {
+			/* the event loop is being shut down, see ipc_sim_shutdown */
+			break;
+		}
 		if (rc < 0) {
 			TLOGE("wait_any failed (%d)\n", rc);
 			break;
@@ -446,6 +533,9 @@ void ipc_loop(void)
 		if (rc == NO_ERROR) { /* got an event */
 			dispatch_event(&event);
 		}
+		if (!list_is_empty(&deferred_list)) {
+			run_deferred(false);
+		}
 	}
 }
 
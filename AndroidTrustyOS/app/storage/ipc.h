@@ -16,6 +16,8 @@
 
 #pragma once
 
+#include <list.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #include <trusty_ipc.h>
@@ -58,6 +60,18 @@ typedef int (*ipc_msg_handler_t)(struct ipc_channel_context *context,
  */
 typedef void (*ipc_disconnect_handler_t)(struct ipc_channel_context *context);
 
+/**
+ * ipc_send_unblocked_handler_t - handler for send unblocked events
+ * @context: the channel context returned from ipc_connect_handler_t
+ *
+ * Called when a message can be sent on a channel after send_msg returned
+ * ERR_NOT_ENOUGH_BUFFER.
+ *
+ * Returns NO_ERROR on success, error code < 0 on failure.
+ * In case of error, the channel is disconnected.
+ */
+typedef int (*ipc_send_unblocked_handler_t)(struct ipc_channel_context *context);
+
 typedef void (*ipc_evt_handler_t) (struct ipc_context *context, const struct uevent *ev);
 
 /**
@@ -70,12 +84,35 @@ struct ipc_port_ops {
 
 /**
  * ipc_channel_ops
- * @on_handle_msg: optional msg handler
- * @on_disconnect: required disconnect handler
+ * @on_handle_msg:      optional msg handler
+ * @on_disconnect:      required disconnect handler
+ * @on_send_unblocked:  optional send unblocked handler
  */
 struct ipc_channel_ops {
 	ipc_msg_handler_t            on_handle_msg;
 	ipc_disconnect_handler_t     on_disconnect;
+	ipc_send_unblocked_handler_t on_send_unblocked;
+};
+
+struct ipc_deferred;
+
+/**
+ * ipc_deferred_handler_t - handler for deferred work
+ * @deferred: the deferred work object passed to ipc_defer
+ */
+typedef void (*ipc_deferred_handler_t)(struct ipc_deferred *deferred);
+
+/**
+ * ipc_deferred - work to run once pending events have been handled
+ * @node:     list node, used internally
+ * @deadline: time (in ns) after which @handler runs even if more events are
+ *            pending, used internally
+ * @handler:  function to call
+ */
+struct ipc_deferred {
+	struct list_node node;
+	int64_t deadline;
+	ipc_deferred_handler_t handler;
 };
 
 struct ipc_context {
@@ -107,5 +144,8 @@ int sync_ipc_send_msg(handle_t session, iovec_t *tx_iovecs, uint tx_iovec_count,
 int ipc_port_create(struct ipc_port_context *contextp, const char *port_name,
                     size_t queue_size, size_t max_buffer_size, uint32_t flags);
 int ipc_port_destroy(struct ipc_port_context *context);
+void ipc_defer(struct ipc_deferred *deferred, ipc_deferred_handler_t handler,
+               uint32_t max_delay_ms);
+void ipc_defer_cancel(struct ipc_deferred *deferred);
 void ipc_loop(void);
 
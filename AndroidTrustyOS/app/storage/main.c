@@ -19,6 +19,7 @@
 #include <interface/storage/storage.h>
 
 #include "block_cache.h"
+#include "block_device_tipc.h"
 #include "ipc.h"
 #include "proxy.h"
 #include "tipc_limits.h"
@@ -35,7 +36,8 @@ int main(void)
 
 	block_cache_init();
 
-	int rc = ipc_port_create(&ctx, STORAGE_DISK_PROXY_PORT, 1, STORAGE_MAX_BUFFER_SIZE,
+	int rc = ipc_port_create(&ctx, STORAGE_DISK_PROXY_PORT, 1,
+				 BLOCK_DEVICE_TIPC_NS_MAX_IO_SIZE,
 				 IPC_PORT_ALLOW_TA_CONNECT | IPC_PORT_ALLOW_NS_CONNECT);
 
 	if (rc < 0) {
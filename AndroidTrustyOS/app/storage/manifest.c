@@ -17,6 +17,7 @@
 #include <trusty_app_manifest.h>
 
 #include "block_cache_priv.h"
+#include "block_device_tipc.h"
 
 trusty_app_manifest_t TRUSTY_APP_MANIFEST_ATTRS trusty_app_manifest =
 {
@@ -26,6 +27,8 @@ trusty_app_manifest_t TRUSTY_APP_MANIFEST_ATTRS trusty_app_manifest =
     },
     {
         TRUSTY_APP_CONFIG_MIN_STACK_SIZE(4 * 4096),
-        TRUSTY_APP_CONFIG_MIN_HEAP_SIZE(8 * 4096 + BLOCK_CACHE_SIZE_BYTES),
+        TRUSTY_APP_CONFIG_MIN_HEAP_SIZE(8 * 4096 + BLOCK_CACHE_SIZE_BYTES +
+                                        BLOCK_CACHE_GROWTH_BYTES +
+                                        2 * BLOCK_DEVICE_TIPC_NS_MAX_IO_SIZE),
     },
 };
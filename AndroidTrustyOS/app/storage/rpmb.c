@@ -65,6 +65,7 @@ struct rpmb_packet {
     struct rpmb_u16      result;
     struct rpmb_u16      req_resp;
 };
+STATIC_ASSERT(sizeof(struct rpmb_packet) == RPMB_PACKET_SIZE);
 
 enum rpmb_request {
     RPMB_REQ_PROGRAM_KEY                = 0x0001,
@@ -94,10 +95,19 @@ enum rpmb_result {
     RPMB_RES_WRITE_COUNTER_EXPIRED      = 0x0080,
 };
 
+/**
+ * struct rpmb_state - RPMB device state
+ * @key:                    Authentication key.
+ * @mmc_handle:             Handle passed to rpmb_send.
+ * @write_counter:          Write counter value expected by the next write.
+ * @write_counter_valid:    %true if @write_counter matches the device,
+ *                          %false if it needs to be read from the device.
+ */
 struct rpmb_state {
     struct rpmb_key     key;
     void                *mmc_handle;
     uint32_t            write_counter;
+    bool                write_counter_valid;
 };
 
 static struct rpmb_u16 rpmb_u16(uint16_t val)
@@ -370,7 +380,7 @@ static int rpmb_write_data(struct rpmb_state *state, const char *buf, uint16_t a
     int i;
     int ret;
     struct rpmb_key mac;
-    struct rpmb_packet cmd[count];
+    struct rpmb_packet cmd[RPMB_MAX_WRITE_COUNT];
     struct rpmb_packet rescmd = {
         .req_resp = rpmb_u16(RPMB_REQ_RESULT_READ),
     };
@@ -390,9 +400,12 @@ static int rpmb_write_data(struct rpmb_state *state, const char *buf, uint16_t a
     if (ret < 0)
         return ret;
 
-    ret = rpmb_send(state->mmc_handle, cmd, sizeof(cmd), &rescmd, sizeof(rescmd), &res, sizeof(res), sync);
-    if (ret < 0)
+    ret = rpmb_send(state->mmc_handle, cmd, count * sizeof(cmd[0]), &rescmd, sizeof(rescmd), &res, sizeof(res), sync);
+    if (ret < 0) {
+        /* write may or may not have reached the device */
+        state->write_counter_valid = false;
         return ret;
+    }
 
     ret = rpmb_mac(state->key, &res, 1, &mac);
     if (ret < 0)
@@ -409,32 +422,83 @@ static int rpmb_write_data(struct rpmb_state *state, const char *buf, uint16_t a
     ret = rpmb_check_response("write data", RPMB_RESP_DATA_WRITE,
                               &res, 1, &mac, NULL, &addr);
     if (ret < 0) {
-        if (rpmb_get_u16(res.result) == RPMB_RES_COUNT_FAILURE)
-            state->write_counter = 0; /* clear counter to trigger a re-read */
+        if (rpmb_get_u16(res.result) == RPMB_RES_COUNT_FAILURE) {
+            state->write_counter_valid = false;
+            return -EAGAIN;
+        }
         return ret;
     }
 
+    if (rpmb_get_u32(res.write_counter) != state->write_counter + 1) {
+        fprintf(stderr, "write data: Bad write counter, got %u, expected %u\n",
+                rpmb_get_u32(res.write_counter), state->write_counter + 1);
+        state->write_counter_valid = false;
+        return -1;
+    }
     state->write_counter++;
 
     return 0;
 }
 
+/**
+ * rpmb_sync_counter - Read write counter from device if needed
+ * @state:      RPMB state.
+ *
+ * Return: 0 on success, < 0 on error.
+ */
+static int rpmb_sync_counter(struct rpmb_state *state)
+{
+    int ret;
+
+    if (state->write_counter_valid)
+        return 0;
+
+    ret = rpmb_read_counter(state, &state->write_counter);
+    if (ret < 0)
+        return ret;
+
+    state->write_counter_valid = true;
+
+    return 0;
+}
+
+/**
+ * rpmb_write - Write blocks with a single authenticated request
+ * @state:      RPMB state.
+ * @buf:        Data to write, @count * RPMB_BUF_SIZE bytes.
+ * @addr:       First RPMB block to write.
+ * @count:      Number of RPMB blocks to write. Must not exceed the reliable
+ *              write size of the device, %RPMB_MAX_WRITE_COUNT.
+ * @sync:       Ask the proxy to sync before and after the write.
+ *
+ * The write counter is read from the device before the first write and then
+ * tracked locally. If the device reports a counter mismatch, the counter is
+ * read again and the write is retried once.
+ *
+ * Return: 0 on success, < 0 on error.
+ */
 int rpmb_write(struct rpmb_state *state, const void *buf, uint16_t addr, uint16_t count, bool sync)
 {
     int ret;
 
-    if (!state)
+    if (!state || !count || count > RPMB_MAX_WRITE_COUNT)
         return -EINVAL;
 
-    if (!state->write_counter) {
-        ret = rpmb_read_counter(state, &state->write_counter);
-        if (ret < 0)
-            return ret;
-    }
+    ret = rpmb_sync_counter(state);
+    if (ret < 0)
+        return ret;
+
+    ret = rpmb_write_data(state, buf, addr, count, sync);
+    if (ret != -EAGAIN)
+        return ret;
+
+    ret = rpmb_sync_counter(state);
+    if (ret < 0)
+        return ret;
+
     return rpmb_write_data(state, buf, addr, count, sync);
 }
 
-
 int rpmb_init(struct rpmb_state **statep,
               void *mmc_handle,
               const struct rpmb_key *key)
@@ -447,6 +511,7 @@ int rpmb_init(struct rpmb_state **statep,
     state->mmc_handle = mmc_handle;
     state->key = *key;
     state->write_counter = 0;
+    state->write_counter_valid = false;
 
     *statep = state;
 
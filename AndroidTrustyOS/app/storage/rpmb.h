@@ -24,6 +24,15 @@ struct rpmb_key {
 struct rpmb_state;
 
 #define RPMB_BUF_SIZE 256
+#define RPMB_PACKET_SIZE 512 /* frame size, including RPMB_BUF_SIZE data */
+
+#ifdef APP_STORAGE_RPMB_REL_WR_SEC_C
+#define RPMB_REL_WR_SEC_C (APP_STORAGE_RPMB_REL_WR_SEC_C)
+#else
+#define RPMB_REL_WR_SEC_C (1) /* EXT_CSD REL_WR_SEC_C, in 512 byte sectors */
+#endif
+
+#define RPMB_MAX_WRITE_COUNT (RPMB_REL_WR_SEC_C * 2) /* in RPMB_BUF_SIZE blocks */
 
 /* provides */
 int rpmb_init(struct rpmb_state **statep,
@@ -31,7 +40,7 @@ int rpmb_init(struct rpmb_state **statep,
               const struct rpmb_key *key);
 void rpmb_uninit(struct rpmb_state *statep);
 int rpmb_read(struct rpmb_state *state, void *buf, uint16_t addr, uint16_t count);
-int rpmb_write(struct rpmb_state *state, const void *buf, uint16_t addr, uint16_t count, bool sync); /* count must be 1 or 2, addr must be aligned */
+int rpmb_write(struct rpmb_state *state, const void *buf, uint16_t addr, uint16_t count, bool sync); /* count must not exceed RPMB_MAX_WRITE_COUNT, addr must be aligned */
 
 /* needs */
 int rpmb_send(void *mmc_handle,
@@ -27,6 +27,7 @@ MODULE_SRCS := \
 	$(LOCAL_DIR)/block_tree.c \
 	$(LOCAL_DIR)/client_tipc.c \
 	$(LOCAL_DIR)/crypt.c \
+	$(LOCAL_DIR)/debug_stats.c \
 	$(LOCAL_DIR)/file.c \
 	$(LOCAL_DIR)/ipc.c \
 	$(LOCAL_DIR)/main.c \
@@ -39,7 +39,8 @@
 #define SUPER_BLOCK_MAGIC (0x0073797473757274) /* trustys */
 #define SUPER_BLOCK_FLAGS_VERSION_MASK (0x3)
 #define SUPER_BLOCK_FLAGS_BLOCK_INDEX_MASK (0x1)
-#define SUPER_BLOCK_FS_VERSION (0)
+#define SUPER_BLOCK_FS_VERSION (1)
+#define SUPER_BLOCK_FS_VERSION_KEYED_PATH_HASH (1) /* first version using keyed_hash */
 
 /**
  * struct super_block - On-disk root block for file system state
@@ -48,7 +49,10 @@
  * @flags:          Version in bottom two bits, other bits are reserved.
  * @fs_version:     Required file system version. If greater than
  *                  %SUPER_BLOCK_FS_VERSION, do not mount or overwrite
- *                  filesystem.
+ *                  filesystem. File systems created with version
+ *                  %SUPER_BLOCK_FS_VERSION_KEYED_PATH_HASH or later use
+ *                  keyed_hash for file paths, older file systems keep using
+ *                  str_hash.
  * @block_size:     Block size of file system.
  * @block_num_size: Number of bytes used to store block numbers.
  * @mac_size:       number of bytes used to store mac values.
@@ -125,7 +129,7 @@ bool update_super_block(struct transaction *tr,
     }
     super_rw->magic = SUPER_BLOCK_MAGIC;
     super_rw->flags = ver;
-    super_rw->fs_version = SUPER_BLOCK_FS_VERSION; /* TODO: keep existing fs version when possible */
+    super_rw->fs_version = tr->fs->fs_version;
     super_rw->block_size = tr->fs->dev->block_size;
     super_rw->block_num_size = tr->fs->block_num_size;
     super_rw->mac_size = tr->fs->mac_size;
@@ -286,10 +290,14 @@ static int fs_init_from_super(struct fs *fs,
     if(super) {
         fs->block_num_size = super->block_num_size;
         fs->mac_size = super->mac_size;
+        fs->fs_version = super->fs_version;
     } else {
         fs->block_num_size = fs->dev->block_num_size;
         fs->mac_size = fs->dev->mac_size;
+        fs->fs_version = SUPER_BLOCK_FS_VERSION;
     }
+    fs->keyed_path_hash =
+            fs->fs_version >= SUPER_BLOCK_FS_VERSION_KEYED_PATH_HASH;
     block_mac_size = fs->block_num_size + fs->mac_size;
     block_set_init(fs, &fs->free);
     fs->free.block_tree.copy_on_write = true;
@@ -399,11 +407,20 @@ int fs_init(struct fs *fs,
         return -1; //ERR_NOT_VALID?
     }
 
+    if (derive_hash_key(key, &fs->path_hash_key, "trusty storage path hash")) {
+        pr_err("failed to derive path hash key\n");
+        return -1;
+    }
+
     fs->key = key;
     fs->dev = dev;
     fs->super_dev = super_dev;
     list_initialize(&fs->transactions);
+    list_initialize(&fs->snapshots);
     list_initialize(&fs->allocated);
+    fs->committed_free = NULL;
+    memset(&fs->path_cache, 0, sizeof(fs->path_cache));
+    fs->range_search_start = 0;
 
     if (dev == super_dev) {
         fs->min_block_num = 2;
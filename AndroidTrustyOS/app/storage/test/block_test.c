@@ -101,6 +101,10 @@ static const struct key key;
 static bool print_test_verbose = false;
 static bool print_block_tree_test_verbose = false;
 
+static data_block_t block_test_last_write;
+static uint block_test_write_count;
+static uint block_test_write_descending;
+
 static void block_test_start_read(struct block_device *dev, data_block_t block)
 {
     assert(dev->block_size <= BLOCK_SIZE);
@@ -114,6 +118,11 @@ static void block_test_start_write(struct block_device *dev, data_block_t block,
     assert(block < countof(blocks));
     assert(data_size <= sizeof(blocks[block].data));
     memcpy(blocks[block].data, data, data_size);
+    if (block < block_test_last_write) {
+        block_test_write_descending++;
+    }
+    block_test_last_write = block;
+    block_test_write_count++;
     block_cache_complete_write(dev, block, false);
 }
 
@@ -171,10 +180,6 @@ static void mark_block_tree_in_use(struct transaction *tr,
 
 static void mark_files_in_use(struct transaction *tr)
 {
-    void file_block_map_init(struct transaction *tr,
-                             struct block_map *block_map,
-                             const struct block_mac *file);
-
     struct block_tree_path path;
     struct block_map block_map;
 
@@ -463,6 +468,42 @@ static void block_set_test(struct transaction *tr)
     }
 }
 
+static void block_set_iter_test(struct transaction *tr)
+{
+    struct block_set set;
+    struct block_set_iter iter;
+    struct block_range range;
+    struct block_range expected;
+    data_block_t next_block;
+    int i;
+
+    block_set_init(tr->fs, &set);
+    for (i = 0; i < 60; i++) {
+        block_set_add_block(tr, &set, 10 + i * 3);
+        block_set_add_block(tr, &set, 11 + i * 3);
+    }
+
+    block_set_iter_init(&iter, &set);
+    next_block = 1;
+    for (i = 0; ; i++) {
+        if (i == 50) {
+            /* merge two ranges in front of the iterator */
+            block_set_add_block(tr, &set, (next_block / 3 + 2) * 3);
+        }
+        range = block_set_iter_next_range(tr, &iter, next_block);
+        expected = block_set_find_next_range(tr, &set, next_block);
+        assert(range.start == expected.start);
+        assert(range.end == expected.end);
+        if (block_range_empty(range)) {
+            break;
+        }
+        /* also check ranges that start before min_block */
+        next_block = (i & 1) ? range.end : range.start + 1;
+    }
+    assert(!tr->failed);
+    assert(i > 60);
+}
+
 static void block_tree_allocate_all_test(struct transaction *tr)
 {
     uint i;
@@ -1357,6 +1398,338 @@ static void file_create2_read_after_commit_test(struct transaction *tr)
     }
 }
 
+static void file_read_ahead_test(struct transaction *tr)
+{
+    int i;
+    const int *block_data_ro;
+    obj_ref_t ref = OBJ_REF_INITIAL_VALUE(ref);
+    struct file_handle file;
+    struct block_cache_prefetch_stats start;
+    struct block_cache_prefetch_stats end;
+
+    file_test(tr, "test1", FILE_OPEN_CREATE_EXCLUSIVE, file_test_block_count, 0, 0, false, 2);
+    transaction_complete(tr);
+    assert(!tr->failed);
+    transaction_activate(tr);
+
+    /* push most of test1 out of the cache */
+    file_test(tr, "test2", FILE_OPEN_CREATE_EXCLUSIVE, file_test_block_count, 0, 0, false, 3);
+    transaction_complete(tr);
+    assert(!tr->failed);
+    transaction_activate(tr);
+
+    block_cache_get_prefetch_stats(&start);
+    open_test_file(tr, &file, "test1", FILE_OPEN_NO_CREATE);
+    for (i = 0; i < file_test_block_count; i++) {
+        if (!(i % 2)) {
+            file_read_ahead(tr, &file, i, 2);
+        }
+        block_data_ro = file_get_block(tr, &file, i, &ref);
+        assert(block_data_ro);
+        block_data_ro = (void *)block_data_ro + sizeof(struct iv);
+        assert(block_data_ro[0] == i);
+        assert(block_data_ro[1] == ~i);
+        assert(block_data_ro[2] == 2);
+        assert(block_data_ro[3] == ~2);
+        file_block_put((void *)block_data_ro - sizeof(struct iv), &ref);
+    }
+    file_close(&file);
+    block_cache_get_prefetch_stats(&end);
+
+    if (print_test_verbose) {
+        printf("%s: prefetch issued %lld, hits %lld, wasted %lld\n", __func__,
+               (long long)(end.issued - start.issued),
+               (long long)(end.hits - start.hits),
+               (long long)(end.wasted - start.wasted));
+    }
+    /* test1 was evicted, so the sequential read must prefetch and use it */
+    assert(end.issued - start.issued > 0);
+    assert(end.hits - start.hits > 0);
+
+    /* Every prefetched block is within the file, so all must be used or evicted */
+    assert(end.issued - start.issued ==
+           (end.hits - start.hits) + (end.wasted - start.wasted));
+
+    /* the window is tunable, and 0 only prefetches the requested blocks */
+    assert(!file_set_read_ahead_blocks(FILE_READ_AHEAD_MAX_WINDOW + 1));
+    assert(file_set_read_ahead_blocks(0));
+    open_test_file(tr, &file, "test1", FILE_OPEN_NO_CREATE);
+    file_read_ahead(tr, &file, 0, 2);
+    file_read_ahead(tr, &file, 2, 2);
+    assert(file.read_ahead_end == 4);
+    file_close(&file);
+    assert(file_set_read_ahead_blocks(FILE_READ_AHEAD_BLOCKS));
+
+    file_test(tr, "test1", FILE_OPEN_NO_CREATE, 0, 0, file_test_block_count, true, 2);
+    file_test(tr, "test2", FILE_OPEN_NO_CREATE, 0, 0, file_test_block_count, true, 3);
+}
+
+static void file_contiguous_test(struct transaction *tr)
+{
+    int i;
+    size_t count;
+    int contiguous = 0;
+    data_block_t block;
+    data_block_t prev_block;
+    struct file_handle file;
+    struct block_map block_map;
+    struct block_mac block_mac;
+    struct block_mac block_macs[file_test_block_count + 1];
+
+    file_test(tr, "test1", FILE_OPEN_CREATE_EXCLUSIVE, file_test_block_count, 0, 0, false, 2);
+    transaction_complete(tr);
+    assert(!tr->failed);
+    transaction_activate(tr);
+
+    open_test_file(tr, &file, "test1", FILE_OPEN_NO_CREATE);
+    file_block_map_init(tr, &block_map, &file.block_mac);
+
+    /* a single range lookup should match per-block lookups and stop at eof */
+    count = block_map_get_range(tr, &block_map, 0, block_macs,
+                                countof(block_macs));
+    assert(count == file_test_block_count);
+    for (i = 0; i < file_test_block_count; i++) {
+        assert(block_map_get(tr, &block_map, i, &block_mac));
+        assert(block_mac_eq(tr, &block_mac, &block_macs[i]));
+        if (!i) {
+            continue;
+        }
+        /*
+         * File data is allocated in file order from the lowest free blocks,
+         * so a gap between two data blocks may only hold blocks that the
+         * block map or file entry is using.
+         */
+        block = block_mac_to_block(tr, &block_macs[i]);
+        prev_block = block_mac_to_block(tr, &block_macs[i - 1]);
+        assert(block > prev_block);
+        assert(block_set_range_not_in_set(tr, &tr->fs->free,
+                                          (struct block_range){
+                                              prev_block + 1, block}));
+        if (block == prev_block + 1) {
+            contiguous++;
+        }
+    }
+    count = block_map_get_range(tr, &block_map, file_test_block_count - 1,
+                                block_macs, countof(block_macs));
+    assert(count == 1);
+    file_close(&file);
+
+    if (print_test_verbose) {
+        printf("%s: %d of %d blocks follow the previous block\n", __func__,
+               contiguous, file_test_block_count - 1);
+    }
+    file_test(tr, "test1", FILE_OPEN_NO_CREATE, 0, 0, file_test_block_count, true, 2);
+}
+
+/**
+ * file_extent_count - Count contiguous disk block runs used by file data
+ * @tr:         Transaction object.
+ * @file:       File handle object.
+ * @count:      Number of file blocks to check.
+ *
+ * Return: Number of runs of contiguous disk blocks backing the first @count
+ * blocks of @file.
+ */
+static int file_extent_count(struct transaction *tr, struct file_handle *file,
+                             size_t count)
+{
+    size_t i;
+    int extents = 0;
+    struct block_map block_map;
+    struct block_mac block_macs[count];
+
+    file_block_map_init(tr, &block_map, &file->block_mac);
+    assert(block_map_get_range(tr, &block_map, 0, block_macs, count) == count);
+    for (i = 0; i < count; i++) {
+        if (!i || block_mac_to_block(tr, &block_macs[i]) !=
+                  block_mac_to_block(tr, &block_macs[i - 1]) + 1) {
+            extents++;
+        }
+    }
+    return extents;
+}
+
+/**
+ * file_allocate_range_write - Write a new file and report its layout
+ * @tr:         Transaction object.
+ * @count:      Number of file blocks to write.
+ * @reserve:    %true to allocate all blocks up front with file_reserve_blocks,
+ *              %false to allocate each block as it is written.
+ *
+ * Write @count blocks to a new file, print the time spent and the number of
+ * extents the file data ended up in, then discard the transaction.
+ *
+ * Return: Number of extents.
+ */
+static int file_allocate_range_write(struct transaction *tr, size_t count,
+                                     bool reserve)
+{
+    size_t i;
+    int extents;
+    int64_t start;
+    int64_t end;
+    void *data;
+    obj_ref_t ref = OBJ_REF_INITIAL_VALUE(ref);
+    struct file_handle file;
+
+    open_test_file(tr, &file, "test1", FILE_OPEN_CREATE_EXCLUSIVE);
+
+    gettime(0, 0, &start);
+    if (reserve) {
+        file_reserve_blocks(tr, &file, 0, count);
+    }
+    for (i = 0; i < count; i++) {
+        data = file_get_block_write(tr, &file, i, false, &ref);
+        assert(data);
+        memset(data, i, get_file_block_size(tr->fs));
+        file_block_put_dirty(tr, &file, i, data, &ref);
+    }
+    file_release_blocks(tr, &file);
+    gettime(0, 0, &end);
+    assert(!tr->failed);
+
+    extents = file_extent_count(tr, &file, count);
+    printf("%s: %s: %zd blocks in %lld us, %d extents\n", __func__,
+           reserve ? "range" : "per block", count,
+           (long long)((end - start) / 1000), extents);
+
+    file_close(&file);
+    transaction_fail(tr);
+    transaction_activate(tr);
+
+    return extents;
+}
+
+/**
+ * file_allocate_range_test - Compare per-block and range allocation
+ * @tr:         Transaction object.
+ *
+ * Fragment the free set by deleting every other file in a set of small files,
+ * then write a file with and without reserving its blocks up front.
+ */
+static void file_allocate_range_test(struct transaction *tr)
+{
+    const int frag_file_count = 24;
+    const size_t count = 16;
+    char path[10];
+    int i;
+    int extents;
+    int range_extents;
+    struct block_range range;
+    struct block_allocator_free_stats stats;
+
+    for (i = 0; i < frag_file_count; i++) {
+        snprintf(path, sizeof(path), "frag%d", i);
+        file_test(tr, path, FILE_OPEN_CREATE_EXCLUSIVE, 1, 0, 0, false, i);
+    }
+    transaction_complete(tr);
+    assert(!tr->failed);
+    transaction_activate(tr);
+    for (i = 0; i < frag_file_count; i += 2) {
+        snprintf(path, sizeof(path), "frag%d", i);
+        file_test(tr, path, FILE_OPEN_NO_CREATE, 0, 1, 1, true, i);
+    }
+    transaction_complete(tr);
+    assert(!tr->failed);
+    transaction_activate(tr);
+
+    block_allocator_get_free_stats(tr, &stats);
+    printf("%s: %lld free blocks in %lld ranges, largest %lld\n", __func__,
+           stats.free_blocks, stats.free_ranges, stats.largest_free_range);
+    assert(stats.free_ranges > 1);
+    assert(stats.largest_free_range >= count);
+
+    /* blocks in an allocated range are freed one at a time like others */
+    range = block_allocate_range(tr, 2);
+    assert(range.end - range.start == 2);
+    for (i = range.start; i < range.end; i++) {
+        block_free(tr, i);
+    }
+    assert(!tr->failed);
+
+    /* a request no free range can hold gets a partial range, not a failure */
+    range = block_allocate_range(tr, stats.largest_free_range + 1);
+    assert(!block_range_empty(range));
+    assert(range.end - range.start <= stats.largest_free_range);
+    for (i = range.start; i < range.end; i++) {
+        block_free(tr, i);
+    }
+    assert(!tr->failed);
+
+    extents = file_allocate_range_write(tr, count, false);
+    range_extents = file_allocate_range_write(tr, count, true);
+    assert(range_extents == 1);
+    assert(range_extents <= extents);
+
+    for (i = 1; i < frag_file_count; i += 2) {
+        snprintf(path, sizeof(path), "frag%d", i);
+        file_test(tr, path, FILE_OPEN_NO_CREATE, 0, 1, 1, true, i);
+    }
+}
+
+/**
+ * file_merge_free_walk_test - Check tree walks in transaction_merge_free_sets
+ * @tr:         Transaction object.
+ *
+ * Free every other block of a set of small files in one transaction, so the
+ * commit merges many separate freed ranges into the free set. Each range step
+ * used to walk the freed and allocated sets from the root. The set iterators
+ * should continue from their saved path for most steps instead.
+ */
+static void file_merge_free_walk_test(struct transaction *tr)
+{
+    const int file_count = 32;
+    char path[10];
+    int i;
+    uint64_t walks;
+    uint64_t reuses;
+    uint64_t tree_walks;
+    struct stats_timer tree_walk_start;
+    struct stats_timer tree_walk_end;
+    struct stats_timer walk_start;
+    struct stats_timer walk_end;
+    struct stats_timer reuse_start;
+    struct stats_timer reuse_end;
+
+    for (i = 0; i < file_count; i++) {
+        snprintf(path, sizeof(path), "merge%d", i);
+        file_test(tr, path, FILE_OPEN_CREATE_EXCLUSIVE, 1, 0, 0, false, i);
+    }
+    transaction_complete(tr);
+    assert(!tr->failed);
+    transaction_activate(tr);
+
+    for (i = 0; i < file_count; i += 2) {
+        snprintf(path, sizeof(path), "merge%d", i);
+        file_test(tr, path, FILE_OPEN_NO_CREATE, 0, 1, 1, true, i);
+    }
+    stats_timer_get(STATS_TREE_WALK, &tree_walk_start);
+    stats_timer_get(STATS_SET_ITER_WALK, &walk_start);
+    stats_timer_get(STATS_SET_ITER_REUSE, &reuse_start);
+    transaction_complete(tr);
+    assert(!tr->failed);
+    stats_timer_get(STATS_TREE_WALK, &tree_walk_end);
+    stats_timer_get(STATS_SET_ITER_WALK, &walk_end);
+    stats_timer_get(STATS_SET_ITER_REUSE, &reuse_end);
+    transaction_activate(tr);
+
+    tree_walks = tree_walk_end.count - tree_walk_start.count;
+    walks = walk_end.count - walk_start.count;
+    reuses = reuse_end.count - reuse_start.count;
+    printf("%s: %llu of %llu set iterator steps walked the tree\n", __func__,
+           (unsigned long long)walks, (unsigned long long)(walks + reuses));
+    printf("%s: commit walked the tree %llu times, %llu without set iterators\n",
+           __func__, (unsigned long long)tree_walks,
+           (unsigned long long)(tree_walks + reuses));
+    assert(walks + reuses >= file_count);
+    /* without the iterators, every step would walk the tree */
+    assert(walks * 4 <= walks + reuses);
+
+    for (i = 1; i < file_count; i += 2) {
+        snprintf(path, sizeof(path), "merge%d", i);
+        file_test(tr, path, FILE_OPEN_NO_CREATE, 0, 1, 1, true, i);
+    }
+}
 
 static void file_create3_conflict_test(struct transaction *tr)
 {
@@ -1389,6 +1762,51 @@ static void file_create3_conflict_test(struct transaction *tr)
     transaction_free(&tr3);
 }
 
+static void file_create3_group_conflict_test(struct transaction *tr)
+{
+    struct transaction tr1;
+    struct transaction tr2;
+    struct transaction tr3;
+    struct transaction *group[3] = { &tr1, &tr2, &tr3 };
+    struct transaction_group_stats start;
+    struct transaction_group_stats end;
+    uint super_block_version = tr->fs->super_block_version;
+
+    transaction_init(&tr1, tr->fs, true);
+    transaction_init(&tr2, tr->fs, true);
+    transaction_init(&tr3, tr->fs, true);
+
+    file_test(&tr1, "test1", FILE_OPEN_CREATE_EXCLUSIVE, 1, 0, 0, false, 4);
+    file_test(&tr2, "test1", FILE_OPEN_CREATE_EXCLUSIVE, 1, 0, 0, false, 5);
+    file_test(&tr3, "test2", FILE_OPEN_CREATE_EXCLUSIVE, 1, 0, 0, false, 6);
+
+    assert(!tr1.failed);
+    assert(!tr2.failed);
+    assert(!tr3.failed);
+    transaction_get_group_stats(&start);
+    transaction_complete_group(group, countof(group));
+    transaction_get_group_stats(&end);
+    assert(!tr1.failed);
+    assert(tr2.failed);
+    assert(!tr3.failed);
+    assert(tr1.complete);
+    assert(tr3.complete);
+
+    /* tr1 and tr3 should share a single super block update */
+    assert(tr->fs->super_block_version != super_block_version);
+    assert(end.commits - start.commits == 1);
+    assert(end.transactions - start.transactions == 2);
+    assert(end.failed - start.failed == 1);
+    assert(end.max_group_size >= 2);
+
+    file_test(tr, "test1", FILE_OPEN_NO_CREATE, 0, 1, 1, true, 4);
+    file_test(tr, "test2", FILE_OPEN_NO_CREATE, 0, 1, 1, true, 6);
+
+    transaction_free(&tr1);
+    transaction_free(&tr2);
+    transaction_free(&tr3);
+}
+
 static void file_create_delete_2_transaction_test(struct transaction *tr)
 {
     struct transaction tr1;
@@ -1476,6 +1894,217 @@ static void file_allocate_leave_10_test(struct transaction *tr)
     file_allocate_all_test(tr, 1, 1, 10, "test1", FILE_OPEN_CREATE);
 }
 
+static void keyed_hash_test(struct transaction *tr)
+{
+    int i;
+    uint8_t data[15];
+    struct hash_key key;
+
+    /* SipHash-2-4 reference vectors */
+    for (i = 0; i < sizeof(key.byte); i++) {
+        key.byte[i] = i;
+    }
+    for (i = 0; i < sizeof(data); i++) {
+        data[i] = i;
+    }
+    assert(keyed_hash(&key, data, 0) == 0x726fdb47dd0e0e31ULL);
+    assert(keyed_hash(&key, data, 7) == 0xab0200f58b01d137ULL);
+    assert(keyed_hash(&key, data, 8) == 0x93f5f5799a932462ULL);
+    assert(keyed_hash(&key, data, 15) == 0xa129ca6149be45e5ULL);
+
+    assert(tr->fs->keyed_path_hash);
+}
+
+static void file_path_cache_test(struct transaction *tr)
+{
+    struct file_handle file;
+    struct file_path_cache *cache = &tr->fs->path_cache;
+    uint64_t hits;
+    uint64_t lookups;
+    bool deleted;
+
+    file_test(tr, "pc_test", FILE_OPEN_CREATE_EXCLUSIVE, 1, 0, 0, false, 11);
+    transaction_complete(tr);
+    assert(!tr->failed);
+    transaction_activate(tr);
+
+    /* committed add is in cache */
+    hits = cache->hits;
+    file_test(tr, "pc_test", FILE_OPEN_NO_CREATE, 2, 2, 0, false, 12);
+    assert(cache->hits == hits + 1);
+    transaction_complete(tr);
+    assert(!tr->failed);
+    transaction_activate(tr);
+
+    /* committed update is in cache, block_get checks the cached mac */
+    file_test(tr, "pc_test", FILE_OPEN_NO_CREATE, 0, 2, 0, false, 12);
+    assert(cache->hits == hits + 2);
+    deleted = file_delete(tr, "pc_test");
+    assert(deleted);
+    assert(cache->hits == hits + 3);
+    transaction_complete(tr);
+    assert(!tr->failed);
+    transaction_activate(tr);
+
+    /* committed delete is removed from cache */
+    lookups = cache->lookups;
+    open_test_file_etc(tr, &file, "pc_test", FILE_OPEN_NO_CREATE, true);
+    assert(cache->lookups == lookups + 1);
+    assert(cache->hits == hits + 3);
+}
+
+static void file_snapshot_test(struct transaction *tr)
+{
+    struct transaction snapshot;
+    struct file_handle file;
+    char path[10];
+    int i;
+
+    file_test(tr, "snap", FILE_OPEN_CREATE_EXCLUSIVE, 2, 0, 0, false, 21);
+    transaction_complete(tr);
+    assert(!tr->failed);
+    transaction_activate(tr);
+
+    transaction_init_snapshot(&snapshot, tr->fs);
+    open_test_file(&snapshot, &file, "snap", FILE_OPEN_CREATE);
+    open_test_file_etc(&snapshot, &file, "snap_new", FILE_OPEN_CREATE, true);
+
+    /* commit an update to the file opened by the snapshot */
+    file_test(tr, "snap", FILE_OPEN_NO_CREATE, 2, 2, 0, false, 22);
+    transaction_complete(tr);
+    assert(!tr->failed);
+    transaction_activate(tr);
+    file_test_open(&snapshot, &file, 0, 2, 0, 21);
+    assert(!snapshot.failed);
+
+    /* delete it and reuse as many blocks as possible */
+    file_test(tr, "snap", FILE_OPEN_NO_CREATE, 0, 2, 2, true, 22);
+    transaction_complete(tr);
+    assert(!tr->failed);
+    transaction_activate(tr);
+    for (i = 0; i < 4; i++) {
+        snprintf(path, sizeof(path), "snap%d", i);
+        file_test(tr, path, FILE_OPEN_CREATE_EXCLUSIVE, 4, 0, 0, false, 23);
+    }
+    transaction_complete(tr);
+    assert(!tr->failed);
+    transaction_activate(tr);
+    file_test_open(&snapshot, &file, 0, 2, 0, 21);
+    assert(!snapshot.failed);
+    file_close(&file);
+
+    transaction_snapshot_refresh(&snapshot);
+    open_test_file_etc(&snapshot, &file, "snap", FILE_OPEN_NO_CREATE, true);
+    open_test_file(&snapshot, &file, "snap0", FILE_OPEN_NO_CREATE);
+    file_test_open(&snapshot, &file, 0, 4, 0, 23);
+    file_close(&file);
+    transaction_free(&snapshot);
+
+    for (i = 0; i < 4; i++) {
+        snprintf(path, sizeof(path), "snap%d", i);
+        file_test(tr, path, FILE_OPEN_NO_CREATE, 0, 4, 4, true, 23);
+    }
+}
+
+/**
+ * file_snapshot_read_test - Read open files through a snapshot
+ * @tr:         Transaction object.
+ *
+ * A transaction that reads a file through file_open_snapshot must not be
+ * failed when another transaction commits the file, but must fail if it then
+ * modifies the file based on the old version.
+ */
+static void file_snapshot_read_test(struct transaction *tr)
+{
+    void *block_data_rw;
+    obj_ref_t ref = OBJ_REF_INITIAL_VALUE(ref);
+    struct transaction reader;
+    struct transaction snapshot;
+    struct file_handle file;
+    struct file_handle snapshot_file;
+
+    file_test(tr, "snapread", FILE_OPEN_CREATE_EXCLUSIVE, 2, 0, 0, false, 31);
+    transaction_complete(tr);
+    assert(!tr->failed);
+    transaction_activate(tr);
+
+    transaction_init(&reader, tr->fs, true);
+    open_test_file(&reader, &file, "snapread", FILE_OPEN_NO_CREATE);
+
+    /* no commit between the read and the write */
+    transaction_init_snapshot(&snapshot, tr->fs);
+    assert(file_open_snapshot(&snapshot, &snapshot_file, &reader, &file));
+    file_test_open(&snapshot, &snapshot_file, 0, 2, 0, 31);
+    file_close_snapshot(&snapshot_file, &file);
+    transaction_free(&snapshot);
+    file_test_open(&reader, &file, 2, 0, 0, 32);
+    transaction_complete(&reader);
+    assert(!reader.failed);
+
+    /* files modified by the reader can not be read through a snapshot */
+    transaction_activate(&reader);
+    file_test_open(&reader, &file, 2, 0, 0, 33);
+    transaction_init_snapshot(&snapshot, tr->fs);
+    assert(!file_open_snapshot(&snapshot, &snapshot_file, &reader, &file));
+    transaction_free(&snapshot);
+    transaction_fail(&reader);
+
+    /* commit by another transaction while the reader has the file open */
+    transaction_activate(&reader);
+    transaction_init_snapshot(&snapshot, tr->fs);
+    assert(file_open_snapshot(&snapshot, &snapshot_file, &reader, &file));
+    file_test(tr, "snapread", FILE_OPEN_NO_CREATE, 2, 0, 0, false, 34);
+    transaction_complete(tr);
+    assert(!tr->failed);
+    transaction_activate(tr);
+    file_test_open(&snapshot, &snapshot_file, 0, 2, 0, 32);
+    assert(!snapshot.failed);
+    file_close_snapshot(&snapshot_file, &file);
+    transaction_free(&snapshot);
+    assert(!reader.failed);
+
+    /* writing after reading the old version is a conflict */
+    block_data_rw = file_get_block_write(&reader, &file, 0, true, &ref);
+    assert(!block_data_rw);
+    assert(reader.failed);
+
+    file_close(&file);
+    transaction_free(&reader);
+    file_test(tr, "snapread", FILE_OPEN_NO_CREATE, 0, 2, 2, true, 34);
+}
+
+static void file_write_order_test(struct transaction *tr)
+{
+    uint write_count;
+    uint write_descending;
+    unsigned int flush_threshold;
+
+    /* a flush threshold below the file size would split the writes */
+    flush_threshold = block_cache_debug_set_flush_threshold(0);
+    write_count = block_test_write_count;
+    write_descending = block_test_write_descending;
+    file_test(tr, "write_order", FILE_OPEN_CREATE_EXCLUSIVE, 16, 0, 0, false,
+              24);
+    transaction_complete(tr);
+    assert(!tr->failed);
+    write_count = block_test_write_count - write_count;
+    write_descending = block_test_write_descending - write_descending;
+    if (print_test_verbose) {
+        printf("%s: %u writes, %u descending\n", __func__,
+               write_count, write_descending);
+    }
+    /*
+     * Dirty blocks are written back in block order, so only the super block
+     * write and at most one earlier flush or eviction can go backwards.
+     */
+    assert(write_count >= 16);
+    assert(write_descending <= 2);
+    block_cache_debug_set_flush_threshold(flush_threshold);
+    transaction_activate(tr);
+
+    file_test(tr, "write_order", FILE_OPEN_NO_CREATE, 0, 16, 16, true, 24);
+}
+
 static void future_fs_version_test(struct transaction *tr)
 {
     obj_ref_t super_ref = OBJ_REF_INITIAL_VALUE(super_ref);
@@ -1540,6 +2169,87 @@ static void file_allocate_leave_10_test2(struct transaction *tr)
 }
 #endif
 
+#define CRYPT_BENCHMARK_BLOCK_SIZE (2048)
+#define CRYPT_BENCHMARK_BATCH_COUNT (16)
+#define CRYPT_BENCHMARK_ROUNDS (256)
+
+/**
+ * crypt_benchmark_print - Print blocks per second for a benchmark run
+ * @name:       Name of benchmarked method.
+ * @start:      Start time in ns.
+ * @end:        End time in ns.
+ */
+static void crypt_benchmark_print(const char *name, int64_t start, int64_t end)
+{
+    uint64_t block_count = CRYPT_BENCHMARK_BATCH_COUNT * CRYPT_BENCHMARK_ROUNDS;
+    int64_t ns = end - start ?: 1;
+
+    printf("crypt_benchmark: %s: %lld blocks in %lld us, %lld blocks/sec\n",
+           name, (long long)block_count, (long long)(ns / 1000),
+           (long long)(block_count * 1000000000ULL / ns));
+}
+
+/**
+ * crypt_benchmark - Compare per-block and batched encrypt and mac
+ *
+ * Encrypts and macs the same blocks with encrypt and calculate_mac for each
+ * block, then with encrypt_and_mac_blocks for all blocks at once, checks that
+ * both produce the same macs and prints the throughput of each.
+ */
+static void crypt_benchmark(void)
+{
+    int ret;
+    int i;
+    int round;
+    int64_t start;
+    int64_t end;
+    static uint8_t data[2][CRYPT_BENCHMARK_BATCH_COUNT][CRYPT_BENCHMARK_BLOCK_SIZE];
+    struct mac mac[2][CRYPT_BENCHMARK_BATCH_COUNT];
+    struct crypt_block crypt_blocks[CRYPT_BENCHMARK_BATCH_COUNT];
+
+    for (i = 0; i < CRYPT_BENCHMARK_BATCH_COUNT; i++) {
+        memset(data[0][i], i, sizeof(data[0][i]));
+        ret = generate_iv((struct iv *)data[0][i]);
+        assert(!ret);
+    }
+    memcpy(data[1], data[0], sizeof(data[1]));
+
+    gettime(0, 0, &start);
+    for (round = 0; round < CRYPT_BENCHMARK_ROUNDS; round++) {
+        for (i = 0; i < CRYPT_BENCHMARK_BATCH_COUNT; i++) {
+            ret = encrypt(&key, data[0][i] + sizeof(struct iv),
+                          sizeof(data[0][i]) - sizeof(struct iv),
+                          (struct iv *)data[0][i]);
+            assert(!ret);
+            ret = calculate_mac(&key, &mac[0][i], data[0][i],
+                                sizeof(data[0][i]));
+            assert(!ret);
+        }
+    }
+    gettime(0, 0, &end);
+    crypt_benchmark_print("per block", start, end);
+
+    for (i = 0; i < CRYPT_BENCHMARK_BATCH_COUNT; i++) {
+        crypt_blocks[i].data = data[1][i] + sizeof(struct iv);
+        crypt_blocks[i].data_size = sizeof(data[1][i]) - sizeof(struct iv);
+        crypt_blocks[i].iv = (struct iv *)data[1][i];
+        crypt_blocks[i].mac_data = data[1][i];
+        crypt_blocks[i].mac_data_size = sizeof(data[1][i]);
+        crypt_blocks[i].mac = &mac[1][i];
+    }
+    gettime(0, 0, &start);
+    for (round = 0; round < CRYPT_BENCHMARK_ROUNDS; round++) {
+        ret = encrypt_and_mac_blocks(&key, crypt_blocks,
+                                     CRYPT_BENCHMARK_BATCH_COUNT);
+        assert(!ret);
+    }
+    gettime(0, 0, &end);
+    crypt_benchmark_print("batched", start, end);
+
+    assert(!memcmp(data[0], data[1], sizeof(data[0])));
+    assert(!memcmp(mac[0], mac[1], sizeof(mac[0])));
+}
+
 #define TEST(a, ...) {.name = #a, .func = (a), ##__VA_ARGS__}
 struct {
     const char *name;
@@ -1550,6 +2260,7 @@ struct {
     TEST(empty_test),
     TEST(block_tree_test),
     TEST(block_set_test),
+    TEST(block_set_iter_test),
     TEST(block_map_test),
     TEST(allocate_frag_test, .no_free_check = true),
     TEST(allocate_free_same_test, .no_free_check = true),
@@ -1583,7 +2294,12 @@ struct {
     TEST(file_delete2_test),
     TEST(file_create2_read_after_commit_test),
     TEST(file_delete2_test),
+    TEST(file_read_ahead_test),
+    TEST(file_contiguous_test),
+    TEST(file_allocate_range_test),
+    TEST(file_merge_free_walk_test),
     TEST(file_create3_conflict_test),
+    TEST(file_create3_group_conflict_test),
     TEST(file_create_delete_2_transaction_test),
     TEST(file_create_many_test),
     TEST(file_create1_small_test),
@@ -1629,6 +2345,11 @@ struct {
 //    TEST(file_write1_test),
 //    TEST(file_allocate_leave_10_test2),
     TEST(file_delete1_no_free_test),
+    TEST(keyed_hash_test),
+    TEST(file_path_cache_test),
+    TEST(file_snapshot_test),
+    TEST(file_snapshot_read_test),
+    TEST(file_write_order_test),
     TEST(future_fs_version_test),
 };
 
@@ -1714,6 +2435,8 @@ int main(int argc, const char *argv[])
     stats_timer_print();
     transaction_free(&tr);
 
+    crypt_benchmark();
+
     printf("%s: done\n", __func__);
 
     return 0;
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host stand-in for lib/hwkey. Keys are fixed so a file system created by one
+ * run can be mounted by the next.
+ */
+
+#include <err.h>
+#include <string.h>
+
+#include <lib/hwkey/hwkey.h>
+
+#include "hwkey_sim.h"
+
+#define HWKEY_SIM_SESSION 0x4b4559 /* "KEY" */
+
+const uint8_t hwkey_sim_rpmb_key[HWKEY_SIM_RPMB_KEY_SIZE] = {
+    0xea, 0xdf, 0x64, 0x44, 0xea, 0x65, 0x5d, 0x1c,
+    0x87, 0x27, 0xd4, 0x20, 0x71, 0x0d, 0x53, 0x42,
+    0xdd, 0x73, 0xa3, 0x38, 0x63, 0xe1, 0xd7, 0x94,
+    0xc3, 0x2f, 0xb5, 0x33, 0x1e, 0x9b, 0x52, 0x43,
+};
+
+long hwkey_open(void)
+{
+    return HWKEY_SIM_SESSION;
+}
+
+long hwkey_get_keyslot_data(hwkey_session_t session, const char *slot_id,
+                            uint8_t *data, uint32_t *data_size)
+{
+    if (session != HWKEY_SIM_SESSION || !slot_id || !data || !data_size) {
+        return ERR_NOT_VALID;
+    }
+    if (strcmp(slot_id, "com.android.trusty.storage_auth.rpmb")) {
+        return ERR_NOT_FOUND;
+    }
+    if (*data_size < sizeof(hwkey_sim_rpmb_key)) {
+        return ERR_TOO_BIG;
+    }
+    memcpy(data, hwkey_sim_rpmb_key, sizeof(hwkey_sim_rpmb_key));
+    *data_size = sizeof(hwkey_sim_rpmb_key);
+    return NO_ERROR;
+}
+
+long hwkey_derive(hwkey_session_t session, uint32_t *kdf_version,
+                  const uint8_t *src, uint8_t *dest, uint32_t buf_size)
+{
+    uint32_t i;
+
+    if (session != HWKEY_SIM_SESSION || !kdf_version || !src || !dest) {
+        return ERR_NOT_VALID;
+    }
+    if (*kdf_version != HWKEY_KDF_VERSION_BEST &&
+        *kdf_version != HWKEY_KDF_VERSION_1) {
+        return ERR_NOT_VALID;
+    }
+    *kdf_version = HWKEY_KDF_VERSION_1;
+
+    /* not a real kdf, only needs to be stable */
+    for (i = 0; i < buf_size; i++) {
+        dest[i] = src[i] ^ hwkey_sim_rpmb_key[i % sizeof(hwkey_sim_rpmb_key)];
+    }
+    return NO_ERROR;
+}
+
+void hwkey_close(hwkey_session_t session)
+{
+}
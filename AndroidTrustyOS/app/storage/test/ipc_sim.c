@@ -0,0 +1,711 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ipc_sim.h"
+
+#define IPC_SIM_MAX_HANDLES 64
+#define IPC_SIM_MAX_PORTS 16
+#define IPC_SIM_MAX_NAME 64
+#define IPC_SIM_MAX_PENDING 16
+
+enum ipc_sim_msg_state {
+    IPC_SIM_MSG_FREE,
+    IPC_SIM_MSG_FILLED,
+    IPC_SIM_MSG_READ,
+};
+
+/**
+ * struct ipc_sim_msg - Receive buffer
+ * @state:  Buffer state.
+ * @seq:    Order @buf was filled in, used to return messages in order.
+ * @len:    Length of message in @buf.
+ * @buf:    Message data.
+ */
+struct ipc_sim_msg {
+    enum ipc_sim_msg_state state;
+    uint64_t seq;
+    size_t len;
+    uint8_t *buf;
+};
+
+/**
+ * struct ipc_sim_chan - One end of a channel
+ * @peer:           Other end of channel, %NULL if it has been closed.
+ * @peer_uuid:      Uuid of app at the other end.
+ * @peer_closed:    %true if the other end has been closed.
+ * @send_blocked:   Last send_msg failed with ERR_NOT_ENOUGH_BUFFER.
+ * @send_unblocked: IPC_HANDLE_POLL_SEND_UNBLOCKED event is pending.
+ * @queue_size:     Number of entries in @msgs.
+ * @max_msg_size:   Size of each receive buffer.
+ * @msgs:           Receive buffers for messages sent by @peer.
+ */
+struct ipc_sim_chan {
+    struct ipc_sim_chan *peer;
+    uuid_t peer_uuid;
+    bool peer_closed;
+    bool send_blocked;
+    bool send_unblocked;
+    uint32_t queue_size;
+    size_t max_msg_size;
+    struct ipc_sim_msg *msgs;
+};
+
+/**
+ * struct ipc_sim_port - Named port
+ * @name:           Port name, empty if slot is not in use.
+ * @queue_size:     Number of receive buffers for new channels.
+ * @max_msg_size:   Receive buffer size for new channels.
+ * @pending:        Server side of channels that have not been accepted.
+ * @pending_count:  Number of entries in @pending.
+ */
+struct ipc_sim_port {
+    char name[IPC_SIM_MAX_NAME];
+    uint32_t queue_size;
+    size_t max_msg_size;
+    struct ipc_sim_chan *pending[IPC_SIM_MAX_PENDING];
+    uint32_t pending_count;
+};
+
+struct ipc_sim_handle {
+    struct ipc_sim_port *port;
+    struct ipc_sim_chan *chan;
+    void *cookie;
+};
+
+/**
+ * struct ipc_sim_app - Simulated app
+ * @name:       App name, for debug messages.
+ * @uuid:       Uuid returned to the peer by accept.
+ * @handles:    Handle table. Handle values are indexes in this table.
+ * @last_event: Handle returned by the last wait_any call. The next call
+ *              starts looking after this handle.
+ * @stats:      Message counters.
+ */
+struct ipc_sim_app {
+    const char *name;
+    uuid_t uuid;
+    struct ipc_sim_handle handles[IPC_SIM_MAX_HANDLES];
+    uint32_t last_event;
+    struct ipc_sim_stats stats;
+};
+
+static pthread_mutex_t ipc_sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ipc_sim_cond = PTHREAD_COND_INITIALIZER;
+static struct ipc_sim_port ipc_sim_ports[IPC_SIM_MAX_PORTS];
+static uint32_t ipc_sim_app_count;
+static uint64_t ipc_sim_seq;
+static bool ipc_sim_stopped;
+static __thread struct ipc_sim_app *ipc_sim_current;
+
+long gettime(uint32_t clock_id, uint32_t flags, int64_t *time)
+{
+    int ret;
+    struct timespec ts;
+    assert(!clock_id);
+    assert(!flags);
+
+    ret = clock_gettime(CLOCK_MONOTONIC, &ts);
+    assert(!ret);
+    *time = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+    return 0;
+}
+
+/**
+ * ipc_sim_app_create - Create an app
+ * @name:   App name.
+ *
+ * Return: new app.
+ */
+struct ipc_sim_app *ipc_sim_app_create(const char *name)
+{
+    struct ipc_sim_app *app = calloc(1, sizeof(*app));
+
+    assert(app);
+    app->name = name;
+
+    pthread_mutex_lock(&ipc_sim_lock);
+    app->uuid.time_low = ++ipc_sim_app_count;
+    pthread_mutex_unlock(&ipc_sim_lock);
+
+    return app;
+}
+
+/**
+ * ipc_sim_app_enter - Run ipc syscalls on the current thread as @app
+ * @app:    App.
+ */
+void ipc_sim_app_enter(struct ipc_sim_app *app)
+{
+    ipc_sim_current = app;
+}
+
+/**
+ * ipc_sim_app_get_stats - Get message counters of an app
+ * @app:    App.
+ * @stats:  Pointer to return counters in.
+ */
+void ipc_sim_app_get_stats(struct ipc_sim_app *app,
+                           struct ipc_sim_stats *stats)
+{
+    pthread_mutex_lock(&ipc_sim_lock);
+    *stats = app->stats;
+    pthread_mutex_unlock(&ipc_sim_lock);
+}
+
+/**
+ * ipc_sim_shutdown - Stop all apps
+ *
+ * Blocked and future wait and wait_any calls return ERR_CANCELLED once there
+ * are no more events for them to return. ipc_loop returns quietly on
+ * ERR_CANCELLED.
+ */
+void ipc_sim_shutdown(void)
+{
+    pthread_mutex_lock(&ipc_sim_lock);
+    ipc_sim_stopped = true;
+    pthread_cond_broadcast(&ipc_sim_cond);
+    pthread_mutex_unlock(&ipc_sim_lock);
+}
+
+static struct ipc_sim_handle *ipc_sim_get_handle(uint32_t handle)
+{
+    struct ipc_sim_handle *h;
+
+    assert(ipc_sim_current);
+    if (handle >= IPC_SIM_MAX_HANDLES) {
+        return NULL;
+    }
+    h = &ipc_sim_current->handles[handle];
+    if (!h->port && !h->chan) {
+        return NULL;
+    }
+    return h;
+}
+
+static long ipc_sim_alloc_handle(struct ipc_sim_port *port,
+                                 struct ipc_sim_chan *chan)
+{
+    uint32_t handle;
+    struct ipc_sim_handle *h;
+
+    assert(ipc_sim_current);
+    /* skip 0 so a zero initialized handle is never valid */
+    for (handle = 1; handle < IPC_SIM_MAX_HANDLES; handle++) {
+        h = &ipc_sim_current->handles[handle];
+        if (!h->port && !h->chan) {
+            h->port = port;
+            h->chan = chan;
+            h->cookie = NULL;
+            return handle;
+        }
+    }
+    return ERR_NO_RESOURCES;
+}
+
+static struct ipc_sim_port *ipc_sim_find_port(const char *name)
+{
+    int i;
+
+    for (i = 0; i < IPC_SIM_MAX_PORTS; i++) {
+        if (ipc_sim_ports[i].name[0] &&
+            !strcmp(ipc_sim_ports[i].name, name)) {
+            return &ipc_sim_ports[i];
+        }
+    }
+    return NULL;
+}
+
+static struct ipc_sim_chan *ipc_sim_chan_alloc(uint32_t queue_size,
+                                               size_t max_msg_size)
+{
+    uint32_t i;
+    struct ipc_sim_chan *chan = calloc(1, sizeof(*chan));
+
+    assert(chan);
+    chan->queue_size = queue_size;
+    chan->max_msg_size = max_msg_size;
+    chan->msgs = calloc(queue_size, sizeof(*chan->msgs));
+    assert(chan->msgs);
+    for (i = 0; i < queue_size; i++) {
+        chan->msgs[i].buf = malloc(max_msg_size);
+        assert(chan->msgs[i].buf);
+    }
+    return chan;
+}
+
+static void ipc_sim_chan_free(struct ipc_sim_chan *chan)
+{
+    uint32_t i;
+
+    if (chan->peer) {
+        chan->peer->peer = NULL;
+        chan->peer->peer_closed = true;
+    }
+    for (i = 0; i < chan->queue_size; i++) {
+        free(chan->msgs[i].buf);
+    }
+    free(chan->msgs);
+    free(chan);
+}
+
+static uint32_t ipc_sim_events(struct ipc_sim_handle *h)
+{
+    uint32_t i;
+    uint32_t event = IPC_HANDLE_POLL_NONE;
+    struct ipc_sim_chan *chan = h->chan;
+
+    if (h->port) {
+        return h->port->pending_count ? IPC_HANDLE_POLL_READY :
+                                        IPC_HANDLE_POLL_NONE;
+    }
+
+    for (i = 0; i < chan->queue_size; i++) {
+        if (chan->msgs[i].state == IPC_SIM_MSG_FILLED) {
+            event |= IPC_HANDLE_POLL_MSG;
+            break;
+        }
+    }
+    if (chan->send_unblocked) {
+        event |= IPC_HANDLE_POLL_SEND_UNBLOCKED;
+    }
+    if (chan->peer_closed) {
+        event |= IPC_HANDLE_POLL_HUP;
+    }
+    return event;
+}
+
+static bool ipc_sim_get_event(uint32_t handle, uevent_t *event)
+{
+    struct ipc_sim_handle *h = &ipc_sim_current->handles[handle];
+
+    if (!h->port && !h->chan) {
+        return false;
+    }
+    event->event = ipc_sim_events(h);
+    if (event->event == IPC_HANDLE_POLL_NONE) {
+        return false;
+    }
+    if (h->chan) {
+        h->chan->send_unblocked = false;
+    }
+    event->handle = handle;
+    event->cookie = h->cookie;
+    return true;
+}
+
+static long ipc_sim_block(unsigned long timeout_msecs,
+                          const struct timespec *deadline)
+{
+    int ret;
+
+    if (ipc_sim_stopped) {
+        return ERR_CANCELLED;
+    }
+    if (!timeout_msecs) {
+        return ERR_TIMED_OUT;
+    }
+    ipc_sim_current->stats.waits++;
+    if (timeout_msecs == (unsigned long)-1) {
+        pthread_cond_wait(&ipc_sim_cond, &ipc_sim_lock);
+        return NO_ERROR;
+    }
+    ret = pthread_cond_timedwait(&ipc_sim_cond, &ipc_sim_lock, deadline);
+    return ret ? ERR_TIMED_OUT : NO_ERROR;
+}
+
+static struct timespec ipc_sim_deadline(unsigned long timeout_msecs)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (timeout_msecs != (unsigned long)-1) {
+        ts.tv_sec += timeout_msecs / 1000;
+        ts.tv_nsec += (timeout_msecs % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+    }
+    return ts;
+}
+
+long port_create(const char *path, uint num_recv_bufs, size_t recv_buf_size,
+                 uint32_t flags)
+{
+    int i;
+    long ret;
+    struct ipc_sim_port *port = NULL;
+
+    if (strlen(path) >= IPC_SIM_MAX_NAME || !num_recv_bufs) {
+        return ERR_INVALID_ARGS;
+    }
+
+    pthread_mutex_lock(&ipc_sim_lock);
+    if (ipc_sim_find_port(path)) {
+        ret = ERR_ALREADY_EXISTS;
+        goto err;
+    }
+    for (i = 0; i < IPC_SIM_MAX_PORTS; i++) {
+        if (!ipc_sim_ports[i].name[0]) {
+            port = &ipc_sim_ports[i];
+            break;
+        }
+    }
+    if (!port) {
+        ret = ERR_NO_RESOURCES;
+        goto err;
+    }
+    ret = ipc_sim_alloc_handle(port, NULL);
+    if (ret < 0) {
+        goto err;
+    }
+    strcpy(port->name, path);
+    port->queue_size = num_recv_bufs;
+    port->max_msg_size = recv_buf_size;
+    port->pending_count = 0;
+    pthread_cond_broadcast(&ipc_sim_cond);
+err:
+    pthread_mutex_unlock(&ipc_sim_lock);
+    return ret;
+}
+
+long connect(const char *path, uint flags)
+{
+    long ret;
+    struct ipc_sim_port *port;
+    struct ipc_sim_chan *chan;
+    struct ipc_sim_chan *peer;
+    struct timespec deadline = ipc_sim_deadline(-1);
+
+    pthread_mutex_lock(&ipc_sim_lock);
+    while (!(port = ipc_sim_find_port(path))) {
+        if (!(flags & IPC_CONNECT_WAIT_FOR_PORT)) {
+            ret = ERR_NOT_FOUND;
+            goto err;
+        }
+        ret = ipc_sim_block(-1, &deadline);
+        if (ret < 0) {
+            goto err;
+        }
+    }
+    if (port->pending_count == IPC_SIM_MAX_PENDING) {
+        ret = ERR_NO_RESOURCES;
+        goto err;
+    }
+
+    chan = ipc_sim_chan_alloc(port->queue_size, port->max_msg_size);
+    peer = ipc_sim_chan_alloc(port->queue_size, port->max_msg_size);
+    ret = ipc_sim_alloc_handle(NULL, chan);
+    if (ret < 0) {
+        ipc_sim_chan_free(chan);
+        ipc_sim_chan_free(peer);
+        goto err;
+    }
+    chan->peer = peer;
+    peer->peer = chan;
+    peer->peer_uuid = ipc_sim_current->uuid;
+    port->pending[port->pending_count++] = peer;
+    pthread_cond_broadcast(&ipc_sim_cond);
+err:
+    pthread_mutex_unlock(&ipc_sim_lock);
+    return ret;
+}
+
+long accept(uint32_t handle_id, uuid_t *peer_uuid)
+{
+    long ret;
+    struct ipc_sim_handle *h;
+    struct ipc_sim_port *port;
+    struct ipc_sim_chan *chan;
+
+    pthread_mutex_lock(&ipc_sim_lock);
+    h = ipc_sim_get_handle(handle_id);
+    if (!h || !h->port) {
+        ret = ERR_BAD_HANDLE;
+        goto err;
+    }
+    port = h->port;
+    if (!port->pending_count) {
+        ret = ERR_NO_MSG;
+        goto err;
+    }
+    chan = port->pending[0];
+    ret = ipc_sim_alloc_handle(NULL, chan);
+    if (ret < 0) {
+        goto err;
+    }
+    port->pending_count--;
+    memmove(port->pending, port->pending + 1,
+            port->pending_count * sizeof(port->pending[0]));
+    *peer_uuid = chan->peer_uuid;
+err:
+    pthread_mutex_unlock(&ipc_sim_lock);
+    return ret;
+}
+
+long close(uint32_t handle_id)
+{
+    uint32_t i;
+    struct ipc_sim_handle *h;
+    struct ipc_sim_port *port;
+
+    pthread_mutex_lock(&ipc_sim_lock);
+    h = ipc_sim_get_handle(handle_id);
+    if (!h) {
+        pthread_mutex_unlock(&ipc_sim_lock);
+        return ERR_BAD_HANDLE;
+    }
+    port = h->port;
+    if (port) {
+        for (i = 0; i < port->pending_count; i++) {
+            ipc_sim_chan_free(port->pending[i]);
+        }
+        port->name[0] = '\0';
+        port->pending_count = 0;
+    } else {
+        ipc_sim_chan_free(h->chan);
+    }
+    h->port = NULL;
+    h->chan = NULL;
+    h->cookie = NULL;
+    pthread_cond_broadcast(&ipc_sim_cond);
+    pthread_mutex_unlock(&ipc_sim_lock);
+    return NO_ERROR;
+}
+
+long set_cookie(uint32_t handle, void *cookie)
+{
+    struct ipc_sim_handle *h;
+
+    pthread_mutex_lock(&ipc_sim_lock);
+    h = ipc_sim_get_handle(handle);
+    if (h) {
+        h->cookie = cookie;
+    }
+    pthread_mutex_unlock(&ipc_sim_lock);
+    return h ? NO_ERROR : ERR_BAD_HANDLE;
+}
+
+long wait(uint32_t handle_id, uevent_t *event, unsigned long timeout_msecs)
+{
+    long ret;
+    struct timespec deadline = ipc_sim_deadline(timeout_msecs);
+
+    pthread_mutex_lock(&ipc_sim_lock);
+    while (true) {
+        if (!ipc_sim_get_handle(handle_id)) {
+            ret = ERR_BAD_HANDLE;
+            break;
+        }
+        if (ipc_sim_get_event(handle_id, event)) {
+            ret = NO_ERROR;
+            break;
+        }
+        ret = ipc_sim_block(timeout_msecs, &deadline);
+        if (ret < 0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ipc_sim_lock);
+    return ret;
+}
+
+long wait_any(uevent_t *event, unsigned long timeout_msecs)
+{
+    long ret;
+    uint32_t i;
+    uint32_t handle;
+    struct timespec deadline = ipc_sim_deadline(timeout_msecs);
+
+    pthread_mutex_lock(&ipc_sim_lock);
+    while (true) {
+        /* round robin, so one busy channel can't starve the others */
+        for (i = 1; i <= IPC_SIM_MAX_HANDLES; i++) {
+            handle = (ipc_sim_current->last_event + i) % IPC_SIM_MAX_HANDLES;
+            if (ipc_sim_get_event(handle, event)) {
+                ipc_sim_current->last_event = handle;
+                ret = NO_ERROR;
+                goto done;
+            }
+        }
+        ret = ipc_sim_block(timeout_msecs, &deadline);
+        if (ret < 0) {
+            break;
+        }
+    }
+done:
+    pthread_mutex_unlock(&ipc_sim_lock);
+    return ret;
+}
+
+long send_msg(uint32_t handle, ipc_msg_t *msg)
+{
+    long ret;
+    uint i;
+    size_t len = 0;
+    struct ipc_sim_handle *h;
+    struct ipc_sim_chan *peer;
+    struct ipc_sim_msg *slot = NULL;
+
+    for (i = 0; i < msg->num_iov; i++) {
+        len += msg->iov[i].len;
+    }
+
+    pthread_mutex_lock(&ipc_sim_lock);
+    h = ipc_sim_get_handle(handle);
+    if (!h || !h->chan) {
+        ret = ERR_BAD_HANDLE;
+        goto err;
+    }
+    peer = h->chan->peer;
+    if (!peer) {
+        ret = ERR_CHANNEL_CLOSED;
+        goto err;
+    }
+    if (len > peer->max_msg_size) {
+        ret = ERR_TOO_BIG;
+        goto err;
+    }
+    for (i = 0; i < peer->queue_size; i++) {
+        if (peer->msgs[i].state == IPC_SIM_MSG_FREE) {
+            slot = &peer->msgs[i];
+            break;
+        }
+    }
+    if (!slot) {
+        h->chan->send_blocked = true;
+        ret = ERR_NOT_ENOUGH_BUFFER;
+        goto err;
+    }
+    slot->len = 0;
+    for (i = 0; i < msg->num_iov; i++) {
+        memcpy(slot->buf + slot->len, msg->iov[i].base, msg->iov[i].len);
+        slot->len += msg->iov[i].len;
+    }
+    slot->state = IPC_SIM_MSG_FILLED;
+    slot->seq = ++ipc_sim_seq;
+    ipc_sim_current->stats.msgs_sent++;
+    ipc_sim_current->stats.bytes_sent += len;
+    pthread_cond_broadcast(&ipc_sim_cond);
+    ret = len;
+err:
+    pthread_mutex_unlock(&ipc_sim_lock);
+    return ret;
+}
+
+long get_msg(uint32_t handle, ipc_msg_info_t *msg_info)
+{
+    long ret;
+    uint32_t i;
+    struct ipc_sim_handle *h;
+    struct ipc_sim_chan *chan;
+    struct ipc_sim_msg *first = NULL;
+
+    pthread_mutex_lock(&ipc_sim_lock);
+    h = ipc_sim_get_handle(handle);
+    if (!h || !h->chan) {
+        ret = ERR_BAD_HANDLE;
+        goto err;
+    }
+    chan = h->chan;
+    for (i = 0; i < chan->queue_size; i++) {
+        if (chan->msgs[i].state == IPC_SIM_MSG_FILLED &&
+            (!first || chan->msgs[i].seq < first->seq)) {
+            first = &chan->msgs[i];
+        }
+    }
+    if (!first) {
+        ret = ERR_NO_MSG;
+        goto err;
+    }
+    first->state = IPC_SIM_MSG_READ;
+    msg_info->id = first - chan->msgs;
+    msg_info->len = first->len;
+    ret = NO_ERROR;
+err:
+    pthread_mutex_unlock(&ipc_sim_lock);
+    return ret;
+}
+
+static struct ipc_sim_msg *ipc_sim_get_read_msg(uint32_t handle,
+                                                uint32_t msg_id)
+{
+    struct ipc_sim_handle *h = ipc_sim_get_handle(handle);
+
+    if (!h || !h->chan || msg_id >= h->chan->queue_size ||
+        h->chan->msgs[msg_id].state != IPC_SIM_MSG_READ) {
+        return NULL;
+    }
+    return &h->chan->msgs[msg_id];
+}
+
+long read_msg(uint32_t handle, uint32_t msg_id, uint32_t offset,
+              ipc_msg_t *msg)
+{
+    long ret;
+    uint i;
+    size_t len;
+    struct ipc_sim_msg *m;
+
+    pthread_mutex_lock(&ipc_sim_lock);
+    m = ipc_sim_get_read_msg(handle, msg_id);
+    if (!m || offset > m->len) {
+        ret = m ? ERR_INVALID_ARGS : ERR_BAD_HANDLE;
+        goto err;
+    }
+    ret = 0;
+    for (i = 0; i < msg->num_iov && offset < m->len; i++) {
+        len = MIN(msg->iov[i].len, m->len - offset);
+        memcpy(msg->iov[i].base, m->buf + offset, len);
+        offset += len;
+        ret += len;
+    }
+err:
+    pthread_mutex_unlock(&ipc_sim_lock);
+    return ret;
+}
+
+long put_msg(uint32_t handle, uint32_t msg_id)
+{
+    struct ipc_sim_msg *m;
+    struct ipc_sim_chan *peer;
+
+    pthread_mutex_lock(&ipc_sim_lock);
+    m = ipc_sim_get_read_msg(handle, msg_id);
+    if (!m) {
+        pthread_mutex_unlock(&ipc_sim_lock);
+        return ERR_INVALID_ARGS;
+    }
+    m->state = IPC_SIM_MSG_FREE;
+    peer = ipc_sim_current->handles[handle].chan->peer;
+    if (peer && peer->send_blocked) {
+        peer->send_blocked = false;
+        peer->send_unblocked = true;
+        pthread_cond_broadcast(&ipc_sim_cond);
+    }
+    pthread_mutex_unlock(&ipc_sim_lock);
+    return NO_ERROR;
+}
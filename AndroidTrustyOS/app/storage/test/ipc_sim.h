@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Host implementation of the trusty ipc syscalls (port_create, connect,
+ * accept, wait, wait_any, send_msg, get_msg, read_msg, put_msg, set_cookie
+ * and close). Each host thread that calls these functions is a separate app
+ * with its own handle table. Apps are connected through ports and channels
+ * that behave like the kernel implementation: messages are copied into a
+ * fixed number of receive buffers per channel, send_msg fails with
+ * ERR_NOT_ENOUGH_BUFFER when they are all in use and
+ * IPC_HANDLE_POLL_SEND_UNBLOCKED is raised when one is released.
+ */
+
+/**
+ * struct ipc_sim_stats - Message counters for an app
+ * @msgs_sent:  Number of messages sent.
+ * @bytes_sent: Number of bytes sent.
+ * @waits:      Number of times a wait or wait_any call had to block.
+ */
+struct ipc_sim_stats {
+    uint64_t msgs_sent;
+    uint64_t bytes_sent;
+    uint64_t waits;
+};
+
+struct ipc_sim_app;
+
+struct ipc_sim_app *ipc_sim_app_create(const char *name);
+void ipc_sim_app_enter(struct ipc_sim_app *app);
+void ipc_sim_app_get_stats(struct ipc_sim_app *app,
+                           struct ipc_sim_stats *stats);
+void ipc_sim_shutdown(void);
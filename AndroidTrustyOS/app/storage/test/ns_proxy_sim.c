@@ -0,0 +1,483 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Stand-in for the non-secure storage proxy. Connects to the storage server
+ * proxy port from its own thread, keeps non-secure files in a host directory
+ * and forwards rpmb requests to an emulated rpmb partition.
+ */
+
+#include <assert.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <interface/storage/storage.h>
+
+#include "ipc_sim.h"
+#include "hwkey_sim.h"
+#include "ns_proxy_sim.h"
+#include "rpmb_dev_sim.h"
+
+#define NS_PROXY_MAX_FILES 8
+#define NS_PROXY_MAX_PATH 256
+#define NS_PROXY_MSG_SIZE 16384
+#define NS_PROXY_DEFAULT_MSG_SIZE 4096
+
+/**
+ * struct ns_proxy_sim - Proxy state
+ * @config:         Configuration passed to ns_proxy_sim_start.
+ * @app:            Simulated app the proxy thread runs as.
+ * @thread:         Proxy thread.
+ * @chan:           Channel to storage server.
+ * @files:          Open non-secure files, indexed by handle.
+ * @batch_result:   First error of current sequence of batched writes.
+ * @msg_size:       Message size selected by STORAGE_NEGOTIATE.
+ * @rpmb:           Emulated rpmb partition.
+ * @stats_lock:     Protects @stats.
+ * @stats:          Request counters.
+ * @req:            Request buffer.
+ * @resp:           Response buffer.
+ */
+struct ns_proxy_sim {
+    struct ns_proxy_sim_config config;
+    struct ipc_sim_app *app;
+    pthread_t thread;
+    handle_t chan;
+    FILE *files[NS_PROXY_MAX_FILES];
+    enum storage_err batch_result;
+    size_t msg_size;
+    struct rpmb_dev_sim rpmb;
+    pthread_mutex_t stats_lock;
+    struct ns_proxy_sim_stats stats;
+    uint8_t req[NS_PROXY_MSG_SIZE];
+    uint8_t resp[NS_PROXY_MSG_SIZE];
+};
+
+static struct ns_proxy_sim ns_proxy;
+
+static void ns_proxy_delay(uint32_t us)
+{
+    struct timespec ts = {
+        .tv_sec = us / 1000000,
+        .tv_nsec = (us % 1000000) * 1000,
+    };
+
+    if (us) {
+        clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+    }
+}
+
+static void ns_proxy_sync(void)
+{
+    int i;
+
+    for (i = 0; i < NS_PROXY_MAX_FILES; i++) {
+        if (ns_proxy.files[i]) {
+            fflush(ns_proxy.files[i]);
+        }
+    }
+}
+
+static FILE *ns_proxy_get_file(uint32_t handle)
+{
+    if (handle >= NS_PROXY_MAX_FILES) {
+        return NULL;
+    }
+    return ns_proxy.files[handle];
+}
+
+static enum storage_err ns_proxy_file_open(struct storage_file_open_req *req,
+                                           size_t req_size,
+                                           struct storage_file_open_resp *resp)
+{
+    int i;
+    int len;
+    FILE *file;
+    char path[NS_PROXY_MAX_PATH];
+    size_t name_len = req_size - sizeof(*req);
+
+    if (req_size < sizeof(*req)) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    len = snprintf(path, sizeof(path), "%s/%.*s", ns_proxy.config.dir,
+                   (int)name_len, (const char *)req->name);
+    if (len < 0 || (size_t)len >= sizeof(path)) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    for (i = 0; i < NS_PROXY_MAX_FILES; i++) {
+        if (!ns_proxy.files[i]) {
+            break;
+        }
+    }
+    if (i == NS_PROXY_MAX_FILES) {
+        return STORAGE_ERR_GENERIC;
+    }
+
+    file = fopen(path, "r+b");
+    if (!file && (req->flags & STORAGE_FILE_OPEN_CREATE)) {
+        file = fopen(path, "w+b");
+    }
+    if (!file) {
+        return STORAGE_ERR_NOT_FOUND;
+    }
+    ns_proxy.files[i] = file;
+    resp->handle = i;
+    return STORAGE_NO_ERROR;
+}
+
+static enum storage_err ns_proxy_file_close(struct storage_file_close_req *req,
+                                            size_t req_size)
+{
+    FILE *file;
+
+    if (req_size != sizeof(*req)) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    file = ns_proxy_get_file(req->handle);
+    if (!file) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    fclose(file);
+    ns_proxy.files[req->handle] = NULL;
+    return STORAGE_NO_ERROR;
+}
+
+static enum storage_err ns_proxy_file_read(struct storage_file_read_req *req,
+                                           size_t req_size, void *buf,
+                                           size_t *len)
+{
+    FILE *file;
+
+    if (req_size != sizeof(*req) || req->size > *len) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    file = ns_proxy_get_file(req->handle);
+    if (!file || fseeko(file, req->offset, SEEK_SET)) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    /* short read at end of file is not an error */
+    *len = fread(buf, 1, req->size, file);
+    if (ferror(file)) {
+        clearerr(file);
+        return STORAGE_ERR_GENERIC;
+    }
+
+    pthread_mutex_lock(&ns_proxy.stats_lock);
+    ns_proxy.stats.ns_reads++;
+    ns_proxy.stats.ns_read_bytes += *len;
+    pthread_mutex_unlock(&ns_proxy.stats_lock);
+
+    ns_proxy_delay(ns_proxy.config.ns_latency_us);
+    return STORAGE_NO_ERROR;
+}
+
+static enum storage_err ns_proxy_file_write(struct storage_file_write_req *req,
+                                            size_t req_size)
+{
+    FILE *file;
+    size_t len = req_size - sizeof(*req);
+
+    if (req_size < sizeof(*req)) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    file = ns_proxy_get_file(req->handle);
+    if (!file || fseeko(file, req->offset, SEEK_SET)) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    if (fwrite(req->data, 1, len, file) != len) {
+        clearerr(file);
+        return STORAGE_ERR_GENERIC;
+    }
+
+    pthread_mutex_lock(&ns_proxy.stats_lock);
+    ns_proxy.stats.ns_writes++;
+    ns_proxy.stats.ns_write_bytes += len;
+    pthread_mutex_unlock(&ns_proxy.stats_lock);
+
+    ns_proxy_delay(ns_proxy.config.ns_latency_us);
+    return STORAGE_NO_ERROR;
+}
+
+static enum storage_err ns_proxy_rpmb_send(struct storage_rpmb_send_req *req,
+                                           size_t req_size, void *buf,
+                                           size_t *len)
+{
+    int ret;
+    const uint8_t *p = req->payload;
+
+    if (req_size < sizeof(*req) ||
+        req_size - sizeof(*req) !=
+        (size_t)req->reliable_write_size + req->write_size ||
+        req->read_size > *len) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+
+    ret = rpmb_dev_sim_send(&ns_proxy.rpmb, p, req->reliable_write_size,
+                            p + req->reliable_write_size, req->write_size,
+                            buf, req->read_size);
+    if (ret < 0) {
+        return STORAGE_ERR_GENERIC;
+    }
+    *len = req->read_size;
+
+    pthread_mutex_lock(&ns_proxy.stats_lock);
+    if (req->reliable_write_size) {
+        ns_proxy.stats.rpmb_writes++;
+        ns_proxy.stats.rpmb_write_blocks +=
+                req->reliable_write_size / RPMB_DEV_SIM_FRAME_SIZE;
+    } else {
+        ns_proxy.stats.rpmb_reads++;
+    }
+    pthread_mutex_unlock(&ns_proxy.stats_lock);
+
+    ns_proxy_delay(ns_proxy.config.rpmb_latency_us);
+    return STORAGE_NO_ERROR;
+}
+
+static enum storage_err ns_proxy_negotiate(struct storage_negotiate_req *req,
+                                           size_t req_size,
+                                           struct storage_negotiate_resp *resp)
+{
+    if (!ns_proxy.config.max_msg_size) {
+        return STORAGE_ERR_UNIMPLEMENTED;
+    }
+    if (req_size != sizeof(*req) ||
+        req->max_msg_size < NS_PROXY_DEFAULT_MSG_SIZE) {
+        return STORAGE_ERR_NOT_VALID;
+    }
+    ns_proxy.msg_size = req->max_msg_size;
+    if (ns_proxy.msg_size > ns_proxy.config.max_msg_size) {
+        ns_proxy.msg_size = ns_proxy.config.max_msg_size;
+    }
+    if (ns_proxy.msg_size > NS_PROXY_MSG_SIZE) {
+        ns_proxy.msg_size = NS_PROXY_MSG_SIZE;
+    }
+    resp->max_msg_size = ns_proxy.msg_size;
+    resp->flags = 0;
+    return STORAGE_NO_ERROR;
+}
+
+static int ns_proxy_handle_msg(size_t len)
+{
+    struct storage_msg *msg = (struct storage_msg *)ns_proxy.req;
+    struct storage_msg *resp_msg = (struct storage_msg *)ns_proxy.resp;
+    void *req = msg->payload;
+    void *resp = resp_msg->payload;
+    size_t req_size;
+    size_t resp_size = 0;
+    enum storage_err result;
+
+    if (len < sizeof(*msg)) {
+        fprintf(stderr, "ns_proxy: invalid message size %zd\n", len);
+        return ERR_NOT_VALID;
+    }
+    req_size = len - sizeof(*msg);
+
+    if (msg->flags & STORAGE_MSG_FLAG_PRE_COMMIT) {
+        ns_proxy_sync();
+    }
+
+    switch (msg->cmd) {
+    case STORAGE_FILE_OPEN:
+        result = ns_proxy_file_open(req, req_size, resp);
+        resp_size = sizeof(struct storage_file_open_resp);
+        break;
+    case STORAGE_FILE_CLOSE:
+        result = ns_proxy_file_close(req, req_size);
+        break;
+    case STORAGE_FILE_READ:
+        resp_size = ns_proxy.msg_size - sizeof(*resp_msg);
+        result = ns_proxy_file_read(req, req_size, resp, &resp_size);
+        break;
+    case STORAGE_FILE_WRITE:
+        result = ns_proxy_file_write(req, req_size);
+        break;
+    case STORAGE_RPMB_SEND:
+        resp_size = ns_proxy.msg_size - sizeof(*resp_msg);
+        result = ns_proxy_rpmb_send(req, req_size, resp, &resp_size);
+        break;
+    case STORAGE_NEGOTIATE:
+        result = ns_proxy_negotiate(req, req_size, resp);
+        resp_size = sizeof(struct storage_negotiate_resp);
+        break;
+    default:
+        fprintf(stderr, "ns_proxy: unsupported command 0x%x\n", msg->cmd);
+        result = STORAGE_ERR_UNIMPLEMENTED;
+        break;
+    }
+
+    if (msg->flags & (STORAGE_MSG_FLAG_PRE_COMMIT |
+                      STORAGE_MSG_FLAG_POST_COMMIT)) {
+        if (msg->flags & STORAGE_MSG_FLAG_POST_COMMIT) {
+            ns_proxy_sync();
+        }
+        pthread_mutex_lock(&ns_proxy.stats_lock);
+        ns_proxy.stats.syncs++;
+        pthread_mutex_unlock(&ns_proxy.stats_lock);
+    }
+
+    if (msg->flags & STORAGE_MSG_FLAG_BATCH) {
+        /* report first error with the response to the last request */
+        if (ns_proxy.batch_result == STORAGE_NO_ERROR) {
+            ns_proxy.batch_result = result;
+        }
+        return NO_ERROR;
+    }
+    if (ns_proxy.batch_result != STORAGE_NO_ERROR) {
+        result = ns_proxy.batch_result;
+        ns_proxy.batch_result = STORAGE_NO_ERROR;
+    }
+
+    if (result != STORAGE_NO_ERROR) {
+        resp_size = 0;
+    }
+    *resp_msg = *msg;
+    resp_msg->cmd |= STORAGE_RESP_BIT;
+    resp_msg->flags = 0;
+    resp_msg->size = sizeof(*resp_msg) + resp_size;
+    resp_msg->result = result;
+
+    iovec_t iov = {
+        .base = resp_msg,
+        .len = sizeof(*resp_msg) + resp_size,
+    };
+    ipc_msg_t ipc_msg = {
+        .num_iov = 1,
+        .iov = &iov,
+    };
+    long rc = send_msg(ns_proxy.chan, &ipc_msg);
+    return rc < 0 ? rc : NO_ERROR;
+}
+
+static void *ns_proxy_thread(void *arg)
+{
+    long rc;
+    uevent_t ev;
+    ipc_msg_info_t msg_info;
+    iovec_t iov = {
+        .base = ns_proxy.req,
+        .len = sizeof(ns_proxy.req),
+    };
+    ipc_msg_t msg = {
+        .num_iov = 1,
+        .iov = &iov,
+    };
+
+    ipc_sim_app_enter(ns_proxy.app);
+
+    rc = connect(STORAGE_DISK_PROXY_PORT, IPC_CONNECT_WAIT_FOR_PORT);
+    if (rc < 0) {
+        fprintf(stderr, "ns_proxy: connect failed (%ld)\n", rc);
+        return NULL;
+    }
+    ns_proxy.chan = (handle_t)rc;
+
+    while (true) {
+        rc = wait(ns_proxy.chan, &ev, -1);
+        if (rc < 0) {
+            break;
+        }
+        if (ev.event & IPC_HANDLE_POLL_MSG) {
+            rc = get_msg(ns_proxy.chan, &msg_info);
+            if (rc < 0) {
+                break;
+            }
+            rc = read_msg(ns_proxy.chan, msg_info.id, 0, &msg);
+            put_msg(ns_proxy.chan, msg_info.id);
+            if (rc < 0 || (size_t)rc != msg_info.len ||
+                msg_info.len > ns_proxy.msg_size) {
+                fprintf(stderr, "ns_proxy: read_msg failed (%ld)\n", rc);
+                break;
+            }
+            rc = ns_proxy_handle_msg(msg_info.len);
+            if (rc < 0) {
+                fprintf(stderr, "ns_proxy: request failed (%ld)\n", rc);
+                break;
+            }
+        } else if (ev.event & IPC_HANDLE_POLL_HUP) {
+            break;
+        }
+    }
+
+    if (rc != ERR_CANCELLED) {
+        close(ns_proxy.chan);
+    }
+    return NULL;
+}
+
+/**
+ * ns_proxy_sim_start - Start proxy thread
+ * @config: Proxy configuration.
+ * @app:    Simulated app to run as.
+ *
+ * Return: 0 on success, < 0 on error.
+ */
+int ns_proxy_sim_start(const struct ns_proxy_sim_config *config,
+                       struct ipc_sim_app *app)
+{
+    int ret;
+    char path[NS_PROXY_MAX_PATH];
+
+    memset(&ns_proxy, 0, sizeof(ns_proxy));
+    ns_proxy.config = *config;
+    ns_proxy.app = app;
+    ns_proxy.msg_size = NS_PROXY_DEFAULT_MSG_SIZE;
+    pthread_mutex_init(&ns_proxy.stats_lock, NULL);
+
+    snprintf(path, sizeof(path), "%s/rpmb", config->dir);
+    ret = rpmb_dev_sim_init(&ns_proxy.rpmb, path, config->rpmb_block_count,
+                            config->rpmb_max_write, hwkey_sim_rpmb_key);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = pthread_create(&ns_proxy.thread, NULL, ns_proxy_thread, NULL);
+    if (ret) {
+        rpmb_dev_sim_uninit(&ns_proxy.rpmb);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * ns_proxy_sim_stop - Wait for proxy thread to exit and close files
+ *
+ * Call after ipc_sim_shutdown.
+ */
+void ns_proxy_sim_stop(void)
+{
+    int i;
+
+    pthread_join(ns_proxy.thread, NULL);
+    for (i = 0; i < NS_PROXY_MAX_FILES; i++) {
+        if (ns_proxy.files[i]) {
+            fclose(ns_proxy.files[i]);
+            ns_proxy.files[i] = NULL;
+        }
+    }
+    rpmb_dev_sim_uninit(&ns_proxy.rpmb);
+}
+
+void ns_proxy_sim_get_stats(struct ns_proxy_sim_stats *stats)
+{
+    pthread_mutex_lock(&ns_proxy.stats_lock);
+    *stats = ns_proxy.stats;
+    pthread_mutex_unlock(&ns_proxy.stats_lock);
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * struct ns_proxy_sim_config - Proxy configuration
+ * @dir:                Directory for non-secure files and the rpmb image.
+ * @rpmb_block_count:   Size of emulated rpmb partition in 256 byte blocks.
+ * @rpmb_max_write:     Max number of blocks per authenticated rpmb write.
+ * @rpmb_latency_us:    Simulated latency added to each rpmb request.
+ * @ns_latency_us:      Simulated latency added to each non-secure file read
+ *                      or write request.
+ * @max_msg_size:       Largest message size the proxy accepts in
+ *                      STORAGE_NEGOTIATE, or 0 to reject STORAGE_NEGOTIATE
+ *                      like proxies that do not support it.
+ */
+struct ns_proxy_sim_config {
+    const char *dir;
+    uint16_t rpmb_block_count;
+    uint16_t rpmb_max_write;
+    uint32_t rpmb_latency_us;
+    uint32_t ns_latency_us;
+    uint32_t max_msg_size;
+};
+
+/**
+ * struct ns_proxy_sim_stats - Requests handled by the proxy
+ * @ns_reads:           Number of non-secure file read requests.
+ * @ns_writes:          Number of non-secure file write requests, including
+ *                      batched writes.
+ * @ns_read_bytes:      Bytes read from non-secure files.
+ * @ns_write_bytes:     Bytes written to non-secure files.
+ * @rpmb_reads:         Number of rpmb requests that did not write.
+ * @rpmb_writes:        Number of authenticated rpmb writes.
+ * @rpmb_write_blocks:  Number of rpmb blocks written.
+ * @syncs:              Number of requests with pre or post commit flags.
+ */
+struct ns_proxy_sim_stats {
+    uint64_t ns_reads;
+    uint64_t ns_writes;
+    uint64_t ns_read_bytes;
+    uint64_t ns_write_bytes;
+    uint64_t rpmb_reads;
+    uint64_t rpmb_writes;
+    uint64_t rpmb_write_blocks;
+    uint64_t syncs;
+};
+
+struct ipc_sim_app;
+
+int ns_proxy_sim_start(const struct ns_proxy_sim_config *config,
+                       struct ipc_sim_app *app);
+void ns_proxy_sim_stop(void);
+void ns_proxy_sim_get_stats(struct ns_proxy_sim_stats *stats);
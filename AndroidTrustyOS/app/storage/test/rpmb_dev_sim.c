@@ -0,0 +1,350 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Emulated RPMB partition. Implements the authenticated data frames the
+ * storage server sends through the non-secure proxy: program key is not
+ * supported (the key is provisioned at init), everything else checks MACs,
+ * nonces, addresses and the write counter like a device would.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/hmac.h>
+#include <openssl/mem.h>
+
+#include "rpmb_dev_sim.h"
+
+#define RPMB_DEV_SIM_DEBUG 0
+
+#if RPMB_DEV_SIM_DEBUG
+#define rpmb_dev_dprintf(args...) fprintf(stderr, "rpmb_dev: " args)
+#else
+#define rpmb_dev_dprintf(args...) do { } while (0)
+#endif
+
+/* Same frame layout as in rpmb.c */
+struct rpmb_dev_packet {
+    uint8_t     pad[196];
+    uint8_t     key_mac[32];
+    uint8_t     data[256];
+    uint8_t     nonce[16];
+    uint8_t     write_counter[4];
+    uint8_t     address[2];
+    uint8_t     block_count[2];
+    uint8_t     result[2];
+    uint8_t     req_resp[2];
+};
+STATIC_ASSERT(sizeof(struct rpmb_dev_packet) == RPMB_DEV_SIM_FRAME_SIZE);
+
+#define RPMB_DEV_MAC_OFFSET offsetof(struct rpmb_dev_packet, data)
+#define RPMB_DEV_MAC_SIZE (sizeof(struct rpmb_dev_packet) - RPMB_DEV_MAC_OFFSET)
+
+enum {
+    RPMB_DEV_REQ_PROGRAM_KEY    = 0x0001,
+    RPMB_DEV_REQ_GET_COUNTER    = 0x0002,
+    RPMB_DEV_REQ_DATA_WRITE     = 0x0003,
+    RPMB_DEV_REQ_DATA_READ      = 0x0004,
+    RPMB_DEV_REQ_RESULT_READ    = 0x0005,
+
+    RPMB_DEV_RESP_PROGRAM_KEY   = 0x0100,
+    RPMB_DEV_RESP_GET_COUNTER   = 0x0200,
+    RPMB_DEV_RESP_DATA_WRITE    = 0x0300,
+    RPMB_DEV_RESP_DATA_READ     = 0x0400,
+
+    RPMB_DEV_RES_OK             = 0x0000,
+    RPMB_DEV_RES_GENERAL_FAILURE = 0x0001,
+    RPMB_DEV_RES_AUTH_FAILURE   = 0x0002,
+    RPMB_DEV_RES_COUNT_FAILURE  = 0x0003,
+    RPMB_DEV_RES_ADDR_FAILURE   = 0x0004,
+};
+
+static uint16_t rpmb_dev_get_u16(const uint8_t *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+static uint32_t rpmb_dev_get_u32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void rpmb_dev_set_u16(uint8_t *p, uint16_t val)
+{
+    p[0] = val >> 8;
+    p[1] = val;
+}
+
+static void rpmb_dev_set_u32(uint8_t *p, uint32_t val)
+{
+    p[0] = val >> 24;
+    p[1] = val >> 16;
+    p[2] = val >> 8;
+    p[3] = val;
+}
+
+static void rpmb_dev_mac(struct rpmb_dev_sim *dev,
+                         const struct rpmb_dev_packet *packet, size_t count,
+                         uint8_t *mac)
+{
+    size_t i;
+    unsigned int md_len;
+    uint8_t buf[count * RPMB_DEV_MAC_SIZE];
+
+    for (i = 0; i < count; i++) {
+        memcpy(buf + i * RPMB_DEV_MAC_SIZE,
+               (const uint8_t *)&packet[i] + RPMB_DEV_MAC_OFFSET,
+               RPMB_DEV_MAC_SIZE);
+    }
+    HMAC(EVP_sha256(), dev->key, sizeof(dev->key), buf, sizeof(buf), mac,
+         &md_len);
+    assert(md_len == sizeof(packet->key_mac));
+}
+
+static int rpmb_dev_save(struct rpmb_dev_sim *dev, uint16_t addr,
+                         uint16_t count)
+{
+    uint8_t counter[4];
+
+    if (!dev->file) {
+        return 0;
+    }
+    rpmb_dev_set_u32(counter, dev->write_counter);
+    if (fseek(dev->file, (long)addr * RPMB_DEV_SIM_BLOCK_SIZE, SEEK_SET) ||
+        fwrite(dev->data + addr * RPMB_DEV_SIM_BLOCK_SIZE,
+               RPMB_DEV_SIM_BLOCK_SIZE, count, dev->file) != count ||
+        fseek(dev->file, (long)dev->block_count * RPMB_DEV_SIM_BLOCK_SIZE,
+              SEEK_SET) ||
+        fwrite(counter, sizeof(counter), 1, dev->file) != 1 ||
+        fflush(dev->file)) {
+        return -1;
+    }
+    return 0;
+}
+
+static void rpmb_dev_data_write(struct rpmb_dev_sim *dev,
+                                const struct rpmb_dev_packet *cmd,
+                                size_t count)
+{
+    size_t i;
+    uint8_t mac[32];
+    uint16_t result = RPMB_DEV_RES_OK;
+    uint16_t addr = rpmb_dev_get_u16(cmd[0].address);
+    struct rpmb_dev_packet *res = (struct rpmb_dev_packet *)dev->result;
+
+    rpmb_dev_mac(dev, cmd, count, mac);
+    if (count > dev->max_write ||
+        rpmb_dev_get_u16(cmd[0].block_count) != count) {
+        result = RPMB_DEV_RES_GENERAL_FAILURE;
+    } else if (CRYPTO_memcmp(mac, cmd[count - 1].key_mac, sizeof(mac))) {
+        result = RPMB_DEV_RES_AUTH_FAILURE;
+    } else if (rpmb_dev_get_u32(cmd[0].write_counter) != dev->write_counter) {
+        result = RPMB_DEV_RES_COUNT_FAILURE;
+    } else if ((size_t)addr + count > dev->block_count) {
+        result = RPMB_DEV_RES_ADDR_FAILURE;
+    } else {
+        for (i = 0; i < count; i++) {
+            memcpy(dev->data + (addr + i) * RPMB_DEV_SIM_BLOCK_SIZE,
+                   cmd[i].data, RPMB_DEV_SIM_BLOCK_SIZE);
+        }
+        dev->write_counter++;
+        if (rpmb_dev_save(dev, addr, count)) {
+            result = RPMB_DEV_RES_GENERAL_FAILURE;
+        }
+    }
+    rpmb_dev_dprintf("write addr %d, count %zd, counter %d, result %d\n",
+                     addr, count, dev->write_counter, result);
+
+    memset(res, 0, sizeof(*res));
+    rpmb_dev_set_u32(res->write_counter, dev->write_counter);
+    rpmb_dev_set_u16(res->address, addr);
+    rpmb_dev_set_u16(res->result, result);
+    rpmb_dev_set_u16(res->req_resp, RPMB_DEV_RESP_DATA_WRITE);
+    rpmb_dev_mac(dev, res, 1, res->key_mac);
+}
+
+static int rpmb_dev_read_cmd(struct rpmb_dev_sim *dev,
+                             const struct rpmb_dev_packet *cmd,
+                             struct rpmb_dev_packet *res, size_t res_count)
+{
+    size_t i;
+    uint16_t result = RPMB_DEV_RES_OK;
+    uint16_t addr;
+
+    switch (rpmb_dev_get_u16(cmd->req_resp)) {
+    case RPMB_DEV_REQ_RESULT_READ:
+        if (res_count != 1) {
+            return -1;
+        }
+        memcpy(res, dev->result, sizeof(*res));
+        return 0;
+
+    case RPMB_DEV_REQ_GET_COUNTER:
+        if (res_count != 1) {
+            return -1;
+        }
+        memset(res, 0, sizeof(*res));
+        memcpy(res->nonce, cmd->nonce, sizeof(res->nonce));
+        rpmb_dev_set_u32(res->write_counter, dev->write_counter);
+        rpmb_dev_set_u16(res->req_resp, RPMB_DEV_RESP_GET_COUNTER);
+        rpmb_dev_mac(dev, res, 1, res->key_mac);
+        return 0;
+
+    case RPMB_DEV_REQ_DATA_READ:
+        if (!res_count) {
+            return -1;
+        }
+        addr = rpmb_dev_get_u16(cmd->address);
+        if ((size_t)addr + res_count > dev->block_count) {
+            result = RPMB_DEV_RES_ADDR_FAILURE;
+        }
+        for (i = 0; i < res_count; i++) {
+            memset(&res[i], 0, sizeof(res[i]));
+            if (result == RPMB_DEV_RES_OK) {
+                memcpy(res[i].data,
+                       dev->data + (addr + i) * RPMB_DEV_SIM_BLOCK_SIZE,
+                       RPMB_DEV_SIM_BLOCK_SIZE);
+            }
+            memcpy(res[i].nonce, cmd->nonce, sizeof(res[i].nonce));
+            rpmb_dev_set_u16(res[i].address, addr);
+            rpmb_dev_set_u16(res[i].block_count, res_count);
+            rpmb_dev_set_u16(res[i].result, result);
+            rpmb_dev_set_u16(res[i].req_resp, RPMB_DEV_RESP_DATA_READ);
+        }
+        rpmb_dev_mac(dev, res, res_count, res[res_count - 1].key_mac);
+        return 0;
+
+    default:
+        fprintf(stderr, "rpmb_dev: unsupported request 0x%x\n",
+                rpmb_dev_get_u16(cmd->req_resp));
+        return -1;
+    }
+}
+
+/**
+ * rpmb_dev_sim_init - Open emulated RPMB partition
+ * @dev:            Device state to initialize.
+ * @path:           Backing file, or %NULL to keep data in memory only. Created
+ *                  if it does not exist or does not match @block_count.
+ * @block_count:    Number of 256 byte blocks.
+ * @max_write:      Max number of blocks in a single authenticated write.
+ * @key:            32 byte authentication key.
+ *
+ * Return: 0 on success, -1 on error.
+ */
+int rpmb_dev_sim_init(struct rpmb_dev_sim *dev, const char *path,
+                      uint16_t block_count, uint16_t max_write,
+                      const uint8_t *key)
+{
+    size_t size = (size_t)block_count * RPMB_DEV_SIM_BLOCK_SIZE;
+    uint8_t counter[4];
+    bool loaded = false;
+
+    memset(dev, 0, sizeof(*dev));
+    memcpy(dev->key, key, sizeof(dev->key));
+    dev->block_count = block_count;
+    dev->max_write = max_write;
+    dev->data = calloc(1, size);
+    if (!dev->data) {
+        return -1;
+    }
+    if (!path) {
+        return 0;
+    }
+
+    dev->file = fopen(path, "r+b");
+    if (dev->file) {
+        loaded = fread(dev->data, 1, size, dev->file) == size &&
+                 fread(counter, 1, sizeof(counter), dev->file) ==
+                 sizeof(counter);
+    }
+    if (loaded) {
+        dev->write_counter = rpmb_dev_get_u32(counter);
+        return 0;
+    }
+
+    /* new device */
+    if (dev->file) {
+        fclose(dev->file);
+    }
+    memset(dev->data, 0, size);
+    dev->file = fopen(path, "w+b");
+    if (!dev->file || rpmb_dev_save(dev, 0, block_count)) {
+        fprintf(stderr, "rpmb_dev: failed to create %s\n", path);
+        rpmb_dev_sim_uninit(dev);
+        return -1;
+    }
+    return 0;
+}
+
+void rpmb_dev_sim_uninit(struct rpmb_dev_sim *dev)
+{
+    if (dev->file) {
+        fclose(dev->file);
+        dev->file = NULL;
+    }
+    free(dev->data);
+    dev->data = NULL;
+}
+
+/**
+ * rpmb_dev_sim_send - Handle STORAGE_RPMB_SEND payload
+ * @dev:                    Device state.
+ * @reliable_write_buf:     Frames to send as a reliable write.
+ * @reliable_write_size:    Size of @reliable_write_buf.
+ * @write_buf:              Request frame.
+ * @write_size:             Size of @write_buf.
+ * @read_buf:               Buffer for response frames.
+ * @read_size:              Size of @read_buf.
+ *
+ * Return: 0 on success, -1 if the request is malformed.
+ */
+int rpmb_dev_sim_send(struct rpmb_dev_sim *dev,
+                      const void *reliable_write_buf,
+                      size_t reliable_write_size,
+                      const void *write_buf, size_t write_size,
+                      void *read_buf, size_t read_size)
+{
+    const struct rpmb_dev_packet *cmd;
+    size_t frame = sizeof(struct rpmb_dev_packet);
+
+    if (reliable_write_size % frame || write_size % frame ||
+        read_size % frame) {
+        return -1;
+    }
+
+    if (reliable_write_size) {
+        cmd = reliable_write_buf;
+        if (rpmb_dev_get_u16(cmd->req_resp) != RPMB_DEV_REQ_DATA_WRITE) {
+            fprintf(stderr, "rpmb_dev: unsupported reliable write 0x%x\n",
+                    rpmb_dev_get_u16(cmd->req_resp));
+            return -1;
+        }
+        rpmb_dev_data_write(dev, cmd, reliable_write_size / frame);
+    }
+
+    if (write_size) {
+        if (write_size != frame) {
+            return -1;
+        }
+        return rpmb_dev_read_cmd(dev, write_buf, read_buf, read_size / frame);
+    }
+
+    return read_size ? -1 : 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define RPMB_DEV_SIM_BLOCK_SIZE 256
+#define RPMB_DEV_SIM_FRAME_SIZE 512
+
+/**
+ * struct rpmb_dev_sim - Emulated RPMB partition
+ * @file:           Backing file. Holds @block_count data blocks followed by
+ *                  the write counter.
+ * @key:            Authentication key.
+ * @block_count:    Number of 256 byte blocks.
+ * @max_write:      Max number of blocks in a single authenticated write.
+ * @write_counter:  Write counter.
+ * @result:         Response frame returned by the next result read request.
+ * @data:           Block data.
+ */
+struct rpmb_dev_sim {
+    FILE *file;
+    uint8_t key[32];
+    uint16_t block_count;
+    uint16_t max_write;
+    uint32_t write_counter;
+    uint8_t result[RPMB_DEV_SIM_FRAME_SIZE];
+    uint8_t *data;
+};
+
+int rpmb_dev_sim_init(struct rpmb_dev_sim *dev, const char *path,
+                      uint16_t block_count, uint16_t max_write,
+                      const uint8_t *key);
+void rpmb_dev_sim_uninit(struct rpmb_dev_sim *dev);
+int rpmb_dev_sim_send(struct rpmb_dev_sim *dev,
+                      const void *reliable_write_buf,
+                      size_t reliable_write_size,
+                      const void *write_buf, size_t write_size,
+                      void *read_buf, size_t read_size);
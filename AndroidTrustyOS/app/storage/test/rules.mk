@@ -25,12 +25,13 @@ SRCS := \
 	$(LOCAL_DIR)/../block_set.c \
 	$(LOCAL_DIR)/../block_tree.c \
 	$(LOCAL_DIR)/../crypt.c \
+	$(LOCAL_DIR)/../debug_stats.c \
 	$(LOCAL_DIR)/../file.c \
 	$(LOCAL_DIR)/../super.c \
 	$(LOCAL_DIR)/../transaction.c \
 	$(LOCAL_DIR)/block_test.c \
 
-$(TOOL): TOOL_CFLAGS := -DBUILD_STORAGE_TEST=1
+$(TOOL): TOOL_CFLAGS := -DBUILD_STORAGE_TEST=1 -DAPP_STORAGE_STATS=1
 
 $(TOOL): FORCE_INCLUDE := \
 	-include $(LOCAL_DIR)/trusty_std.h \
@@ -44,6 +45,49 @@ $(TOOL): $(SRCS)
 
 host_tests: $(TOOL)
 
+BENCH := $(SAVED_BUILDDIR)/host_tests/storage_bench
+
+BENCH_SRCS := \
+	$(LOCAL_DIR)/../block_allocator.c \
+	$(LOCAL_DIR)/../block_cache.c \
+	$(LOCAL_DIR)/../block_device_tipc.c \
+	$(LOCAL_DIR)/../block_mac.c \
+	$(LOCAL_DIR)/../block_map.c \
+	$(LOCAL_DIR)/../block_set.c \
+	$(LOCAL_DIR)/../block_tree.c \
+	$(LOCAL_DIR)/../client_tipc.c \
+	$(LOCAL_DIR)/../crypt.c \
+	$(LOCAL_DIR)/../debug_stats.c \
+	$(LOCAL_DIR)/../file.c \
+	$(LOCAL_DIR)/../ipc.c \
+	$(LOCAL_DIR)/../proxy.c \
+	$(LOCAL_DIR)/../rpmb.c \
+	$(LOCAL_DIR)/../super.c \
+	$(LOCAL_DIR)/../tipc_ns.c \
+	$(LOCAL_DIR)/../transaction.c \
+	$(LOCAL_DIR)/../../../lib/lib/storage/storage.c \
+	$(LOCAL_DIR)/hwkey_sim.c \
+	$(LOCAL_DIR)/ipc_sim.c \
+	$(LOCAL_DIR)/ns_proxy_sim.c \
+	$(LOCAL_DIR)/rpmb_dev_sim.c \
+	$(LOCAL_DIR)/storage_bench.c \
+
+$(BENCH): TOOL_CFLAGS := -DAPP_STORAGE_STATS=1
+
+# host <err.h> would otherwise shadow the lk error codes
+$(BENCH): FORCE_INCLUDE := \
+	-include $(LOCAL_DIR)/trusty_std.h \
+	-include $(LOCAL_DIR)/../../../external/lk/include/err.h \
+
+$(BENCH): TOOL_INCLUDE := $(LOCAL_DIR) -I$(LOCAL_DIR)/../../../lib/lib/storage/include
+
+$(BENCH): $(BENCH_SRCS)
+	@echo building $@
+	@$(MKDIR)
+	@gcc $^ $(FORCE_INCLUDE) -I$(TOOL_INCLUDE) $(TOOL_CFLAGS) $(subst -I,-idirafter,$(GLOBAL_INCLUDES)) -lcrypto -lpthread -g -Wall -Werror -o $@
+
+host_tests: $(BENCH)
+
 $(TOOL)_run: $(TOOL) .PHONY
 	@echo running $<
 	gdb -batch -ex run -ex where $(TOOL)
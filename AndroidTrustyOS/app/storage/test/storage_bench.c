@@ -0,0 +1,570 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * End-to-end storage benchmark. Runs the storage server (client_tipc.c,
+ * tipc_ns.c, block_device_tipc.c, rpmb.c and the file system) on one thread,
+ * a file backed non-secure proxy with an emulated rpmb partition on another,
+ * and a workload that uses lib/storage on the main thread. All threads talk
+ * through the simulated ipc syscalls in ipc_sim.c.
+ *
+ * Usage: storage_bench [--option=value]..., see bench_usage.
+ */
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <lib/storage/storage.h>
+
+#include "../block_cache.h"
+#include "../block_device_tipc.h"
+#include "../ipc.h"
+#include "../proxy.h"
+#include "ipc_sim.h"
+#include "ns_proxy_sim.h"
+
+#define BENCH_MAX_FILES 64
+
+/**
+ * struct bench_config - Workload parameters
+ * @port:           Storage port to connect to.
+ * @files:          Number of files.
+ * @file_size:      Size of each file.
+ * @io_size:        Size of each read or write.
+ * @ops:            Number of reads and writes in the mixed phase.
+ * @read_percent:   Percentage of reads in the mixed phase.
+ * @ops_per_commit: Number of writes per transaction in the mixed phase.
+ * @seed:           Random seed.
+ * @read_ahead:     Server read-ahead window in blocks, or %UINT32_MAX to
+ *                  keep the server default.
+ */
+struct bench_config {
+    const char *port;
+    uint32_t files;
+    uint32_t file_size;
+    uint32_t io_size;
+    uint32_t ops;
+    uint32_t read_percent;
+    uint32_t ops_per_commit;
+    uint32_t seed;
+    uint32_t read_ahead;
+};
+
+/**
+ * struct bench_counters - Counters sampled at the start and end of a phase
+ * @time:   Time in ns.
+ * @client: Messages sent by the workload.
+ * @server: Messages sent by the storage server, to the workload or proxy.
+ * @proxy:  Messages sent by the proxy.
+ * @ns:     Requests handled by the proxy.
+ */
+struct bench_counters {
+    int64_t time;
+    struct ipc_sim_stats client;
+    struct ipc_sim_stats server;
+    struct ipc_sim_stats proxy;
+    struct ns_proxy_sim_stats ns;
+};
+
+/**
+ * struct bench_latency - Commit latency samples
+ * @count:  Number of entries in @ns.
+ * @max:    Allocated size of @ns.
+ * @ns:     Samples in ns.
+ */
+struct bench_latency {
+    size_t count;
+    size_t max;
+    int64_t *ns;
+};
+
+static struct ipc_sim_app *bench_client_app;
+static struct ipc_sim_app *bench_server_app;
+static struct ipc_sim_app *bench_proxy_app;
+static uint32_t bench_rand_state;
+
+static uint32_t bench_rand(void)
+{
+    /* xorshift32, deterministic for a given --seed */
+    bench_rand_state ^= bench_rand_state << 13;
+    bench_rand_state ^= bench_rand_state >> 17;
+    bench_rand_state ^= bench_rand_state << 5;
+    return bench_rand_state;
+}
+
+static int64_t bench_now(void)
+{
+    int64_t now;
+
+    gettime(0, 0, &now);
+    return now;
+}
+
+static void *bench_server_thread(void *arg)
+{
+    int rc;
+    /* same setup as main.c */
+    struct ipc_port_context ctx = {
+        .ops = {
+            .on_connect = proxy_connect,
+        }
+    };
+
+    ipc_sim_app_enter(bench_server_app);
+
+    block_cache_init();
+
+    rc = ipc_port_create(&ctx, STORAGE_DISK_PROXY_PORT, 1,
+                         BLOCK_DEVICE_TIPC_NS_MAX_IO_SIZE,
+                         IPC_PORT_ALLOW_TA_CONNECT | IPC_PORT_ALLOW_NS_CONNECT);
+    if (rc < 0) {
+        fprintf(stderr, "fatal: unable to initialize proxy endpoint (%d)\n",
+                rc);
+        return NULL;
+    }
+
+    ipc_loop();
+
+    ipc_port_destroy(&ctx);
+    return NULL;
+}
+
+static void bench_sample(struct bench_counters *counters)
+{
+    counters->time = bench_now();
+    ipc_sim_app_get_stats(bench_client_app, &counters->client);
+    ipc_sim_app_get_stats(bench_server_app, &counters->server);
+    ipc_sim_app_get_stats(bench_proxy_app, &counters->proxy);
+    ns_proxy_sim_get_stats(&counters->ns);
+}
+
+static void bench_print_header(void)
+{
+    printf("%-8s %8s %10s %8s %8s %8s %8s %8s %8s %8s %8s\n",
+           "phase", "ops", "ops/s", "MB/s", "cli/op", "srv/op", "prx/op",
+           "nsrd/op", "nswr/op", "rpmbr/op", "rpmbw/op");
+}
+
+static void bench_print_phase(const char *name, uint64_t ops, uint64_t bytes,
+                              const struct bench_counters *start,
+                              const struct bench_counters *end)
+{
+    double sec = (end->time - start->time) / 1e9;
+    double n = ops ? ops : 1;
+
+#define BENCH_PER_OP(field) ((end->field - start->field) / n)
+    printf("%-8s %8llu %10.1f %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f\n",
+           name, (unsigned long long)ops, ops / sec, bytes / sec / 1e6,
+           BENCH_PER_OP(client.msgs_sent), BENCH_PER_OP(server.msgs_sent),
+           BENCH_PER_OP(proxy.msgs_sent), BENCH_PER_OP(ns.ns_reads),
+           BENCH_PER_OP(ns.ns_writes), BENCH_PER_OP(ns.rpmb_reads),
+           BENCH_PER_OP(ns.rpmb_writes));
+#undef BENCH_PER_OP
+}
+
+static void bench_latency_add(struct bench_latency *lat, int64_t ns)
+{
+    if (lat->count == lat->max) {
+        lat->max = lat->max ? lat->max * 2 : 64;
+        lat->ns = realloc(lat->ns, lat->max * sizeof(*lat->ns));
+        assert(lat->ns);
+    }
+    lat->ns[lat->count++] = ns;
+}
+
+static int bench_cmp_int64(const void *a, const void *b)
+{
+    int64_t va = *(const int64_t *)a;
+    int64_t vb = *(const int64_t *)b;
+
+    return va < vb ? -1 : va > vb;
+}
+
+static void bench_print_latency(const char *name, struct bench_latency *lat)
+{
+    if (!lat->count) {
+        return;
+    }
+    qsort(lat->ns, lat->count, sizeof(*lat->ns), bench_cmp_int64);
+    printf("%s latency: count %zu, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+           name, lat->count, lat->ns[lat->count / 2] / 1e3,
+           lat->ns[(lat->count * 99) / 100] / 1e3,
+           lat->ns[lat->count - 1] / 1e3);
+}
+
+/**
+ * bench_print_server_stats - Print server read-ahead and tree walk counters
+ * @session:    Storage session.
+ *
+ * Read the cache_prefetch_*, tree_walk and set_iter_* event counters with
+ * STORAGE_DEBUG_GET_STATS. The counters cover the whole run. Each set iterator
+ * step that reused its saved path would have walked the tree from the root
+ * with block_set_find_next_range, so the tree walk count without set
+ * iterators is tree_walk + set_iter_reuse.
+ */
+static void bench_print_server_stats(storage_session_t session)
+{
+    int rc;
+    uint32_t i;
+    uint32_t first = 0;
+    uint64_t issued = 0;
+    uint64_t hits = 0;
+    uint64_t wasted = 0;
+    uint64_t walks = 0;
+    uint64_t iter_walks = 0;
+    uint64_t iter_reuses = 0;
+    struct storage_stats_counter *counter;
+    struct {
+        struct storage_debug_get_stats_resp resp;
+        struct storage_stats_counter counters[16];
+    } buf;
+
+    do {
+        rc = storage_debug_get_stats(session, first, false, &buf.resp,
+                                     sizeof(buf));
+        if (rc < 0) {
+            fprintf(stderr, "failed to get server stats (%d)\n", rc);
+            return;
+        }
+        for (i = 0; i < buf.resp.count; i++) {
+            counter = &buf.resp.counters[i];
+            if (!strcmp(counter->name, "cache_prefetch_issued")) {
+                issued = counter->count;
+            } else if (!strcmp(counter->name, "cache_prefetch_hit")) {
+                hits = counter->count;
+            } else if (!strcmp(counter->name, "cache_prefetch_wasted")) {
+                wasted = counter->count;
+            } else if (!strcmp(counter->name, "tree_walk")) {
+                walks = counter->count;
+            } else if (!strcmp(counter->name, "set_iter_walk")) {
+                iter_walks = counter->count;
+            } else if (!strcmp(counter->name, "set_iter_reuse")) {
+                iter_reuses = counter->count;
+            }
+        }
+        first += buf.resp.count;
+    } while (buf.resp.count && first < buf.resp.total_count);
+
+    printf("prefetch: issued %llu, hits %llu, wasted %llu\n",
+           (unsigned long long)issued, (unsigned long long)hits,
+           (unsigned long long)wasted);
+    printf("tree walks: %llu, %llu without set iterators; "
+           "set iterator steps: %llu walked, %llu reused\n",
+           (unsigned long long)walks,
+           (unsigned long long)(walks + iter_reuses),
+           (unsigned long long)iter_walks, (unsigned long long)iter_reuses);
+}
+
+static int bench_commit(storage_session_t session, struct bench_latency *lat)
+{
+    int rc;
+    int64_t start = bench_now();
+
+    rc = storage_end_transaction(session, true);
+    if (rc < 0) {
+        fprintf(stderr, "commit failed (%d)\n", rc);
+        return rc;
+    }
+    bench_latency_add(lat, bench_now() - start);
+    return 0;
+}
+
+static int bench_run(const struct bench_config *config)
+{
+    int rc;
+    uint32_t i;
+    uint32_t f;
+    uint32_t writes = 0;
+    uint64_t bytes = 0;
+    uint64_t off;
+    ssize_t len;
+    char name[32];
+    storage_session_t session;
+    file_handle_t files[BENCH_MAX_FILES];
+    struct bench_counters start;
+    struct bench_counters end;
+    struct bench_latency create_lat = {0};
+    struct bench_latency commit_lat = {0};
+    uint8_t *buf;
+
+    buf = malloc(config->io_size > config->file_size ? config->io_size :
+                                                       config->file_size);
+    assert(buf);
+
+    rc = storage_open_session(&session, config->port);
+    if (rc < 0) {
+        fprintf(stderr, "failed to open session (%d)\n", rc);
+        goto err_open_session;
+    }
+
+    if (config->read_ahead != UINT32_MAX) {
+        rc = storage_debug_set_read_ahead(session, config->read_ahead);
+        if (rc < 0) {
+            fprintf(stderr, "failed to set read-ahead window (%d)\n", rc);
+            goto err_set_read_ahead;
+        }
+    }
+
+    bench_print_header();
+
+    /* create and fill files, one transaction per file */
+    bench_sample(&start);
+    for (f = 0; f < config->files; f++) {
+        int64_t t = bench_now();
+
+        snprintf(name, sizeof(name), "bench_%u", f);
+        memset(buf, f, config->file_size);
+        rc = storage_open_file(session, &files[f], name,
+                               STORAGE_FILE_OPEN_CREATE |
+                               STORAGE_FILE_OPEN_TRUNCATE, 0);
+        if (rc < 0) {
+            fprintf(stderr, "failed to create %s (%d)\n", name, rc);
+            goto err_create;
+        }
+        len = storage_write(files[f], 0, buf, config->file_size,
+                            STORAGE_OP_COMPLETE);
+        if (len != (ssize_t)config->file_size) {
+            fprintf(stderr, "failed to write %s (%zd)\n", name, len);
+            f++;
+            rc = len < 0 ? len : ERR_IO;
+            goto err_create;
+        }
+        bench_latency_add(&create_lat, bench_now() - t);
+    }
+    bench_sample(&end);
+    bench_print_phase("create", config->files,
+                      (uint64_t)config->files * config->file_size,
+                      &start, &end);
+
+    /* mixed reads and writes */
+    bench_sample(&start);
+    for (i = 0; i < config->ops; i++) {
+        f = bench_rand() % config->files;
+        off = (uint64_t)(bench_rand() %
+                         (config->file_size / config->io_size)) *
+              config->io_size;
+        if (bench_rand() % 100 < config->read_percent) {
+            len = storage_read(files[f], off, buf, config->io_size);
+        } else {
+            len = storage_write(files[f], off, buf, config->io_size, 0);
+            if (++writes == config->ops_per_commit) {
+                writes = 0;
+                rc = bench_commit(session, &commit_lat);
+                if (rc < 0) {
+                    goto err_mixed;
+                }
+            }
+        }
+        if (len != (ssize_t)config->io_size) {
+            fprintf(stderr, "io failed (%zd)\n", len);
+            rc = len < 0 ? len : ERR_IO;
+            goto err_mixed;
+        }
+        bytes += len;
+    }
+    if (writes) {
+        rc = bench_commit(session, &commit_lat);
+        if (rc < 0) {
+            goto err_mixed;
+        }
+    }
+    bench_sample(&end);
+    bench_print_phase("mixed", config->ops, bytes, &start, &end);
+
+    /* delete files in one transaction */
+    bench_sample(&start);
+    for (i = 0; i < config->files; i++) {
+        storage_close_file(files[i]);
+        snprintf(name, sizeof(name), "bench_%u", i);
+        rc = storage_delete_file(session, name, 0);
+        if (rc < 0) {
+            fprintf(stderr, "failed to delete %s (%d)\n", name, rc);
+        }
+    }
+    f = 0;
+    rc = bench_commit(session, &commit_lat);
+    bench_sample(&end);
+    bench_print_phase("delete", config->files, 0, &start, &end);
+
+    bench_print_latency("create", &create_lat);
+    bench_print_latency("commit", &commit_lat);
+    bench_print_server_stats(session);
+
+err_mixed:
+err_create:
+    while (f--) {
+        storage_close_file(files[f]);
+    }
+err_set_read_ahead:
+    storage_close_session(session);
+err_open_session:
+    free(create_lat.ns);
+    free(commit_lat.ns);
+    free(buf);
+    return rc;
+}
+
+static void bench_usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --dir=PATH              directory for ns files and rpmb image\n"
+            "  --port=td|tdea|tp       storage port (td)\n"
+            "  --files=N               number of files (4)\n"
+            "  --file-size=BYTES       size of each file (65536)\n"
+            "  --io-size=BYTES         size of each read or write (4096)\n"
+            "  --ops=N                 reads and writes in mixed phase (1000)\n"
+            "  --read-percent=N        percentage of reads (50)\n"
+            "  --ops-per-commit=N      writes per transaction (1)\n"
+            "  --seed=N                random seed (1)\n"
+            "  --read-ahead=N          server read-ahead window in blocks\n"
+            "                          (server default)\n"
+            "  --rpmb-blocks=N         rpmb partition size in 256 byte blocks (4096)\n"
+            "  --rpmb-max-write=N      max blocks per rpmb write (2)\n"
+            "  --rpmb-latency-us=N     added latency per rpmb request (0)\n"
+            "  --ns-latency-us=N       added latency per ns read or write (0)\n"
+            "  --proxy-msg-size=BYTES  max proxy message size, 0 if the proxy\n"
+            "                          does not support STORAGE_NEGOTIATE (16384)\n",
+            prog);
+}
+
+static bool bench_parse_u32(const char *arg, const char *name, uint32_t *val)
+{
+    size_t len = strlen(name);
+    char *end;
+
+    if (strncmp(arg, name, len) || arg[len] != '=') {
+        return false;
+    }
+    *val = strtoul(arg + len + 1, &end, 0);
+    if (*end) {
+        fprintf(stderr, "bad value for %s\n", name);
+        exit(1);
+    }
+    return true;
+}
+
+int main(int argc, const char *argv[])
+{
+    int i;
+    int rc;
+    uint32_t rpmb_blocks = 4096;
+    uint32_t rpmb_max_write = 2;
+    const char *port = "td";
+    pthread_t server_thread;
+    struct ns_proxy_sim_config proxy_config = {
+        .dir = "storage_bench_data",
+        .max_msg_size = 16384,
+    };
+    struct bench_config config = {
+        .files = 4,
+        .file_size = 65536,
+        .io_size = 4096,
+        .ops = 1000,
+        .read_percent = 50,
+        .ops_per_commit = 1,
+        .seed = 1,
+        .read_ahead = UINT32_MAX,
+    };
+
+    /* keep results in order with log messages on stderr */
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    for (i = 1; i < argc; i++) {
+        if (!strncmp(argv[i], "--dir=", 6)) {
+            proxy_config.dir = argv[i] + 6;
+        } else if (!strncmp(argv[i], "--port=", 7)) {
+            port = argv[i] + 7;
+        } else if (!bench_parse_u32(argv[i], "--files", &config.files) &&
+                   !bench_parse_u32(argv[i], "--file-size", &config.file_size) &&
+                   !bench_parse_u32(argv[i], "--io-size", &config.io_size) &&
+                   !bench_parse_u32(argv[i], "--ops", &config.ops) &&
+                   !bench_parse_u32(argv[i], "--read-percent",
+                                    &config.read_percent) &&
+                   !bench_parse_u32(argv[i], "--ops-per-commit",
+                                    &config.ops_per_commit) &&
+                   !bench_parse_u32(argv[i], "--seed", &config.seed) &&
+                   !bench_parse_u32(argv[i], "--read-ahead",
+                                    &config.read_ahead) &&
+                   !bench_parse_u32(argv[i], "--rpmb-blocks", &rpmb_blocks) &&
+                   !bench_parse_u32(argv[i], "--rpmb-max-write",
+                                    &rpmb_max_write) &&
+                   !bench_parse_u32(argv[i], "--rpmb-latency-us",
+                                    &proxy_config.rpmb_latency_us) &&
+                   !bench_parse_u32(argv[i], "--ns-latency-us",
+                                    &proxy_config.ns_latency_us) &&
+                   !bench_parse_u32(argv[i], "--proxy-msg-size",
+                                    &proxy_config.max_msg_size)) {
+            bench_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!strcmp(port, "td")) {
+        config.port = STORAGE_CLIENT_TD_PORT;
+    } else if (!strcmp(port, "tdea")) {
+        config.port = STORAGE_CLIENT_TDEA_PORT;
+    } else if (!strcmp(port, "tp")) {
+        config.port = STORAGE_CLIENT_TP_PORT;
+    } else {
+        bench_usage(argv[0]);
+        return 1;
+    }
+    if (!config.files || config.files > BENCH_MAX_FILES ||
+        !config.io_size || config.file_size < config.io_size ||
+        !config.ops_per_commit || config.read_percent > 100 ||
+        !rpmb_blocks || rpmb_blocks > UINT16_MAX || !rpmb_max_write) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+    proxy_config.rpmb_block_count = rpmb_blocks;
+    proxy_config.rpmb_max_write = rpmb_max_write;
+    bench_rand_state = config.seed ? config.seed : 1;
+
+    if (mkdir(proxy_config.dir, 0700) && errno != EEXIST) {
+        fprintf(stderr, "failed to create %s\n", proxy_config.dir);
+        return 1;
+    }
+
+    bench_client_app = ipc_sim_app_create("client");
+    bench_server_app = ipc_sim_app_create("storage");
+    bench_proxy_app = ipc_sim_app_create("proxy");
+    ipc_sim_app_enter(bench_client_app);
+
+    rc = pthread_create(&server_thread, NULL, bench_server_thread, NULL);
+    assert(!rc);
+
+    rc = ns_proxy_sim_start(&proxy_config, bench_proxy_app);
+    if (rc < 0) {
+        fprintf(stderr, "failed to start proxy (%d)\n", rc);
+        return 1;
+    }
+
+    rc = bench_run(&config);
+
+    ipc_sim_shutdown();
+    pthread_join(server_thread, NULL);
+    ns_proxy_sim_stop();
+
+    return rc < 0 ? 1 : 0;
+}
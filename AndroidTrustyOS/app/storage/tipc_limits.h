@@ -17,4 +17,26 @@
 #pragma once
 
 #define STORAGE_MAX_BUFFER_SIZE 4096
+
+/*
+ * STORAGE_MAX_MSG_SIZE:
+ * Client port message size, offered to clients with STORAGE_NEGOTIATE. Must
+ * not exceed the kernel IPC_CHAN_MAX_BUF_SIZE.
+ *
+ * STORAGE_CLIENT_RECV_BUFS:
+ * Number of messages queued in each direction of a client channel. More than
+ * one lets a streamed read send the next response while the client is still
+ * copying the previous one. The kernel allocates
+ * 2 * STORAGE_CLIENT_RECV_BUFS * STORAGE_MAX_MSG_SIZE bytes per connection.
+ */
+#ifdef APP_STORAGE_MAX_MSG_SIZE
+#define STORAGE_MAX_MSG_SIZE (APP_STORAGE_MAX_MSG_SIZE)
+#else
+#define STORAGE_MAX_MSG_SIZE (8192)
+#endif
+#ifdef APP_STORAGE_CLIENT_RECV_BUFS
+#define STORAGE_CLIENT_RECV_BUFS (APP_STORAGE_CLIENT_RECV_BUFS)
+#else
+#define STORAGE_CLIENT_RECV_BUFS (4)
+#endif
 #define STORAGE_MAX_OPEN_FILES (128)
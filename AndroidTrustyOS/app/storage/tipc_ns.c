@@ -17,6 +17,7 @@
 #include <err.h>
 #include <compiler.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <trusty_ipc.h>
 
@@ -46,7 +47,7 @@ static inline int check_response(enum storage_cmd cmd, struct storage_msg *msg,
                                  size_t read_len)
 {
 	if (read_len < sizeof(*msg)) {
-		SS_ERR("%s: invalid response size %d\n", __func__, read_len);
+		SS_ERR("%s: invalid response size %zu\n", __func__, read_len);
 		return ERR_IO;
 	}
 
@@ -125,6 +126,76 @@ int rpmb_send(void *handle_,
 	return check_response(STORAGE_RPMB_SEND, &msg, rc);
 }
 
+/**
+ * ns_negotiate - Negotiate the proxy message size
+ * @ipc_handle:     Proxy channel.
+ * @max_msg_size:   Largest message, including struct storage_msg, that the
+ *                  caller can send and receive.
+ * @msg_sizep:      Returns the message size to use, at most @max_msg_size.
+ *
+ * Return: NO_ERROR, or an error code < 0 if the proxy does not support
+ * STORAGE_NEGOTIATE. The caller should then use 4096 byte messages.
+ */
+int ns_negotiate(handle_t ipc_handle, uint32_t max_msg_size,
+                 uint32_t *msg_sizep)
+{
+	struct storage_negotiate_resp resp;
+
+	struct storage_negotiate_req req = {
+		.max_msg_size = max_msg_size,
+	};
+
+	struct storage_msg msg = {
+		.cmd = STORAGE_NEGOTIATE,
+		.size = sizeof(msg) + sizeof(req),
+	};
+
+	iovec_t tx_iov[] = {
+		{
+			.base = &msg,
+			.len = sizeof(msg),
+		},
+		{
+			.base = &req,
+			.len = sizeof(req),
+		},
+	};
+
+	iovec_t rx_iov[] = {
+		{
+			.base = &msg,
+			.len = sizeof(msg),
+		},
+		{
+			.base = &resp,
+			.len = sizeof(resp),
+		}
+	};
+
+	int rc = sync_ipc_send_msg(ipc_handle, tx_iov, countof(tx_iov),
+	                           rx_iov, countof(rx_iov));
+	if (rc < 0) {
+		SS_ERR("%s: negotiate failed, %d\n", __func__, rc);
+		return rc;
+	}
+
+	size_t bytes_read = (size_t) rc;
+
+	rc = check_response(STORAGE_NEGOTIATE, &msg, bytes_read);
+	if (rc != NO_ERROR) {
+		return rc;
+	}
+
+	if (bytes_read != sizeof(msg) + sizeof(resp)) {
+		SS_ERR("%s: invalid response size (%zu)\n", __func__, bytes_read);
+		return ERR_NOT_VALID;
+	}
+
+	*msg_sizep = MIN(resp.max_msg_size, max_msg_size);
+
+	return NO_ERROR;
+}
+
 int ns_open_file(handle_t ipc_handle, const char *fname,
                  ns_handle_t *handlep, bool create)
 {
@@ -185,7 +256,7 @@ int ns_open_file(handle_t ipc_handle, const char *fname,
 	}
 
 	if (bytes_read != sizeof(msg) + sizeof(resp)) {
-		SS_ERR("%s: open failed, invalid response size (%d !=  %d)\n",
+		SS_ERR("%s: open failed, invalid response size (%zu !=  %zu)\n",
 		       __func__, bytes_read, sizeof(resp));
 		return ERR_NOT_VALID;
 	}
@@ -289,11 +360,40 @@ int ns_read_pos(handle_t ipc_handle, ns_handle_t handle, ns_off_t pos, void *dat
 	return data_len - sizeof(msg);
 }
 
-int ns_write_pos(handle_t ipc_handle, ns_handle_t handle, ns_off_t pos,
-                 const void *data, int data_size)
+/**
+ * ns_write_pos_iov - Write a contiguous range of a non-secure file
+ * @ipc_handle:     Proxy channel.
+ * @handle:         Non-secure file handle.
+ * @pos:            File offset to start writing at.
+ * @data_iov:       Buffers to write back to back starting at @pos.
+ * @data_iov_count: Number of entries in @data_iov.
+ * @batch:          If %true, set STORAGE_MSG_FLAG_BATCH and return without
+ *                  waiting for a response. The proxy reports the cumulative
+ *                  result of all batched writes in the response to the next
+ *                  write sent with @batch set to %false.
+ *
+ * Return: Number of bytes written (or queued if @batch is %true), or an error
+ * code < 0.
+ */
+int ns_write_pos_iov(handle_t ipc_handle, ns_handle_t handle, ns_off_t pos,
+                     const iovec_t *data_iov, uint data_iov_count, bool batch)
 {
-	SS_DBG_IO("%s: handle %llu, pos %llu, size %d\n",
-		  __func__, handle, pos, data_size);
+	uint i;
+	int rc;
+	size_t data_size = 0;
+	iovec_t tx_iov[2 + NS_WRITE_MAX_IOVS];
+
+	if (data_iov_count > NS_WRITE_MAX_IOVS) {
+		SS_ERR("%s: too many iovs, %u\n", __func__, data_iov_count);
+		return ERR_INVALID_ARGS;
+	}
+
+	for (i = 0; i < data_iov_count; i++) {
+		data_size += data_iov[i].len;
+	}
+
+	SS_DBG_IO("%s: handle %llu, pos %llu, size %zu, iov %u, batch %d\n",
+		  __func__, handle, pos, data_size, data_iov_count, batch);
 
 	struct storage_file_write_req req = {
 		.handle = handle,
@@ -302,35 +402,48 @@ int ns_write_pos(handle_t ipc_handle, ns_handle_t handle, ns_off_t pos,
 
 	struct storage_msg msg = {
 		.cmd = STORAGE_FILE_WRITE,
+		.flags = batch ? STORAGE_MSG_FLAG_BATCH : 0,
 		.size = sizeof(msg) + sizeof(req) + data_size,
 	};
 
-	iovec_t iov[] = {
-		{
-			.base = &msg,
-			.len = sizeof(msg),
-		},
-		{
-			.base = &req,
-			.len = sizeof(req),
-		},
-		{
-			// TODO: use const API
-			.base = (void *) data,
-			.len = data_size,
-		}
-	};
+	tx_iov[0].base = &msg;
+	tx_iov[0].len = sizeof(msg);
+	tx_iov[1].base = &req;
+	tx_iov[1].len = sizeof(req);
+	for (i = 0; i < data_iov_count; i++) {
+		tx_iov[2 + i] = data_iov[i];
+	}
 
-	int rc = sync_ipc_send_msg(ipc_handle, iov, countof(iov), iov, 1);
+	if (batch) {
+		rc = sync_ipc_send_msg(ipc_handle, tx_iov, 2 + data_iov_count,
+		                       NULL, 0);
+	} else {
+		rc = sync_ipc_send_msg(ipc_handle, tx_iov, 2 + data_iov_count,
+		                       tx_iov, 1);
+	}
 	if (rc < 0) {
 		SS_ERR("%s: write failed, %d\n", __func__, rc);
 		return rc;
 	}
 
-	rc = check_response(STORAGE_FILE_WRITE, &msg, rc);
-	if (rc != NO_ERROR) {
-		return rc;
+	if (!batch) {
+		rc = check_response(STORAGE_FILE_WRITE, &msg, rc);
+		if (rc != NO_ERROR) {
+			return rc;
+		}
 	}
 
 	return data_size;
 }
+
+int ns_write_pos(handle_t ipc_handle, ns_handle_t handle, ns_off_t pos,
+                 const void *data, int data_size)
+{
+	iovec_t data_iov = {
+		// TODO: use const API
+		.base = (void *) data,
+		.len = data_size,
+	};
+
+	return ns_write_pos_iov(ipc_handle, handle, pos, &data_iov, 1, false);
+}
@@ -22,6 +22,11 @@
 typedef uint64_t ns_handle_t;
 typedef uint64_t ns_off_t;
 
+/* max data_iov_count for ns_write_pos_iov */
+#define NS_WRITE_MAX_IOVS 8
+
+int ns_negotiate(handle_t ipc_handle, uint32_t max_msg_size,
+                 uint32_t *msg_sizep);
 int ns_open_file(handle_t ipc_handle, const char *name,
                  ns_handle_t *handlep, bool create);
 void ns_close_file(handle_t ipc_handle, ns_handle_t handle);
@@ -29,3 +34,5 @@ int ns_read_pos(handle_t ipc_handle, ns_handle_t handle,
                 ns_off_t pos, void *data, int data_size);
 int ns_write_pos(handle_t ipc_handle, ns_handle_t handle,
                  ns_off_t pos, const void *data, int data_size);
+int ns_write_pos_iov(handle_t ipc_handle, ns_handle_t handle, ns_off_t pos,
+                     const iovec_t *data_iov, uint data_iov_count, bool batch);
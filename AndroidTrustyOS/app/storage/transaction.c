@@ -26,11 +26,14 @@
 #include "block_allocator.h"
 #include "block_set.h"
 #include "debug.h"
+#include "debug_stats.h"
 #include "file.h"
 #include "transaction.h"
 
 bool print_merge_free;
 
+static struct transaction_group_stats transaction_group_stats;
+
 /**
  * transaction_check_free
  * @tr:         Transaction object.
@@ -46,10 +49,12 @@ static bool transaction_check_free(struct transaction *tr,
     data_block_t next_block;
     struct block_range free_range;
     data_block_t count;
+    struct block_set_iter iter;
 
+    block_set_iter_init(&iter, set);
     next_block = 0;
     while (true) {
-        free_range = block_set_find_next_range(tr, set, next_block);
+        free_range = block_set_iter_next_range(tr, &iter, next_block);
         if (block_range_empty(free_range)) {
             return false;
         }
@@ -73,6 +78,10 @@ static bool transaction_check_free(struct transaction *tr,
  * Helper function to update the free_set when committing a transaction.
  * @new_set = @set_i - @set_d - @new_set-blocks + @set_a + set_[ida]-blocks
  * The start state of @new_set must be a copy-on-write verison of @set_i.
+ *
+ * @set_d and @set_a are walked once in block order. Updating @new_set can
+ * allocate or free blocks, which can modify @set_d or @set_a, so their
+ * iterators only walk the tree again after such a modification.
  */
 static void transaction_merge_free_sets(struct transaction *tr,
                                         struct block_set *new_set,
@@ -83,6 +92,8 @@ static void transaction_merge_free_sets(struct transaction *tr,
     data_block_t next_block;
     struct block_range delete_range = BLOCK_RANGE_INITIAL_VALUE(delete_range);
     struct block_range add_range = BLOCK_RANGE_INITIAL_VALUE(add_range);
+    struct block_set_iter iter_d;
+    struct block_set_iter iter_a;
 
     full_assert(block_set_check(tr, set_i));
     full_assert(block_set_check(tr, set_d));
@@ -94,12 +105,13 @@ static void transaction_merge_free_sets(struct transaction *tr,
         printf("%s\n", __func__);
     }
 
-    /* TODO: don't walk the whole tree each time */
+    block_set_iter_init(&iter_d, set_d);
+    block_set_iter_init(&iter_a, set_a);
     next_block = 1;
     while (next_block != 0) {
         tr->min_free_block = next_block;
-        delete_range = block_set_find_next_range(tr, set_d, next_block);
-        add_range = block_set_find_next_range(tr, set_a, next_block);
+        delete_range = block_set_iter_next_range(tr, &iter_d, next_block);
+        add_range = block_set_iter_next_range(tr, &iter_a, next_block);
         if (print_merge_free) {
             printf("%s: add %lld-%lld or delete %lld-%lld\n",
                    __func__, add_range.start, add_range.end - 1,
@@ -144,6 +156,12 @@ static void transaction_merge_free_sets(struct transaction *tr,
 bool transaction_block_need_copy(struct transaction *tr, data_block_t block)
 {
     assert(block);
+    if (block_is_dirty_in_transaction(tr, block)) {
+        /* Avoid the set lookups for nodes already copied by this transaction */
+        full_assert(block_set_block_in_set(tr, &tr->allocated, block) ||
+                    block_allocator_allocation_queued(tr, block, false));
+        return false;
+    }
     assert(!block_set_block_in_set(tr, &tr->tmp_allocated, block));
     assert(!block_allocator_allocation_queued(tr, block, true));
 
@@ -168,7 +186,9 @@ static void transaction_delete_active(struct transaction *tr)
  * @tr:         Transaction object.
  *
  * Marks transaction as failed, removes it from active list, discards dirty
- * cache entries and restore open files to last committed state.
+ * cache entries and restore open files to last committed state. A failed
+ * snapshot transaction stays failed until transaction_snapshot_refresh is
+ * called.
  */
 void transaction_fail(struct transaction *tr)
 {
@@ -176,7 +196,7 @@ void transaction_fail(struct transaction *tr)
 
     tr->failed = true;
 
-    if (tr->complete) {
+    if (tr->complete || tr->snapshot) {
         return;
     }
 
@@ -190,7 +210,7 @@ void transaction_fail(struct transaction *tr)
  * @tr:         Transaction object.
  *
  * Prepare @tr for free. @tr must not be active and all open files must already
- * be closed.
+ * be closed. Releases the blocks pinned by a snapshot transaction.
  */
 void transaction_free(struct transaction *tr)
 {
@@ -224,50 +244,54 @@ static void check_free_tree(struct transaction *tr, struct block_set *free)
 }
 
 /**
- * transaction_complete - Complete transaction
- * @tr:         Transaction object.
+ * transaction_complete_prepare - Write transaction to disk (internal)
+ * @tr:             Transaction object.
+ * @new_free_set:   Block set object to store the new free set in.
+ * @new_files:      Object to return block and mac of the new file tree in.
+ *
+ * Merge the file and block changes of @tr with the current file-system state
+ * and write all dirty blocks except the super block.
+ *
+ * Return: %true if @tr is ready for a super block update, %false if @tr
+ * failed.
  */
-void transaction_complete(struct transaction *tr)
+static bool transaction_complete_prepare(struct transaction *tr,
+                                         struct block_set *new_free_set,
+                                         struct block_mac *new_files)
 {
-    struct block_mac new_files;
-    struct transaction *tmp_tr;
-    struct transaction *other_tr;
-    struct block_set new_free_set = BLOCK_SET_INITIAL_VALUE(new_free_set);
-    bool super_block_updated;
-
     assert(tr->fs);
     assert(!tr->complete);
 
     //printf("%s: %lld\n", __func__, tr->version);
 
-    block_set_copy(tr, &new_free_set, &tr->fs->free);
+    block_set_copy(tr, new_free_set, &tr->fs->free);
 
     if (tr->failed) {
         pr_warn("transaction failed, abort\n");
-        goto err_transaction_failed;
+        return false;
     }
 
     assert(transaction_is_active(tr));
 
-    file_transaction_complete(tr, &new_files);
+    file_transaction_complete(tr, new_files);
     if (tr->failed) {
         pr_warn("transaction failed, abort\n");
-        goto err_transaction_failed;
+        return false;
     }
 
-    tr->new_free_set = &new_free_set;
-    transaction_merge_free_sets(tr, &new_free_set, &tr->fs->free, &tr->allocated, &tr->freed);
+    tr->new_free_set = new_free_set;
+    transaction_merge_free_sets(tr, new_free_set, &tr->fs->free, &tr->allocated, &tr->freed);
     if (tr->failed) {
         pr_warn("transaction failed, abort\n");
-        goto err_transaction_failed;
+        return false;
     }
 
-    if (!transaction_check_free(tr, &new_free_set, tr->fs->reserved_count)) {
+    if (!transaction_check_free(tr, new_free_set, tr->fs->reserved_count)) {
         if (!tr->failed) {
             transaction_fail(tr);
         }
         pr_warn("transaction would leave fs too full, abort\n");
-        goto err_transaction_failed;
+        return false;
     }
 
     if (0) {
@@ -280,43 +304,47 @@ void transaction_complete(struct transaction *tr)
         printf("%s: freed:\n", __func__);
         block_set_print(tr, &tr->freed);
         printf("%s: new free:\n", __func__);
-        block_set_print(tr, &new_free_set);
+        block_set_print(tr, new_free_set);
     }
 
     if (tr->failed) {
         pr_warn("transaction failed, abort\n");
-        goto err_transaction_failed;
+        return false;
     }
 
     block_cache_clean_transaction(tr);
 
     if (tr->failed) {
         pr_warn("transaction failed, abort\n");
-        goto err_transaction_failed;
+        return false;
     }
 
-    assert(block_range_empty(new_free_set.initial_range));
-    check_free_tree(tr, &new_free_set);
+    assert(block_range_empty(new_free_set->initial_range));
+    check_free_tree(tr, new_free_set);
 
-    super_block_updated = update_super_block(tr, &new_free_set.block_tree.root,
-                                             &new_files);
-    if (!super_block_updated) {
-        assert(tr->failed);
-        pr_warn("failed to update super block, abort\n");
-        goto err_transaction_failed;
-    }
-    block_cache_clean_transaction(tr);
+    return true;
+}
 
-    /*
-     * If an error was detected writing the super block, it is not safe to
-     * continue as we do not know if the write completed.
-     */
-    assert(!tr->failed);
+/**
+ * transaction_complete_apply - Make prepared transaction current (internal)
+ * @tr:             Transaction object.
+ * @new_free_set:   New free set returned by transaction_complete_prepare.
+ * @new_files:      New file tree returned by transaction_complete_prepare.
+ *
+ * Update the in-memory file-system state, open files and conflicting
+ * transactions as if @tr had been committed. The caller must update the super
+ * block before reporting @tr as complete.
+ */
+static void transaction_complete_apply(struct transaction *tr,
+                                       struct block_set *new_free_set,
+                                       const struct block_mac *new_files)
+{
+    struct transaction *tmp_tr;
+    struct transaction *other_tr;
 
-    tr->fs->free.block_tree.root = new_free_set.block_tree.root;
+    tr->fs->free.block_tree.root = new_free_set->block_tree.root;
     block_range_clear(&tr->fs->free.initial_range); /* clear for initial file-system state */
-    tr->fs->files.root = new_files;
-    tr->fs->super_block_version = tr->fs->written_super_block_version;
+    tr->fs->files.root = *new_files;
 
     transaction_delete_active(tr);
     tr->complete = true;
@@ -353,12 +381,117 @@ void transaction_complete(struct transaction *tr)
     }
     assert(!tr->failed);
     block_cache_discard_transaction(tr, false);
+}
 
-err_transaction_failed:
-    if (tr->failed) {
-        file_transaction_complete_failed(tr);
+/**
+ * transaction_complete_group - Complete a group of transactions
+ * @trs:        Array of transactions to complete, in commit order.
+ * @count:      Number of entries in @trs.
+ *
+ * Complete every transaction in @trs as if transaction_complete had been
+ * called for each of them in order, but write the super block only once. A
+ * transaction that conflicts with an earlier transaction in the group fails
+ * without affecting the rest of the group. Each transaction in @trs has either
+ * failed or is complete when this function returns.
+ */
+void transaction_complete_group(struct transaction **trs, size_t count)
+{
+    size_t i;
+    struct fs *fs;
+    struct transaction *tr;
+    struct transaction *last_tr = NULL;
+    struct block_mac new_files;
+    struct block_set committed_free = BLOCK_SET_INITIAL_VALUE(committed_free);
+    size_t committed_count = 0;
+    bool super_block_updated;
+
+    assert(count);
+    fs = trs[0]->fs;
+    assert(fs);
+    assert(!fs->committed_free);
+
+    stats_timer_start(STATS_FS_COMMIT_GROUP);
+
+    for (i = 0; i < count; i++) {
+        struct block_set new_free_set = BLOCK_SET_INITIAL_VALUE(new_free_set);
+
+        tr = trs[i];
+        assert(tr->fs == fs);
+
+        if (!transaction_complete_prepare(tr, &new_free_set, &new_files)) {
+            assert(tr->failed);
+            file_transaction_complete_failed(tr);
+            assert(!block_cache_debug_get_ref_block_count());
+            continue;
+        }
+
+        if (!last_tr) {
+            /*
+             * The first transaction in the group changes the in-memory free
+             * set. Until the super block is written, only hand out blocks
+             * that are also free in the committed state.
+             */
+            committed_free.block_tree = fs->free.block_tree;
+            committed_free.initial_range = fs->free.initial_range;
+        }
+        transaction_complete_apply(tr, &new_free_set, &new_files);
+        fs->committed_free = &committed_free;
+        last_tr = tr;
+        committed_count++;
+        assert(!block_cache_debug_get_ref_block_count());
     }
+
+    fs->committed_free = NULL;
+
+    if (last_tr) {
+        /*
+         * transaction_complete_apply clears any failure of @last_tr caused by
+         * failing other transactions, so this cannot fail.
+         */
+        super_block_updated = update_super_block(last_tr,
+                                                 &fs->free.block_tree.root,
+                                                 &fs->files.root);
+        assert(super_block_updated);
+        block_cache_clean_transaction(last_tr);
+
+        /*
+         * If an error was detected writing the super block, it is not safe to
+         * continue as we do not know if the write completed.
+         */
+        assert(!last_tr->failed);
+
+        fs->super_block_version = fs->written_super_block_version;
+        block_cache_discard_transaction(last_tr, false);
+
+        transaction_group_stats.commits++;
+        transaction_group_stats.transactions += committed_count;
+        if (committed_count > transaction_group_stats.max_group_size) {
+            transaction_group_stats.max_group_size = committed_count;
+        }
+    }
+    transaction_group_stats.failed += count - committed_count;
+
     assert(!block_cache_debug_get_ref_block_count());
+
+    stats_timer_stop(STATS_FS_COMMIT_GROUP);
+}
+
+/**
+ * transaction_complete - Complete transaction
+ * @tr:         Transaction object.
+ */
+void transaction_complete(struct transaction *tr)
+{
+    transaction_complete_group(&tr, 1);
+}
+
+/**
+ * transaction_get_group_stats - Get commit batching counters
+ * @stats:      Pointer to store counters in.
+ */
+void transaction_get_group_stats(struct transaction_group_stats *stats)
+{
+    *stats = transaction_group_stats;
 }
 
 /**
@@ -398,6 +531,72 @@ void transaction_activate(struct transaction *tr)
     list_add_tail(&tr->fs->allocated, &tr->tmp_allocated.node);
 }
 
+/**
+ * transaction_snapshot_pin - Pin current file system state (internal)
+ * @tr:         Snapshot transaction object.
+ */
+static void transaction_snapshot_pin(struct transaction *tr)
+{
+    struct fs *fs = tr->fs;
+    size_t block_mac_size = fs->block_num_size + fs->mac_size;
+
+    tr->failed = false;
+
+    block_tree_copy(&tr->snapshot_files, &fs->files);
+    block_set_init(fs, &tr->snapshot_free);
+    tr->snapshot_free.block_tree.root = fs->free.block_tree.root;
+    tr->snapshot_free.initial_range = fs->free.initial_range;
+
+    block_tree_init(&tr->files_added, fs->dev->block_size,
+                    fs->block_num_size, block_mac_size, block_mac_size);
+    block_tree_init(&tr->files_updated, fs->dev->block_size,
+                    fs->block_num_size, block_mac_size, block_mac_size);
+    block_tree_init(&tr->files_removed, fs->dev->block_size,
+                    fs->block_num_size, block_mac_size, block_mac_size);
+}
+
+/**
+ * transaction_init_snapshot - Initialize read-only snapshot transaction
+ * @tr:         Transaction object.
+ * @fs:         File system state object.
+ *
+ * Pin the last committed file system state. Files opened with @tr are read
+ * from that state even after other transactions commit changes to them, and
+ * @tr is never failed by those transactions. Blocks used by the pinned state
+ * are not reused until @tr is refreshed or freed. @tr can not modify files.
+ */
+void transaction_init_snapshot(struct transaction *tr, struct fs *fs)
+{
+    assert(fs);
+    assert(fs->dev);
+    assert(!fs->committed_free);
+
+    memset(tr, 0, sizeof(*tr));
+    tr->fs = fs;
+    tr->snapshot = true;
+
+    list_initialize(&tr->open_files);
+    list_add_tail(&fs->snapshots, &tr->node);
+
+    transaction_snapshot_pin(tr);
+}
+
+/**
+ * transaction_snapshot_refresh - Move snapshot to current file system state
+ * @tr:         Snapshot transaction object.
+ *
+ * Release the blocks pinned by @tr and pin the last committed state instead.
+ * All files opened with @tr must already be closed.
+ */
+void transaction_snapshot_refresh(struct transaction *tr)
+{
+    assert(tr->snapshot);
+    assert(list_is_empty(&tr->open_files));
+    assert(!tr->fs->committed_free);
+
+    transaction_snapshot_pin(tr);
+}
+
 /**
  * transaction_init - Initialize new transaction object
  * @tr:         Transaction object.
@@ -17,6 +17,8 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "block_mac.h"
 #include "block_set.h"
@@ -25,7 +27,8 @@
 
 /**
  * struct transaction - Transaction state
- * @node:                   List node used to link transaction in fs.
+ * @node:                   List node used to link transaction in fs, in
+ *                          &fs->snapshots if @snapshot is %true.
  * @fs:                     Pointer to file system state.
  * @open_files:             List of open files.
  * @failed:                 %true if transaction ran out of disk space, or
@@ -46,6 +49,9 @@
  * @files_added:            Files added by transaction.
  * @files_updated:          Files modified by transaction.
  * @files_removed:          Files removed by transaction.
+ * @snapshot:               %true if transaction is a read-only snapshot.
+ * @snapshot_files:         File tree pinned by snapshot.
+ * @snapshot_free:          Free set pinned by snapshot.
  */
 struct transaction {
     struct list_node node;
@@ -64,15 +70,39 @@ struct transaction {
     struct block_tree files_added;
     struct block_tree files_updated;
     struct block_tree files_removed;
+
+    bool snapshot;
+    struct block_tree snapshot_files;
+    struct block_set snapshot_free;
 };
 
 void transaction_init(struct transaction *tr,
                       struct fs *fs,
                       bool activate);
+void transaction_init_snapshot(struct transaction *tr, struct fs *fs);
+void transaction_snapshot_refresh(struct transaction *tr);
 void transaction_free(struct transaction *tr);
 void transaction_activate(struct transaction *tr);
 void transaction_fail(struct transaction *tr);
 void transaction_complete(struct transaction *tr);
+void transaction_complete_group(struct transaction **trs, size_t count);
+
+/**
+ * struct transaction_group_stats - Commit batching counters
+ * @commits:        Number of super block updates.
+ * @transactions:   Number of transactions committed by those updates.
+ * @failed:         Number of transactions that failed to commit.
+ * @max_group_size: Largest number of transactions committed by one super
+ *                  block update.
+ */
+struct transaction_group_stats {
+    uint64_t commits;
+    uint64_t transactions;
+    uint64_t failed;
+    uint64_t max_group_size;
+};
+
+void transaction_get_group_stats(struct transaction_group_stats *stats);
 
 static inline bool transaction_is_active(struct transaction *tr) {
     return list_in_list(&tr->allocated.node);
@@ -46,6 +46,8 @@ enum {
 	IPC_PORT_ALLOW_TA_CONNECT = 0x1,
 	/* allow non-secure clients to connect to this port */
 	IPC_PORT_ALLOW_NS_CONNECT = 0x2,
+	/* allow channels to map their message buffers (map_msg_bufs) */
+	IPC_PORT_SHARED_BUFS = 0x4,
 };
 
 /*
@@ -56,6 +58,20 @@ enum {
 	IPC_CONNECT_ASYNC = 0x2,
 };
 
+/*
+ * Flags for memref_create syscall and for mapping memory objects with
+ * mmap (MMAP_FLAG_MEMREF). Memory object handles can be sent to other
+ * apps in the handles array of an IPC message, the receiver gets a new
+ * handle and the sender keeps its own. Closing a handle unmaps what was
+ * mapped through it; the creator closing its handle revokes access for
+ * all receivers.
+ */
+enum {
+	MMAP_FLAG_MEMREF = 0x2,
+	MMAP_FLAG_PROT_READ = 0x4,
+	MMAP_FLAG_PROT_WRITE = 0x8,
+};
+
 /*
  *  IPC message
  */
@@ -75,8 +91,21 @@ typedef struct ipc_msg {
 typedef struct ipc_msg_info {
 	size_t		len;
 	uint32_t	id;
+	uint32_t	num_handles;
 } ipc_msg_info_t;
 
+/*
+ *  Message buffers mapped by map_msg_bufs. Buffer of message id is
+ *  located at rx_base (received messages, read-only) or tx_base
+ *  (buffers returned by get_send_buf) plus id * buf_size.
+ */
+typedef struct ipc_msg_bufs {
+	const void	*rx_base;
+	void		*tx_base;
+	uint32_t	num_bufs;
+	uint32_t	buf_size;
+} ipc_msg_bufs_t;
+
 /*
  *  Combination of these values is used for event field
  *  ot uevent_t structure.
@@ -53,6 +53,15 @@ enum storage_cmd {
 
 	/* transaction support */
 	STORAGE_END_TRANSACTION = 9 << STORAGE_REQ_SHIFT,
+
+	/* debug support */
+	STORAGE_DEBUG_GET_STATS = 10 << STORAGE_REQ_SHIFT,
+
+	/* protocol negotiation */
+	STORAGE_NEGOTIATE      = 11 << STORAGE_REQ_SHIFT,
+
+	/* debug support */
+	STORAGE_DEBUG_SET_READ_AHEAD = 12 << STORAGE_REQ_SHIFT,
 };
 
 /**
@@ -117,8 +126,12 @@ enum storage_file_open_flag {
  *                                      it receives a command with this flag unset, at
  *                                      which point a cummulative result for all messages
  *                                      sent with STORAGE_MSG_FLAG_BATCH will be sent.
- *                                      This is only supported by the non-secure disk proxy
- *                                      server.
+ *                                      This is supported by the non-secure disk proxy
+ *                                      server, and by the storage server for
+ *                                      STORAGE_FILE_WRITE once STORAGE_NEGOTIATE_STREAM
+ *                                      has been negotiated. The storage server also
+ *                                      sets this flag on all but the last response to
+ *                                      a streamed STORAGE_FILE_READ request.
  * @STORAGE_MSG_FLAG_PRE_COMMIT:        if set, indicates that server need to commit
  *                                      pending changes before processing this message.
  * @STORAGE_MSG_FLAG_POST_COMMIT:       if set, indicates that server need to commit
@@ -262,6 +275,117 @@ struct storage_rpmb_send_resp {
 	uint8_t data[0];
 };
 
+/**
+ * enum storage_debug_get_stats_flag - flags for STORAGE_DEBUG_GET_STATS
+ * @STORAGE_DEBUG_GET_STATS_RESET: clear all counters after reading them.
+ */
+enum storage_debug_get_stats_flag {
+	STORAGE_DEBUG_GET_STATS_RESET = (1 << 0),
+};
+
+/**
+ * struct storage_debug_get_stats_req - request format for STORAGE_DEBUG_GET_STATS
+ * @first:  index of the first counter to return
+ * @count:  maximum number of counters to return
+ * @flags:  any of enum storage_debug_get_stats_flag or'ed together
+ */
+struct storage_debug_get_stats_req {
+	uint32_t first;
+	uint32_t count;
+	uint32_t flags;
+};
+
+#define STORAGE_STATS_NAME_SIZE 32
+#define STORAGE_STATS_HIST_SIZE 32
+
+/**
+ * struct storage_stats_counter - statistics for one timed server code path
+ * @name:      nul terminated counter name
+ * @count:     number of times the code path was timed
+ * @total_ns:  total time spent in the code path
+ * @min_ns:    shortest time spent in the code path
+ * @max_ns:    longest time spent in the code path
+ * @hist:      log2 histogram, @hist[i] counts durations of at least 2^i ns
+ *             and less than 2^(i+1) ns
+ */
+struct storage_stats_counter {
+	char     name[STORAGE_STATS_NAME_SIZE];
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	uint32_t hist[STORAGE_STATS_HIST_SIZE];
+};
+
+/**
+ * struct storage_debug_get_stats_resp - response format for STORAGE_DEBUG_GET_STATS
+ * @total_count: number of counters available on the server
+ * @count:       number of counters in @counters, starting at the requested
+ *               index. Limited by the requested count and the message size.
+ * @counters:    counter values
+ *
+ * Only available if the server was built with statistics enabled. Returns
+ * STORAGE_ERR_UNIMPLEMENTED otherwise.
+ */
+struct storage_debug_get_stats_resp {
+	uint32_t total_count;
+	uint32_t count;
+	struct storage_stats_counter counters[0];
+};
+
+/**
+ * struct storage_debug_set_read_ahead_req - request format for
+ *                                           STORAGE_DEBUG_SET_READ_AHEAD
+ * @blocks: number of blocks to prefetch past the end of sequential file reads.
+ *          0 disables read-ahead past the requested data.
+ *
+ * Changes the read-ahead window of the server, for all clients. Only
+ * available to secure side clients. Returns STORAGE_ERR_NOT_VALID if @blocks
+ * is larger than the server supports.
+ */
+struct storage_debug_set_read_ahead_req {
+	uint32_t blocks;
+};
+
+/**
+ * enum storage_negotiate_flag - protocol features for STORAGE_NEGOTIATE
+ * @STORAGE_NEGOTIATE_STREAM: STORAGE_FILE_READ requests can ask for more data
+ *                            than fits in one message. The server sends the
+ *                            data in multiple responses, and sets
+ *                            STORAGE_MSG_FLAG_BATCH on all but the last one.
+ *                            STORAGE_FILE_WRITE requests can be sent with
+ *                            STORAGE_MSG_FLAG_BATCH.
+ */
+enum storage_negotiate_flag {
+	STORAGE_NEGOTIATE_STREAM = (1 << 0),
+};
+
+/**
+ * struct storage_negotiate_req - request format for STORAGE_NEGOTIATE
+ * @max_msg_size: largest message, including struct storage_msg, the client
+ *                can send and receive. Must be at least 4096.
+ * @flags:        any of enum storage_negotiate_flag or'ed together
+ */
+struct storage_negotiate_req {
+	uint32_t max_msg_size;
+	uint32_t flags;
+};
+
+/**
+ * struct storage_negotiate_resp - response format for STORAGE_NEGOTIATE
+ * @max_msg_size: largest message size to use for the rest of the session
+ * @flags:        requested enum storage_negotiate_flag features that the
+ *                server supports
+ *
+ * Servers that do not support STORAGE_NEGOTIATE return
+ * STORAGE_ERR_UNIMPLEMENTED. Clients should then use 4096 byte messages and
+ * no optional features.
+ */
+struct storage_negotiate_resp {
+	uint32_t max_msg_size;
+	uint32_t flags;
+};
+
 /**
  * struct storage_msg - generic req/resp format for all storage commands
  * @cmd:        one of enum storage_cmd
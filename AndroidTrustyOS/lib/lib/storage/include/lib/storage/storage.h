@@ -153,4 +153,37 @@ int storage_get_file_size(file_handle_t handle, storage_off_t *size);
  */
 int storage_end_transaction(storage_session_t session, bool complete);
 
+/**
+ * storage_debug_get_stats() - Read timing statistics from the storage server
+ * @session: the storage_session_t returned from a call to storage_open_session
+ * @first:   index of the first counter to read
+ * @reset:   if true, clear all counters on the server after reading them
+ * @resp:    buffer to store the response in, followed by space for counters
+ * @size:    size of @resp in bytes
+ *
+ * Reads as many counters starting at @first as fit in @size and in a single
+ * server message. Call again with @first advanced by @resp->count to read more
+ * counters, until @first reaches @resp->total_count.
+ *
+ * Return: NO_ERROR on success, ERR_NOT_IMPLEMENTED if the server was built
+ * without statistics, or another negative error code on failure.
+ */
+int storage_debug_get_stats(storage_session_t session, uint32_t first,
+                            bool reset,
+                            struct storage_debug_get_stats_resp *resp,
+                            size_t size);
+
+/**
+ * storage_debug_set_read_ahead() - Set the server read-ahead window
+ * @session: the storage_session_t returned from a call to storage_open_session
+ * @blocks:  number of blocks the server prefetches past the end of sequential
+ *           file reads, 0 to disable read-ahead
+ *
+ * The window applies to all clients of the server.
+ *
+ * Return: NO_ERROR on success, ERR_NOT_VALID if @blocks is larger than the
+ * server supports, or another negative error code on failure.
+ */
+int storage_debug_set_read_ahead(storage_session_t session, uint32_t blocks);
+
 __END_CDECLS
@@ -15,7 +15,9 @@
  */
 
 #include <err.h>
+#include <list.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <lib/storage/storage.h>
@@ -37,6 +39,32 @@
 
 #define MAX_CHUNK_SIZE 4040
 
+/* message size every storage server accepts */
+#define DEFAULT_MSG_SIZE 4096
+
+/* requested message size, server may return a smaller size */
+#ifndef STORAGE_CLIENT_MSG_SIZE
+#define STORAGE_CLIENT_MSG_SIZE (2 * DEFAULT_MSG_SIZE)
+#endif
+
+/**
+ * struct session_params - Negotiated parameters of a session
+ * @node:           List node in session_params_list.
+ * @session:        Session the parameters apply to.
+ * @max_msg_size:   Max message size, in either direction.
+ * @flags:          Enabled features (enum storage_negotiate_flag).
+ */
+struct session_params {
+    struct list_node node;
+    storage_session_t session;
+    uint32_t max_msg_size;
+    uint32_t flags;
+};
+
+/* sessions that have negotiated, see get_session_params */
+static struct list_node session_params_list =
+        LIST_INITIAL_VALUE(session_params_list);
+
 static inline file_handle_t make_file_handle(storage_session_t s, uint32_t fid)
 {
     return ((uint64_t)s << 32) | fid;
@@ -52,6 +80,11 @@ static inline uint32_t _to_handle(file_handle_t fh)
     return (uint32_t) fh;
 }
 
+static size_t get_max_chunk_size(struct session_params params)
+{
+    return params.max_msg_size - (DEFAULT_MSG_SIZE - MAX_CHUNK_SIZE);
+}
+
 static inline uint32_t _to_msg_flags(uint32_t opflags)
 {
     uint32_t msg_flags = 0;
@@ -208,6 +241,101 @@ ssize_t send_reqv(storage_session_t session,
     return rc;
 }
 
+static struct session_params *find_session_params(storage_session_t session)
+{
+    struct session_params *params;
+
+    list_for_every_entry(&session_params_list, params,
+                         struct session_params, node) {
+        if (params->session == session)
+            return params;
+    }
+    return NULL;
+}
+
+static int negotiate(storage_session_t session, struct session_params *params)
+{
+    struct storage_msg msg = { .cmd = STORAGE_NEGOTIATE };
+    struct storage_negotiate_req req = {
+        .max_msg_size = STORAGE_CLIENT_MSG_SIZE,
+        .flags = STORAGE_NEGOTIATE_STREAM,
+    };
+    struct storage_negotiate_resp rsp;
+    struct iovec tx[2] = {{&msg, sizeof(msg)}, {&req, sizeof(req)}};
+    struct iovec rx[2] = {{&msg, sizeof(msg)}, {&rsp, sizeof(rsp)}};
+
+    ssize_t rc = send_reqv(session, tx, 2, rx, 2);
+    rc = check_response(&msg, rc);
+    if (rc == ERR_NOT_IMPLEMENTED) {
+        /* old server, use defaults */
+        return NO_ERROR;
+    }
+    if (rc < 0)
+        return rc;
+
+    if ((size_t)rc != sizeof(rsp)) {
+        TLOGE("%s: invalid response length (%zd != %zd)\n",
+              __func__, (size_t)rc, sizeof(rsp));
+        return ERR_IO;
+    }
+    if (rsp.max_msg_size < DEFAULT_MSG_SIZE ||
+        rsp.max_msg_size > STORAGE_CLIENT_MSG_SIZE) {
+        TLOGE("%s: invalid message size (%u)\n", __func__, rsp.max_msg_size);
+        return ERR_IO;
+    }
+
+    params->max_msg_size = rsp.max_msg_size;
+    params->flags = rsp.flags;
+    return NO_ERROR;
+}
+
+/**
+ * get_session_params - Get parameters to use for a request
+ * @session:    Session to send request on.
+ * @size:       Size of file data to transfer.
+ * @params:     Pointer to store parameters in.
+ *
+ * Requests that fit in a single default size message gain nothing from
+ * negotiation, so they use the defaults every server supports. The first
+ * larger request negotiates the session parameters with the server and
+ * remembers the result until the session is closed.
+ *
+ * Return: NO_ERROR on success, or a negative error code if negotiation failed.
+ */
+static int get_session_params(storage_session_t session, size_t size,
+                              struct session_params *params)
+{
+    int rc;
+    struct session_params *session_params;
+
+    params->max_msg_size = DEFAULT_MSG_SIZE;
+    params->flags = 0;
+
+    if (size <= MAX_CHUNK_SIZE)
+        return NO_ERROR;
+
+    session_params = find_session_params(session);
+    if (!session_params) {
+        rc = negotiate(session, params);
+        if (rc < 0) {
+            TLOGE("%s: failed (%d) to negotiate session parameters\n",
+                  __func__, rc);
+            return rc;
+        }
+        session_params = malloc(sizeof(*session_params));
+        if (!session_params) {
+            /* renegotiate on the next large request */
+            return NO_ERROR;
+        }
+        *session_params = *params;
+        session_params->session = session;
+        list_add_tail(&session_params_list, &session_params->node);
+    }
+
+    *params = *session_params;
+    return NO_ERROR;
+}
+
 int storage_open_session(storage_session_t *session_p, const char *type)
 {
     long rc = connect(type, IPC_CONNECT_WAIT_FOR_PORT);
@@ -221,6 +349,12 @@ int storage_open_session(storage_session_t *session_p, const char *type)
 
 void storage_close_session(storage_session_t session)
 {
+    struct session_params *params = find_session_params(session);
+
+    if (params) {
+        list_delete(&params->node);
+        free(params);
+    }
     close(session);
 }
 
@@ -283,13 +417,50 @@ static ssize_t _read_chunk(file_handle_t fh, storage_off_t off, void *buf, size_
     return check_response(&msg, rc);
 }
 
+static ssize_t _read_stream(file_handle_t fh, storage_off_t off, void *buf, size_t size)
+{
+    struct storage_msg msg = { .cmd = STORAGE_FILE_READ };
+    struct storage_file_read_req req = { .handle = _to_handle(fh), .size = size, .offset = off };
+    struct iovec tx[2] = {{&msg, sizeof(msg)}, {&req, sizeof(req)}};
+    struct iovec rx[2] = {{&msg, sizeof(msg)}, {buf, size}};
+    size_t bytes_read = 0;
+
+    /* server sends one response per message, all but the last flagged batch */
+    ssize_t rc = send_reqv(_to_session(fh), tx, 2, rx, 2);
+    while (true) {
+        rc = check_response(&msg, rc);
+        if (rc < 0)
+            return rc;
+        bytes_read += rc;
+        if (!(msg.flags & STORAGE_MSG_FLAG_BATCH))
+            break;
+        if (bytes_read >= size) {
+            TLOGE("%s: too much data returned\n", __func__);
+            return ERR_IO;
+        }
+        rx[1].base = (uint8_t *)buf + bytes_read;
+        rx[1].len = size - bytes_read;
+        rc = get_response(_to_session(fh), rx, 2);
+    }
+    return bytes_read;
+}
+
 ssize_t storage_read(file_handle_t fh, storage_off_t off, void *buf, size_t size)
 {
     ssize_t rc;
     size_t bytes_read = 0;
-    size_t chunk = MAX_CHUNK_SIZE;
+    struct session_params params;
+    size_t chunk;
     uint8_t *ptr = buf;
 
+    rc = get_session_params(_to_session(fh), size, &params);
+    if (rc < 0)
+        return rc;
+    chunk = get_max_chunk_size(params);
+
+    if (params.flags & STORAGE_NEGOTIATE_STREAM)
+        return _read_stream(fh, off, buf, size);
+
     while (size) {
         if (chunk > size)
             chunk = size;
@@ -313,8 +484,12 @@ static ssize_t _write_req(file_handle_t fh, storage_off_t off,
     struct storage_file_write_req req = { .handle = _to_handle(fh), .offset = off, };
     struct iovec tx[3] = {{&msg, sizeof(msg)}, {&req, sizeof(req)}, {(void *)buf, size}};
     struct iovec rx[1] = {{&msg, sizeof(msg)}};
+    /* server does not respond to batched requests */
+    uint rx_iovcnt = (msg_flags & STORAGE_MSG_FLAG_BATCH) ? 0 : 1;
 
-    ssize_t rc = send_reqv(_to_session(fh), tx, 3, rx, 1);
+    ssize_t rc = send_reqv(_to_session(fh), tx, 3, rx, rx_iovcnt);
+    if (rc >= 0 && !rx_iovcnt)
+        return size;
     rc = check_response(&msg, rc);
     return rc < 0 ? rc : (ssize_t)size;
 }
@@ -324,10 +499,20 @@ ssize_t storage_write(file_handle_t fh, storage_off_t off,
 {
     ssize_t rc;
     size_t bytes_written = 0;
-    size_t chunk = MAX_CHUNK_SIZE;
+    struct session_params params;
+    size_t chunk;
     const uint8_t *ptr = buf;
     uint32_t msg_flags = _to_msg_flags(opflags & ~STORAGE_OP_COMPLETE);
 
+    rc = get_session_params(_to_session(fh), size, &params);
+    if (rc < 0)
+        return rc;
+    chunk = get_max_chunk_size(params);
+
+    /* only wait for the response to the last chunk */
+    if (params.flags & STORAGE_NEGOTIATE_STREAM)
+        msg_flags |= STORAGE_MSG_FLAG_BATCH;
+
     while (size) {
         if (chunk >= size) {
             /* last chunk in sequence */
@@ -395,3 +580,45 @@ int storage_end_transaction(storage_session_t session, bool complete)
     return (int)check_response(&msg, rc);
 }
 
+int storage_debug_get_stats(storage_session_t session, uint32_t first,
+                            bool reset,
+                            struct storage_debug_get_stats_resp *resp,
+                            size_t size)
+{
+    struct storage_msg msg = { .cmd = STORAGE_DEBUG_GET_STATS };
+    struct storage_debug_get_stats_req req = {
+        .first = first,
+        .count = (size - sizeof(*resp)) / sizeof(resp->counters[0]),
+        .flags = reset ? STORAGE_DEBUG_GET_STATS_RESET : 0,
+    };
+    struct iovec tx[2] = {{&msg, sizeof(msg)}, {&req, sizeof(req)}};
+    struct iovec rx[2] = {{&msg, sizeof(msg)}, {resp, size}};
+
+    if (size < sizeof(*resp)) {
+        return ERR_NOT_VALID;
+    }
+
+    ssize_t rc = send_reqv(session, tx, 2, rx, 2);
+    rc = check_response(&msg, rc);
+    if (rc < 0)
+        return rc;
+
+    if ((size_t)rc < sizeof(*resp) ||
+        (size_t)rc != sizeof(*resp) + resp->count * sizeof(resp->counters[0])) {
+        TLOGE("%s: invalid response length (%zd)\n", __func__, (size_t)rc);
+        return ERR_IO;
+    }
+
+    return NO_ERROR;
+}
+
+int storage_debug_set_read_ahead(storage_session_t session, uint32_t blocks)
+{
+    struct storage_msg msg = { .cmd = STORAGE_DEBUG_SET_READ_AHEAD };
+    struct storage_debug_set_read_ahead_req req = { .blocks = blocks };
+    struct iovec tx[2] = {{&msg, sizeof(msg)}, {&req, sizeof(req)}};
+    struct iovec rx[1] = {{&msg, sizeof(msg)}};
+
+    ssize_t rc = send_reqv(session, tx, 2, rx, 1);
+    return (int)check_response(&msg, rc);
+}
@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2017, Google Inc. All rights reserved
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * IPC stress benchmark
+ *
+ * Runs a ping-pong message exchange over 1, 2, 4, ... IPCSTRESS_MAX_PAIRS
+ * independent channel pairs at the same time, each pair served by its own
+ * client and server kernel thread, and prints the total number of messages
+ * per second for each pair count. With channel-local locking in the ipc
+ * core the rate should scale with the number of pairs up to the number of
+ * cpus.
+ */
+
+#include <err.h>
+#include <kernel/event.h>
+#include <kernel/thread.h>
+#include <lib/trusty/handle.h>
+#include <lib/trusty/ipc.h>
+#include <lib/trusty/ipc_msg.h>
+#include <lk/init.h>
+#include <platform.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#define IPCSTRESS_MAX_PAIRS (SMP_MAX_CPUS)
+#define IPCSTRESS_ITERATIONS (10000)
+#define IPCSTRESS_MSG_SIZE (64)
+#define IPCSTRESS_NUM_BUFS (4)
+
+struct ipcstress_pair {
+    uint id;
+    char path[IPC_PORT_PATH_MAX];
+    handle_t *port;
+    thread_t *server;
+    thread_t *client;
+    event_t *start;
+};
+
+static const uuid_t ipcstress_uuid = {
+    0x6d1b9e3a, 0x4c1f, 0x4b0e,
+    { 0x9a, 0x47, 0x3e, 0x51, 0x2b, 0x87, 0x0d, 0x66 }
+};
+
+static int ipcstress_recv(handle_t *chan, uint8_t *buf)
+{
+    int ret;
+    uint32_t event;
+    ipc_msg_info_t msg_info;
+    iovec_kern_t iov = { buf, IPCSTRESS_MSG_SIZE };
+    ipc_msg_kern_t msg = {
+        .num_iov = 1,
+        .iov = &iov,
+    };
+
+    while ((ret = ipc_get_msg(chan, &msg_info)) == ERR_NO_MSG) {
+        ret = handle_wait(chan, &event, INFINITE_TIME);
+        if (ret < 0) {
+            return ret;
+        }
+        if ((event & IPC_HANDLE_POLL_HUP) && !(event & IPC_HANDLE_POLL_MSG)) {
+            return ERR_CHANNEL_CLOSED;
+        }
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    ret = ipc_read_msg(chan, msg_info.id, 0, &msg);
+    ipc_put_msg(chan, msg_info.id);
+    return ret;
+}
+
+static int ipcstress_send(handle_t *chan, uint8_t *buf, size_t len)
+{
+    iovec_kern_t iov = { buf, len };
+    ipc_msg_kern_t msg = {
+        .num_iov = 1,
+        .iov = &iov,
+    };
+
+    return ipc_send_msg(chan, &msg);
+}
+
+static int ipcstress_server(void *arg)
+{
+    struct ipcstress_pair *pair = arg;
+    uint8_t buf[IPCSTRESS_MSG_SIZE];
+    const uuid_t *peer_uuid;
+    handle_t *chan;
+    uint32_t event;
+    int ret;
+
+    ret = handle_wait(pair->port, &event, INFINITE_TIME);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = ipc_port_accept(pair->port, &chan, &peer_uuid);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* echo until client closes its channel */
+    while ((ret = ipcstress_recv(chan, buf)) >= 0) {
+        ret = ipcstress_send(chan, buf, ret);
+        if (ret < 0) {
+            break;
+        }
+    }
+
+    handle_close(chan);
+    return ret == ERR_CHANNEL_CLOSED ? NO_ERROR : ret;
+}
+
+static int ipcstress_client(void *arg)
+{
+    struct ipcstress_pair *pair = arg;
+    uint8_t buf[IPCSTRESS_MSG_SIZE];
+    handle_t *chan;
+    uint32_t event;
+    uint i;
+    int ret;
+
+    ret = ipc_port_connect_async(&ipcstress_uuid, pair->path,
+                                 sizeof(pair->path), 0, &chan);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = handle_wait(chan, &event, INFINITE_TIME);
+    if (ret < 0 || !(event & IPC_HANDLE_POLL_READY)) {
+        handle_close(chan);
+        return ret < 0 ? ret : ERR_NOT_READY;
+    }
+
+    event_wait(pair->start);
+
+    memset(buf, pair->id, sizeof(buf));
+    for (i = 0; i < IPCSTRESS_ITERATIONS; i++) {
+        ret = ipcstress_send(chan, buf, sizeof(buf));
+        if (ret < 0) {
+            break;
+        }
+        ret = ipcstress_recv(chan, buf);
+        if (ret < 0) {
+            break;
+        }
+        if (ret != sizeof(buf) || buf[0] != pair->id) {
+            ret = ERR_BAD_STATE;
+            break;
+        }
+    }
+
+    handle_close(chan);
+    return ret < 0 ? ret : NO_ERROR;
+}
+
+static int ipcstress_run(uint pair_count)
+{
+    struct ipcstress_pair pairs[IPCSTRESS_MAX_PAIRS];
+    char name[32];
+    event_t start;
+    lk_bigtime_t start_time;
+    lk_bigtime_t elapsed;
+    unsigned long long msgs;
+    uint i;
+    int ret;
+    int thread_ret;
+    int err = NO_ERROR;
+
+    event_init(&start, false, 0);
+
+    for (i = 0; i < pair_count; i++) {
+        struct ipcstress_pair *pair = &pairs[i];
+
+        pair->id = i;
+        pair->start = &start;
+        snprintf(pair->path, sizeof(pair->path),
+                 "com.android.trusty.ipcstress.%u", i);
+        ret = ipc_port_create(&ipcstress_uuid, pair->path,
+                              IPCSTRESS_NUM_BUFS, IPCSTRESS_MSG_SIZE,
+                              IPC_PORT_ALLOW_TA_CONNECT, &pair->port);
+        if (ret < 0) {
+            return ret;
+        }
+        ret = ipc_port_publish(pair->port);
+        if (ret < 0) {
+            handle_close(pair->port);
+            return ret;
+        }
+
+        snprintf(name, sizeof(name), "ipcstress-srv-%u", i);
+        pair->server = thread_create(name, ipcstress_server, pair,
+                                     DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        snprintf(name, sizeof(name), "ipcstress-cli-%u", i);
+        pair->client = thread_create(name, ipcstress_client, pair,
+                                     DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_resume(pair->server);
+        thread_resume(pair->client);
+    }
+
+    /* let clients connect before starting the clock */
+    thread_sleep(100);
+    start_time = current_time_hires();
+    event_signal(&start, true);
+
+    for (i = 0; i < pair_count; i++) {
+        thread_join(pairs[i].client, &thread_ret, INFINITE_TIME);
+        if (thread_ret < 0) {
+            err = thread_ret;
+        }
+    }
+    elapsed = current_time_hires() - start_time;
+
+    for (i = 0; i < pair_count; i++) {
+        thread_join(pairs[i].server, &thread_ret, INFINITE_TIME);
+        if (thread_ret < 0) {
+            err = thread_ret;
+        }
+        handle_close(pairs[i].port);
+    }
+    event_destroy(&start);
+
+    if (err < 0) {
+        return err;
+    }
+
+    msgs = 2ULL * IPCSTRESS_ITERATIONS * pair_count;
+    printf("%s: %u pairs: %llu msgs in %llu us, %llu msgs/sec\n",
+           __func__, pair_count, msgs, elapsed,
+           elapsed ? msgs * 1000000 / elapsed : 0);
+    return NO_ERROR;
+}
+
+static int ipcstress(void *arg)
+{
+    uint pair_count;
+    int ret;
+
+    for (pair_count = 1; pair_count <= IPCSTRESS_MAX_PAIRS; pair_count *= 2) {
+        ret = ipcstress_run(pair_count);
+        if (ret < 0) {
+            printf("%s: %u pairs: failed (%d)\n", __func__, pair_count, ret);
+            return ret;
+        }
+    }
+    printf("PASSED - %s\n", __func__);
+    return 0;
+}
+
+static void ipcstress_init(uint level)
+{
+    thread_t *thread;
+
+    thread = thread_create("ipcstress", ipcstress, NULL,
+                           DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_detach_and_resume(thread);
+}
+
+LK_INIT_HOOK(ipcstress, ipcstress_init, LK_INIT_LEVEL_APPS + 1);
@@ -35,6 +35,20 @@
  */
 #define MMAP_FLAG_IO_HANDLE		(0x1 << 0)
 
+/*
+ * Maps memory object specified by handle (created by memref_create syscall)
+ * to user address space. Size must match the size of the object.
+ */
+#define MMAP_FLAG_MEMREF		(0x1 << 1)
+
+/*
+ * Access rights for memref_create and MMAP_FLAG_MEMREF mappings
+ */
+#define MMAP_FLAG_PROT_READ		(0x1 << 2)
+#define MMAP_FLAG_PROT_WRITE		(0x1 << 3)
+#define MMAP_FLAG_PROT_MASK		(MMAP_FLAG_PROT_READ | \
+					 MMAP_FLAG_PROT_WRITE)
+
 /**
  * struct dma_pmem - a contiguous physical memory block
  * @paddr: start of physical address
@@ -45,6 +45,8 @@ typedef long (*smc32_handler_t)(smc32_args_t *args);
 typedef struct smc32_entity {
 	smc32_handler_t fastcall_handler;
 	smc32_handler_t stdcall_handler;
+	/* optional, std calls that may run in parallel with other std calls */
+	smc32_handler_t concurrent_stdcall_handler;
 } smc32_entity_t;
 
 /* Schedule Secure OS */
@@ -60,6 +62,9 @@ void sm_handle_fiq(void);
 /* Version */
 long smc_sm_api_version(smc32_args_t *args);
 
+/* Number of std call slots */
+long smc_sm_stdcall_slots(smc32_args_t *args);
+
 /* Interrupt controller irq/fiq support */
 long smc_intc_get_next_irq(smc32_args_t *args);
 long smc_intc_request_fiq(smc32_args_t *args);
@@ -32,6 +32,18 @@
 #define SMC_ENTITY(smc_nr)	(((smc_nr) & 0x3F000000) >> 24)
 #define SMC_FUNCTION(smc_nr)	((smc_nr) & 0x0000FFFF)
 
+/*
+ * Standard calls carry the id of the std call slot they run in in the
+ * otherwise unused bits 16-23. See SMC_FC_STDCALL_SLOTS.
+ */
+#define SMC_STDCALL_SLOT_SHIFT	16
+#define SMC_STDCALL_SLOT_MASK	0x00FF0000
+#define SMC_STDCALL_SLOT(smc_nr) \
+	(((smc_nr) & SMC_STDCALL_SLOT_MASK) >> SMC_STDCALL_SLOT_SHIFT)
+#define SMC_STDCALL_SET_SLOT(smc_nr, slot) \
+	(((smc_nr) & ~SMC_STDCALL_SLOT_MASK) | \
+	 (((slot) << SMC_STDCALL_SLOT_SHIFT) & SMC_STDCALL_SLOT_MASK))
+
 #define SMC_NR(entity, fn, fastcall, smc64) ((((fastcall) & 0x1) << 31) | \
 					     (((smc64) & 0x1) << 30) | \
 					     (((entity) & 0x3F) << 24) | \
@@ -120,9 +132,28 @@
  */
 #define TRUSTY_API_VERSION_RESTART_FIQ	(1)
 #define TRUSTY_API_VERSION_SMP		(2)
-#define TRUSTY_API_VERSION_CURRENT	(2)
+#define TRUSTY_API_VERSION_MULTI_STDCALL (3)
+#define TRUSTY_API_VERSION_CURRENT	(3)
 #define SMC_FC_API_VERSION	SMC_FASTCALL_NR (SMC_ENTITY_SECURE_MONITOR, 11)
 
+/**
+ * SMC_FC_STDCALL_SLOTS - Get the number of std call slots.
+ *
+ * No arguments.
+ *
+ * Returns the number of standard calls that can be active at the same time.
+ * Each active call occupies a slot selected by the client with
+ * SMC_STDCALL_SET_SLOT, and runs on its own secure thread. Slot 0 accepts any
+ * std call. Other slots only accept calls that the entity handles in its
+ * concurrent_stdcall_handler, and return SM_ERR_NOT_ALLOWED for the rest.
+ * Interrupted calls are restarted by SMC_SC_RESTART_LAST with the same slot.
+ * Clients that never set a slot use slot 0 and keep the old behavior.
+ *
+ * Enable by selecting api version TRUSTY_API_VERSION_MULTI_STDCALL (3) or
+ * later.
+ */
+#define SMC_FC_STDCALL_SLOTS	SMC_FASTCALL_NR (SMC_ENTITY_SECURE_MONITOR, 12)
+
 /* TRUSTED_OS entity calls */
 #define SMC_SC_VIRTIO_GET_DESCR	SMC_STDCALL_NR(SMC_ENTITY_TRUSTED_OS, 20)
 #define SMC_SC_VIRTIO_START	SMC_STDCALL_NR(SMC_ENTITY_TRUSTED_OS, 21)
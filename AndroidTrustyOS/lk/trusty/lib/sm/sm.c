@@ -39,6 +39,11 @@
 
 #define LTRACEF_LEVEL(level, x...) do { if (LOCAL_TRACE >= level) { TRACEF(x); } } while (0)
 
+/* Number of std calls that can be active at the same time */
+#ifndef SM_MAX_STDCALL_SLOTS
+#define SM_MAX_STDCALL_SLOTS	4
+#endif
+
 struct sm_std_call_state {
 	spin_lock_t lock;
 	event_t event;
@@ -49,6 +54,8 @@ struct sm_std_call_state {
 	int initial_cpu; /* Debug info: cpu that started stdcall */
 	int last_cpu; /* Debug info: most recent cpu expecting stdcall result */
 	int restart_count;
+	uint slot;
+	thread_t *thread;
 };
 
 extern unsigned long monitor_vector_table;
@@ -64,17 +71,19 @@ static spin_lock_t sm_api_version_lock;
 static event_t nsirqevent[SMP_MAX_CPUS];
 static thread_t *nsirqthreads[SMP_MAX_CPUS];
 static thread_t *nsidlethreads[SMP_MAX_CPUS];
-static thread_t *stdcallthread;
 static bool ns_threads_started;
 static bool irq_thread_ready[SMP_MAX_CPUS];
-struct sm_std_call_state stdcallstate = {
-	.event = EVENT_INITIAL_VALUE(stdcallstate.event, 0, 0),
-	.active_cpu = -1,
-	.initial_cpu = -1,
-	.last_cpu = -1,
+static struct sm_std_call_state stdcallstate[SM_MAX_STDCALL_SLOTS] = {
+	[0 ... SM_MAX_STDCALL_SLOTS - 1] = {
+		.active_cpu = -1,
+		.initial_cpu = -1,
+		.last_cpu = -1,
+	},
 };
 
 extern smc32_handler_t sm_stdcall_table[];
+extern smc32_handler_t sm_concurrent_stdcall_table[];
+extern long smc_undefined(smc32_args_t *args);
 
 long smc_sm_api_version(smc32_args_t *args)
 {
@@ -98,6 +107,11 @@ long smc_sm_api_version(smc32_args_t *args)
 	return api_version;
 }
 
+long smc_sm_stdcall_slots(smc32_args_t *args)
+{
+	return SM_MAX_STDCALL_SLOTS;
+}
+
 static uint32_t sm_get_api_version(void)
 {
 	if (!sm_api_version_locked) {
@@ -114,69 +128,109 @@ static int __NO_RETURN sm_stdcall_loop(void *arg)
 {
 	long ret;
 	spin_lock_saved_state_t state;
+	struct sm_std_call_state *stdcall = arg;
+	smc32_handler_t *table;
 
 	while (true) {
-		LTRACEF("cpu %d, wait for stdcall\n", arch_curr_cpu_num());
-		event_wait(&stdcallstate.event);
+		LTRACEF("cpu %d, slot %u, wait for stdcall\n",
+			arch_curr_cpu_num(), stdcall->slot);
+		event_wait(&stdcall->event);
 
 		/* Dispatch 'standard call' handler */
-		LTRACEF("cpu %d, got stdcall: 0x%x, 0x%x, 0x%x, 0x%x\n",
-			arch_curr_cpu_num(),
-			stdcallstate.args.smc_nr, stdcallstate.args.params[0],
-			stdcallstate.args.params[1], stdcallstate.args.params[2]);
-		ret = sm_stdcall_table[SMC_ENTITY(stdcallstate.args.smc_nr)](&stdcallstate.args);
-		LTRACEF("cpu %d, stdcall(0x%x, 0x%x, 0x%x, 0x%x) returned 0x%lx (%ld)\n",
-			arch_curr_cpu_num(),
-			stdcallstate.args.smc_nr, stdcallstate.args.params[0],
-			stdcallstate.args.params[1], stdcallstate.args.params[2], ret, ret);
-		spin_lock_save(&stdcallstate.lock, &state, SPIN_LOCK_FLAG_IRQ);
-		stdcallstate.ret = ret;
-		stdcallstate.done = true;
-		event_unsignal(&stdcallstate.event);
-		spin_unlock_restore(&stdcallstate.lock, state, SPIN_LOCK_FLAG_IRQ);
+		LTRACEF("cpu %d, slot %u, got stdcall: 0x%x, 0x%x, 0x%x, 0x%x\n",
+			arch_curr_cpu_num(), stdcall->slot,
+			stdcall->args.smc_nr, stdcall->args.params[0],
+			stdcall->args.params[1], stdcall->args.params[2]);
+		table = stdcall->slot ? sm_concurrent_stdcall_table :
+					sm_stdcall_table;
+		ret = table[SMC_ENTITY(stdcall->args.smc_nr)](&stdcall->args);
+		LTRACEF("cpu %d, slot %u, stdcall(0x%x, 0x%x, 0x%x, 0x%x) returned 0x%lx (%ld)\n",
+			arch_curr_cpu_num(), stdcall->slot,
+			stdcall->args.smc_nr, stdcall->args.params[0],
+			stdcall->args.params[1], stdcall->args.params[2], ret, ret);
+		spin_lock_save(&stdcall->lock, &state, SPIN_LOCK_FLAG_IRQ);
+		stdcall->ret = ret;
+		stdcall->done = true;
+		event_unsignal(&stdcall->event);
+		spin_unlock_restore(&stdcall->lock, state, SPIN_LOCK_FLAG_IRQ);
 	}
 }
 
+/*
+ * Return the std call slot the cpu expects a result from, or NULL. Only the
+ * cpu itself sets or clears active_cpu to its own number, so this is stable
+ * while interrupts are disabled.
+ */
+static struct sm_std_call_state *sm_get_active_stdcall(int cpu)
+{
+	uint i;
+
+	for (i = 0; i < SM_MAX_STDCALL_SLOTS; i++) {
+		if (stdcallstate[i].active_cpu == cpu)
+			return &stdcallstate[i];
+	}
+	return NULL;
+}
+
 /* must be called with irqs disabled */
 static long sm_queue_stdcall(smc32_args_t *args)
 {
 	long ret;
 	uint cpu = arch_curr_cpu_num();
+	uint slot = 0;
+	uint32_t smc_nr = args->smc_nr;
+	struct sm_std_call_state *stdcall;
+
+	if (sm_get_api_version() >= TRUSTY_API_VERSION_MULTI_STDCALL) {
+		slot = SMC_STDCALL_SLOT(smc_nr);
+		if (slot >= SM_MAX_STDCALL_SLOTS) {
+			dprintf(CRITICAL, "%s: cpu %d, bad std call slot %u\n",
+				__func__, cpu, slot);
+			return SM_ERR_INVALID_PARAMETERS;
+		}
+		if (slot && smc_nr != SMC_STDCALL_SET_SLOT(SMC_SC_RESTART_LAST, slot) &&
+		    sm_concurrent_stdcall_table[SMC_ENTITY(smc_nr)] == smc_undefined)
+			return SM_ERR_NOT_ALLOWED;
+	}
+	smc_nr = SMC_STDCALL_SET_SLOT(smc_nr, 0);
+	stdcall = &stdcallstate[slot];
 
-	spin_lock(&stdcallstate.lock);
+	spin_lock(&stdcall->lock);
 
-	if (stdcallstate.event.signalled || stdcallstate.done) {
-		if (args->smc_nr == SMC_SC_RESTART_LAST && stdcallstate.active_cpu == -1) {
-			stdcallstate.restart_count++;
-			LTRACEF_LEVEL(3, "cpu %d, restart std call, restart_count %d\n",
-				      cpu, stdcallstate.restart_count);
+	if (stdcall->event.signalled || stdcall->done) {
+		if (smc_nr == SMC_SC_RESTART_LAST && stdcall->active_cpu == -1) {
+			stdcall->restart_count++;
+			LTRACEF_LEVEL(3, "cpu %d, slot %u, restart std call, restart_count %d\n",
+				      cpu, slot, stdcall->restart_count);
 			goto restart_stdcall;
 		}
-		dprintf(CRITICAL, "%s: cpu %d, std call busy\n", __func__, cpu);
+		dprintf(CRITICAL, "%s: cpu %d, slot %u, std call busy\n",
+			__func__, cpu, slot);
 		ret = SM_ERR_BUSY;
 		goto err;
 	} else {
-		if (args->smc_nr == SMC_SC_RESTART_LAST) {
-			dprintf(CRITICAL, "%s: cpu %d, unexpected restart, no std call active\n",
-				__func__, arch_curr_cpu_num());
+		if (smc_nr == SMC_SC_RESTART_LAST) {
+			dprintf(CRITICAL, "%s: cpu %d, slot %u, unexpected restart, no std call active\n",
+				__func__, arch_curr_cpu_num(), slot);
 			ret = SM_ERR_UNEXPECTED_RESTART;
 			goto err;
 		}
 	}
 
-	LTRACEF("cpu %d, queue std call 0x%x\n", cpu, args->smc_nr);
-	stdcallstate.initial_cpu = cpu;
-	stdcallstate.ret = SM_ERR_INTERNAL_FAILURE;
-	stdcallstate.args = *args;
-	stdcallstate.restart_count = 0;
-	event_signal(&stdcallstate.event, false);
+	LTRACEF("cpu %d, slot %u, queue std call 0x%x\n", cpu, slot, smc_nr);
+	stdcall->initial_cpu = cpu;
+	stdcall->ret = SM_ERR_INTERNAL_FAILURE;
+	stdcall->args = *args;
+	stdcall->args.smc_nr = smc_nr;
+	stdcall->restart_count = 0;
+	event_signal(&stdcall->event, false);
 
 restart_stdcall:
-	stdcallstate.active_cpu = cpu;
+	stdcall->active_cpu = cpu;
 	ret = 0;
 
 err:
-	spin_unlock(&stdcallstate.lock);
+	spin_unlock(&stdcall->lock);
 
 	return ret;
 }
@@ -205,21 +259,23 @@ static void sm_irq_return_ns(void)
 {
 	long ret;
 	int cpu;
+	struct sm_std_call_state *stdcall;
 
 	cpu = arch_curr_cpu_num();
 
-	spin_lock(&stdcallstate.lock); /* TODO: remove? */
-	LTRACEF_LEVEL(2, "got irq on cpu %d, stdcallcpu %d\n",
-		      cpu, stdcallstate.active_cpu);
-	if (stdcallstate.active_cpu == cpu) {
-		stdcallstate.last_cpu = stdcallstate.active_cpu;
-		stdcallstate.active_cpu = -1;
+	stdcall = sm_get_active_stdcall(cpu);
+	if (stdcall) {
+		spin_lock(&stdcall->lock); /* TODO: remove? */
+		LTRACEF_LEVEL(2, "got irq on cpu %d, stdcall slot %u\n",
+			      cpu, stdcall->slot);
+		stdcall->last_cpu = stdcall->active_cpu;
+		stdcall->active_cpu = -1;
+		spin_unlock(&stdcall->lock);
 		ret = SM_ERR_INTERRUPTED;
 	} else {
 		ret = SM_ERR_NOP_INTERRUPTED;
 	}
 	LTRACEF_LEVEL(2, "got irq on cpu %d, return %ld\n", cpu, ret);
-	spin_unlock(&stdcallstate.lock);
 	sm_return_and_wait_for_next_stdcall(ret, cpu);
 }
 
@@ -245,41 +301,41 @@ static int __NO_RETURN sm_irq_loop(void *arg)
 }
 
 /* must be called with irqs disabled */
-static long sm_get_stdcall_ret(void)
+static long sm_get_stdcall_ret(struct sm_std_call_state *stdcall)
 {
 	long ret;
 	uint cpu = arch_curr_cpu_num();
 
-	spin_lock(&stdcallstate.lock);
+	spin_lock(&stdcall->lock);
 
-	if (stdcallstate.active_cpu != (int)cpu) {
-		dprintf(CRITICAL, "%s: stdcallcpu, a%d != curr-cpu %d, l%d, i%d\n",
-			__func__, stdcallstate.active_cpu, cpu,
-			stdcallstate.last_cpu, stdcallstate.initial_cpu);
+	if (stdcall->active_cpu != (int)cpu) {
+		dprintf(CRITICAL, "%s: slot %u, stdcallcpu, a%d != curr-cpu %d, l%d, i%d\n",
+			__func__, stdcall->slot, stdcall->active_cpu, cpu,
+			stdcall->last_cpu, stdcall->initial_cpu);
 		ret = SM_ERR_INTERNAL_FAILURE;
 		goto err;
 	}
-	stdcallstate.last_cpu = stdcallstate.active_cpu;
-	stdcallstate.active_cpu = -1;
-
-	if (stdcallstate.done) {
-		stdcallstate.done = false;
-		ret = stdcallstate.ret;
-		LTRACEF("cpu %d, return stdcall result, %ld, initial cpu %d\n",
-			cpu, stdcallstate.ret, stdcallstate.initial_cpu);
+	stdcall->last_cpu = stdcall->active_cpu;
+	stdcall->active_cpu = -1;
+
+	if (stdcall->done) {
+		stdcall->done = false;
+		ret = stdcall->ret;
+		LTRACEF("cpu %d, slot %u, return stdcall result, %ld, initial cpu %d\n",
+			cpu, stdcall->slot, stdcall->ret, stdcall->initial_cpu);
 	} else {
 		if (sm_get_api_version() >= TRUSTY_API_VERSION_SMP) /* ns using new api */
 			ret = SM_ERR_CPU_IDLE;
-		else if (stdcallstate.restart_count)
+		else if (stdcall->restart_count)
 			ret = SM_ERR_BUSY;
 		else
 			ret = SM_ERR_INTERRUPTED;
-		LTRACEF("cpu %d, initial cpu %d, restart_count %d, std call not finished, return %ld\n",
-			cpu, stdcallstate.initial_cpu,
-			stdcallstate.restart_count, ret);
+		LTRACEF("cpu %d, slot %u, initial cpu %d, restart_count %d, std call not finished, return %ld\n",
+			cpu, stdcall->slot, stdcall->initial_cpu,
+			stdcall->restart_count, ret);
 	}
 err:
-	spin_unlock(&stdcallstate.lock);
+	spin_unlock(&stdcall->lock);
 
 	return ret;
 }
@@ -288,12 +344,13 @@ static void sm_wait_for_smcall(void)
 {
 	int cpu;
 	long ret = 0;
+	struct sm_std_call_state *stdcall;
 
 	LTRACEF("wait for stdcalls, on cpu %d\n", arch_curr_cpu_num());
 
 	while (true) {
 		/*
-		 * Disable interrupts so stdcallstate.active_cpu does not
+		 * Disable interrupts so stdcallstate[].active_cpu does not
 		 * change to or from this cpu after checking it below.
 		 */
 		arch_disable_ints();
@@ -302,8 +359,9 @@ static void sm_wait_for_smcall(void)
 		thread_yield();
 
 		cpu = arch_curr_cpu_num();
-		if (cpu == stdcallstate.active_cpu)
-			ret = sm_get_stdcall_ret();
+		stdcall = sm_get_active_stdcall(cpu);
+		if (stdcall)
+			ret = sm_get_stdcall_ret(stdcall);
 		else
 			ret = SM_ERR_NOP_DONE;
 
@@ -399,13 +457,24 @@ static void sm_init(uint level)
 
 	mutex_release(&boot_args_lock);
 
-	stdcallthread = thread_create("sm-stdcall", sm_stdcall_loop, NULL,
-				      LOWEST_PRIORITY + 2, DEFAULT_STACK_SIZE);
-	if (!stdcallthread) {
-		panic("failed to create sm-stdcall thread!\n");
+	for (uint i = 0; i < SM_MAX_STDCALL_SLOTS; i++) {
+		char name[32];
+		struct sm_std_call_state *stdcall = &stdcallstate[i];
+
+		spin_lock_init(&stdcall->lock);
+		event_init(&stdcall->event, false, 0);
+		stdcall->slot = i;
+
+		snprintf(name, sizeof(name), "sm-stdcall-%u", i);
+		stdcall->thread = thread_create(name, sm_stdcall_loop, stdcall,
+						LOWEST_PRIORITY + 2,
+						DEFAULT_STACK_SIZE);
+		if (!stdcall->thread) {
+			panic("failed to create sm-stdcall thread %u!\n", i);
+		}
+		thread_set_real_time(stdcall->thread);
+		thread_resume(stdcall->thread);
 	}
-	thread_set_real_time(stdcallthread);
-	thread_resume(stdcallthread);
 }
 
 LK_INIT_HOOK(libsm, sm_init, LK_INIT_LEVEL_PLATFORM - 1);
@@ -160,6 +160,7 @@ smc32_handler_t sm_fastcall_function_table[] = {
 	[SMC_FUNCTION(SMC_FC_GET_VERSION_STR)] = smc_get_version_str,
 #endif
 	[SMC_FUNCTION(SMC_FC_API_VERSION)] = smc_sm_api_version,
+	[SMC_FUNCTION(SMC_FC_STDCALL_SLOTS)] = smc_sm_stdcall_slots,
 };
 
 uint32_t sm_nr_fastcall_functions = countof(sm_fastcall_function_table);
@@ -177,6 +178,10 @@ smc32_handler_t sm_stdcall_table[SMC_NUM_ENTITIES] = {
 	[SMC_ENTITY_SECURE_MONITOR + 1 ... SMC_NUM_ENTITIES - 1] = smc_undefined
 };
 
+smc32_handler_t sm_concurrent_stdcall_table[SMC_NUM_ENTITIES] = {
+	[0 ... SMC_NUM_ENTITIES - 1] = smc_undefined
+};
+
 status_t sm_register_entity(uint entity_nr, smc32_entity_t *entity)
 {
 	status_t err = NO_ERROR;
@@ -207,6 +212,10 @@ status_t sm_register_entity(uint entity_nr, smc32_entity_t *entity)
 
 	if (entity->stdcall_handler)
 		sm_stdcall_table[entity_nr] = entity->stdcall_handler;
+
+	if (entity->concurrent_stdcall_handler)
+		sm_concurrent_stdcall_table[entity_nr] =
+			entity->concurrent_stdcall_handler;
 unlock:
 	mutex_release(&smc_table_lock);
 	return err;
@@ -52,6 +52,8 @@ void handle_init(handle_t *handle, struct handle_ops *ops)
 	mutex_init(&handle->wait_event_lock);
 	handle->cookie = NULL;
 	list_clear_node(&handle->hlist_node);
+	handle->hlist = NULL;
+	list_clear_node(&handle->ready_node);
 }
 
 static void __handle_destroy_ref(refcount_t *ref)
@@ -154,18 +156,51 @@ err_prepare_wait:
 	return ret;
 }
 
+/*
+ *  Put handle on the ready queue of specified handle list unless it is
+ *  already there. Returns true if it was added.
+ */
+static bool _hlist_queue_ready(handle_list_t *hlist, handle_t *handle)
+{
+	bool queued = false;
+
+	mutex_acquire(&hlist->ready_lock);
+	if (!list_in_list(&handle->ready_node)) {
+		list_add_tail(&hlist->ready, &handle->ready_node);
+		queued = true;
+	}
+	mutex_release(&hlist->ready_lock);
+	return queued;
+}
+
+static handle_t *_hlist_dequeue_ready(handle_list_t *hlist)
+{
+	handle_t *handle;
+
+	mutex_acquire(&hlist->ready_lock);
+	handle = list_remove_head_type(&hlist->ready, handle_t, ready_node);
+	mutex_release(&hlist->ready_lock);
+	return handle;
+}
+
 void handle_notify(handle_t *handle)
 {
 	DEBUG_ASSERT(handle);
 
-	/* TODO: need to keep track of the number of events posted? */
-
 	mutex_acquire(&handle->wait_event_lock);
 	if (handle->wait_event) {
 		LTRACEF("notifying handle %p wait_event %p\n",
 			handle, handle->wait_event);
 		event_signal(handle->wait_event, true);
 	}
+	if (handle->hlist) {
+		/* an already queued handle will be polled anyway */
+		if (_hlist_queue_ready(handle->hlist, handle)) {
+			LTRACEF("notifying handle %p hlist %p\n",
+				handle, handle->hlist);
+			event_signal(&handle->hlist->ready_event, true);
+		}
+	}
 	mutex_release(&handle->wait_event_lock);
 }
 
@@ -185,16 +220,14 @@ void handle_list_add(handle_list_t *hlist, handle_t *handle)
 	handle_incref(handle);
 	mutex_acquire(&hlist->lock);
 	list_add_tail(&hlist->handles, &handle->hlist_node);
-	if (hlist->wait_event) {
-		/* somebody is waiting on list */
-		_prepare_wait_handle(hlist->wait_event, handle);
 
-		/* call poll to check if it is already signaled */
-		uint32_t event = handle->ops->poll(handle);
-		if (event) {
-			handle_notify(handle);
-		}
-	}
+	mutex_acquire(&handle->wait_event_lock);
+	DEBUG_ASSERT(!handle->hlist);
+	handle->hlist = hlist;
+	mutex_release(&handle->wait_event_lock);
+
+	/* handle might already be signaled: have the next waiter poll it */
+	handle_notify(handle);
 	mutex_release(&hlist->lock);
 }
 
@@ -207,14 +240,19 @@ static void _handle_list_del_locked(handle_list_t *hlist, handle_t *handle)
 	/* remove item from list */
 	list_delete(&handle->hlist_node);
 
-	/* check if somebody is waiting on this handle list */
-	if (hlist->wait_event) {
-		/* finish waiting */
-		_finish_wait_handle(handle);
-		if (list_is_empty(&hlist->handles)) {
-			/* wakeup waiter if list is now empty */
-			event_signal(hlist->wait_event, true);
-		}
+	/* and from ready queue, so handle_notify can no longer reach hlist */
+	mutex_acquire(&handle->wait_event_lock);
+	DEBUG_ASSERT(handle->hlist == hlist);
+	handle->hlist = NULL;
+	mutex_acquire(&hlist->ready_lock);
+	if (list_in_list(&handle->ready_node))
+		list_delete(&handle->ready_node);
+	mutex_release(&hlist->ready_lock);
+	mutex_release(&handle->wait_event_lock);
+
+	if (list_is_empty(&hlist->handles)) {
+		/* wakeup waiter if list is now empty */
+		event_signal(&hlist->ready_event, true);
 	}
 	handle_decref(handle);
 }
@@ -244,59 +282,88 @@ void handle_list_delete_all(handle_list_t *hlist)
 	mutex_release(&hlist->lock);
 }
 
+static bool _hlist_in_batch(handle_t **handles, uint cnt, handle_t *handle)
+{
+	for (uint i = 0; i < cnt; i++) {
+		if (handles[i] == handle)
+			return true;
+	}
+	return false;
+}
+
 /*
- *  Iterate handle list and call finish_wait for each item until the last one
- *  (inclusive) specified by corresponding function parameter. If the last item
- *  is not specified, iterate the whole list.
+ *  Drain the ready queue until up to count handles with pending events are
+ *  found. A handle is dequeued before it is polled, so a notification that
+ *  races with the poll requeues it. Handles that have nothing pending are
+ *  dropped from the queue until the next handle_notify. Reported handles are
+ *  requeued at the tail afterwards: they may have more events pending (every
+ *  message is not notified separately) and this keeps the list round robin.
  */
-static void _hlist_finish_wait_locked(handle_list_t *hlist, handle_t *last)
+static int _hlist_collect_locked(handle_list_t *hlist, handle_t **handles,
+				 uint32_t *events, uint count)
 {
+	uint cnt = 0;
 	handle_t *handle;
-	list_for_every_entry(&hlist->handles, handle, handle_t, hlist_node) {
-		_finish_wait_handle(handle);
-		if (handle == last)
-			break;
+
+	while (cnt < count && (handle = _hlist_dequeue_ready(hlist))) {
+		/* notified again while in this batch, requeued below */
+		if (_hlist_in_batch(handles, cnt, handle))
+			continue;
+
+		uint32_t event = handle->ops->poll(handle);
+		if (!event)
+			continue;
+
+		if (handle->ops->finalize_event)
+			handle->ops->finalize_event(handle, event);
+
+		handle_incref(handle);
+		handles[cnt] = handle;
+		events[cnt] = event;
+		cnt++;
 	}
+
+	for (uint i = 0; i < cnt; i++)
+		_hlist_queue_ready(hlist, handles[i]);
+
+	return cnt;
 }
 
-/*
- *  Iterate handle list and call prepare wait (if required) and poll for each
- *  handle until the ready one is found and return it to caller.
- *  Undo prepare op if ready handle is found or en error occured.
+/* fills in up to count handles that have pending events and returns the
+ * number of handles found. The caller is responsible for dropping the extra
+ * reference taken on each returned handle.
  */
-static int _hlist_do_poll_locked(handle_list_t *hlist, handle_t **handle_ptr,
-				 uint32_t *event_ptr, bool prepare)
+int handle_list_wait_many(handle_list_t *hlist, handle_t **handles,
+			  uint32_t *events, uint count, lk_time_t timeout)
 {
 	int ret;
 
-	DEBUG_ASSERT(hlist->wait_event);
+	DEBUG_ASSERT(hlist);
+	DEBUG_ASSERT(handles);
+	DEBUG_ASSERT(events);
 
-	if (list_is_empty(&hlist->handles))
-		return ERR_NOT_FOUND;  /* no handles in the list */
+	if (!count)
+		return ERR_INVALID_ARGS;
 
-	handle_t *next;
-	handle_t *last_prep = NULL;
-	list_for_every_entry(&hlist->handles, next, handle_t, hlist_node) {
-		if (prepare) {
-			ret = _prepare_wait_handle(hlist->wait_event, next);
-			if (ret)
-				break;
-			last_prep = next;
+	mutex_acquire(&hlist->lock);
+	while (true) {
+		if (list_is_empty(&hlist->handles)) {
+			ret = ERR_NOT_FOUND;  /* no handles in the list */
+			break;
 		}
 
-		uint32_t event = next->ops->poll(next);
-		if (event) {
-			*event_ptr = event;
-			*handle_ptr = next;
-			ret = 1;
+		ret = _hlist_collect_locked(hlist, handles, events, count);
+		if (ret)
 			break;
-		}
-	}
 
-	if (ret && prepare && last_prep) {
-		/* need to undo prepare */
-		_hlist_finish_wait_locked(hlist, last_prep);
+		/* no handles ready */
+		mutex_release(&hlist->lock);
+		ret = __do_wait(&hlist->ready_event, timeout);
+		mutex_acquire(&hlist->lock);
+		if (ret < 0)
+			break;
 	}
+	mutex_release(&hlist->lock);
 	return ret;
 }
 
@@ -307,64 +374,18 @@ int handle_list_wait(handle_list_t *hlist, handle_t **handle_ptr,
                      uint32_t *event_ptr, lk_time_t timeout)
 {
 	int ret;
-	event_t ev;
 
-	DEBUG_ASSERT(hlist);
 	DEBUG_ASSERT(handle_ptr);
 	DEBUG_ASSERT(event_ptr);
 
-	event_init(&ev, false, EVENT_FLAG_AUTOUNSIGNAL);
-
 	*event_ptr = 0;
 	*handle_ptr = 0;
 
-	mutex_acquire(&hlist->lock);
-
-	DEBUG_ASSERT(hlist->wait_event == NULL);
-
-	hlist->wait_event = &ev;
-	ret = _hlist_do_poll_locked(hlist, handle_ptr, event_ptr, true);
+	ret = handle_list_wait_many(hlist, handle_ptr, event_ptr, 1, timeout);
 	if (ret < 0)
-		goto err_do_poll;
-
-	if (ret == 0) {
-		/* no handles ready */
-		do {
-			mutex_release(&hlist->lock);
-			ret = __do_wait(&ev, timeout);
-			mutex_acquire(&hlist->lock);
-
-			if (ret < 0)
-				break;
+		return ret;
 
-			/* poll again */
-			ret = _hlist_do_poll_locked(hlist, handle_ptr,
-						    event_ptr, false);
-		} while (!ret);
-
-		_hlist_finish_wait_locked(hlist, NULL);
-	}
-
-	if (ret == 1) {
-		handle_t *handle = *handle_ptr;
-
-		if (handle->ops->finalize_event)
-			handle->ops->finalize_event(handle, *event_ptr);
-
-		handle_incref(handle);
-
-		/* move list head after item we just found */
-		list_delete(&hlist->handles);
-		list_add_head(&handle->hlist_node, &hlist->handles);
-
-		ret = NO_ERROR;
-	}
-
-err_do_poll:
-	hlist->wait_event = NULL;
-	mutex_release(&hlist->lock);
-	event_destroy(&ev);
-	return ret;
+	return NO_ERROR;
 }
 
 #endif /* WITH_TRUSTY_IPC */
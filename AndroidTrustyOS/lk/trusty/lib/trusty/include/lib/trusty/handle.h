@@ -45,6 +45,7 @@ enum {
 };
 
 struct handle_ops;
+struct handle_list;
 
 typedef struct handle {
 	refcount_t		refcnt;
@@ -59,6 +60,12 @@ typedef struct handle {
 
 	struct list_node	hlist_node;
 
+	/* handle list this handle is on (protected by wait_event_lock) and
+	 * its entry in that list's ready queue.
+	 */
+	struct handle_list	*hlist;
+	struct list_node	ready_node;
+
 	void			*cookie;
 } handle_t;
 
@@ -69,16 +76,27 @@ struct handle_ops {
 	void (*destroy)(handle_t *handle);
 };
 
+/*
+ * Handles that have been notified since they were last polled are queued on
+ * the ready list by handle_notify, so waiters only poll those instead of
+ * every handle in the list. ready_lock nests inside handle wait_event_lock.
+ */
 typedef struct handle_list {
 	struct list_node	handles;
 	mutex_t			lock;
-	event_t			*wait_event;
+	struct list_node	ready;
+	mutex_t			ready_lock;
+	event_t			ready_event;
 } handle_list_t;
 
 #define HANDLE_LIST_INITIAL_VALUE(hs) \
 { \
 	.handles	= LIST_INITIAL_VALUE((hs).handles), \
 	.lock		= MUTEX_INITIAL_VALUE((hs).lock), \
+	.ready		= LIST_INITIAL_VALUE((hs).ready), \
+	.ready_lock	= MUTEX_INITIAL_VALUE((hs).ready_lock), \
+	.ready_event	= EVENT_INITIAL_VALUE((hs).ready_event, false, \
+					      EVENT_FLAG_AUTOUNSIGNAL), \
 }
 
 /* handle management */
@@ -107,5 +125,7 @@ void handle_list_del(handle_list_t *hlist, handle_t *handle);
 void handle_list_delete_all(handle_list_t *hlist);
 int handle_list_wait(handle_list_t *hlist, handle_t **handle_ptr,
 		     uint32_t *event_ptr, lk_time_t timeout);
+int handle_list_wait_many(handle_list_t *hlist, handle_t **handles,
+			  uint32_t *events, uint count, lk_time_t timeout);
 
 #endif
@@ -45,6 +45,7 @@ enum {
 enum {
 	IPC_PORT_ALLOW_TA_CONNECT	= 0x1,
 	IPC_PORT_ALLOW_NS_CONNECT	= 0x2,
+	IPC_PORT_SHARED_BUFS		= 0x4,
 };
 
 #define IPC_PORT_PATH_MAX	64
@@ -80,7 +81,7 @@ enum {
 	IPC_CHAN_FLAG_SERVER		= 0x1,
 };
 
-/* aux state bitmasks */
+/* aux state bitmasks, only updated with atomic_or and atomic_and */
 enum {
 	IPC_CHAN_AUX_STATE_SEND_BLOCKED = 0x1,
 	IPC_CHAN_AUX_STATE_SEND_UNBLOCKED = 0x2,
@@ -88,17 +89,21 @@ enum {
 };
 
 #define IPC_CHAN_MAX_BUFS	32
-#define IPC_CHAN_MAX_BUF_SIZE	4096
+#define IPC_CHAN_MAX_BUF_SIZE	16384
 
 typedef struct ipc_chan {
 	obj_t			refobj;
+
+	/* mlock protects state, peer and msg_queue pointer, see ipc.c */
+	mutex_t			mlock;
+
 	obj_ref_t		peer_ref;
 	struct ipc_chan		*peer;
 	const struct uuid	*uuid;
 
 	uint32_t		state;
 	uint32_t		flags;
-	uint32_t		aux_state;
+	volatile int		aux_state;
 
 	/* handle_ref is a self reference when there are
 	 * outstanding handles out there. It is removed
@@ -118,6 +123,15 @@ typedef struct ipc_chan {
 
 	ipc_msg_queue_t		*msg_queue;
 
+	/* user mappings of this channel's receive queue and of the
+	 * peer's queue it sends to, set up by sys_map_msg_bufs and
+	 * removed when the channel handle is closed. Protected by mlock.
+	 */
+	uthread_t		*bufs_ut;
+	ipc_msg_queue_t		*tx_bufs_mq;
+	vaddr_t			rx_bufs_va;
+	vaddr_t			tx_bufs_va;
+
 	/*
 	 * TODO: consider changing async connect to preallocate
 	 *       not-yet-existing port object then we can get rid
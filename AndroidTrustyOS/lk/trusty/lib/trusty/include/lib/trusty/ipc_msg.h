@@ -34,12 +34,22 @@
 
 typedef struct ipc_msg_queue ipc_msg_queue_t;
 
-int ipc_msg_queue_create(uint num_items, size_t item_sz, ipc_msg_queue_t **mq);
+enum {
+	/* buffer can be mapped into user space with ipc_msg_queue_map */
+	IPC_MSG_QUEUE_SHARED	= 0x1,
+};
+
+int ipc_msg_queue_create(uint num_items, size_t item_sz, uint32_t flags,
+			 ipc_msg_queue_t **mq);
 void ipc_msg_queue_destroy(ipc_msg_queue_t *mq);
 
 bool ipc_msg_queue_is_empty(ipc_msg_queue_t *mq);
 bool ipc_msg_queue_is_full(ipc_msg_queue_t *mq);
 
+int ipc_msg_queue_map(ipc_msg_queue_t *mq, uthread_t *ut, u_int flags,
+		      vaddr_t *vaddrp);
+void ipc_msg_queue_unmap(ipc_msg_queue_t *mq, uthread_t *ut, vaddr_t vaddr);
+
 /********** these structure definitions shared with userspace **********/
 
 /* The layout for iovec_user and ipc_msg_user MUST match
@@ -66,12 +76,22 @@ typedef struct ipc_msg_user {
 typedef struct ipc_msg_info {
 	uint32_t	len;
 	uint32_t	id;
+	uint32_t	num_handles;
 } ipc_msg_info_t;
 
+/* buffer of message id is at rx_base/tx_base + id * buf_size */
+typedef struct ipc_msg_bufs {
+	user_addr_t	rx_base;
+	user_addr_t	tx_base;
+	uint32_t	num_bufs;
+	uint32_t	buf_size;
+} ipc_msg_bufs_t;
+
 int ipc_get_msg(handle_t *chandle, ipc_msg_info_t *msg_info);
 int ipc_read_msg(handle_t *chandle, uint32_t msg_id, uint32_t offset,
 		 ipc_msg_kern_t *msg);
 int ipc_put_msg(handle_t *chandle, uint32_t msg_id);
 int ipc_send_msg(handle_t *chandle, ipc_msg_kern_t *msg);
+int ipc_get_max_msg_size(handle_t *chandle, size_t *max_size);
 
 #endif
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2017, Google, Inc. All rights reserved
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef __LIB_TRUSTY_MEMREF_H
+#define __LIB_TRUSTY_MEMREF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <uthread.h>
+
+#include <lib/trusty/handle.h>
+
+/*
+ * Memory objects describe a range of an app's address space and can be
+ * passed to other apps in IPC messages. The receiver maps them with mmap
+ * and MMAP_FLAG_MEMREF. Closing a memory object handle unmaps the
+ * mappings made through it; closing the creator's handle unmaps all of
+ * them.
+ */
+bool memref_is_memref(handle_t *handle);
+
+/* create a new handle to the memory object of handle for a receiver */
+int memref_share(handle_t *handle, handle_t **shared);
+
+/* map memory object handle_id of the current app, returns user address */
+long memref_mmap(uint32_t handle_id, uint32_t size, uint32_t flags);
+
+/* unmap memory object mapping at vaddr, ERR_NOT_FOUND if there is none */
+long memref_munmap(uthread_t *ut, vaddr_t vaddr);
+
+#endif
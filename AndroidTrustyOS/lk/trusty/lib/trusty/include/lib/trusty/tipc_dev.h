@@ -27,6 +27,7 @@
 #include <arch/defines.h>
 #include <remoteproc/remoteproc.h>
 #include <lib/trusty/uuid.h>
+#include <virtio/virtio_ring.h>
 
 struct tipc_dev;
 
@@ -42,6 +43,26 @@ struct tipc_dev;
 #define TIPC_VQ_RX			(1)
 #define TIPC_VQ_NUM			(2)
 
+/*
+ * Feature bit: if negotiated, the device has up to TIPC_MAX_VQ_PAIRS
+ * TX/RX vqueue pairs, each served by its own threads. vring
+ * (pair * TIPC_VQ_NUM + TIPC_VQ_TX/RX) belongs to a pair. The NS side
+ * picks the pair for each channel and sends the connection request on
+ * it; all traffic for that channel then stays on that pair. Pairs whose
+ * vrings were not set up by NS side are not used. Without this feature
+ * only the first pair is used.
+ */
+#define VIRTIO_TIPC_F_MULTIQUEUE	(0)
+
+#define TIPC_MAX_VQ_PAIRS		(4)
+#define TIPC_MAX_VQ_NUM			(TIPC_VQ_NUM * TIPC_MAX_VQ_PAIRS)
+
+/*
+ *  Maximum message size advertised to NS side. Messages larger than a
+ *  page are passed as chains of descriptors.
+ */
+#define TIPC_MSG_BUF_MAX_SIZE		(4 * PAGE_SIZE)
+
 /*
  *  Maximum device name size
  */
@@ -54,15 +75,28 @@ struct tipc_dev_config {
 	uint32_t msg_buf_max_size;  /* max msg size that this device can handle */
 	uint32_t msg_buf_alignment; /* required msg alignment (PAGE_SIZE) */
 	char     dev_name[TIPC_MAX_DEV_NAME_LEN]; /* NS device node name  */
+	uint32_t num_vq_pairs;      /* vqueue pairs (VIRTIO_TIPC_F_MULTIQUEUE) */
 } __PACKED;
 
 struct tipc_vdev_descr {
 	struct fw_rsc_hdr		hdr;
 	struct fw_rsc_vdev		vdev;
-	struct fw_rsc_vdev_vring	vrings[TIPC_VQ_NUM];
+	struct fw_rsc_vdev_vring	vrings[TIPC_MAX_VQ_NUM];
 	struct tipc_dev_config		config;
 } __PACKED;
 
+#define TIPC_VQ_PAIR_DESCR(_q, _txvq_sz, _rxvq_sz)                   \
+		[(_q) * TIPC_VQ_NUM + TIPC_VQ_TX] = {                \
+			.align		= PAGE_SIZE,                 \
+			.num		= (_txvq_sz),                \
+			.notifyid	= (_q) * TIPC_VQ_NUM + 1,    \
+		},                                                   \
+		[(_q) * TIPC_VQ_NUM + TIPC_VQ_RX] = {                \
+			.align		= PAGE_SIZE,                 \
+			.num		= (_rxvq_sz),                \
+			.notifyid	= (_q) * TIPC_VQ_NUM + 2,    \
+		}
+
 
 #define DECLARE_TIPC_DEVICE_DESCR(_nm, _nid, _txvq_sz, _rxvq_sz, _nd_name) \
 static const struct tipc_vdev_descr _nm = {                          \
@@ -70,26 +104,22 @@ static const struct tipc_vdev_descr _nm = {                          \
 	.vdev		= {                                          \
 		.id		= VIRTIO_ID_TIPC,                    \
 		.notifyid	= _nid,                              \
-		.dfeatures	= 0,                                 \
+		.dfeatures	= (1U << VIRTIO_TIPC_F_MULTIQUEUE) | \
+				  (1U << VIRTIO_RING_F_EVENT_IDX),   \
 		.config_len	= sizeof(struct tipc_dev_config),    \
-		.num_of_vrings	= TIPC_VQ_NUM,                       \
+		.num_of_vrings	= TIPC_MAX_VQ_NUM,                   \
 	},                                                           \
-	.vrings	= {                                                  \
-		[TIPC_VQ_TX]	= {                                  \
-			.align		= PAGE_SIZE,                 \
-			.num		= (_txvq_sz),                \
-			.notifyid	= 1,                         \
-		},                                                   \
-		[TIPC_VQ_RX]	= {                                  \
-			.align		= PAGE_SIZE,                 \
-			.num		= (_rxvq_sz),                \
-			.notifyid	= 2,                         \
-		},                                                   \
+	.vrings	= {  /* one entry per TIPC_MAX_VQ_PAIRS */           \
+		TIPC_VQ_PAIR_DESCR(0, _txvq_sz, _rxvq_sz),           \
+		TIPC_VQ_PAIR_DESCR(1, _txvq_sz, _rxvq_sz),           \
+		TIPC_VQ_PAIR_DESCR(2, _txvq_sz, _rxvq_sz),           \
+		TIPC_VQ_PAIR_DESCR(3, _txvq_sz, _rxvq_sz),           \
 	},                                                           \
 	.config = {                                                  \
-		.msg_buf_max_size  = PAGE_SIZE,                      \
+		.msg_buf_max_size  = TIPC_MSG_BUF_MAX_SIZE,          \
 		.msg_buf_alignment = PAGE_SIZE,                      \
-		.dev_name = _nd_name                                 \
+		.dev_name = _nd_name,                                \
+		.num_vq_pairs = TIPC_MAX_VQ_PAIRS,                   \
 	}                                                            \
 };                                                                   \
 
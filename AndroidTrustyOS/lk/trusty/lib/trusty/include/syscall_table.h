@@ -37,6 +37,7 @@ DEF_SYSCALL(0x8, mmap, long, 4, user_addr_t uaddr, uint32_t size, uint32_t flags
 DEF_SYSCALL(0x9, munmap, long, 2, user_addr_t uaddr, uint32_t size)
 DEF_SYSCALL(0xa, prepare_dma, long, 4, user_addr_t uaddr, uint32_t size, uint32_t flags, user_addr_t pmem)
 DEF_SYSCALL(0xb, finish_dma, long, 3, user_addr_t uaddr, uint32_t size, uint32_t flags)
+DEF_SYSCALL(0xc, memref_create, long, 3, void *uaddr, uint32_t size, uint32_t flags)
 
 /* IPC connection establishement syscalls */
 DEF_SYSCALL(0x10, port_create, long, 4, const char *path, uint num_recv_bufs, size_t recv_buf_size, uint32_t flags)
@@ -48,9 +49,15 @@ DEF_SYSCALL(0x14, set_cookie, long, 2, uint32_t handle, void *cookie)
 /* handle polling related syscalls */
 DEF_SYSCALL(0x18, wait, long, 3, uint32_t handle_id, uevent_t *event, unsigned long timeout_msecs)
 DEF_SYSCALL(0x19, wait_any, long, 2, uevent_t *event, unsigned long timeout_msecs)
+DEF_SYSCALL(0x1a, wait_many, long, 3, uevent_t *events, uint32_t count, unsigned long timeout_msecs)
 
 /* message send/recv syscalls */
 DEF_SYSCALL(0x20, get_msg, long, 2, uint32_t handle, ipc_msg_info_t *msg_info)
 DEF_SYSCALL(0x21, read_msg, long, 4, uint32_t handle, uint32_t msg_id, uint32_t offset, ipc_msg_t *msg)
 DEF_SYSCALL(0x22, put_msg, long, 2, uint32_t handle, uint32_t msg_id)
 DEF_SYSCALL(0x23, send_msg, long, 2, uint32_t handle, ipc_msg_t *msg)
+
+/* shared message buffer syscalls */
+DEF_SYSCALL(0x24, map_msg_bufs, long, 2, uint32_t handle, ipc_msg_bufs_t *bufs)
+DEF_SYSCALL(0x25, get_send_buf, long, 2, uint32_t handle, ipc_msg_info_t *msg_info)
+DEF_SYSCALL(0x26, send_buf, long, 3, uint32_t handle, uint32_t msg_id, uint32_t len)
@@ -32,6 +32,7 @@
 #include <uthread.h>
 #include <platform.h>
 
+#include <arch/ops.h>
 #include <lk/init.h>
 #include <kernel/mutex.h>
 #include <kernel/event.h>
@@ -49,12 +50,45 @@
 
 #include <reflist.h>
 
+/*
+ * Locking
+ *
+ * ipc_port_lock protects the port list, the waiting for port list, port
+ * state and pending connection lists, channel reference lists and all
+ * channel connection state changes (connect, accept, publish and
+ * shutdown). It is not taken on the message path.
+ *
+ * chan->mlock protects the state, peer and msg_queue fields of a channel.
+ * A channel holds a reference to its peer that is only dropped after
+ * chan->peer has been cleared with chan->mlock held, so the peer can be
+ * used for as long as chan->mlock is held.
+ *
+ * Each message queue has its own lock (see ipc_msg.c) protecting the
+ * message lists. It is taken by the channel owning the queue to receive
+ * messages and by its peer to send them.
+ *
+ * chan->aux_state is only modified with atomic operations so the side
+ * releasing a message buffer can unblock the sender without taking the
+ * sender's mlock.
+ *
+ * Lock order:
+ *	handle list lock
+ *	ipc_port_lock
+ *	chan->mlock (never more than one channel at a time)
+ *	message queue lock
+ *	handle wait_event_lock
+ *
+ * Shared message buffers are mapped and unmapped with chan->mlock held,
+ * which nests the uthread mmap lock inside it. Handles sent in a message
+ * are removed from the sender's handle list with chan->mlock held (see
+ * ipc_msg.c), which is safe as only the app's own thread uses that list.
+ */
+static mutex_t ipc_port_lock = MUTEX_INITIAL_VALUE(ipc_port_lock);
+
 static struct list_node waiting_for_port_chan_list = LIST_INITIAL_VALUE(waiting_for_port_chan_list);
 
 static struct list_node ipc_port_list = LIST_INITIAL_VALUE(ipc_port_list);
 
-mutex_t ipc_lock = MUTEX_INITIAL_VALUE(ipc_lock);
-
 static uint32_t port_poll(handle_t *handle);
 static void port_shutdown(handle_t *handle);
 static void port_handle_destroy(handle_t *handle);
@@ -170,7 +204,7 @@ static void port_shutdown(handle_t *phandle)
 	ASSERT(phandle);
 	ASSERT(ipc_is_port(phandle));
 
-	mutex_acquire(&ipc_lock);
+	mutex_acquire(&ipc_port_lock);
 
 	ipc_port_t *port = containerof(phandle, ipc_port_t, handle);
 
@@ -204,7 +238,7 @@ static void port_shutdown(handle_t *phandle)
 		handle_decref(phandle);
 	}
 
-	mutex_release(&ipc_lock);
+	mutex_release(&ipc_port_lock);
 }
 
 /*
@@ -240,7 +274,7 @@ int ipc_port_publish(handle_t *phandle)
 	DEBUG_ASSERT(phandle);
 	DEBUG_ASSERT(ipc_is_port(phandle));
 
-	mutex_acquire(&ipc_lock);
+	mutex_acquire(&ipc_port_lock);
 
 	ipc_port_t *port = containerof(phandle, ipc_port_t, handle);
 	DEBUG_ASSERT(!list_in_list(&port->node));
@@ -281,7 +315,7 @@ int ipc_port_publish(handle_t *phandle)
 			chan_del_ref(client, &tmp_client_ref);   /* drop local ref */
 		}
 	}
-	mutex_release(&ipc_lock);
+	mutex_release(&ipc_port_lock);
 
 	return ret;
 }
@@ -342,7 +376,7 @@ err_port_create:
 }
 
 /*
- *  Look up and port with given name (ipc_lock must be held)
+ *  Look up and port with given name (ipc_port_lock must be held)
  */
 static ipc_port_t *port_find_locked(const char *path)
 {
@@ -363,19 +397,19 @@ static uint32_t port_poll(handle_t *phandle)
 	ipc_port_t *port = containerof(phandle, ipc_port_t, handle);
 	uint32_t events = 0;
 
-	mutex_acquire(&ipc_lock);
+	mutex_acquire(&ipc_port_lock);
 	if (port->state != IPC_PORT_STATE_LISTENING)
 		events |= IPC_HANDLE_POLL_ERROR;
 	else if (!list_is_empty(&port->pending_list))
 		events |= IPC_HANDLE_POLL_READY;
 	LTRACEF("%s in state %d events %x\n", port->path, port->state, events);
-	mutex_release(&ipc_lock);
+	mutex_release(&ipc_port_lock);
 
 	return events;
 }
 
 /*
- *  Channel ref counting
+ *  Channel ref counting (ipc_port_lock must be held)
  */
 static inline void __chan_destroy_refobj(obj_t *ref)
 {
@@ -394,6 +428,7 @@ static inline void __chan_destroy_refobj(obj_t *ref)
 		ipc_msg_queue_destroy(chan->msg_queue);
 		chan->msg_queue = NULL;
 	}
+	mutex_destroy(&chan->mlock);
 	free(chan);
 }
 
@@ -431,6 +466,7 @@ static ipc_chan_t *chan_alloc(uint32_t flags, const uuid_t *uuid,
 
 	/* init ref count */
 	obj_init(&chan->refobj, ref);
+	mutex_init(&chan->mlock);
 
 	/* init refs */
 	obj_ref_init(&chan->node_ref);
@@ -467,15 +503,25 @@ static void _chan_shutdown_locked(ipc_chan_t *chan)
 	}
 }
 
+/*
+ *  Shut down channel and its peer (ipc_port_lock must be held)
+ */
 static void chan_shutdown_locked(ipc_chan_t *chan)
 {
-	LTRACEF("chan %p: peer %p\n", chan, chan->peer);
+	ipc_chan_t *peer;
 
+	mutex_acquire(&chan->mlock);
+	LTRACEF("chan %p: peer %p\n", chan, chan->peer);
 	_chan_shutdown_locked(chan);
-	if (chan->peer) {
-		_chan_shutdown_locked(chan->peer);
-		chan_del_ref(chan->peer, &chan->peer_ref);
-		chan->peer = NULL;
+	peer = chan->peer;
+	chan->peer = NULL;
+	mutex_release(&chan->mlock);
+
+	if (peer) {
+		mutex_acquire(&peer->mlock);
+		_chan_shutdown_locked(peer);
+		mutex_release(&peer->mlock);
+		chan_del_ref(peer, &chan->peer_ref);
 	}
 }
 
@@ -487,13 +533,25 @@ static void chan_shutdown(handle_t *chandle)
 	DEBUG_ASSERT(chandle);
 	DEBUG_ASSERT(ipc_is_channel(chandle));
 
-	mutex_acquire(&ipc_lock);
+	mutex_acquire(&ipc_port_lock);
 
 	ipc_chan_t *chan = containerof(chandle, ipc_chan_t, handle);
 
+	/* unmap shared buffers while we still hold a ref to the peer */
+	mutex_acquire(&chan->mlock);
+	if (chan->bufs_ut) {
+		ipc_msg_queue_unmap(chan->msg_queue, chan->bufs_ut,
+				    chan->rx_bufs_va);
+		ipc_msg_queue_unmap(chan->tx_bufs_mq, chan->bufs_ut,
+				    chan->tx_bufs_va);
+		chan->bufs_ut = NULL;
+		chan->tx_bufs_mq = NULL;
+	}
+	mutex_release(&chan->mlock);
+
 	chan_shutdown_locked(chan);
 
-	mutex_release(&ipc_lock);
+	mutex_release(&ipc_port_lock);
 }
 
 static void chan_handle_destroy(handle_t *chandle)
@@ -502,9 +560,9 @@ static void chan_handle_destroy(handle_t *chandle)
 	DEBUG_ASSERT(ipc_is_channel(chandle));
 
 	ipc_chan_t *chan = containerof(chandle, ipc_chan_t, handle);
-	mutex_acquire(&ipc_lock);
+	mutex_acquire(&ipc_port_lock);
 	chan_del_ref(chan, &chan->handle_ref);
-	mutex_release(&ipc_lock);
+	mutex_release(&ipc_port_lock);
 }
 
 /*
@@ -515,11 +573,10 @@ static uint32_t chan_poll(handle_t *chandle)
 	DEBUG_ASSERT(chandle);
 	DEBUG_ASSERT(ipc_is_channel(chandle));
 
-	/* TODO: finer locking? */
-	mutex_acquire(&ipc_lock);
-
 	ipc_chan_t *chan = containerof(chandle, ipc_chan_t, handle);
 
+	mutex_acquire(&chan->mlock);
+
 	uint32_t events = 0;
 
 	if (chan->state == IPC_CHAN_STATE_INVALID) {
@@ -549,7 +606,7 @@ static uint32_t chan_poll(handle_t *chandle)
 	}
 
 done:
-	mutex_release(&ipc_lock);
+	mutex_release(&chan->mlock);
 	return events;
 }
 
@@ -558,15 +615,12 @@ static void chan_finalize_event(handle_t *chandle, uint32_t event)
 	DEBUG_ASSERT(chandle);
 	DEBUG_ASSERT(ipc_is_channel(chandle));
 
-	if (event & (IPC_HANDLE_POLL_SEND_UNBLOCKED | IPC_HANDLE_POLL_READY)) {
-		mutex_acquire(&ipc_lock);
-		ipc_chan_t *chan = containerof(chandle, ipc_chan_t, handle);
-		if (event & IPC_HANDLE_POLL_SEND_UNBLOCKED)
-			chan->aux_state &= ~IPC_CHAN_AUX_STATE_SEND_UNBLOCKED;
-		if (event & IPC_HANDLE_POLL_READY)
-			chan->aux_state &= ~IPC_CHAN_AUX_STATE_CONNECTED;
-		mutex_release(&ipc_lock);
-	}
+	ipc_chan_t *chan = containerof(chandle, ipc_chan_t, handle);
+
+	if (event & IPC_HANDLE_POLL_SEND_UNBLOCKED)
+		atomic_and(&chan->aux_state, ~IPC_CHAN_AUX_STATE_SEND_UNBLOCKED);
+	if (event & IPC_HANDLE_POLL_READY)
+		atomic_and(&chan->aux_state, ~IPC_CHAN_AUX_STATE_CONNECTED);
 }
 
 
@@ -591,10 +645,15 @@ static int check_access(ipc_port_t *port, const uuid_t *uuid)
 	return ERR_ACCESS_DENIED;
 }
 
+/*
+ *  Connect client to port (ipc_port_lock must be held)
+ */
 static int port_attach_client(ipc_port_t *port, ipc_chan_t *client)
 {
 	int ret;
 	ipc_chan_t *server;
+	ipc_msg_queue_t *client_mq;
+	uint32_t mq_flags;
 	obj_ref_t   tmp_server_ref = OBJ_REF_INITIAL_VALUE(tmp_server_ref);
 
 	if (port->state != IPC_PORT_STATE_LISTENING) {
@@ -617,16 +676,18 @@ static int port_attach_client(ipc_port_t *port, ipc_chan_t *client)
 	}
 
 	/* allocate msg queues */
+	mq_flags = (port->flags & IPC_PORT_SHARED_BUFS) ?
+		   IPC_MSG_QUEUE_SHARED : 0;
 	ret = ipc_msg_queue_create(port->num_recv_bufs,
-				   port->recv_buf_size,
-				   &client->msg_queue);
+				   port->recv_buf_size, mq_flags,
+				   &client_mq);
 	if (ret != NO_ERROR) {
 		LTRACEF("failed to alloc mq: %d\n", ret);
 		goto err_client_mq;
 	}
 
 	ret = ipc_msg_queue_create(port->num_recv_bufs,
-				   port->recv_buf_size,
+				   port->recv_buf_size, mq_flags,
 				   &server->msg_queue);
 	if (ret != NO_ERROR) {
 		LTRACEF("failed to alloc mq: %d\n", ret);
@@ -636,16 +697,18 @@ static int port_attach_client(ipc_port_t *port, ipc_chan_t *client)
 	/* move server to accepting state */
 	server->state = IPC_CHAN_STATE_ACCEPTING;
 
-	/* move client to connecting state  */
-	client->state = IPC_CHAN_STATE_CONNECTING;
-
 	/* setup peer refs */
 	chan_add_ref(server, &client->peer_ref);
-	client->peer = server;
-
 	chan_add_ref(client, &server->peer_ref);
 	server->peer = client;
 
+	/* client handle might already be visible to a waiter */
+	mutex_acquire(&client->mlock);
+	client->msg_queue = client_mq;
+	client->state = IPC_CHAN_STATE_CONNECTING;
+	client->peer = server;
+	mutex_release(&client->mlock);
+
 	/* and add server channel to pending connection list */
 	chan_add_ref(server, &server->node_ref);
 	list_add_tail(&port->pending_list, &server->node);
@@ -660,8 +723,7 @@ static int port_attach_client(ipc_port_t *port, ipc_chan_t *client)
 	return NO_ERROR;
 
 err_server_mq:
-	ipc_msg_queue_destroy(client->msg_queue);
-	client->msg_queue = NULL;
+	ipc_msg_queue_destroy(client_mq);
 err_client_mq:
 	chan_del_ref(server, &tmp_server_ref);
 	return ERR_NO_MEMORY;
@@ -702,7 +764,7 @@ int ipc_port_connect_async(const uuid_t *cid, const char *path, size_t max_path,
 
 	LTRACEF("Connecting to '%s'\n", path);
 
-	mutex_acquire(&ipc_lock);
+	mutex_acquire(&ipc_port_lock);
 
 	port = port_find_locked(path);
 	if (port) {
@@ -740,7 +802,7 @@ err_alloc_path:
 err_attach_client:
 err_find_ports:
 	chan_del_ref(client, &tmp_client_ref);
-	mutex_release(&ipc_lock);
+	mutex_release(&ipc_port_lock);
 	return ret;
 }
 
@@ -841,7 +903,7 @@ int ipc_port_accept(handle_t *phandle, handle_t **chandle_ptr,
 
 	port = containerof(phandle, ipc_port_t, handle);
 
-	mutex_acquire(&ipc_lock);
+	mutex_acquire(&ipc_port_lock);
 
 	if (port->state != IPC_PORT_STATE_LISTENING) {
 		/* Not in listening state: caller should close port.
@@ -886,9 +948,14 @@ int ipc_port_accept(handle_t *phandle, handle_t **chandle_ptr,
 	}
 
 	/* move both client and server into connected state */
+	mutex_acquire(&server->mlock);
 	server->state = IPC_CHAN_STATE_CONNECTED;
+	mutex_release(&server->mlock);
+
+	mutex_acquire(&client->mlock);
 	client->state = IPC_CHAN_STATE_CONNECTED;
-	client->aux_state |= IPC_CHAN_AUX_STATE_CONNECTED;
+	atomic_or(&client->aux_state, IPC_CHAN_AUX_STATE_CONNECTED);
+	mutex_release(&client->mlock);
 
 	/* init server channel handle and return it to caller */
 	*chandle_ptr = chan_handle_init(server);
@@ -903,7 +970,7 @@ err_bad_chan_state:
 	chan_del_ref(server, &tmp_server_ref);
 err_no_connections:
 err_bad_port_state:
-	mutex_release(&ipc_lock);
+	mutex_release(&ipc_port_lock);
 	return ret;
 }
 
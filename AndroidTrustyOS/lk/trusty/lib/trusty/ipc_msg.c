@@ -40,6 +40,7 @@
 #include <assert.h>
 #include <err.h>
 #include <list.h>
+#include <malloc.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -48,6 +49,9 @@
 #include <trace.h>
 #include <uthread.h>
 
+#include <arch/ops.h>
+#include <kernel/mutex.h>
+#include <kernel/vm.h>
 #include <lib/syscall.h>
 
 #if WITH_TRUSTY_IPC
@@ -55,40 +59,50 @@
 #include <lib/trusty/handle.h>
 #include <lib/trusty/ipc.h>
 #include <lib/trusty/ipc_msg.h>
+#include <lib/trusty/memref.h>
 #include <lib/trusty/trusty_app.h>
 #include <lib/trusty/uctx.h>
 
-extern mutex_t ipc_lock;
-
 enum {
 	MSG_ITEM_STATE_FREE	= 0,
 	MSG_ITEM_STATE_FILLED	= 1,
 	MSG_ITEM_STATE_READ	= 2,
+	MSG_ITEM_STATE_RESERVED	= 3,
 };
 
 typedef struct msg_item {
 	uint8_t			id;
 	uint8_t			state;
 	uint			num_handles;
-	handle_id_t		handles[MAX_MSG_HANDLES];
+	handle_t		*handles[MAX_MSG_HANDLES];
 	size_t			len;
 	struct list_node	node;
 } msg_item_t;
 
+/*
+ * The message lists are protected by lock. It is taken by the channel that
+ * owns the queue to get, read and put messages and by its peer to send
+ * messages. It nests inside chan->mlock of either channel (see ipc.c).
+ */
 typedef struct ipc_msg_queue {
+	mutex_t			lock;
+
 	struct list_node	free_list;
 	struct list_node	filled_list;
 	struct list_node	read_list;
 
 	uint			num_items;
 	size_t			item_sz;
+	uint32_t		flags;
 
 	uint8_t			*buf;
+	size_t			buf_sz;
 
 	/* store the message descriptors in the queue,
-	 * and the buffer separately. The buffer could
-	 * eventually move to a separate area that can
-	 * be mapped into the process directly.
+	 * and the buffer separately. The buffer of an
+	 * IPC_MSG_QUEUE_SHARED queue is page aligned and
+	 * can be mapped into the processes on both ends of
+	 * the channel (see sys_map_msg_bufs).
 	 */
 	msg_item_t		items[0];
 } ipc_msg_queue_t;
@@ -104,6 +118,10 @@ typedef struct msg_desc {
 		ipc_msg_kern_t	kern;
 		ipc_msg_user_t	user;
 	};
+
+	/* handles for the receiver, created from user.handles */
+	uint		num_handles;
+	handle_t	*handles[MAX_MSG_HANDLES];
 } msg_desc_t;
 
 /**
@@ -114,12 +132,15 @@ typedef struct msg_desc {
  *
  * @param num_items   Number of messages we need to store.
  * @param item_sz     Size of each message item.
+ * @param flags       IPC_MSG_QUEUE_SHARED to allocate a buffer that can be
+ *                    mapped into user space.
  * @param mq          Pointer where to store the ptr to the newly allocated
  *                    message queue.
  *
  * @return  Returns NO_ERROR on success, ERR_NO_MEMORY on error.
  */
-int ipc_msg_queue_create(uint num_items, size_t item_sz, ipc_msg_queue_t **mq)
+int ipc_msg_queue_create(uint num_items, size_t item_sz, uint32_t flags,
+			 ipc_msg_queue_t **mq)
 {
 	ipc_msg_queue_t *tmp_mq;
 	int ret;
@@ -131,7 +152,16 @@ int ipc_msg_queue_create(uint num_items, size_t item_sz, ipc_msg_queue_t **mq)
 		return ERR_NO_MEMORY;
 	}
 
-	tmp_mq->buf = malloc(num_items * item_sz);
+	if (flags & IPC_MSG_QUEUE_SHARED) {
+		/* whole pages, cleared as they become visible to user space */
+		tmp_mq->buf_sz = ROUNDUP(num_items * item_sz, PAGE_SIZE);
+		tmp_mq->buf = memalign(PAGE_SIZE, tmp_mq->buf_sz);
+		if (tmp_mq->buf)
+			memset(tmp_mq->buf, 0, tmp_mq->buf_sz);
+	} else {
+		tmp_mq->buf_sz = num_items * item_sz;
+		tmp_mq->buf = malloc(tmp_mq->buf_sz);
+	}
 	if (!tmp_mq->buf) {
 		dprintf(CRITICAL,
 			"cannot allocate memory for message queue buf\n");
@@ -139,8 +169,10 @@ int ipc_msg_queue_create(uint num_items, size_t item_sz, ipc_msg_queue_t **mq)
 		goto err_alloc_buf;
 	}
 
+	mutex_init(&tmp_mq->lock);
 	tmp_mq->num_items = num_items;
 	tmp_mq->item_sz = item_sz;
+	tmp_mq->flags = flags;
 	list_initialize(&tmp_mq->free_list);
 	list_initialize(&tmp_mq->filled_list);
 	list_initialize(&tmp_mq->read_list);
@@ -157,20 +189,66 @@ err_alloc_buf:
 	return ret;
 }
 
+static void msg_close_handles(handle_t **handles, uint num_handles)
+{
+	for (uint i = 0; i < num_handles; i++)
+		handle_close(handles[i]);
+}
+
 void ipc_msg_queue_destroy(ipc_msg_queue_t *mq)
 {
+	/* drop handles of messages that were never received */
+	for (uint i = 0; i < mq->num_items; i++)
+		msg_close_handles(mq->items[i].handles,
+		                  mq->items[i].num_handles);
+
+	mutex_destroy(&mq->lock);
 	free(mq->buf);
 	free(mq);
 }
 
 bool ipc_msg_queue_is_empty(ipc_msg_queue_t *mq)
 {
-	return list_is_empty(&mq->filled_list);
+	bool empty;
+
+	mutex_acquire(&mq->lock);
+	empty = list_is_empty(&mq->filled_list);
+	mutex_release(&mq->lock);
+	return empty;
 }
 
 bool ipc_msg_queue_is_full(ipc_msg_queue_t *mq)
 {
-	return list_is_empty(&mq->free_list);
+	bool full;
+
+	mutex_acquire(&mq->lock);
+	full = list_is_empty(&mq->free_list);
+	mutex_release(&mq->lock);
+	return full;
+}
+
+/*
+ * Map the buffer of a shared queue into ut. The buffer stays allocated
+ * until the queue is destroyed, so callers must hold a reference to the
+ * channel owning the queue until they have called ipc_msg_queue_unmap.
+ */
+int ipc_msg_queue_map(ipc_msg_queue_t *mq, uthread_t *ut, u_int flags,
+		      vaddr_t *vaddrp)
+{
+	if (!(mq->flags & IPC_MSG_QUEUE_SHARED))
+		return ERR_NOT_SUPPORTED;
+
+	*vaddrp = 0;
+	return uthread_map_contig(ut, vaddrp, vaddr_to_paddr(mq->buf),
+				  mq->buf_sz, flags, UT_MAP_ALIGN_4KB);
+}
+
+void ipc_msg_queue_unmap(ipc_msg_queue_t *mq, uthread_t *ut, vaddr_t vaddr)
+{
+	status_t err = uthread_unmap(ut, vaddr, mq->buf_sz);
+
+	DEBUG_ASSERT(err == NO_ERROR);
+	(void) err;
 }
 
 static inline uint8_t *msg_queue_get_buf(ipc_msg_queue_t *mq, msg_item_t *item)
@@ -183,7 +261,7 @@ static inline msg_item_t *msg_queue_get_item(ipc_msg_queue_t *mq, uint32_t id)
 	return id < mq->num_items ? &mq->items[id] : NULL;
 }
 
-static int check_channel_locked(handle_t *chandle)
+static int check_channel(handle_t *chandle)
 {
 	if (unlikely(!chandle))
 		return ERR_INVALID_ARGS;
@@ -194,12 +272,12 @@ static int check_channel_locked(handle_t *chandle)
 	return NO_ERROR;
 }
 
+/*
+ * Check that a channel is connected. Must be called with chan->mlock held
+ * after check_channel has verified that chandle is a channel.
+ */
 static int check_channel_connected_locked(handle_t *chandle)
 {
-	int ret = check_channel_locked(chandle);
-	if (unlikely(ret != NO_ERROR))
-		return ret;
-
 	ipc_chan_t *chan = containerof(chandle, ipc_chan_t, handle);
 
 	if (likely(chan->state == IPC_CHAN_STATE_CONNECTED)) {
@@ -213,21 +291,30 @@ static int check_channel_connected_locked(handle_t *chandle)
 		return ERR_NOT_READY;
 }
 
+/*
+ * Write message to peer's queue. Must be called with chan->mlock held.
+ *
+ * The free item is taken off the free list before the data is copied, so
+ * the queue lock is not held while copying and the peer can keep receiving
+ * messages in the meantime.
+ */
 static int msg_write_locked(ipc_chan_t *chan, msg_desc_t *msg)
 {
 	ssize_t ret;
 	msg_item_t *item;
 	ipc_msg_queue_t *mq = chan->peer->msg_queue;
 
-	item = list_peek_head_type(&mq->free_list, msg_item_t, node);
+	mutex_acquire(&mq->lock);
+	item = list_remove_head_type(&mq->free_list, msg_item_t, node);
 	if (item == NULL) {
-		chan->aux_state |= IPC_CHAN_AUX_STATE_SEND_BLOCKED;
+		atomic_or(&chan->aux_state, IPC_CHAN_AUX_STATE_SEND_BLOCKED);
+		mutex_release(&mq->lock);
 		return ERR_NOT_ENOUGH_BUFFER;
 	}
+	mutex_release(&mq->lock);
 
 	DEBUG_ASSERT(item->state == MSG_ITEM_STATE_FREE);
 
-	/* TODO: figure out what to do about handles */
 	item->num_handles = 0;
 	item->len = 0;
 
@@ -235,42 +322,52 @@ static int msg_write_locked(ipc_chan_t *chan, msg_desc_t *msg)
 
 	if (msg->type == IPC_MSG_BUFFER_KERNEL) {
 		if (msg->kern.num_handles) {
-			LTRACEF("handles are not supported yet\n");
-			return ERR_NOT_SUPPORTED;
+			LTRACEF("kernel clients cannot pass handles\n");
+			ret = ERR_NOT_SUPPORTED;
+		} else {
+			ret = kern_iovec_to_membuf(buf, mq->item_sz,
+			                          (const iovec_kern_t *)msg->kern.iov,
+			                           msg->kern.num_iov);
 		}
-		ret = kern_iovec_to_membuf(buf, mq->item_sz,
-		                          (const iovec_kern_t *)msg->kern.iov,
-		                           msg->kern.num_iov);
 	} else if (msg->type == IPC_MSG_BUFFER_USER) {
-		if (msg->user.num_handles) {
-			LTRACEF("handles are not supported yet\n");
-			return ERR_NOT_SUPPORTED;
-		}
 		ret = user_iovec_to_membuf(buf, mq->item_sz,
 		                           msg->user.iov, msg->user.num_iov);
 	} else {
-		return ERR_INVALID_ARGS;
+		ret = ERR_INVALID_ARGS;
 	}
 
-	if (ret < 0)
-		return ret;
-
-	item->len = (size_t) ret;
-	list_delete(&item->node);
-	list_add_tail(&mq->filled_list, &item->node);
-	item->state = MSG_ITEM_STATE_FILLED;
+	mutex_acquire(&mq->lock);
+	if (ret < 0) {
+		/* put it back on the head of the free list */
+		list_add_head(&mq->free_list, &item->node);
+	} else {
+		/* the item takes over the refs held by msg */
+		for (uint i = 0; i < msg->num_handles; i++)
+			item->handles[i] = msg->handles[i];
+		item->num_handles = msg->num_handles;
+		item->len = (size_t) ret;
+		list_add_tail(&mq->filled_list, &item->node);
+		item->state = MSG_ITEM_STATE_FILLED;
+	}
+	mutex_release(&mq->lock);
 
-	return item->len;
+	return ret;
 }
 
 /*
  * reads the specified message by copying the data into the iov list
  * provided by msg. The message must have been previously moved
- * to the read list (and thus put into READ state).
+ * to the read list (and thus put into READ state). Must be called with
+ * mq->lock held.
+ *
+ * If msg has room for all handles attached to the message they are
+ * detached from it and returned in msg->handles for the caller to install.
+ * Otherwise they stay with the message and are closed when it is put.
  */
 static int msg_read_locked(ipc_msg_queue_t *mq, uint32_t msg_id,
                            uint32_t offset, msg_desc_t *msg)
 {
+	int ret;
 	msg_item_t *item;
 
 	item = msg_queue_get_item(mq, msg_id);
@@ -285,11 +382,6 @@ static int msg_read_locked(ipc_msg_queue_t *mq, uint32_t msg_id,
 		return ERR_INVALID_ARGS;
 	}
 
-	if (item->num_handles) {
-		LTRACEF("handles are not supported yet\n");
-		return ERR_NOT_SUPPORTED;
-	}
-
 	if (offset > item->len) {
 		LTRACEF("invalid offset %d\n", offset);
 		return ERR_INVALID_ARGS;
@@ -300,24 +392,140 @@ static int msg_read_locked(ipc_msg_queue_t *mq, uint32_t msg_id,
 
 	if (msg->type == IPC_MSG_BUFFER_KERNEL) {
 		if (msg->kern.num_handles) {
-			LTRACEF("handles are not supported yet\n");
+			LTRACEF("kernel clients cannot pass handles\n");
 			return ERR_NOT_SUPPORTED;
 		}
 		return membuf_to_kern_iovec((const iovec_kern_t *)msg->kern.iov,
 		                            msg->kern.num_iov,
 		                            buf, bytes_left);
 	} else if (msg->type == IPC_MSG_BUFFER_USER) {
-		if (msg->user.num_handles) {
-			LTRACEF("handles are not supported yet\n");
-			return ERR_NOT_SUPPORTED;
+		ret = membuf_to_user_iovec(msg->user.iov, msg->user.num_iov,
+		                           buf, bytes_left);
+		if (ret >= 0 && item->num_handles &&
+		    msg->user.num_handles >= item->num_handles) {
+			for (uint i = 0; i < item->num_handles; i++)
+				msg->handles[i] = item->handles[i];
+			msg->num_handles = item->num_handles;
+			item->num_handles = 0;
 		}
-		return membuf_to_user_iovec(msg->user.iov, msg->user.num_iov,
-		                            buf, bytes_left);
+		return ret;
 	} else {
 		return ERR_INVALID_ARGS;
 	}
 }
 
+/*
+ * Look up handles listed in a user message and create a new handle for the
+ * receiver from each of them. The sender keeps its own handles. Only
+ * memory objects can be sent.
+ */
+static int msg_get_user_handles(uctx_t *ctx, msg_desc_t *msg)
+{
+	int ret;
+	handle_id_t ids[MAX_MSG_HANDLES];
+	uint num_handles = msg->user.num_handles;
+
+	msg->num_handles = 0;
+	if (!num_handles)
+		return NO_ERROR;
+
+	if (num_handles > MAX_MSG_HANDLES)
+		return ERR_TOO_BIG;
+
+	ret = copy_from_user(ids, msg->user.handles,
+	                     num_handles * sizeof(handle_id_t));
+	if (ret != NO_ERROR)
+		return ret;
+
+	for (uint i = 0; i < num_handles; i++) {
+		handle_t *handle;
+
+		ret = uctx_handle_get(ctx, ids[i], &handle);
+		if (ret != NO_ERROR)
+			goto err;
+
+		if (memref_is_memref(handle)) {
+			ret = memref_share(handle, &msg->handles[i]);
+		} else {
+			LTRACEF("handle %d cannot be sent\n", ids[i]);
+			ret = ERR_NOT_SUPPORTED;
+		}
+		handle_decref(handle);
+		if (ret != NO_ERROR)
+			goto err;
+		msg->num_handles++;
+	}
+	return NO_ERROR;
+
+err:
+	msg_close_handles(msg->handles, msg->num_handles);
+	msg->num_handles = 0;
+	return ret;
+}
+
+/*
+ * Install handles returned by msg_read_locked into the current app and
+ * copy their ids to user space. On failure all of them are closed.
+ */
+static int msg_install_user_handles(msg_desc_t *msg)
+{
+	uctx_t *ctx = current_uctx();
+	handle_id_t ids[MAX_MSG_HANDLES];
+	handle_t *handle;
+	uint i;
+	int ret = NO_ERROR;
+
+	for (i = 0; i < msg->num_handles; i++) {
+		ret = uctx_handle_install(ctx, msg->handles[i], &ids[i]);
+		if (ret != NO_ERROR)
+			break;
+	}
+
+	if (ret == NO_ERROR)
+		ret = copy_to_user(msg->user.handles, ids,
+		                   msg->num_handles * sizeof(handle_id_t));
+
+	if (ret != NO_ERROR) {
+		while (i--)
+			uctx_handle_remove(ctx, ids[i], &handle);
+		msg_close_handles(msg->handles, msg->num_handles);
+	}
+	msg->num_handles = 0;
+	return ret;
+}
+
+
+/*
+ * Lock channel and its queue and read message.
+ */
+static int msg_read(ipc_chan_t *chan, uint32_t msg_id, uint32_t offset,
+                    msg_desc_t *msg)
+{
+	int ret;
+	ipc_msg_queue_t *mq;
+
+	msg->num_handles = 0;
+
+	mutex_acquire(&chan->mlock);
+	mq = chan->msg_queue;
+	if (unlikely(!mq)) {
+		ret = ERR_INVALID_ARGS;
+	} else {
+		mutex_acquire(&mq->lock);
+		ret = msg_read_locked(mq, msg_id, offset, msg);
+		mutex_release(&mq->lock);
+	}
+	mutex_release(&chan->mlock);
+
+	/* installing takes the handle list lock, so do it unlocked */
+	if (msg->num_handles) {
+		int rc = msg_install_user_handles(msg);
+		if (rc != NO_ERROR)
+			ret = rc;
+	}
+	return ret;
+}
+
 
 /*
  *  Is called to look at the head of the filled messages list. It should be followed by
@@ -333,6 +541,7 @@ static int msg_peek_next_filled_locked(ipc_msg_queue_t *mq, ipc_msg_info_t *info
 
 	info->len = item->len;
 	info->id  = item->id;
+	info->num_handles = item->num_handles;
 
 	return NO_ERROR;
 }
@@ -353,6 +562,9 @@ static void msg_get_filled_locked(ipc_msg_queue_t *mq)
 	item->state = MSG_ITEM_STATE_READ;
 }
 
+/*
+ * Return message to free list. Must be called with chan->mlock held.
+ */
 static int msg_put_read_locked(ipc_chan_t *chan, uint32_t msg_id)
 {
 	DEBUG_ASSERT(chan);
@@ -360,26 +572,123 @@ static int msg_put_read_locked(ipc_chan_t *chan, uint32_t msg_id)
 
 	ipc_msg_queue_t *mq = chan->msg_queue;
 	msg_item_t *item = msg_queue_get_item(mq, msg_id);
+	ipc_chan_t *peer = chan->peer;
+	bool unblocked = false;
+	handle_t *handles[MAX_MSG_HANDLES];
+	uint num_handles;
+
+	if (!item)
+		return ERR_INVALID_ARGS;
 
-	if (!item || item->state != MSG_ITEM_STATE_READ)
+	mutex_acquire(&mq->lock);
+	if (item->state != MSG_ITEM_STATE_READ) {
+		mutex_release(&mq->lock);
 		return ERR_INVALID_ARGS;
+	}
 
 	list_delete(&item->node);
 
+	/* handles that were not received are closed below */
+	num_handles = item->num_handles;
+	for (uint i = 0; i < num_handles; i++)
+		handles[i] = item->handles[i];
+	item->num_handles = 0;
+
 	/* put it on the head since it was just taken off here */
 	list_add_head(&mq->free_list, &item->node);
 	item->state = MSG_ITEM_STATE_FREE;
 
-	ipc_chan_t *peer = chan->peer;
-	if (peer && (peer->aux_state & IPC_CHAN_AUX_STATE_SEND_BLOCKED)) {
-		peer->aux_state &= ~IPC_CHAN_AUX_STATE_SEND_BLOCKED;
-		peer->aux_state |=  IPC_CHAN_AUX_STATE_SEND_UNBLOCKED;
+	/*
+	 * The peer sets SEND_BLOCKED with mq->lock held when it finds the
+	 * free list empty, so checking it here cannot miss a blocked sender.
+	 */
+	if (peer && (atomic_and(&peer->aux_state,
+	                        ~IPC_CHAN_AUX_STATE_SEND_BLOCKED) &
+	             IPC_CHAN_AUX_STATE_SEND_BLOCKED)) {
+		atomic_or(&peer->aux_state, IPC_CHAN_AUX_STATE_SEND_UNBLOCKED);
+		unblocked = true;
+	}
+	mutex_release(&mq->lock);
+
+	msg_close_handles(handles, num_handles);
+
+	if (unblocked)
 		handle_notify(&peer->handle);
+
+	return NO_ERROR;
+}
+
+/*
+ * Take a free item off the peer's queue for the sender to fill in place
+ * through its mapping of the queue. Must be called with chan->mlock held.
+ */
+static int msg_reserve_locked(ipc_chan_t *chan, ipc_msg_info_t *info)
+{
+	msg_item_t *item;
+	ipc_msg_queue_t *mq = chan->peer->msg_queue;
+
+	mutex_acquire(&mq->lock);
+	item = list_remove_head_type(&mq->free_list, msg_item_t, node);
+	if (item == NULL) {
+		atomic_or(&chan->aux_state, IPC_CHAN_AUX_STATE_SEND_BLOCKED);
+		mutex_release(&mq->lock);
+		return ERR_NOT_ENOUGH_BUFFER;
 	}
+	DEBUG_ASSERT(item->state == MSG_ITEM_STATE_FREE);
+	item->state = MSG_ITEM_STATE_RESERVED;
+	item->num_handles = 0;
+	item->len = 0;
+	mutex_release(&mq->lock);
 
+	info->id = item->id;
+	info->len = mq->item_sz;
+	info->num_handles = 0;
 	return NO_ERROR;
 }
 
+/*
+ * Return a reserved item to the free list. Must be called with
+ * chan->mlock held.
+ */
+static void msg_unreserve_locked(ipc_chan_t *chan, uint32_t msg_id)
+{
+	ipc_msg_queue_t *mq = chan->peer->msg_queue;
+	msg_item_t *item = msg_queue_get_item(mq, msg_id);
+
+	DEBUG_ASSERT(item);
+
+	mutex_acquire(&mq->lock);
+	DEBUG_ASSERT(item->state == MSG_ITEM_STATE_RESERVED);
+	list_add_head(&mq->free_list, &item->node);
+	item->state = MSG_ITEM_STATE_FREE;
+	mutex_release(&mq->lock);
+}
+
+/*
+ * Queue an item previously reserved with msg_reserve_locked and filled by
+ * the sender. Must be called with chan->mlock held.
+ */
+static int msg_commit_locked(ipc_chan_t *chan, uint32_t msg_id, uint32_t len)
+{
+	ipc_msg_queue_t *mq = chan->peer->msg_queue;
+	msg_item_t *item = msg_queue_get_item(mq, msg_id);
+
+	if (!item || len > mq->item_sz)
+		return ERR_INVALID_ARGS;
+
+	mutex_acquire(&mq->lock);
+	if (item->state != MSG_ITEM_STATE_RESERVED) {
+		mutex_release(&mq->lock);
+		return ERR_INVALID_ARGS;
+	}
+	item->len = len;
+	list_add_tail(&mq->filled_list, &item->node);
+	item->state = MSG_ITEM_STATE_FILLED;
+	mutex_release(&mq->lock);
+
+	return (int) len;
+}
+
 
 long __SYSCALL sys_send_msg(uint32_t handle_id, user_addr_t user_msg)
 {
@@ -398,19 +707,34 @@ long __SYSCALL sys_send_msg(uint32_t handle_id, user_addr_t user_msg)
 	if (unlikely(ret != NO_ERROR))
 		return (long) ret;
 
-	mutex_acquire(&ipc_lock);
+	/* and the handles to send along */
+	ret = msg_get_user_handles(current_uctx(), &tmp_msg);
+	if (unlikely(ret != NO_ERROR)) {
+		handle_decref(chandle);
+		return (long) ret;
+	}
+
 	/* check if it is  avalid channel to call send_msg */
-	ret = check_channel_connected_locked(chandle);
+	ret = check_channel(chandle);
 	if (likely(ret == NO_ERROR)) {
 		ipc_chan_t *chan = containerof(chandle, ipc_chan_t, handle);
-		/* do write message to target channel  */
-		ret = msg_write_locked(chan, &tmp_msg);
-		if (ret >= 0) {
-			/* and notify target */
-			handle_notify(&chan->peer->handle);
+
+		mutex_acquire(&chan->mlock);
+		ret = check_channel_connected_locked(chandle);
+		if (likely(ret == NO_ERROR)) {
+			/* do write message to target channel  */
+			ret = msg_write_locked(chan, &tmp_msg);
+			if (ret >= 0) {
+				/* and notify target */
+				handle_notify(&chan->peer->handle);
+			}
 		}
+		mutex_release(&chan->mlock);
+	}
+	if (ret < 0) {
+		/* handles were not sent, close the ones created above */
+		msg_close_handles(tmp_msg.handles, tmp_msg.num_handles);
 	}
-	mutex_release(&ipc_lock);
 	handle_decref(chandle);
 	return (long) ret;
 }
@@ -425,17 +749,43 @@ int ipc_send_msg(handle_t *chandle, ipc_msg_kern_t *msg)
 
 	tmp_msg.type = IPC_MSG_BUFFER_KERNEL;
 	memcpy(&tmp_msg.kern, msg, sizeof(ipc_msg_kern_t));
+	tmp_msg.num_handles = 0;
 
-	mutex_acquire(&ipc_lock);
-	ret = check_channel_connected_locked(chandle);
+	ret = check_channel(chandle);
 	if (likely(ret == NO_ERROR)) {
 		ipc_chan_t *chan = containerof(chandle, ipc_chan_t, handle);
-		ret = msg_write_locked(chan, &tmp_msg);
-		if (ret >= 0) {
-			handle_notify(&chan->peer->handle);
+
+		mutex_acquire(&chan->mlock);
+		ret = check_channel_connected_locked(chandle);
+		if (likely(ret == NO_ERROR)) {
+			ret = msg_write_locked(chan, &tmp_msg);
+			if (ret >= 0) {
+				handle_notify(&chan->peer->handle);
+			}
 		}
+		mutex_release(&chan->mlock);
+	}
+	return ret;
+}
+
+/*
+ * Get the largest message that can be sent on a connected channel, which is
+ * the buffer size of the peer's message queue.
+ */
+int ipc_get_max_msg_size(handle_t *chandle, size_t *max_size)
+{
+	int ret;
+
+	ret = check_channel(chandle);
+	if (likely(ret == NO_ERROR)) {
+		ipc_chan_t *chan = containerof(chandle, ipc_chan_t, handle);
+
+		mutex_acquire(&chan->mlock);
+		ret = check_channel_connected_locked(chandle);
+		if (likely(ret == NO_ERROR))
+			*max_size = chan->peer->msg_queue->item_sz;
+		mutex_release(&chan->mlock);
 	}
-	mutex_release(&ipc_lock);
 	return ret;
 }
 
@@ -450,24 +800,32 @@ long __SYSCALL sys_get_msg(uint32_t handle_id, user_addr_t user_msg_info)
 	if (ret != NO_ERROR)
 		return (long) ret;
 
-	mutex_acquire(&ipc_lock);
 	/* check if channel handle is a valid one */
-	ret = check_channel_locked(chandle);
+	ret = check_channel(chandle);
 	if (likely(ret == NO_ERROR)) {
 		ipc_chan_t *chan = containerof(chandle, ipc_chan_t, handle);
-		/* peek next filled message */
-		ret = msg_peek_next_filled_locked(chan->msg_queue, &msg_info);
-		if (likely(ret == NO_ERROR)) {
-			/* copy it to user space */
-			ret = copy_to_user(user_msg_info,
-					   &msg_info, sizeof(ipc_msg_info_t));
+
+		mutex_acquire(&chan->mlock);
+		ipc_msg_queue_t *mq = chan->msg_queue;
+		if (unlikely(!mq)) {
+			ret = ERR_NO_MSG;
+		} else {
+			mutex_acquire(&mq->lock);
+			/* peek next filled message */
+			ret = msg_peek_next_filled_locked(mq, &msg_info);
 			if (likely(ret == NO_ERROR)) {
-				/* and make it readable */
-				msg_get_filled_locked(chan->msg_queue);
+				/* copy it to user space */
+				ret = copy_to_user(user_msg_info,
+						   &msg_info, sizeof(ipc_msg_info_t));
+				if (likely(ret == NO_ERROR)) {
+					/* and make it readable */
+					msg_get_filled_locked(mq);
+				}
 			}
+			mutex_release(&mq->lock);
 		}
+		mutex_release(&chan->mlock);
 	}
-	mutex_release(&ipc_lock);
 	handle_decref(chandle);
 	return (long) ret;
 }
@@ -476,19 +834,27 @@ int ipc_get_msg(handle_t *chandle, ipc_msg_info_t *msg_info)
 {
 	int ret;
 
-	mutex_acquire(&ipc_lock);
 	/* check if channel handle */
-	ret = check_channel_locked(chandle);
+	ret = check_channel(chandle);
 	if (likely(ret == NO_ERROR)) {
 		ipc_chan_t *chan = containerof(chandle, ipc_chan_t, handle);
-		/* peek next filled message */
-		ret  = msg_peek_next_filled_locked(chan->msg_queue, msg_info);
-		if (likely(ret == NO_ERROR)) {
-			/* and make it readable */
-			msg_get_filled_locked(chan->msg_queue);
+
+		mutex_acquire(&chan->mlock);
+		ipc_msg_queue_t *mq = chan->msg_queue;
+		if (unlikely(!mq)) {
+			ret = ERR_NO_MSG;
+		} else {
+			mutex_acquire(&mq->lock);
+			/* peek next filled message */
+			ret  = msg_peek_next_filled_locked(mq, msg_info);
+			if (likely(ret == NO_ERROR)) {
+				/* and make it readable */
+				msg_get_filled_locked(mq);
+			}
+			mutex_release(&mq->lock);
 		}
+		mutex_release(&chan->mlock);
 	}
-	mutex_release(&ipc_lock);
 	return ret;
 }
 
@@ -513,15 +879,20 @@ int ipc_put_msg(handle_t *chandle, uint32_t msg_id)
 {
 	int ret;
 
-	mutex_acquire(&ipc_lock);
 	/* check is channel handle is a valid one */
-	ret = check_channel_locked(chandle);
+	ret = check_channel(chandle);
 	if (likely(ret == NO_ERROR)) {
 		ipc_chan_t *chan = containerof(chandle, ipc_chan_t, handle);
-		/* retire message */
-		ret = msg_put_read_locked(chan, msg_id);
+
+		mutex_acquire(&chan->mlock);
+		if (unlikely(!chan->msg_queue)) {
+			ret = ERR_INVALID_ARGS;
+		} else {
+			/* retire message */
+			ret = msg_put_read_locked(chan, msg_id);
+		}
+		mutex_release(&chan->mlock);
 	}
-	mutex_release(&ipc_lock);
 	return ret;
 }
 
@@ -544,16 +915,13 @@ long __SYSCALL sys_read_msg(uint32_t handle_id, uint32_t msg_id, uint32_t offset
 	if (unlikely(ret != NO_ERROR))
 		return (long) ret;
 
-	mutex_acquire(&ipc_lock);
 	/* check if channel handle is a valid one */
-	ret = check_channel_locked (chandle);
+	ret = check_channel(chandle);
 	if (ret == NO_ERROR) {
 		ipc_chan_t *chan = containerof(chandle, ipc_chan_t, handle);
 		/* read message content */
-		ret = msg_read_locked(chan->msg_queue, msg_id,
-		                      offset, &tmp_msg);
+		ret = msg_read(chan, msg_id, offset, &tmp_msg);
 	}
-	mutex_release(&ipc_lock);
 	handle_decref(chandle);
 
 	return (long) ret;
@@ -571,17 +939,134 @@ int ipc_read_msg(handle_t *chandle, uint32_t msg_id, uint32_t offset,
 	tmp_msg.type = IPC_MSG_BUFFER_KERNEL;
 	memcpy(&tmp_msg.kern, msg, sizeof(ipc_msg_kern_t));
 
-	mutex_acquire(&ipc_lock);
-	ret = check_channel_locked (chandle);
+	ret = check_channel(chandle);
 	if (ret == NO_ERROR) {
 		ipc_chan_t *chan = containerof(chandle, ipc_chan_t, handle);
-		ret = msg_read_locked(chan->msg_queue, msg_id,
-		                      offset, &tmp_msg);
+		ret = msg_read(chan, msg_id, offset, &tmp_msg);
 	}
-	mutex_release(&ipc_lock);
 	return ret;
 }
 
+/*
+ * Map the receive queue of a channel read-only and the peer's queue
+ * writable into the calling process. Once mapped, messages can be sent
+ * with get_send_buf and send_buf and received with get_msg and put_msg,
+ * so only message descriptors pass through the kernel.
+ *
+ * The sender keeps write access to buffers it has already sent, so the
+ * receiver has to copy data it needs to validate out of its mapping first.
+ */
+long __SYSCALL sys_map_msg_bufs(uint32_t handle_id, user_addr_t user_bufs)
+{
+	handle_t *chandle;
+	ipc_msg_bufs_t bufs;
+	int ret;
+
+	ret = uctx_handle_get(current_uctx(), handle_id, &chandle);
+	if (unlikely(ret != NO_ERROR))
+		return (long) ret;
+
+	ret = check_channel(chandle);
+	if (likely(ret == NO_ERROR)) {
+		ipc_chan_t *chan = containerof(chandle, ipc_chan_t, handle);
+		uthread_t *ut = uthread_get_current();
+
+		mutex_acquire(&chan->mlock);
+		ret = check_channel_connected_locked(chandle);
+		if (ret == NO_ERROR && chan->bufs_ut)
+			ret = ERR_ALREADY_EXISTS;
+		if (ret == NO_ERROR) {
+			ipc_msg_queue_t *rx_mq = chan->msg_queue;
+			ipc_msg_queue_t *tx_mq = chan->peer->msg_queue;
+
+			ret = ipc_msg_queue_map(rx_mq, ut, UTM_R,
+						&chan->rx_bufs_va);
+			if (ret == NO_ERROR) {
+				ret = ipc_msg_queue_map(tx_mq, ut,
+							UTM_R | UTM_W,
+							&chan->tx_bufs_va);
+				if (ret != NO_ERROR)
+					ipc_msg_queue_unmap(rx_mq, ut,
+							    chan->rx_bufs_va);
+			}
+			if (ret == NO_ERROR) {
+				chan->bufs_ut = ut;
+				chan->tx_bufs_mq = tx_mq;
+
+				bufs.rx_base = chan->rx_bufs_va;
+				bufs.tx_base = chan->tx_bufs_va;
+				bufs.num_bufs = tx_mq->num_items;
+				bufs.buf_size = tx_mq->item_sz;
+			}
+		}
+		mutex_release(&chan->mlock);
+
+		if (ret == NO_ERROR)
+			ret = copy_to_user(user_bufs, &bufs, sizeof(bufs));
+	}
+	handle_decref(chandle);
+	return (long) ret;
+}
+
+long __SYSCALL sys_get_send_buf(uint32_t handle_id, user_addr_t user_msg_info)
+{
+	handle_t *chandle;
+	ipc_msg_info_t msg_info;
+	int ret;
+
+	ret = uctx_handle_get(current_uctx(), handle_id, &chandle);
+	if (unlikely(ret != NO_ERROR))
+		return (long) ret;
+
+	ret = check_channel(chandle);
+	if (likely(ret == NO_ERROR)) {
+		ipc_chan_t *chan = containerof(chandle, ipc_chan_t, handle);
+
+		mutex_acquire(&chan->mlock);
+		ret = check_channel_connected_locked(chandle);
+		if (ret == NO_ERROR && !chan->bufs_ut)
+			ret = ERR_NOT_READY;
+		if (likely(ret == NO_ERROR)) {
+			ret = msg_reserve_locked(chan, &msg_info);
+			if (ret == NO_ERROR) {
+				ret = copy_to_user(user_msg_info, &msg_info,
+						   sizeof(msg_info));
+				if (ret != NO_ERROR)
+					msg_unreserve_locked(chan, msg_info.id);
+			}
+		}
+		mutex_release(&chan->mlock);
+	}
+	handle_decref(chandle);
+	return (long) ret;
+}
+
+long __SYSCALL sys_send_buf(uint32_t handle_id, uint32_t msg_id, uint32_t len)
+{
+	handle_t *chandle;
+	int ret;
+
+	ret = uctx_handle_get(current_uctx(), handle_id, &chandle);
+	if (unlikely(ret != NO_ERROR))
+		return (long) ret;
+
+	ret = check_channel(chandle);
+	if (likely(ret == NO_ERROR)) {
+		ipc_chan_t *chan = containerof(chandle, ipc_chan_t, handle);
+
+		mutex_acquire(&chan->mlock);
+		ret = check_channel_connected_locked(chandle);
+		if (likely(ret == NO_ERROR)) {
+			ret = msg_commit_locked(chan, msg_id, len);
+			if (ret >= 0)
+				handle_notify(&chan->peer->handle);
+		}
+		mutex_release(&chan->mlock);
+	}
+	handle_decref(chandle);
+	return (long) ret;
+}
+
 #else /* WITH_TRUSTY_IPC */
 
 long __SYSCALL sys_send_msg(uint32_t handle_id, user_addr_t user_msg)
@@ -605,6 +1090,21 @@ long __SYSCALL sys_read_msg(uint32_t handle_id, uint32_t msg_id, uint32_t offset
 	return (long) ERR_NOT_SUPPORTED;
 }
 
+long __SYSCALL sys_map_msg_bufs(uint32_t handle_id, user_addr_t user_bufs)
+{
+	return (long) ERR_NOT_SUPPORTED;
+}
+
+long __SYSCALL sys_get_send_buf(uint32_t handle_id, user_addr_t user_msg_info)
+{
+	return (long) ERR_NOT_SUPPORTED;
+}
+
+long __SYSCALL sys_send_buf(uint32_t handle_id, uint32_t msg_id, uint32_t len)
+{
+	return (long) ERR_NOT_SUPPORTED;
+}
+
 #endif  /* WITH_TRUSTY_IPC */
 
 
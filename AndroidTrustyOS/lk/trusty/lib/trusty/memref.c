@@ -0,0 +1,357 @@
+/*
+ * Copyright (c) 2017, Google, Inc. All rights reserved
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#define LOCAL_TRACE 0
+
+#include <assert.h>
+#include <err.h>
+#include <kernel/mutex.h>
+#include <list.h>
+#include <mm.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <trace.h>
+#include <uthread.h>
+
+#include <lib/syscall.h>
+#include <lib/trusty/memref.h>
+
+#if WITH_TRUSTY_IPC && UTHREAD_WITH_MEMORY_MAPPING_SUPPORT
+
+#include <lib/trusty/uctx.h>
+
+/*
+ * A memory object holds the physical pages backing a range of its
+ * creator's address space, looked up when the object is created. Pages
+ * are not pinned: objects can only be created on app image, heap and
+ * stack mappings (UTM_APP_MEM), which stay in place for the lifetime of
+ * the app. Mappings of other memory objects, of shared message buffers
+ * and of io regions are rejected, their pages can go away while the
+ * object still refers to them.
+ *
+ * Sending an object in a message creates a new handle for the receiver
+ * that refers to the creator's object (root) and keeps it allocated. The
+ * sender keeps its own handle. Closing any handle revokes the mappings
+ * made through it, and closing the root handle also revokes the mappings
+ * of every handle shared from it and stops them from being mapped again.
+ */
+typedef struct memref {
+	handle_t		handle;
+
+	struct memref		*root;	/* creator's object, self for root */
+	bool			closed;	/* protected by memref_lock */
+
+	u_int			flags;	/* UTM_R, UTM_W and UTM_NS_MEM */
+	size_t			offset;	/* of the object in its first page */
+	size_t			size;
+	u_int			npages;	/* of pfn_list, 0 unless root */
+	paddr_t			pfn_list[0];
+} memref_t;
+
+/* mapping of a memory object, on memref_maps */
+typedef struct memref_map {
+	struct list_node	node;
+	memref_t		*memref;	/* handle mapped through */
+	uthread_t		*ut;
+	vaddr_t			vaddr;		/* user address of the object */
+} memref_map_t;
+
+static mutex_t memref_lock = MUTEX_INITIAL_VALUE(memref_lock);
+static struct list_node memref_maps = LIST_INITIAL_VALUE(memref_maps);
+
+static uint32_t memref_poll(handle_t *handle);
+static void memref_handle_shutdown(handle_t *handle);
+static void memref_handle_destroy(handle_t *handle);
+
+static struct handle_ops memref_handle_ops = {
+	.poll		= memref_poll,
+	.shutdown	= memref_handle_shutdown,
+	.destroy	= memref_handle_destroy,
+};
+
+bool memref_is_memref(handle_t *handle)
+{
+	return likely(handle->ops == &memref_handle_ops);
+}
+
+static uint32_t memref_poll(handle_t *handle)
+{
+	/* memory objects have no events */
+	return IPC_HANDLE_POLL_NONE;
+}
+
+/* Unmap and free a mapping. Must be called with memref_lock held. */
+static status_t memref_revoke_map_locked(memref_map_t *map)
+{
+	status_t ret;
+
+	ret = uthread_revoke_pages(map->ut, map->vaddr, map->memref->size);
+	LTRACEF("memref %p: revoked 0x%lx, ret %d\n", map->memref,
+	        map->vaddr, ret);
+	list_delete(&map->node);
+	free(map);
+	return ret;
+}
+
+static void memref_handle_shutdown(handle_t *handle)
+{
+	memref_t *memref = containerof(handle, memref_t, handle);
+	memref_map_t *map, *tmp;
+
+	mutex_acquire(&memref_lock);
+	memref->closed = true;
+	list_for_every_entry_safe(&memref_maps, map, tmp, memref_map_t, node) {
+		if (map->memref == memref || (memref->root == memref &&
+		    map->memref->root == memref))
+			memref_revoke_map_locked(map);
+	}
+	mutex_release(&memref_lock);
+}
+
+static void memref_handle_destroy(handle_t *handle)
+{
+	memref_t *memref = containerof(handle, memref_t, handle);
+
+	LTRACEF("memref %p: destroyed\n", memref);
+	if (memref->root != memref)
+		handle_decref(&memref->root->handle);
+	free(memref);
+}
+
+/*
+ *  Called by user task to create a memory object for [uaddr, uaddr + size)
+ *  with the access rights specified by MMAP_FLAG_PROT_* flags.
+ *
+ *  On success - returns handle id of the new memory object.
+ *  On error   - returns negative error code.
+ */
+long __SYSCALL sys_memref_create(user_addr_t uaddr, uint32_t size,
+                                 uint32_t flags)
+{
+	uthread_t *ut = uthread_get_current();
+	memref_t *memref;
+	vaddr_t start, end;
+	u_int map_flags;
+	handle_id_t handle_id;
+	int ret;
+
+	if (!size || (flags & ~MMAP_FLAG_PROT_MASK) ||
+	    !(flags & MMAP_FLAG_PROT_READ))
+		return ERR_INVALID_ARGS;
+
+	start = ROUNDDOWN((vaddr_t)uaddr, PAGE_SIZE);
+	end = ROUNDUP((vaddr_t)uaddr + size, PAGE_SIZE);
+	if (end <= start)
+		return ERR_INVALID_ARGS;
+
+	memref = calloc(1, sizeof(memref_t) +
+	                   (end - start) / PAGE_SIZE * sizeof(paddr_t));
+	if (!memref)
+		return ERR_NO_MEMORY;
+
+	memref->root = memref;
+	memref->npages = (end - start) / PAGE_SIZE;
+	memref->offset = (vaddr_t)uaddr - start;
+	memref->size = size;
+
+	ret = uthread_get_pages(ut, start, end - start, memref->pfn_list,
+	                        &map_flags);
+	if (ret != NO_ERROR)
+		goto err_get_pages;
+
+	if (!(map_flags & UTM_APP_MEM)) {
+		ret = ERR_NOT_ALLOWED;
+		goto err_get_pages;
+	}
+
+	if ((flags & MMAP_FLAG_PROT_WRITE) && !(map_flags & UTM_W)) {
+		ret = ERR_ACCESS_DENIED;
+		goto err_get_pages;
+	}
+
+	memref->flags = UTM_R | (map_flags & UTM_NS_MEM);
+	if (flags & MMAP_FLAG_PROT_WRITE)
+		memref->flags |= UTM_W;
+
+	handle_init(&memref->handle, &memref_handle_ops);
+
+	ret = uctx_handle_install(current_uctx(), &memref->handle, &handle_id);
+	if (ret != NO_ERROR) {
+		handle_decref(&memref->handle);
+		return ret;
+	}
+
+	LTRACEF("memref %p: %u pages, flags 0x%x\n", memref, memref->npages,
+	        memref->flags);
+	return (long) handle_id;
+
+err_get_pages:
+	free(memref);
+	return ret;
+}
+
+int memref_share(handle_t *handle, handle_t **shared)
+{
+	memref_t *memref = containerof(handle, memref_t, handle);
+	memref_t *new_memref;
+
+	DEBUG_ASSERT(memref_is_memref(handle));
+
+	new_memref = calloc(1, sizeof(memref_t));
+	if (!new_memref)
+		return ERR_NO_MEMORY;
+
+	new_memref->root = memref->root;
+	new_memref->flags = memref->flags;
+	new_memref->offset = memref->offset;
+	new_memref->size = memref->size;
+	handle_incref(&memref->root->handle);
+	handle_init(&new_memref->handle, &memref_handle_ops);
+
+	LTRACEF("memref %p: shared from %p\n", new_memref, memref);
+	*shared = &new_memref->handle;
+	return NO_ERROR;
+}
+
+long memref_mmap(uint32_t handle_id, uint32_t size, uint32_t flags)
+{
+	uthread_t *ut = uthread_get_current();
+	handle_t *handle;
+	memref_t *memref;
+	memref_map_t *map;
+	vaddr_t vaddr = 0;
+	u_int ut_flags = UTM_R;
+	long ret;
+
+	if (flags & ~(MMAP_FLAG_MEMREF | MMAP_FLAG_PROT_MASK))
+		return ERR_INVALID_ARGS;
+
+	ret = uctx_handle_get(current_uctx(), handle_id, &handle);
+	if (ret != NO_ERROR)
+		return ret;
+
+	if (!memref_is_memref(handle)) {
+		ret = ERR_INVALID_ARGS;
+		goto err_handle;
+	}
+	memref = containerof(handle, memref_t, handle);
+
+	if (size != memref->size) {
+		ret = ERR_INVALID_ARGS;
+		goto err_handle;
+	}
+
+	if (flags & MMAP_FLAG_PROT_WRITE) {
+		if (!(memref->flags & UTM_W)) {
+			ret = ERR_ACCESS_DENIED;
+			goto err_handle;
+		}
+		ut_flags |= UTM_W;
+	}
+	ut_flags |= memref->flags & UTM_NS_MEM;
+
+	map = calloc(1, sizeof(memref_map_t));
+	if (!map) {
+		ret = ERR_NO_MEMORY;
+		goto err_handle;
+	}
+
+	/* the root is checked under the lock so its close cannot be missed */
+	mutex_acquire(&memref_lock);
+	if (memref->root->closed) {
+		ret = ERR_CHANNEL_CLOSED;
+		goto err_closed;
+	}
+
+	ret = uthread_map(ut, &vaddr, memref->root->pfn_list,
+	                  memref->root->npages * PAGE_SIZE, ut_flags,
+	                  UT_MAP_ALIGN_4KB);
+	if (ret != NO_ERROR)
+		goto err_closed;
+
+	map->memref = memref;
+	map->ut = ut;
+	map->vaddr = vaddr + memref->offset;
+	list_add_tail(&memref_maps, &map->node);
+	mutex_release(&memref_lock);
+
+	handle_decref(handle);
+	return (long) map->vaddr;
+
+err_closed:
+	mutex_release(&memref_lock);
+	free(map);
+err_handle:
+	handle_decref(handle);
+	return ret;
+}
+
+long memref_munmap(uthread_t *ut, vaddr_t vaddr)
+{
+	memref_map_t *map;
+	long ret = ERR_NOT_FOUND;
+
+	mutex_acquire(&memref_lock);
+	list_for_every_entry(&memref_maps, map, memref_map_t, node) {
+		if (map->ut == ut &&
+		    vaddr >= ROUNDDOWN(map->vaddr, PAGE_SIZE) &&
+		    vaddr < map->vaddr + map->memref->size) {
+			ret = memref_revoke_map_locked(map);
+			break;
+		}
+	}
+	mutex_release(&memref_lock);
+	return ret;
+}
+
+#else /* WITH_TRUSTY_IPC && UTHREAD_WITH_MEMORY_MAPPING_SUPPORT */
+
+long __SYSCALL sys_memref_create(user_addr_t uaddr, uint32_t size,
+                                 uint32_t flags)
+{
+	return (long) ERR_NOT_SUPPORTED;
+}
+
+bool memref_is_memref(handle_t *handle)
+{
+	return false;
+}
+
+int memref_share(handle_t *handle, handle_t **shared)
+{
+	return ERR_NOT_SUPPORTED;
+}
+
+long memref_mmap(uint32_t handle_id, uint32_t size, uint32_t flags)
+{
+	return (long) ERR_NOT_SUPPORTED;
+}
+
+long memref_munmap(uthread_t *ut, vaddr_t vaddr)
+{
+	return (long) ERR_NOT_FOUND;
+}
+
+#endif /* WITH_TRUSTY_IPC && UTHREAD_WITH_MEMORY_MAPPING_SUPPORT */
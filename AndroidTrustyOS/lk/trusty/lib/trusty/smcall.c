@@ -31,6 +31,7 @@
 #include <arch/mmu.h>
 #include <lib/sm.h>
 #include <lib/sm/smcall.h>
+#include <lib/sm/sm_err.h>
 
 #include "trusty_virtio.h"
 
@@ -123,8 +124,34 @@ static long trusty_sm_stdcall(smc32_args_t *args)
 	return res;
 }
 
+/*
+ *  Handle standard Trusted OS SMC calls issued on a non-zero std call slot.
+ *  Only vq kicks are allowed here. Kicks run in parallel with each other and
+ *  hold a bus reference that slot 0 drains before it stops or resets the bus.
+ */
+static long trusty_sm_concurrent_stdcall(smc32_args_t *args)
+{
+	long res;
+
+	switch (args->smc_nr) {
+
+	case SMC_SC_VDEV_KICK_VQ:
+		res = virtio_kick_vq(args->params[0], args->params[1]);
+		break;
+
+	default:
+		LTRACEF("func 0x%x not allowed on concurrent slot\n",
+			SMC_FUNCTION(args->smc_nr));
+		res = SM_ERR_NOT_ALLOWED;
+		break;
+	}
+
+	return res;
+}
+
 static smc32_entity_t trusty_sm_entity = {
 	.stdcall_handler = trusty_sm_stdcall,
+	.concurrent_stdcall_handler = trusty_sm_concurrent_stdcall,
 };
 
 static void trusty_sm_init(uint level)
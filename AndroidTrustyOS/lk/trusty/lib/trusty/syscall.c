@@ -33,6 +33,7 @@
 
 #include <platform.h>
 #include <uthread.h>
+#include <lib/trusty/memref.h>
 #include <lib/trusty/sys_fd.h>
 #include <lib/trusty/trusty_app.h>
 
@@ -167,11 +168,17 @@ long sys_mmap(user_addr_t uaddr, uint32_t size, uint32_t flags, uint32_t handle)
 	long ret;
 
 	/*
-	 * Only allows mapping on IO region specified by handle (id) and uaddr
-	 * must be 0 for now.
+	 * Only allows mapping on IO region or memory object specified by
+	 * handle (id) and uaddr must be 0 for now.
 	 * TBD: Add support in uthread_map to use uaddr as a hint.
 	 */
-	if (flags != MMAP_FLAG_IO_HANDLE || uaddr != 0)
+	if (uaddr != 0)
+		return ERR_INVALID_ARGS;
+
+	if (flags & MMAP_FLAG_MEMREF)
+		return memref_mmap(handle, size, flags);
+
+	if (flags != MMAP_FLAG_IO_HANDLE)
 		return ERR_INVALID_ARGS;
 
 	ret = trusty_app_setup_mmio(trusty_app, handle, &vaddr, size);
@@ -184,6 +191,12 @@ long sys_mmap(user_addr_t uaddr, uint32_t size, uint32_t flags, uint32_t handle)
 long sys_munmap(user_addr_t uaddr, uint32_t size)
 {
 	trusty_app_t *trusty_app = uthread_get_current()->private_data;
+	long ret;
+
+	/* memory object mappings are tracked until they are unmapped */
+	ret = memref_munmap(trusty_app->ut, uaddr);
+	if (ret != ERR_NOT_FOUND)
+		return ret;
 
 	/*
 	 * uthread_unmap always unmaps whole region.
@@ -49,8 +49,12 @@
 #define LOCAL_TRACE  0
 
 
-#define MAX_RX_IOVS  1
-#define MAX_TX_IOVS  1
+/*
+ *  NS side may pass a message as a chain of descriptors (typically one
+ *  per page). This is enough for the largest message (64K) in pages.
+ */
+#define MAX_RX_IOVS  16
+#define MAX_TX_IOVS  16
 
 /*
  *  Control endpoint address
@@ -73,9 +77,29 @@
 #define TIPC_MAX_SRV_NAME_LEN		(256)
 
 
+struct tipc_vq_pair;
+
 struct tipc_ept {
 	uint32_t remote;
 	handle_t *chan;
+	struct tipc_vq_pair *vqp;  /* vqueue pair carrying channel traffic */
+};
+
+/*
+ *  TX/RX vqueue pair, the threads serving it and the channels
+ *  whose messages are sent through it
+ */
+struct tipc_vq_pair {
+	struct tipc_dev		*dev;
+	uint			idx;
+
+	struct vqueue		vqs[TIPC_VQ_NUM];
+
+	event_t			have_handles;
+	handle_list_t		handle_list;
+
+	thread_t		*rx_thread;
+	thread_t		*tx_thread;
 };
 
 struct tipc_dev {
@@ -84,18 +108,14 @@ struct tipc_dev {
 	const void		*descr_ptr;
 	size_t			descr_size;
 
-	struct vqueue		vqs[TIPC_VQ_NUM];
+	struct tipc_vq_pair	vqps[TIPC_MAX_VQ_PAIRS];
+	uint			vqp_cnt;  /* number of pairs in use */
+
 	struct tipc_ept		epts[TIPC_ADDR_MAX_NUM];
 	unsigned long		inuse[BITMAP_NUM_WORDS(TIPC_ADDR_MAX_NUM)];
 
-	event_t			have_handles;
-	handle_list_t		handle_list;
-
 	mutex_t			ept_lock;
 
-	thread_t		*rx_thread;
-	thread_t		*tx_thread;
-
 	bool			tx_stop;
 	bool			rx_stop;
 };
@@ -150,15 +170,15 @@ struct tipc_disc_req_body {
 } __PACKED;
 
 
-typedef int (*tipc_data_cb_t) (uint8_t *dst, size_t sz, void *ctx);
+typedef int (*tipc_data_cb_t) (iovec_kern_t *dst, uint dst_cnt, void *ctx);
 
 static int
-tipc_send_data(struct tipc_dev *dev, uint32_t local, uint32_t remote,
+tipc_send_data(struct tipc_vq_pair *vqp, uint32_t local, uint32_t remote,
                tipc_data_cb_t cb, void *cb_ctx,  uint16_t data_len,
                bool wait);
 
 static int
-tipc_send_buf(struct tipc_dev *dev, uint32_t local, uint32_t remote,
+tipc_send_buf(struct tipc_vq_pair *vqp, uint32_t local, uint32_t remote,
               void *data, uint16_t data_len, bool wait);
 
 
@@ -175,13 +195,14 @@ static inline uint32_t slot_to_addr(uint slot)
 }
 
 static uint32_t alloc_local_addr(struct tipc_dev *dev, uint32_t remote,
-                                 handle_t *chan)
+                                 handle_t *chan, struct tipc_vq_pair *vqp)
 {
 	int slot = bitmap_ffz(dev->inuse, TIPC_ADDR_MAX_NUM);
 	if (slot >= 0) {
 		bitmap_set(dev->inuse, slot);
 		dev->epts[slot].chan = chan;
 		dev->epts[slot].remote = remote;
+		dev->epts[slot].vqp = vqp;
 		return slot_to_addr(slot);
 	}
 	return 0;
@@ -211,6 +232,7 @@ static void free_local_addr(struct tipc_dev *dev, uint32_t local)
 		bitmap_clear(dev->inuse, slot);
 		dev->epts[slot].chan = NULL;
 		dev->epts[slot].remote = 0;
+		dev->epts[slot].vqp = NULL;
 	}
 }
 
@@ -224,7 +246,7 @@ static int _go_online(struct tipc_dev *dev)
 	msg.hdr.type = TIPC_CTRL_MSGTYPE_GO_ONLINE;
 	msg.hdr.body_len  = 0;
 
-	return tipc_send_buf(dev, TIPC_CTRL_ADDR, TIPC_CTRL_ADDR,
+	return tipc_send_buf(&dev->vqps[0], TIPC_CTRL_ADDR, TIPC_CTRL_ADDR,
 	                     &msg, sizeof(msg), true);
 }
 
@@ -250,7 +272,7 @@ static const vqueue_cb_t notify_cbs[TIPC_VQ_NUM] = {
 };
 
 
-static int send_conn_rsp(struct tipc_dev *dev, uint32_t local,
+static int send_conn_rsp(struct tipc_vq_pair *vqp, uint32_t local,
                          uint32_t remote, uint32_t status,
                          uint32_t msg_sz, uint32_t msg_cnt)
 {
@@ -268,11 +290,12 @@ static int send_conn_rsp(struct tipc_dev *dev, uint32_t local,
 	msg.body.max_msg_size = msg_sz;
 	msg.body.max_msg_cnt = msg_cnt;
 
-	return tipc_send_buf(dev, TIPC_CTRL_ADDR, TIPC_CTRL_ADDR,
+	return tipc_send_buf(vqp, TIPC_CTRL_ADDR, TIPC_CTRL_ADDR,
 	                     &msg, sizeof(msg), true);
 }
 
-static int send_disc_req(struct tipc_dev *dev, uint32_t local, uint32_t remote)
+static int send_disc_req(struct tipc_vq_pair *vqp, uint32_t local,
+                         uint32_t remote)
 {
 	struct {
 		struct tipc_ctrl_msg_hdr  hdr;
@@ -284,14 +307,15 @@ static int send_disc_req(struct tipc_dev *dev, uint32_t local, uint32_t remote)
 
 	msg.body.target = remote;
 
-	return tipc_send_buf(dev, local, TIPC_CTRL_ADDR,
+	return tipc_send_buf(vqp, local, TIPC_CTRL_ADDR,
 	                     &msg,  sizeof(msg), true);
 }
 
-static int handle_conn_req(struct tipc_dev *dev, uint32_t remote,
+static int handle_conn_req(struct tipc_vq_pair *vqp, uint32_t remote,
                            const volatile struct tipc_conn_req_body *ns_req)
 {
 	int err;
+	struct tipc_dev *dev = vqp->dev;
 	uint32_t local = 0;
 	handle_t *chan = NULL;
 	struct tipc_conn_req_body req;
@@ -305,7 +329,7 @@ static int handle_conn_req(struct tipc_dev *dev, uint32_t remote,
 				     0, &chan);
 	if (err == NO_ERROR) {
 		mutex_acquire(&dev->ept_lock);
-		local = alloc_local_addr(dev, remote, chan);
+		local = alloc_local_addr(dev, remote, chan, vqp);
 		if (local == 0) {
 			LTRACEF("failed to alloc local address\n");
 			handle_close(chan);
@@ -318,12 +342,12 @@ static int handle_conn_req(struct tipc_dev *dev, uint32_t remote,
 		LTRACEF("new handle: local = 0x%x remote = 0x%x\n",
 			 local, remote);
 		handle_set_cookie(chan, lookup_ept(dev, local));
-		handle_list_add(&dev->handle_list, chan);
-		event_signal(&dev->have_handles, false);
+		handle_list_add(&vqp->handle_list, chan);
+		event_signal(&vqp->have_handles, false);
 		return NO_ERROR;
 	}
 
-	err = send_conn_rsp(dev, local, remote, ERR_NO_RESOURCES, 0, 0);
+	err = send_conn_rsp(vqp, local, remote, ERR_NO_RESOURCES, 0, 0);
 	if (err) {
 		TRACEF("failed (%d) to send response\n", err);
 	}
@@ -365,7 +389,7 @@ static int handle_disc_req(struct tipc_dev *dev, uint32_t remote,
 
 		if (chan) {
 			/* detach handle from handle list */
-			handle_list_del(&dev->handle_list, chan);
+			handle_list_del(&ept->vqp->handle_list, chan);
 
 			/* detach ept */
 			handle_set_cookie(chan, NULL);
@@ -382,7 +406,7 @@ static int handle_disc_req(struct tipc_dev *dev, uint32_t remote,
 	return NO_ERROR;
 }
 
-static int handle_ctrl_msg(struct tipc_dev *dev, uint32_t remote,
+static int handle_ctrl_msg(struct tipc_vq_pair *vqp, uint32_t remote,
                            const volatile void *ns_data, size_t msg_len)
 {
 	uint32_t msg_type;
@@ -410,12 +434,12 @@ static int handle_ctrl_msg(struct tipc_dev *dev, uint32_t remote,
 	case TIPC_CTRL_MSGTYPE_CONN_REQ:
 		if (msg_body_len != sizeof(struct tipc_conn_req_body))
 			break;
-		return handle_conn_req(dev, remote, ns_msg_body);
+		return handle_conn_req(vqp, remote, ns_msg_body);
 
 	case TIPC_CTRL_MSGTYPE_DISC_REQ:
 		if (msg_body_len != sizeof(struct tipc_disc_req_body))
 			break;
-		return handle_disc_req(dev, remote, ns_msg_body);
+		return handle_disc_req(vqp->dev, remote, ns_msg_body);
 
 	default:
 		break;
@@ -427,19 +451,41 @@ err_mailformed_msg:
 	return ERR_NOT_VALID;
 }
 
+/*
+ *  Fill @dst with up to @len bytes of message payload that follows
+ *  tipc header in @vqiovs. The header is expected to be in the first
+ *  iovec. Returns number of iovecs used.
+ */
+static uint get_payload_iovs(iovec_kern_t *dst, const struct vqueue_iovs *vqiovs,
+                             size_t len)
+{
+	uint cnt = 0;
+	size_t skip = sizeof(struct tipc_hdr);
+
+	for (uint i = 0; i < vqiovs->used && len; i++) {
+		size_t iov_len = vqiovs->iovs[i].len - skip;
+
+		if (iov_len) {
+			if (iov_len > len)
+				iov_len = len;
+			dst[cnt].base = (uint8_t *)vqiovs->iovs[i].base + skip;
+			dst[cnt].len  = iov_len;
+			len -= iov_len;
+			cnt++;
+		}
+		skip = 0;
+	}
+	return cnt;
+}
+
 static int handle_chan_msg(struct tipc_dev *dev, uint32_t remote, uint32_t local,
-                           const volatile void *ns_data, size_t len)
+                           iovec_kern_t *ns_iovs, uint ns_iov_cnt)
 {
 	struct tipc_ept *ept;
 	int ret = ERR_NOT_FOUND;
 	ipc_msg_kern_t msg = {
-		.iov		= (iovec_kern_t []) {
-			[0]	= {
-				.base	= (void *)ns_data,
-				.len	= len,
-			},
-		},
-		.num_iov	= 1,
+		.iov		= ns_iovs,
+		.num_iov	= ns_iov_cnt,
 		.num_handles	= 0,
 	};
 
@@ -454,7 +500,7 @@ static int handle_chan_msg(struct tipc_dev *dev, uint32_t remote, uint32_t local
 	return ret;
 }
 
-static int handle_rx_msg(struct tipc_dev *dev, struct vqueue_buf *buf)
+static int handle_rx_msg(struct tipc_vq_pair *vqp, struct vqueue_buf *buf)
 {
 	const volatile struct tipc_hdr *ns_hdr;
 	const volatile void *ns_data;
@@ -462,11 +508,11 @@ static int handle_rx_msg(struct tipc_dev *dev, struct vqueue_buf *buf)
 	uint32_t  src_addr;
 	uint32_t  dst_addr;
 
-	DEBUG_ASSERT(dev);
+	DEBUG_ASSERT(vqp);
 	DEBUG_ASSERT(buf);
 
-	LTRACEF("got RX buf: head %hu buf in %d out %d\n",
-	         buf->head,  buf->in_iovs.used, buf->out_iovs.used);
+	LTRACEF("got RX buf on vq pair %u: head %hu buf in %d out %d\n",
+	         vqp->idx, buf->head,  buf->in_iovs.used, buf->out_iovs.used);
 
 	/* we will need at least 1 iovec */
 	if (buf->in_iovs.used == 0) {
@@ -474,12 +520,6 @@ static int handle_rx_msg(struct tipc_dev *dev, struct vqueue_buf *buf)
 		return ERR_INVALID_ARGS;
 	}
 
-	/* there should be exactly 1 in_iov but it is not fatal if the first
-	   one is big enough */
-	if (buf->in_iovs.used != 1) {
-		LTRACEF("unexpected in_iovs num %d\n", buf->in_iovs.used);
-	}
-
 	/* out_iovs are not supported: just log message and ignore it */
 	if (buf->out_iovs.used != 0) {
 		LTRACEF("unexpected out_iovs num %d\n", buf->in_iovs.used);
@@ -488,7 +528,8 @@ static int handle_rx_msg(struct tipc_dev *dev, struct vqueue_buf *buf)
 	/* map in_iovs, Non-secure, no-execute, cached, read-only */
 	uint map_flags = ARCH_MMU_FLAG_NS | ARCH_MMU_FLAG_PERM_NO_EXECUTE |
 	                 ARCH_MMU_FLAG_CACHED | ARCH_MMU_FLAG_PERM_RO;
-	int ret = vqueue_map_iovs(&buf->in_iovs, map_flags);
+	int ret = vqueue_map_iovs(&vqp->vqs[TIPC_VQ_RX], &buf->in_iovs,
+	                          map_flags);
 	if (ret) {
 		TRACEF("failed to map iovs %d\n", ret);
 		return ret;
@@ -507,30 +548,45 @@ static int handle_rx_msg(struct tipc_dev *dev, struct vqueue_buf *buf)
 	src_addr = ns_hdr->src;
 	dst_addr = ns_hdr->dst;
 
-	if (ns_data_len + sizeof(struct tipc_hdr) != buf->in_iovs.iovs[0].len) {
+	/* message may span all in_iovs */
+	if (ns_data_len + sizeof(struct tipc_hdr) != buf->in_iovs.len) {
 		LTRACEF("malformed message len %zu msglen %zu\n",
-			ns_data_len, buf->in_iovs.iovs[0].len);
+			ns_data_len, buf->in_iovs.len);
 		ret = ERR_INVALID_ARGS;
 		goto done;
 	}
 
-	if (dst_addr == TIPC_CTRL_ADDR)
-		ret = handle_ctrl_msg(dev, src_addr, ns_data, ns_data_len);
-	else
-		ret = handle_chan_msg(dev, src_addr, dst_addr, ns_data, ns_data_len);
+	if (dst_addr == TIPC_CTRL_ADDR) {
+		/* control messages are small: expect them in first iovec */
+		if (ns_data_len + sizeof(struct tipc_hdr) >
+		    buf->in_iovs.iovs[0].len) {
+			LTRACEF("fragmented ctrl message (%zu)\n", ns_data_len);
+			ret = ERR_INVALID_ARGS;
+			goto done;
+		}
+		ret = handle_ctrl_msg(vqp, src_addr, ns_data, ns_data_len);
+	} else {
+		iovec_kern_t ns_iovs[MAX_RX_IOVS];
+		uint ns_iov_cnt = get_payload_iovs(ns_iovs, &buf->in_iovs,
+		                                   ns_data_len);
+
+		ret = handle_chan_msg(vqp->dev, src_addr, dst_addr,
+		                      ns_iovs, ns_iov_cnt);
+	}
 
 done:
-	vqueue_unmap_iovs(&buf->in_iovs);
+	vqueue_unmap_iovs(&vqp->vqs[TIPC_VQ_RX], &buf->in_iovs);
 
 	return ret;
 }
 
 static int tipc_rx_thread_func(void *arg)
 {
-	struct tipc_dev *dev = arg;
+	struct tipc_vq_pair *vqp = arg;
+	struct tipc_dev *dev = vqp->dev;
 	paddr_t in_phys[MAX_RX_IOVS];
 	iovec_kern_t in_iovs[MAX_RX_IOVS];
-	struct vqueue *vq = &dev->vqs[TIPC_VQ_RX];
+	struct vqueue *vq = &vqp->vqs[TIPC_VQ_RX];
 	struct vqueue_buf buf;
 	int ret;
 
@@ -546,30 +602,37 @@ static int tipc_rx_thread_func(void *arg)
 		/* wait for next available buffer */
 		event_wait(&vq->avail_event);
 
-		ret = vqueue_get_avail_buf(vq, &buf);
+		/* handle all available messages, then return them at once */
+		for (;;) {
+			ret = vqueue_get_avail_buf(vq, &buf);
 
-		if (ret == ERR_CHANNEL_CLOSED)
-			break;  /* need to terminate */
+			if (ret == ERR_CHANNEL_CLOSED)
+				goto exit;  /* need to terminate */
 
-		if (ret == ERR_NOT_ENOUGH_BUFFER)
-			continue;  /* no new messages */
+			if (ret == ERR_NOT_ENOUGH_BUFFER)
+				break;  /* no new messages */
 
-		if (likely(ret == NO_ERROR)) {
-			ret = handle_rx_msg(dev, &buf);
-		}
+			if (likely(ret == NO_ERROR)) {
+				ret = handle_rx_msg(vqp, &buf);
+			}
 
-		ret = vqueue_add_buf(vq, &buf, ret);
-		if (ret == ERR_CHANNEL_CLOSED)
-			break;  /* need to terminate */
+			ret = vqueue_add_buf_deferred(vq, &buf, ret);
+			if (ret == ERR_CHANNEL_CLOSED)
+				goto exit;  /* need to terminate */
 
-		if (ret != NO_ERROR) {
-			/* any other error is only possible if
-			 * vqueue is corrupted.
-			 */
-			panic("Unable (%d) to return buffer to vqueue\n", ret);
+			if (ret != NO_ERROR) {
+				/* any other error is only possible if
+				 * vqueue is corrupted.
+				 */
+				panic("Unable (%d) to return buffer to vqueue\n",
+				      ret);
+			}
 		}
+
+		vqueue_publish_used(vq);
 	}
 
+exit:
 	LTRACEF("exit\n");
 
 	return 0;
@@ -580,17 +643,16 @@ typedef struct data_cb_ctx {
 	ipc_msg_info_t msg_inf;
 } data_cb_ctx_t;
 
-static int tx_data_cb(uint8_t *buf, size_t buf_len, void *ctx)
+static int tx_data_cb(iovec_kern_t *dst, uint dst_cnt, void *ctx)
 {
 	data_cb_ctx_t *cb_ctx = (data_cb_ctx_t *) ctx;
 
-	DEBUG_ASSERT(buf);
+	DEBUG_ASSERT(dst);
 	DEBUG_ASSERT(cb_ctx);
 
-	iovec_kern_t dst_iov = { buf, buf_len };
 	ipc_msg_kern_t dst_kern_msg = {
-		.iov     = &dst_iov,
-		.num_iov = 1,
+		.iov     = dst,
+		.num_iov = dst_cnt,
 		.num_handles = 0,
 		.handles = NULL,
 	};
@@ -600,9 +662,10 @@ static int tx_data_cb(uint8_t *buf, size_t buf_len, void *ctx)
 	                    &dst_kern_msg);
 }
 
-static void handle_tx_msg(struct tipc_dev *dev, handle_t *chan)
+static void handle_tx_msg(struct tipc_vq_pair *vqp, handle_t *chan)
 {
 	int ret;
+	struct tipc_dev *dev = vqp->dev;
 	uint32_t local = 0;
 	uint32_t remote = 0;
 	struct tipc_ept *ept;
@@ -636,7 +699,7 @@ static void handle_tx_msg(struct tipc_dev *dev, handle_t *chan)
 		LTRACEF("forward message (%d bytes)\n", ttl_size);
 
 		/* send message using data callback */
-		ret = tipc_send_data(dev, local, remote,
+		ret = tipc_send_data(vqp, local, remote,
 		                     tx_data_cb, &cb_ctx, ttl_size, true);
 		if (ret != NO_ERROR) {
 			/* nothing we can do about it: log it */
@@ -646,10 +709,14 @@ static void handle_tx_msg(struct tipc_dev *dev, handle_t *chan)
 		/* retire msg */
 		ipc_put_msg(chan, cb_ctx.msg_inf.id);
 	}
+
+	/* let NS side see all messages forwarded above */
+	vqueue_publish_used(&vqp->vqs[TIPC_VQ_TX]);
 }
 
-static void handle_hup(struct tipc_dev *dev, handle_t *chan)
+static void handle_hup(struct tipc_vq_pair *vqp, handle_t *chan)
 {
+	struct tipc_dev *dev = vqp->dev;
 	uint32_t local = 0;
 	uint32_t remote = 0;
 	struct tipc_ept *ept;
@@ -664,7 +731,7 @@ static void handle_hup(struct tipc_dev *dev, handle_t *chan)
 		send_disc = true;
 
 		/* remove handle from handle list */
-		handle_list_del(&dev->handle_list, chan);
+		handle_list_del(&vqp->handle_list, chan);
 
 		/* kill cookie */
 		handle_set_cookie(chan, NULL);
@@ -679,13 +746,14 @@ static void handle_hup(struct tipc_dev *dev, handle_t *chan)
 
 	if (send_disc) {
 		/* send disconnect request */
-		(void) send_disc_req(dev, local, remote);
+		(void) send_disc_req(vqp, local, remote);
 	}
 
 }
 
-static void handle_ready(struct tipc_dev *dev, handle_t *chan)
+static void handle_ready(struct tipc_vq_pair *vqp, handle_t *chan)
 {
+	struct tipc_dev *dev = vqp->dev;
 	uint32_t local = 0;
 	uint32_t remote = 0;
 	struct tipc_ept *ept;
@@ -702,23 +770,32 @@ static void handle_ready(struct tipc_dev *dev, handle_t *chan)
 	mutex_release(&dev->ept_lock);
 
 	if (send_rsp) {
-		/* send disconnect request */
-		(void) send_conn_rsp(dev, local, remote, 0,
-				     IPC_CHAN_MAX_BUF_SIZE, 1);
+		/*
+		 * advertise the service's buffer size, limited to what fits
+		 * in a single tipc message
+		 */
+		size_t msg_sz = IPC_CHAN_MAX_BUF_SIZE;
+
+		(void) ipc_get_max_msg_size(chan, &msg_sz);
+		msg_sz = MIN(msg_sz, TIPC_MSG_BUF_MAX_SIZE -
+				     sizeof(struct tipc_hdr));
+
+		/* send connection response */
+		(void) send_conn_rsp(vqp, local, remote, 0, msg_sz, 1);
 	}
 }
 
-static void handle_tx(struct tipc_dev *dev)
+static void handle_tx(struct tipc_vq_pair *vqp)
 {
 	int ret;
 	handle_t *chan;
 	uint32_t  chan_event;
 
-	DEBUG_ASSERT(dev);
+	DEBUG_ASSERT(vqp);
 
 	for (;;) {
 		/* wait for incoming messgages */
-		ret = handle_list_wait(&dev->handle_list, &chan,
+		ret = handle_list_wait(&vqp->handle_list, &chan,
 				       &chan_event, INFINITE_TIME);
 
 		if (ret == ERR_NOT_FOUND) {
@@ -737,11 +814,11 @@ static void handle_tx(struct tipc_dev *dev)
 		DEBUG_ASSERT(ipc_is_channel(chan));
 
 		if (chan_event & IPC_HANDLE_POLL_READY) {
-			handle_ready(dev, chan);
+			handle_ready(vqp, chan);
 		} else if (chan_event & IPC_HANDLE_POLL_MSG) {
-			handle_tx_msg(dev, chan);
+			handle_tx_msg(vqp, chan);
 		} else if (chan_event & IPC_HANDLE_POLL_HUP) {
-			handle_hup(dev, chan);
+			handle_hup(vqp, chan);
 		} else {
 			LTRACEF("Unhandled event %x\n", chan_event);
 		}
@@ -751,19 +828,20 @@ static void handle_tx(struct tipc_dev *dev)
 
 static int tipc_tx_thread_func(void *arg)
 {
-	struct tipc_dev *dev = arg;
+	struct tipc_vq_pair *vqp = arg;
+	struct tipc_dev *dev = vqp->dev;
 
 	LTRACEF("enter\n");
 	while (!dev->tx_stop) {
 		LTRACEF("waiting for handles\n");
 
 		/* wait forever until we have handles */
-		event_wait(&dev->have_handles);
+		event_wait(&vqp->have_handles);
 
 		LTRACEF("have handles\n");
 
 		/* handle messsages */
-		handle_tx(dev);
+		handle_tx(vqp);
 
 		LTRACEF("no handles\n");
 	}
@@ -776,21 +854,25 @@ static status_t tipc_dev_reset(struct tipc_dev *dev)
 {
 	status_t rc;
 	struct tipc_ept *ept;
+	struct tipc_vq_pair *vqp;
 
 	LTRACEF("devid=%d\n", dev->vd.devid);
 
 	if (dev->vd.state == VDEV_STATE_RESET)
 		return NO_ERROR;
 
-	/* Shutdown rx thread to block all incomming requests */
+	/* Shutdown rx threads to block all incomming requests */
 	dev->rx_stop = true;
-	vqueue_signal_avail(&dev->vqs[TIPC_VQ_RX]);
-	rc = thread_join(dev->rx_thread, NULL, 1000);
-	LTRACEF("rx thread join: returned %d\n", rc);
-	if (rc != NO_ERROR) {
-		panic("unable to shutdown rx thread: %d\n", rc);
+	for (uint i = 0; i < dev->vqp_cnt; i++) {
+		vqp = &dev->vqps[i];
+		vqueue_signal_avail(&vqp->vqs[TIPC_VQ_RX]);
+		rc = thread_join(vqp->rx_thread, NULL, 1000);
+		LTRACEF("rx thread %u join: returned %d\n", i, rc);
+		if (rc != NO_ERROR) {
+			panic("unable to shutdown rx thread: %d\n", rc);
+		}
+		vqp->rx_thread = NULL;
 	}
-	dev->rx_thread = NULL;
 	dev->rx_stop = false;
 
 	/* Set stop tx thread */
@@ -806,29 +888,36 @@ static status_t tipc_dev_reset(struct tipc_dev *dev)
 		if (!ept->chan)
 			continue;
 
-		handle_list_del(&dev->handle_list, ept->chan);
+		handle_list_del(&ept->vqp->handle_list, ept->chan);
 		handle_set_cookie(ept->chan, NULL);
 		handle_close(ept->chan);
 		free_local_addr(dev, ept_to_addr(dev, ept));
 	}
 	mutex_release(&dev->ept_lock);
 
-	/* kick tx thread and tx vq */
-	event_signal(&dev->have_handles, false);
-	vqueue_signal_avail(&dev->vqs[TIPC_VQ_TX]);
+	for (uint i = 0; i < dev->vqp_cnt; i++) {
+		vqp = &dev->vqps[i];
+
+		/* kick tx thread and tx vq */
+		event_signal(&vqp->have_handles, false);
+		vqueue_signal_avail(&vqp->vqs[TIPC_VQ_TX]);
 
-	/* wait it to terminate */
-	rc = thread_join(dev->tx_thread, NULL, 1000);
-	LTRACEF("tx thread join: returned %d\n", rc);
-	if (rc != NO_ERROR) {
-		panic("unable to shutdown tx thread: %d\n", rc);
+		/* wait it to terminate */
+		rc = thread_join(vqp->tx_thread, NULL, 1000);
+		LTRACEF("tx thread %u join: returned %d\n", i, rc);
+		if (rc != NO_ERROR) {
+			panic("unable to shutdown tx thread: %d\n", rc);
+		}
+		vqp->tx_thread = NULL;
 	}
-	dev->tx_thread = NULL;
 	dev->tx_stop = false;
 
 	/* destroy vqs */
-	vqueue_destroy(&dev->vqs[TIPC_VQ_RX]);
-	vqueue_destroy(&dev->vqs[TIPC_VQ_TX]);
+	for (uint i = 0; i < dev->vqp_cnt; i++) {
+		vqueue_destroy(&dev->vqps[i].vqs[TIPC_VQ_RX]);
+		vqueue_destroy(&dev->vqps[i].vqs[TIPC_VQ_TX]);
+	}
+	dev->vqp_cnt = 0;
 
 	/* enter reset state */
 	dev->vd.state = VDEV_STATE_RESET;
@@ -877,9 +966,16 @@ static status_t validate_descr(struct tipc_dev *dev,
 		return ERR_INVALID_ARGS;
 	}
 
-	if (vdev_descr->vdev.num_of_vrings != TIPC_VQ_NUM) {
+	if (vdev_descr->vdev.num_of_vrings != TIPC_MAX_VQ_NUM) {
 		LTRACEF("unexpected number of vrings (%d vs. %d)\n",
-			vdev_descr->vdev.num_of_vrings, TIPC_VQ_NUM);
+			vdev_descr->vdev.num_of_vrings, TIPC_MAX_VQ_NUM);
+		return ERR_INVALID_ARGS;
+	}
+
+	if (vdev_descr->vdev.gfeatures & ~vdev_descr->vdev.dfeatures) {
+		LTRACEF("unexpected features 0x%x (supported 0x%x)\n",
+			vdev_descr->vdev.gfeatures,
+			vdev_descr->vdev.dfeatures);
 		return ERR_INVALID_ARGS;
 	}
 
@@ -895,6 +991,31 @@ static status_t validate_descr(struct tipc_dev *dev,
 	return NO_ERROR;
 }
 
+static bool vring_is_set_up(const struct fw_rsc_vdev_vring *vring)
+{
+	return vring->da || vring->reserved;
+}
+
+/*
+ *  Number of vqueue pairs set up by NS side
+ */
+static uint tipc_vq_pair_cnt(struct tipc_vdev_descr *dscr)
+{
+	uint cnt;
+
+	if (!(dscr->vdev.gfeatures & (1U << VIRTIO_TIPC_F_MULTIQUEUE)))
+		return 1;
+
+	for (cnt = 1; cnt < TIPC_MAX_VQ_PAIRS; cnt++) {
+		struct fw_rsc_vdev_vring *vrings = &dscr->vrings[cnt * TIPC_VQ_NUM];
+
+		if (!vring_is_set_up(&vrings[TIPC_VQ_TX]) ||
+		    !vring_is_set_up(&vrings[TIPC_VQ_RX]))
+			break;
+	}
+	return cnt;
+}
+
 /*
  *  Should be only called once.
  */
@@ -903,6 +1024,7 @@ static status_t tipc_dev_probe(struct tipc_dev *dev,
 {
 	status_t ret;
 	uint vring_cnt;
+	uint vring_num;
 	char tname[32];
 
 	LTRACEF("%p: descr = %p\n", dev, dscr);
@@ -914,10 +1036,16 @@ static status_t tipc_dev_probe(struct tipc_dev *dev,
 	if (ret != NO_ERROR)
 		return ret;
 
-	/* vring[0] == TX queue (host's RX) */
-	/* vring[1] == RX queue (host's TX) */
-	for (vring_cnt = 0; vring_cnt < dscr->vdev.num_of_vrings; vring_cnt++) {
+	dev->vqp_cnt = tipc_vq_pair_cnt(dscr);
+	vring_num = dev->vqp_cnt * TIPC_VQ_NUM;
+	LTRACEF("using %u vq pairs\n", dev->vqp_cnt);
+
+	/* vring[2 * n + 0] == TX queue of pair n (host's RX) */
+	/* vring[2 * n + 1] == RX queue of pair n (host's TX) */
+	for (vring_cnt = 0; vring_cnt < vring_num; vring_cnt++) {
 		struct fw_rsc_vdev_vring *vring = &dscr->vrings[vring_cnt];
+		struct tipc_vq_pair *vqp = &dev->vqps[vring_cnt / TIPC_VQ_NUM];
+		uint vq_type = vring_cnt % TIPC_VQ_NUM;
 
 		/* on archs with 64 bits phys addresses we store top 32 bits of
 		 * vring phys address in 'reserved' field of vring desriptor structure,
@@ -935,31 +1063,41 @@ static status_t tipc_dev_probe(struct tipc_dev *dev,
 			goto err_vq_init;
 		}
 
-		ret = vqueue_init(&dev->vqs[vring_cnt],
+		ret = vqueue_init(&vqp->vqs[vq_type],
 				  vring->notifyid, (paddr_t)pa64,
-				  vring->num, vring->align, dev,
-				  notify_cbs[vring_cnt], NULL);
+				  vring->num, vring->align, vqp,
+				  notify_cbs[vq_type], NULL);
 		if (ret)
 			goto err_vq_init;
+
+		vqueue_set_event_idx(&vqp->vqs[vq_type],
+				     dscr->vdev.gfeatures &
+				     (1U << VIRTIO_RING_F_EVENT_IDX));
 	}
 
-	/* create rx thread */
-	snprintf(tname, sizeof(tname), "tipc-dev%d-rx", dev->vd.devid);
-	dev->rx_thread =
-		thread_create(tname, tipc_rx_thread_func, dev,
-			      DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+	for (uint i = 0; i < dev->vqp_cnt; i++) {
+		struct tipc_vq_pair *vqp = &dev->vqps[i];
 
-	if (dev->rx_thread) {
-		thread_resume(dev->rx_thread);
-	}
+		/* create rx thread */
+		snprintf(tname, sizeof(tname), "tipc-dev%d-rx%u",
+			 dev->vd.devid, i);
+		vqp->rx_thread =
+			thread_create(tname, tipc_rx_thread_func, vqp,
+				      DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+
+		if (vqp->rx_thread) {
+			thread_resume(vqp->rx_thread);
+		}
 
-	/* create tx thread */
-	snprintf(tname, sizeof(tname), "tipc-dev%d-tx", dev->vd.devid);
-	dev->tx_thread =
-		thread_create(tname, tipc_tx_thread_func, dev,
-			      DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
-	if (dev->tx_thread) {
-		thread_resume(dev->tx_thread);
+		/* create tx thread */
+		snprintf(tname, sizeof(tname), "tipc-dev%d-tx%u",
+			 dev->vd.devid, i);
+		vqp->tx_thread =
+			thread_create(tname, tipc_tx_thread_func, vqp,
+				      DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+		if (vqp->tx_thread) {
+			thread_resume(vqp->tx_thread);
+		}
 	}
 
 	ret = _go_online(dev);
@@ -971,8 +1109,9 @@ static status_t tipc_dev_probe(struct tipc_dev *dev,
 
 err_vq_init:
 	while (vring_cnt--) {
-		vqueue_destroy(&dev->vqs[vring_cnt]);
+		vqueue_destroy(&dev->vqps[vring_cnt / TIPC_VQ_NUM].vqs[vring_cnt % TIPC_VQ_NUM]);
 	}
+	dev->vqp_cnt = 0;
 	return ret;
 }
 
@@ -992,31 +1131,35 @@ static status_t tipc_vdev_kick_vq(struct vdev *vd, uint vqid)
 
 	LTRACEF("devid = %d: vq=%u\n", vd->devid, vqid);
 
-	/* check TX VQ */
-	if (vqid == vqueue_id(&dev->vqs[TIPC_VQ_TX])) {
-		return vqueue_notify(&dev->vqs[TIPC_VQ_TX]);
-	}
+	for (uint i = 0; i < dev->vqp_cnt; i++) {
+		struct tipc_vq_pair *vqp = &dev->vqps[i];
 
-	/* check RX VQ */
-	if (vqid == vqueue_id(&dev->vqs[TIPC_VQ_RX])) {
-		return vqueue_notify(&dev->vqs[TIPC_VQ_RX]);
+		/* check TX VQ */
+		if (vqid == vqueue_id(&vqp->vqs[TIPC_VQ_TX])) {
+			return vqueue_notify(&vqp->vqs[TIPC_VQ_TX]);
+		}
+
+		/* check RX VQ */
+		if (vqid == vqueue_id(&vqp->vqs[TIPC_VQ_RX])) {
+			return vqueue_notify(&vqp->vqs[TIPC_VQ_RX]);
+		}
 	}
 
 	return ERR_NOT_FOUND;
 }
 
 static int
-tipc_send_data(struct tipc_dev *dev, uint32_t local, uint32_t remote,
+tipc_send_data(struct tipc_vq_pair *vqp, uint32_t local, uint32_t remote,
                tipc_data_cb_t cb, void *cb_ctx,  uint16_t data_len,
                bool wait)
 {
 	paddr_t out_phys[MAX_TX_IOVS];
 	iovec_kern_t out_iovs[MAX_TX_IOVS];
-	struct vqueue *vq = &dev->vqs[TIPC_VQ_TX];
+	struct vqueue *vq = &vqp->vqs[TIPC_VQ_TX];
 	struct vqueue_buf buf;
 	int ret = 0;
 
-	DEBUG_ASSERT(dev);
+	DEBUG_ASSERT(vqp);
 
 	/* check if data callback specified */
 	if (!cb)
@@ -1044,14 +1187,17 @@ tipc_send_data(struct tipc_dev *dev, uint32_t local, uint32_t remote,
 			goto err;
 		}
 
+		/* NS side reuses buffers only after it sees them used */
+		vqueue_publish_used(vq);
+
 		/* wait for buffers */
 		event_wait(&vq->avail_event);
-		if (dev->tx_stop) {
+		if (vqp->dev->tx_stop) {
 			return ERR_CHANNEL_CLOSED;
 		}
 	} while (true);
 
-	/* we only support and expect single out_iovec for now */
+	/* message may span multiple out_iovecs */
 	if (buf.out_iovs.used == 0) {
 		LTRACEF("unexpected iovec cnt in = %d out = %d\n",
 		         buf.in_iovs.used, buf.out_iovs.used);
@@ -1059,7 +1205,7 @@ tipc_send_data(struct tipc_dev *dev, uint32_t local, uint32_t remote,
 		goto done;
 	}
 
-	if (buf.out_iovs.used != 1 || buf.in_iovs.used != 0) {
+	if (buf.in_iovs.used != 0) {
 		LTRACEF("unexpected iovec cnt in = %d out = %d\n",
 		         buf.in_iovs.used, buf.out_iovs.used);
 	}
@@ -1076,8 +1222,10 @@ tipc_send_data(struct tipc_dev *dev, uint32_t local, uint32_t remote,
 	/* map in provided buffers (Non-secure, no-execute, cached, read-write) */
 	uint map_flags = ARCH_MMU_FLAG_NS | ARCH_MMU_FLAG_PERM_NO_EXECUTE |
 	                 ARCH_MMU_FLAG_CACHED;
-	ret = vqueue_map_iovs(&buf.out_iovs, map_flags);
+	ret = vqueue_map_iovs(vq, &buf.out_iovs, map_flags);
 	if (ret == NO_ERROR) {
+		iovec_kern_t data_iovs[MAX_TX_IOVS];
+		uint data_iov_cnt;
 		struct tipc_hdr *hdr = buf.out_iovs.iovs[0].base;
 
 		hdr->src = local;
@@ -1086,27 +1234,29 @@ tipc_send_data(struct tipc_dev *dev, uint32_t local, uint32_t remote,
 		hdr->len = data_len;
 		hdr->flags = 0;
 
-		if (ttl_len > buf.out_iovs.iovs[0].len) {
+		if (ttl_len > buf.out_iovs.len) {
 			/* not enough space to put the whole message
 			   so it will be truncated */
 			LTRACEF("buf is too small (%zu < %zu)\n",
-			         buf.out_iovs.iovs[0].len, ttl_len);
-			data_len = buf.out_iovs.iovs[0].len -
+			         buf.out_iovs.len, ttl_len);
+			data_len = buf.out_iovs.len -
 			           sizeof(struct tipc_hdr);
 		}
 
 		/* invoke data_cb to add actual data */
-		ret = cb(hdr->data, data_len, cb_ctx);
+		data_iov_cnt = get_payload_iovs(data_iovs, &buf.out_iovs,
+		                                data_len);
+		ret = cb(data_iovs, data_iov_cnt, cb_ctx);
 		if (ret >= 0) {
 			/* add header */
 			ret += sizeof(struct tipc_hdr);
 		}
 
-		vqueue_unmap_iovs(&buf.out_iovs);
+		vqueue_unmap_iovs(vq, &buf.out_iovs);
 	}
 
 done:
-	ret = vqueue_add_buf(vq, &buf, ret);
+	ret = vqueue_add_buf_deferred(vq, &buf, ret);
 err:
 	return ret;
 }
@@ -1116,28 +1266,36 @@ struct buf_ctx {
 	size_t    len;
 };
 
-static int _send_buf(uint8_t *dst, size_t sz, void *ctx)
+static int _send_buf(iovec_kern_t *dst, uint dst_cnt, void *ctx)
 {
 	struct buf_ctx *buf = (struct buf_ctx *) ctx;
+	size_t copied = 0;
 
 	DEBUG_ASSERT(dst);
 	DEBUG_ASSERT(buf);
 	DEBUG_ASSERT(buf->data);
-	DEBUG_ASSERT(sz <= buf->len);
 
-	memcpy (dst, buf->data,  sz);
+	for (uint i = 0; i < dst_cnt && copied < buf->len; i++) {
+		size_t sz = MIN(dst[i].len, buf->len - copied);
+
+		memcpy (dst[i].base, buf->data + copied,  sz);
+		copied += sz;
+	}
 
-	return (int) sz;
+	return (int) copied;
 }
 
 static int
-tipc_send_buf(struct tipc_dev *dev, uint32_t local, uint32_t remote,
+tipc_send_buf(struct tipc_vq_pair *vqp, uint32_t local, uint32_t remote,
               void *data, uint16_t data_len, bool wait)
 {
+	int ret;
 	struct buf_ctx ctx = {data, data_len};
 
-	return tipc_send_data(dev, local, remote,
-	                      _send_buf, &ctx, data_len, wait);
+	ret = tipc_send_data(vqp, local, remote,
+	                     _send_buf, &ctx, data_len, wait);
+	vqueue_publish_used(&vqp->vqs[TIPC_VQ_TX]);
+	return ret;
 }
 
 static const struct vdev_ops _tipc_dev_ops = {
@@ -1167,8 +1325,14 @@ status_t create_tipc_device(const struct tipc_vdev_descr *descr, size_t size,
 	dev->uuid = uuid;
 	dev->descr_ptr = descr;
 	dev->descr_size = size;
-	handle_list_init(&dev->handle_list);
-	event_init(&dev->have_handles, false, EVENT_FLAG_AUTOUNSIGNAL);
+	for (uint i = 0; i < countof(dev->vqps); i++) {
+		struct tipc_vq_pair *vqp = &dev->vqps[i];
+
+		vqp->dev = dev;
+		vqp->idx = i;
+		handle_list_init(&vqp->handle_list);
+		event_init(&vqp->have_handles, false, EVENT_FLAG_AUTOUNSIGNAL);
+	}
 
 	ret = virtio_register_device(&dev->vd);
 	if (ret != NO_ERROR)
@@ -248,7 +248,7 @@ static status_t init_brk(trusty_app_t *trusty_app)
 	status = uthread_map_contig(trusty_app->ut, &vaddr,
 			     vaddr_to_paddr(heap),
 			     trusty_app->props.min_heap_size,
-			     UTM_W | UTM_R | UTM_FIXED,
+			     UTM_W | UTM_R | UTM_FIXED | UTM_APP_MEM,
 			     UT_MAP_ALIGN_4KB);
 	if (status != NO_ERROR || vaddr != trusty_app->end_brk) {
 		dprintf(CRITICAL, "cannot map brk\n");
@@ -309,7 +309,8 @@ static status_t alloc_address_map(trusty_app_t *trusty_app)
 		size_t size = (prg_hdr->p_memsz + PAGE_MASK) & ~PAGE_MASK;
 		paddr_t paddr = vaddr_to_paddr(trusty_app_image + prg_hdr->p_offset);
 		vaddr_t vaddr = prg_hdr->p_vaddr;
-		u_int flags = PF_TO_UTM_FLAGS(prg_hdr->p_flags) | UTM_FIXED;
+		u_int flags = PF_TO_UTM_FLAGS(prg_hdr->p_flags) | UTM_FIXED |
+			      UTM_APP_MEM;
 
 		ret = uthread_map_contig(trusty_app->ut, &vaddr, paddr, size,
 				flags, UT_MAP_ALIGN_4KB);
@@ -31,7 +31,9 @@
 
 #include <lk/init.h>
 #include <kernel/vm.h>
+#include <kernel/event.h>
 #include <kernel/mutex.h>
+#include <kernel/spinlock.h>
 #include <arch/arch_ops.h>
 
 #include <remoteproc/remoteproc.h>
@@ -52,14 +54,24 @@ enum {
 	VIRTIO_BUS_STATE_ACTIVATING,
 	VIRTIO_BUS_STATE_ACTIVE,
 	VIRTIO_BUS_STATE_DEACTIVATING,
+	VIRTIO_BUS_STATE_RESETTING,
 };
 
+/*
+ * Kicks can arrive on any std call slot while slot 0 starts, stops or resets
+ * the bus. Each kick holds a reference (kick_cnt) while the bus is active.
+ * Stop and reset move the bus out of the active state under slock, so no new
+ * kicks get in, then wait on kicks_drained for the running ones to finish.
+ */
 struct trusty_virtio_bus {
 	uint   vdev_cnt;
 	uint   next_dev_id;
 	size_t  descr_size;
 	volatile int state;
 	struct list_node vdev_list;
+	spin_lock_t slock;
+	uint kick_cnt;
+	event_t kicks_drained;
 };
 
 
@@ -69,8 +81,46 @@ static struct trusty_virtio_bus _virtio_bus = {
 	.next_dev_id = 0,
 	.state = VIRTIO_BUS_STATE_UNINITIALIZED,
 	.vdev_list = LIST_INITIAL_VALUE(_virtio_bus.vdev_list),
+	.slock = SPIN_LOCK_INITIAL_VALUE,
+	.kick_cnt = 0,
+	.kicks_drained = EVENT_INITIAL_VALUE(_virtio_bus.kicks_drained, false,
+					     EVENT_FLAG_AUTOUNSIGNAL),
 };
 
+static void virtio_bus_set_state(struct trusty_virtio_bus *vb, int state)
+{
+	spin_lock_saved_state_t sstate;
+
+	spin_lock_irqsave(&vb->slock, sstate);
+	vb->state = state;
+	spin_unlock_irqrestore(&vb->slock, sstate);
+}
+
+/*
+ * Move an active bus to @state and wait for kicks in progress to complete.
+ */
+static status_t virtio_bus_deactivate(struct trusty_virtio_bus *vb, int state)
+{
+	int oldstate;
+	uint kick_cnt;
+	spin_lock_saved_state_t sstate;
+
+	spin_lock_irqsave(&vb->slock, sstate);
+	oldstate = vb->state;
+	if (oldstate == VIRTIO_BUS_STATE_ACTIVE)
+		vb->state = state;
+	kick_cnt = vb->kick_cnt;
+	spin_unlock_irqrestore(&vb->slock, sstate);
+
+	if (oldstate != VIRTIO_BUS_STATE_ACTIVE)
+		return ERR_BAD_STATE;
+
+	if (kick_cnt)
+		event_wait(&vb->kicks_drained);
+
+	return NO_ERROR;
+}
+
 static status_t map_descr(ns_paddr_t buf_pa, void **buf_va, ns_size_t sz,
                           uint buf_mmu_flags)
 {
@@ -280,7 +330,7 @@ status_t virtio_start(ns_paddr_t ns_descr_pa, ns_size_t descr_sz,
 	unmap_descr(ns_descr_pa, ns_descr_va, vb->descr_size);
 	free(descr_va);
 
-	vb->state = VIRTIO_BUS_STATE_ACTIVE;
+	virtio_bus_set_state(vb, VIRTIO_BUS_STATE_ACTIVE);
 
 	return NO_ERROR;
 
@@ -294,25 +344,22 @@ err_bad_params:
 
 status_t virtio_stop(ns_paddr_t descr_pa, ns_size_t descr_sz, uint descr_mmu_flags)
 {
-	int oldstate;
+	status_t ret;
 	struct vdev *vd;
 	struct trusty_virtio_bus *vb = &_virtio_bus;
 
 	LTRACEF("%u bytes @ 0x%llx\n", descr_sz, descr_pa);
 
-	oldstate = atomic_cmpxchg(&vb->state,
-				  VIRTIO_BUS_STATE_ACTIVE,
-				  VIRTIO_BUS_STATE_DEACTIVATING);
-
-	if (oldstate != VIRTIO_BUS_STATE_ACTIVE)
-		return ERR_BAD_STATE;
+	ret = virtio_bus_deactivate(vb, VIRTIO_BUS_STATE_DEACTIVATING);
+	if (ret != NO_ERROR)
+		return ret;
 
 	/* reset all devices */
 	list_for_every_entry(&vb->vdev_list, vd, struct vdev, node) {
 		vd->ops->reset(vd);
 	}
 
-	vb->state = VIRTIO_BUS_STATE_IDLE;
+	virtio_bus_set_state(vb, VIRTIO_BUS_STATE_IDLE);
 
 	return NO_ERROR;
 }
@@ -328,7 +375,7 @@ status_t virtio_device_reset(uint devid)
 
 	LTRACEF("dev=%d\n", devid);
 
-	if (vb->state != VIRTIO_BUS_STATE_ACTIVE)
+	if (virtio_bus_deactivate(vb, VIRTIO_BUS_STATE_RESETTING) != NO_ERROR)
 		return ERR_BAD_STATE;
 
 	list_for_every_entry(&vb->vdev_list, vd, struct vdev, node) {
@@ -337,6 +384,8 @@ status_t virtio_device_reset(uint devid)
 			break;
 		}
 	}
+
+	virtio_bus_set_state(vb, VIRTIO_BUS_STATE_ACTIVE);
 	return ret;
 }
 
@@ -346,15 +395,22 @@ status_t virtio_device_reset(uint devid)
 status_t virtio_kick_vq(uint devid, uint vqid)
 {
 	struct vdev *vd;
+	bool drained;
 	status_t ret = ERR_NOT_FOUND;
 	struct trusty_virtio_bus *vb = &_virtio_bus;
+	spin_lock_saved_state_t sstate;
 
 #if WITH_CHATTY_LTRACE
 	LTRACEF("dev=%d\n", devid);
 #endif
 
-	if (vb->state != VIRTIO_BUS_STATE_ACTIVE)
+	spin_lock_irqsave(&vb->slock, sstate);
+	if (vb->state != VIRTIO_BUS_STATE_ACTIVE) {
+		spin_unlock_irqrestore(&vb->slock, sstate);
 		return ERR_BAD_STATE;
+	}
+	vb->kick_cnt++;
+	spin_unlock_irqrestore(&vb->slock, sstate);
 
 	list_for_every_entry(&vb->vdev_list, vd, struct vdev, node) {
 		if (vd->devid == devid) {
@@ -362,6 +418,16 @@ status_t virtio_kick_vq(uint devid, uint vqid)
 			break;
 		}
 	}
+
+	spin_lock_irqsave(&vb->slock, sstate);
+	vb->kick_cnt--;
+	drained = !vb->kick_cnt && vb->state != VIRTIO_BUS_STATE_ACTIVE;
+	spin_unlock_irqrestore(&vb->slock, sstate);
+
+	/* last kick out wakes a stop or reset waiting in virtio_bus_deactivate */
+	if (drained)
+		event_signal(&vb->kicks_drained, true);
+
 	return ret;
 }
 
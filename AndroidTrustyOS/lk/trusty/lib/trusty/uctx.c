@@ -50,6 +50,9 @@
 /* must be a multiple of sizeof(unsigned long) */
 #define IPC_MAX_HANDLES		64
 
+/* max number of events returned by single wait_many call */
+#define IPC_MAX_WAIT_EVENTS	16
+
 struct uctx {
 	unsigned long		inuse[BITMAP_NUM_WORDS(IPC_MAX_HANDLES)];
 	handle_t		*handles[IPC_MAX_HANDLES];
@@ -369,6 +372,61 @@ out:
 	return ret;
 }
 
+/*
+ *   Wait on any handle existing in user context and return up to
+ *   count pending events at once. Returns the number of events
+ *   stored in user_events array.
+ */
+long __SYSCALL sys_wait_many(user_addr_t user_events, uint32_t count,
+                             unsigned long timeout_msecs)
+{
+	uctx_t *ctx = current_uctx();
+	handle_t *handles[IPC_MAX_WAIT_EVENTS];
+	uint32_t events[IPC_MAX_WAIT_EVENTS];
+	uevent_t tmp_events[IPC_MAX_WAIT_EVENTS];
+	int ret;
+
+	LTRACEF("[%p]: %u events %ld msec\n", uthread_get_current(),
+	                                       count, timeout_msecs);
+
+	if (!count)
+		return (long) ERR_INVALID_ARGS;
+
+	if (count > IPC_MAX_WAIT_EVENTS)
+		count = IPC_MAX_WAIT_EVENTS;
+
+	/* returned handles have extra ref taken */
+	ret = handle_list_wait_many(&ctx->handle_list, handles, events,
+				    count, timeout_msecs);
+	if (ret < 0) {
+		/* an error or no events (timeout) */
+		goto out;
+	}
+
+	for (int i = 0; i < ret; i++) {
+		tmp_events[i].handle = _handle_to_id_locked(ctx, handles[i]);
+		tmp_events[i].event = events[i];
+		tmp_events[i].cookie =
+			(user_addr_t)(uintptr_t)handle_get_cookie(handles[i]);
+
+		/* drop the reference that was taken by wait_many */
+		handle_decref(handles[i]);
+
+		/* there should be a handle id */
+		DEBUG_ASSERT(tmp_events[i].handle < IPC_MAX_HANDLES);
+	}
+
+	status_t status = copy_to_user(user_events, tmp_events,
+				       ret * sizeof(uevent_t));
+	if (status) {
+		/* failed to copy, propogate error to caller */
+		ret = status;
+	}
+out:
+	LTRACEF("[%p]: ret = %d\n", uthread_get_current(), ret);
+	return ret;
+}
+
 long __SYSCALL sys_close(uint32_t handle_id)
 {
 	handle_t *handle;
@@ -414,6 +472,12 @@ long __SYSCALL sys_wait_any(user_addr_t user_event, unsigned long timeout_msecs)
 	return (long) ERR_NOT_SUPPORTED;
 }
 
+long __SYSCALL sys_wait_many(user_addr_t user_events, uint32_t count,
+                             unsigned long timeout_msecs)
+{
+	return (long) ERR_NOT_SUPPORTED;
+}
+
 
 long __SYSCALL sys_close(uint32_t handle_id)
 {
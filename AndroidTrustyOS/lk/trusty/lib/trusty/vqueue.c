@@ -41,6 +41,131 @@
 
 #define VQ_LOCK_FLAGS SPIN_LOCK_FLAG_INTERRUPTS
 
+static void vqueue_map_cache_init(struct vqueue_map_cache *mc, uint max_cnt)
+{
+	mutex_init(&mc->lock);
+	mc->cnt = 0;
+	mc->max_cnt = max_cnt;
+	list_initialize(&mc->lru);
+	for (uint i = 0; i < countof(mc->hash); i++)
+		list_initialize(&mc->hash[i]);
+}
+
+static struct list_node *vqueue_map_bucket(struct vqueue_map_cache *mc,
+					   paddr_t paddr)
+{
+	return &mc->hash[(paddr >> PAGE_SIZE_SHIFT) % countof(mc->hash)];
+}
+
+static void vqueue_mapping_free(struct vqueue_map_cache *mc,
+				struct vqueue_mapping *map)
+{
+	DEBUG_ASSERT(!map->users);
+
+	list_delete(&map->hash_node);
+	list_delete(&map->lru_node);
+	mc->cnt--;
+	vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)map->va);
+	free(map);
+}
+
+static void vqueue_map_cache_destroy(struct vqueue_map_cache *mc)
+{
+	struct vqueue_mapping *map;
+
+	mutex_acquire(&mc->lock);
+	while ((map = list_peek_head_type(&mc->lru, struct vqueue_mapping,
+					  lru_node))) {
+		vqueue_mapping_free(mc, map);
+	}
+	DEBUG_ASSERT(!mc->cnt);
+	mutex_release(&mc->lock);
+}
+
+/*
+ * Get a mapping of @size bytes at @paddr with @flags, reusing a cached
+ * mapping if there is one. Must be called with cache lock held.
+ */
+static int vqueue_map_cache_get(struct vqueue_map_cache *mc, paddr_t paddr,
+				size_t size, u_int flags, void **va)
+{
+	int ret;
+	struct vqueue_mapping *map;
+	struct vqueue_mapping *tmp;
+	struct list_node *bucket = vqueue_map_bucket(mc, paddr);
+
+	list_for_every_entry_safe(bucket, map, tmp, struct vqueue_mapping,
+				  hash_node) {
+		if (map->paddr != paddr)
+			continue;
+
+		if (map->size >= size && map->flags == flags)
+			goto found;
+
+		/* buffer at this address changed, drop stale mapping */
+		if (!map->users)
+			vqueue_mapping_free(mc, map);
+	}
+
+	/* make room by dropping the least recently used idle mapping */
+	if (mc->cnt >= mc->max_cnt) {
+		map = list_peek_tail_type(&mc->lru, struct vqueue_mapping,
+					  lru_node);
+		while (map && map->users) {
+			map = list_prev_type(&mc->lru, &map->lru_node,
+					     struct vqueue_mapping, lru_node);
+		}
+		if (map)
+			vqueue_mapping_free(mc, map);
+	}
+
+	map = calloc(1, sizeof(*map));
+	if (!map)
+		return ERR_NO_MEMORY;
+
+	ret = vmm_alloc_physical(vmm_get_kernel_aspace(), "vqueue",
+				 size, &map->va, PAGE_SIZE_SHIFT,
+				 paddr, 0, flags);
+	if (ret) {
+		free(map);
+		return ret;
+	}
+
+	map->paddr = paddr;
+	map->size = size;
+	map->flags = flags;
+	list_add_head(bucket, &map->hash_node);
+	list_add_head(&mc->lru, &map->lru_node);
+	mc->cnt++;
+
+found:
+	map->users++;
+	list_delete(&map->lru_node);
+	list_add_head(&mc->lru, &map->lru_node);
+	*va = map->va;
+	return NO_ERROR;
+}
+
+/*
+ * Release a mapping returned by vqueue_map_cache_get. The mapping stays
+ * in the cache. Must be called with cache lock held.
+ */
+static void vqueue_map_cache_put(struct vqueue_map_cache *mc, paddr_t paddr,
+				 void *va)
+{
+	struct vqueue_mapping *map;
+
+	list_for_every_entry(vqueue_map_bucket(mc, paddr), map,
+			     struct vqueue_mapping, hash_node) {
+		if (map->paddr == paddr && map->va == va) {
+			DEBUG_ASSERT(map->users);
+			map->users--;
+			return;
+		}
+	}
+	panic("%s: no mapping for 0x%lx\n", __func__, (ulong)paddr);
+}
+
 int vqueue_init(struct vqueue *vq, uint32_t id,
 		paddr_t paddr, uint num, ulong align,
 		void *priv, vqueue_cb_t notify_cb, vqueue_cb_t kick_cb)
@@ -70,9 +195,15 @@ int vqueue_init(struct vqueue *vq, uint32_t id,
 	vq->notify_cb = notify_cb;
 	vq->kick_cb = kick_cb;
 	vq->vring_addr = (vaddr_t)vptr;
+	vq->last_avail_idx = 0;
+	vq->used_idx = 0;
+	vq->event_idx = false;
 
 	event_init(&vq->avail_event, false, 0);
 
+	/* the other side normally has at most one buffer per descriptor */
+	vqueue_map_cache_init(&vq->map_cache, num);
+
 	return NO_ERROR;
 }
 
@@ -89,6 +220,8 @@ void vqueue_destroy(struct vqueue *vq)
 	vq->vring_sz = 0;
 	spin_unlock_restore(&vq->slock, state, VQ_LOCK_FLAGS);
 
+	vqueue_map_cache_destroy(&vq->map_cache);
+
 	vmm_free_region(vmm_get_kernel_aspace(), vring_addr);
 }
 
@@ -108,6 +241,19 @@ void vqueue_signal_avail(struct vqueue *vq)
  * and put them onto the used ring.
  */
 
+/*
+ * Ask the other side to kick us when it adds the next buffer. Kicks are
+ * suppressed while we are draining the avail ring and only re-enabled once
+ * it is empty, so a burst of buffers costs at most one kick.
+ */
+static void _vqueue_enable_notify_locked(struct vqueue *vq)
+{
+	if (vq->event_idx)
+		vring_avail_event(&vq->vring) = vq->last_avail_idx;
+	else
+		vq->vring.used->flags &= ~VRING_USED_F_NO_NOTIFY;
+}
+
 static int _vqueue_get_avail_buf_locked(struct vqueue *vq,
 					struct vqueue_buf *iovbuf)
 {
@@ -134,7 +280,7 @@ static int _vqueue_get_avail_buf_locked(struct vqueue *vq,
 
 	if (vq->last_avail_idx == vq->vring.avail->idx) {
 		event_unsignal(&vq->avail_event);
-		vq->vring.used->flags &= ~VRING_USED_F_NO_NOTIFY;
+		_vqueue_enable_notify_locked(vq);
 		smp_mb();
 		if (vq->last_avail_idx == vq->vring.avail->idx) {
 			/* no buffers left */
@@ -208,51 +354,58 @@ int vqueue_get_avail_buf(struct vqueue *vq, struct vqueue_buf *iovbuf)
 	return ret;
 }
 
-int vqueue_map_iovs(struct vqueue_iovs *vqiovs, u_int flags)
+int vqueue_map_iovs(struct vqueue *vq, struct vqueue_iovs *vqiovs,
+		    u_int flags)
 {
 	uint  i;
-	int ret;
+	int ret = NO_ERROR;
 
+	DEBUG_ASSERT(vq);
 	DEBUG_ASSERT(vqiovs);
 	DEBUG_ASSERT(vqiovs->phys);
 	DEBUG_ASSERT(vqiovs->iovs);
 	DEBUG_ASSERT(vqiovs->used <= vqiovs->cnt);
 
+	mutex_acquire(&vq->map_cache.lock);
 	for (i = 0; i < vqiovs->used; i++) {
-        vqiovs->iovs[i].base = NULL;
-		ret = vmm_alloc_physical(vmm_get_kernel_aspace(), "vqueue",
-		                         ROUNDUP(vqiovs->iovs[i].len, PAGE_SIZE),
-		                         &vqiovs->iovs[i].base, PAGE_SIZE_SHIFT,
-		                         vqiovs->phys[i], 0, flags);
+		vqiovs->iovs[i].base = NULL;
+		ret = vqueue_map_cache_get(&vq->map_cache, vqiovs->phys[i],
+					   ROUNDUP(vqiovs->iovs[i].len, PAGE_SIZE),
+					   flags, &vqiovs->iovs[i].base);
 		if (ret)
 			goto err;
 	}
+	mutex_release(&vq->map_cache.lock);
 
 	return NO_ERROR;
 
 err:
 	while (i--) {
-		vmm_free_region(vmm_get_kernel_aspace(),
-		                (vaddr_t)vqiovs->iovs[i].base);
+		vqueue_map_cache_put(&vq->map_cache, vqiovs->phys[i],
+				     vqiovs->iovs[i].base);
 		vqiovs->iovs[i].base = NULL;
 	}
+	mutex_release(&vq->map_cache.lock);
 	return ret;
 }
 
-void vqueue_unmap_iovs(struct vqueue_iovs *vqiovs)
+void vqueue_unmap_iovs(struct vqueue *vq, struct vqueue_iovs *vqiovs)
 {
+	DEBUG_ASSERT(vq);
 	DEBUG_ASSERT(vqiovs);
 	DEBUG_ASSERT(vqiovs->phys);
 	DEBUG_ASSERT(vqiovs->iovs);
 	DEBUG_ASSERT(vqiovs->used <= vqiovs->cnt);
 
+	mutex_acquire(&vq->map_cache.lock);
 	for (uint i = 0; i < vqiovs->used; i++) {
 		/* base is expected to be set */
 		DEBUG_ASSERT(vqiovs->iovs[i].base);
-		vmm_free_region(vmm_get_kernel_aspace(),
-		                (vaddr_t)vqiovs->iovs[i].base);
+		vqueue_map_cache_put(&vq->map_cache, vqiovs->phys[i],
+				     vqiovs->iovs[i].base);
 		vqiovs->iovs[i].base = NULL;
 	}
+	mutex_release(&vq->map_cache.lock);
 }
 
 static int _vqueue_add_buf_locked(struct vqueue *vq, struct vqueue_buf *buf, uint32_t len)
@@ -274,20 +427,75 @@ static int _vqueue_add_buf_locked(struct vqueue *vq, struct vqueue_buf *buf, uin
 		return ERR_NOT_VALID;
 	}
 
-	used = &vq->vring.used->ring[vq->vring.used->idx % vq->vring.num];
+	used = &vq->vring.used->ring[vq->used_idx % vq->vring.num];
 	used->id = buf->head;
 	used->len = len;
-	smp_wmb();
-	vq->vring.used->idx++;
+	vq->used_idx++;
 	return NO_ERROR;
 }
 
+/*
+ * Make all added used entries visible to the other side. Returns true
+ * if the other side asked to be kicked for them.
+ */
+static bool _vqueue_publish_used_locked(struct vqueue *vq)
+{
+	uint16_t old_idx;
+
+	if (!vq->vring_addr)
+		return false;
+
+	old_idx = vq->vring.used->idx;
+	if (old_idx == vq->used_idx)
+		return false;
+
+	smp_wmb();
+	vq->vring.used->idx = vq->used_idx;
+	smp_mb();
+
+	if (vq->event_idx)
+		return vring_need_event(vring_used_event(&vq->vring),
+					vq->used_idx, old_idx);
+
+	return !(vq->vring.avail->flags & VRING_AVAIL_F_NO_INTERRUPT);
+}
+
 int vqueue_add_buf(struct vqueue *vq, struct vqueue_buf *buf, uint32_t len)
 {
+	bool kick = false;
 	spin_lock_saved_state_t state;
 
 	spin_lock_save(&vq->slock, &state, VQ_LOCK_FLAGS);
 	int ret = _vqueue_add_buf_locked(vq, buf, len);
+	if (ret == NO_ERROR)
+		kick = _vqueue_publish_used_locked(vq);
 	spin_unlock_restore(&vq->slock, state, VQ_LOCK_FLAGS);
+
+	if (kick)
+		vqueue_kick(vq);
 	return ret;
 }
+
+int vqueue_add_buf_deferred(struct vqueue *vq, struct vqueue_buf *buf,
+			    uint32_t len)
+{
+	spin_lock_saved_state_t state;
+
+	spin_lock_save(&vq->slock, &state, VQ_LOCK_FLAGS);
+	int ret = _vqueue_add_buf_locked(vq, buf, len);
+	spin_unlock_restore(&vq->slock, state, VQ_LOCK_FLAGS);
+	return ret;
+}
+
+void vqueue_publish_used(struct vqueue *vq)
+{
+	bool kick;
+	spin_lock_saved_state_t state;
+
+	spin_lock_save(&vq->slock, &state, VQ_LOCK_FLAGS);
+	kick = _vqueue_publish_used_locked(vq);
+	spin_unlock_restore(&vq->slock, state, VQ_LOCK_FLAGS);
+
+	if (kick)
+		vqueue_kick(vq);
+}
@@ -25,6 +25,8 @@
 #define _LIB_TRUSTY_VQUEUE_H
 
 #include <kernel/event.h>
+#include <kernel/mutex.h>
+#include <list.h>
 #include <lib/trusty/uio.h>
 #include <stdint.h>
 #include <string.h>
@@ -36,6 +38,35 @@
 struct vqueue;
 typedef int (*vqueue_cb_t)(struct vqueue *vq, void *priv);
 
+/* number of hash buckets used to look up cached buffer mappings */
+#define VQUEUE_MAP_HASH_SIZE	16
+
+/*
+ * The non-secure side allocates the buffers it passes through a vring
+ * once and reuses them for the lifetime of the vring. Instead of creating
+ * and destroying a mapping for every message, mappings are kept in a
+ * per-vqueue cache keyed by physical address and only released when the
+ * vqueue is destroyed (or when the cache is full and an unused mapping
+ * has to make room for a new buffer).
+ */
+struct vqueue_mapping {
+	struct list_node	hash_node;
+	struct list_node	lru_node;
+	paddr_t			paddr;
+	size_t			size;   /* mapped size, page aligned */
+	u_int			flags;  /* arch mmu flags */
+	void			*va;
+	uint			users;  /* number of active map calls */
+};
+
+struct vqueue_map_cache {
+	mutex_t			lock;
+	uint			cnt;      /* number of cached mappings */
+	uint			max_cnt;  /* unused mappings are evicted above this */
+	struct list_node	lru;
+	struct list_node	hash[VQUEUE_MAP_HASH_SIZE];
+};
+
 struct vqueue {
 	uint32_t		id;
 
@@ -47,6 +78,14 @@ struct vqueue {
 
 	uint16_t		last_avail_idx;
 
+	/* next used entry; the other side sees entries up to it only
+	 * after vqueue_publish_used */
+	uint16_t		used_idx;
+
+	/* VIRTIO_RING_F_EVENT_IDX is negotiated: notifications are
+	 * suppressed by event indexes instead of ring flags */
+	bool			event_idx;
+
 	event_t			avail_event;
 
 	/* called when the vq is kicked *from* the other side */
@@ -56,6 +95,8 @@ struct vqueue {
 	vqueue_cb_t		kick_cb;
 
 	void			*priv;
+
+	struct vqueue_map_cache	map_cache;
 };
 
 struct vqueue_iovs {
@@ -81,13 +122,27 @@ void vqueue_destroy(struct vqueue *vq);
 
 int vqueue_get_avail_buf(struct vqueue *vq, struct vqueue_buf *iovbuf);
 
-int vqueue_map_iovs(struct vqueue_iovs *vqiovs, u_int flags);
-void vqueue_unmap_iovs(struct vqueue_iovs *vqiovs);
+int vqueue_map_iovs(struct vqueue *vq, struct vqueue_iovs *vqiovs,
+		    u_int flags);
+void vqueue_unmap_iovs(struct vqueue *vq, struct vqueue_iovs *vqiovs);
 
 int vqueue_add_buf(struct vqueue *vq, struct vqueue_buf *buf, uint32_t len);
 
+/*
+ * Put buffer on the used ring without making it visible to the other side.
+ * Call vqueue_publish_used once a batch of buffers has been added.
+ */
+int vqueue_add_buf_deferred(struct vqueue *vq, struct vqueue_buf *buf,
+			    uint32_t len);
+void vqueue_publish_used(struct vqueue *vq);
+
 void vqueue_signal_avail(struct vqueue *vq);
 
+static inline void vqueue_set_event_idx(struct vqueue *vq, bool enable)
+{
+	vq->event_idx = enable;
+}
+
 static inline uint32_t vqueue_id(struct vqueue *vq)
 {
 	return vq->id;
@@ -116,6 +116,7 @@ enum
 	UTM_NS_MEM	= 1 << 6,
 	UTM_IO		= 1 << 7,
 	UTM_FIXED	= 1 << 8,
+	UTM_APP_MEM	= 1 << 9,	/* app image, heap or stack */
 };
 
 /* uthread mapping alignments */
@@ -189,6 +190,10 @@ status_t uthread_grant_pages(uthread_t *ut_target, ext_vaddr_t vaddr_src,
 
 /* Revoke mappings from a previous grant */
 status_t uthread_revoke_pages(uthread_t *ut, vaddr_t vaddr, size_t size);
+
+/* Get physical pages and map flags backing a page aligned range */
+status_t uthread_get_pages(uthread_t *ut, vaddr_t vaddr, size_t size,
+		paddr_t *pfn_list, u_int *flags);
 #endif
 
 #endif /* __UTHREAD_H */
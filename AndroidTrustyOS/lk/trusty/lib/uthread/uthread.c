@@ -300,7 +300,8 @@ uthread_t *uthread_create(const char *name, vaddr_t entry, int priority,
 	stack_bot = start_stack - stack_size;
 	err = uthread_map_contig(ut, &stack_bot, vaddr_to_paddr(ut->stack),
 				stack_size,
-				UTM_W | UTM_R | UTM_STACK | UTM_FIXED,
+				UTM_W | UTM_R | UTM_STACK | UTM_FIXED |
+				UTM_APP_MEM,
 				UT_MAP_ALIGN_4KB);
 	if (err)
 		goto err_free_ut_stack;
@@ -633,6 +634,36 @@ status_t uthread_revoke_pages(uthread_t *ut, vaddr_t vaddr, size_t size)
 
 	return uthread_unmap(ut, vaddr, size);
 }
+
+status_t uthread_get_pages(uthread_t *ut, vaddr_t vaddr, size_t size,
+		paddr_t *pfn_list, u_int *flags)
+{
+	uthread_map_t *mp;
+	status_t err = NO_ERROR;
+
+	if ((vaddr | size) & (PAGE_SIZE - 1) || size == 0)
+		return ERR_INVALID_ARGS;
+
+	mmap_lock(ut);
+	mp = uthread_map_find(ut, vaddr, size);
+	if (!mp) {
+		err = ERR_INVALID_ARGS;
+		goto err_out;
+	}
+
+	for (u_int pg = 0; pg < size / PAGE_SIZE; pg++) {
+		vaddr_t offset = vaddr + pg * PAGE_SIZE - mp->vaddr;
+
+		if (mp->flags & UTM_PHYS_CONTIG)
+			pfn_list[pg] = mp->pfn_list[0] + offset;
+		else
+			pfn_list[pg] = mp->pfn_list[offset / PAGE_SIZE];
+	}
+	*flags = mp->flags;
+err_out:
+	mmap_unlock(ut);
+	return err;
+}
 #endif
 
 static void uthread_init(uint level)
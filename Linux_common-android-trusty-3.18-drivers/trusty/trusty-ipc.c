@@ -24,6 +24,7 @@
 #include <linux/sched.h>
 #include <linux/compat.h>
 #include <linux/uio.h>
+#include <linux/vmalloc.h>
 
 #include <linux/virtio.h>
 #include <linux/virtio_ids.h>
@@ -42,11 +43,20 @@
 #define DEFAULT_MSG_BUF_SIZE		PAGE_SIZE
 #define DEFAULT_MSG_BUF_ALIGN		PAGE_SIZE
 
+/* tipc message length is 16 bit */
+#define MAX_MSG_BUF_SIZE		(64 * 1024)
+#define MAX_MSG_BUF_PAGES		DIV_ROUND_UP(MAX_MSG_BUF_SIZE, PAGE_SIZE)
+
 #define TIPC_CTRL_ADDR			53
 #define TIPC_ANY_ADDR			0xFFFFFFFF
 
 #define TIPC_MIN_LOCAL_ADDR		1024
 
+/* device feature bits (mirror tipc_dev.h on Trusty side) */
+#define VIRTIO_TIPC_F_MULTIQUEUE	0
+
+#define TIPC_MAX_VQ_PAIRS		4
+
 #define TIPC_IOC_MAGIC			'r'
 #define TIPC_IOC_CONNECT		_IOW(TIPC_IOC_MAGIC, 0x80, char *)
 #if defined(CONFIG_COMPAT)
@@ -60,6 +70,7 @@ struct tipc_dev_config {
 	u32 msg_buf_max_size;
 	u32 msg_buf_alignment;
 	char dev_name[MAX_DEV_NAME_LEN];
+	u32 num_vq_pairs;	/* valid with VIRTIO_TIPC_F_MULTIQUEUE */
 } __packed;
 
 struct tipc_msg_hdr {
@@ -117,8 +128,9 @@ struct tipc_virtio_dev {
 	struct kref refcount;
 	struct mutex lock; /* protects access to this device */
 	struct virtio_device *vdev;
-	struct virtqueue *rxvq;
-	struct virtqueue *txvq;
+	struct virtqueue *rxvqs[TIPC_MAX_VQ_PAIRS];
+	struct virtqueue *txvqs[TIPC_MAX_VQ_PAIRS];
+	uint vq_pairs;
 	uint msg_buf_cnt;
 	uint msg_buf_max_cnt;
 	size_t msg_buf_max_sz;
@@ -172,12 +184,51 @@ static int _match_data(int id, void *p, void *data)
 
 static void *_alloc_shareable_mem(size_t sz, phys_addr_t *ppa, gfp_t gfp)
 {
+	/*
+	 * buffers larger than a page are passed to Trusty page by page
+	 * (see _mb_to_sg) so they do not have to be physically contiguous
+	 */
+	if (sz > PAGE_SIZE)
+		return __vmalloc(sz, gfp, PAGE_KERNEL);
+
 	return alloc_pages_exact(sz, gfp);
 }
 
 static void _free_shareable_mem(size_t sz, void *va, phys_addr_t pa)
 {
-	free_pages_exact(va, sz);
+	if (is_vmalloc_addr(va))
+		vfree(va);
+	else
+		free_pages_exact(va, sz);
+}
+
+/*
+ * Describe the first @len bytes of message buffer @mb with scatterlist
+ * @sg (MAX_MSG_BUF_PAGES entries). Returns number of entries used.
+ */
+static int _mb_to_sg(struct tipc_msg_buf *mb, size_t len,
+		     struct scatterlist *sg)
+{
+	int i, nents;
+	size_t off = 0;
+
+	if (!is_vmalloc_addr(mb->buf_va)) {
+		sg_init_one(sg, mb->buf_va, len);
+		return 1;
+	}
+
+	nents = DIV_ROUND_UP(len, PAGE_SIZE);
+	sg_init_table(sg, nents);
+	for (i = 0; i < nents; i++, off += PAGE_SIZE)
+		sg_set_page(&sg[i], vmalloc_to_page(mb->buf_va + off),
+			    min_t(size_t, len - off, PAGE_SIZE), 0);
+	return nents;
+}
+
+/* number of vring descriptors a message buffer of @sz bytes takes */
+static uint _msg_buf_desc_cnt(size_t sz)
+{
+	return DIV_ROUND_UP(sz, PAGE_SIZE);
 }
 
 static struct tipc_msg_buf *_alloc_msg_buf(size_t sz)
@@ -340,28 +391,35 @@ static struct tipc_msg_buf *vds_get_txbuf(struct tipc_virtio_dev *vds,
 	return mb;
 }
 
-static int vds_queue_txbuf(struct tipc_virtio_dev *vds,
+/*
+ * All messages of a channel go through the same vq pair so they stay
+ * ordered; Trusty replies on the pair the connect request came in on.
+ */
+static int vds_queue_txbuf(struct tipc_virtio_dev *vds, u32 local,
 			   struct tipc_msg_buf *mb)
 {
-	int err;
-	struct scatterlist sg;
+	int err, nents;
+	struct scatterlist sg[MAX_MSG_BUF_PAGES];
+	struct virtqueue *txvq;
 	bool need_notify = false;
 
 	if (!vds)
 		return -EINVAL;
 
+	txvq = vds->txvqs[local % vds->vq_pairs];
+
 	mutex_lock(&vds->lock);
 	if (vds->state == VDS_ONLINE) {
-		sg_init_one(&sg, mb->buf_va, mb->wpos);
-		err = virtqueue_add_outbuf(vds->txvq, &sg, 1, mb, GFP_KERNEL);
-		need_notify = virtqueue_kick_prepare(vds->txvq);
+		nents = _mb_to_sg(mb, mb->wpos, sg);
+		err = virtqueue_add_outbuf(txvq, sg, nents, mb, GFP_KERNEL);
+		need_notify = virtqueue_kick_prepare(txvq);
 	} else {
 		err = -ENODEV;
 	}
 	mutex_unlock(&vds->lock);
 
 	if (need_notify)
-		virtqueue_notify(vds->txvq);
+		virtqueue_notify(txvq);
 
 	return err;
 }
@@ -532,7 +590,7 @@ int tipc_chan_queue_msg(struct tipc_chan *chan, struct tipc_msg_buf *mb)
 	switch (chan->state) {
 	case TIPC_CONNECTED:
 		fill_msg_hdr(mb, chan->local, chan->remote);
-		err = vds_queue_txbuf(chan->vds, mb);
+		err = vds_queue_txbuf(chan->vds, chan->local, mb);
 		if (err) {
 			/* this should never happen */
 			pr_err("%s: failed to queue tx buffer (%d)\n",
@@ -586,7 +644,7 @@ int tipc_chan_connect(struct tipc_chan *chan, const char *name)
 		strcpy(chan->srv_name, body->name);
 
 		fill_msg_hdr(txbuf, chan->local, TIPC_CTRL_ADDR);
-		err = vds_queue_txbuf(chan->vds, txbuf);
+		err = vds_queue_txbuf(chan->vds, chan->local, txbuf);
 		if (err) {
 			/* this should never happen */
 			pr_err("%s: failed to queue tx buffer (%d)\n",
@@ -649,7 +707,7 @@ int tipc_chan_shutdown(struct tipc_chan *chan)
 		body->target = chan->remote;
 
 		fill_msg_hdr(txbuf, chan->local, TIPC_CTRL_ADDR);
-		err = vds_queue_txbuf(chan->vds, txbuf);
+		err = vds_queue_txbuf(chan->vds, chan->local, txbuf);
 		if (err) {
 			/* this should never happen */
 			pr_err("%s: failed to queue tx buffer (%d)\n",
@@ -1387,11 +1445,11 @@ static void _handle_ctrl_msg(struct tipc_virtio_dev *vds,
 	}
 }
 
-static int _handle_rxbuf(struct tipc_virtio_dev *vds,
+static int _handle_rxbuf(struct tipc_virtio_dev *vds, struct virtqueue *rxvq,
 			 struct tipc_msg_buf *rxbuf, size_t rxlen)
 {
-	int err;
-	struct scatterlist sg;
+	int err, nents;
+	struct scatterlist sg[MAX_MSG_BUF_PAGES];
 	struct tipc_msg_hdr *msg;
 	struct device *dev = &vds->vdev->dev;
 
@@ -1438,8 +1496,8 @@ static int _handle_rxbuf(struct tipc_virtio_dev *vds,
 
 drop_it:
 	/* add the buffer back to the virtqueue */
-	sg_init_one(&sg, rxbuf->buf_va, rxbuf->buf_sz);
-	err = virtqueue_add_inbuf(vds->rxvq, &sg, 1, rxbuf, GFP_KERNEL);
+	nents = _mb_to_sg(rxbuf, rxbuf->buf_sz, sg);
+	err = virtqueue_add_inbuf(rxvq, sg, nents, rxbuf, GFP_KERNEL);
 	if (err < 0) {
 		dev_err(dev, "failed to add a virtqueue buffer: %d\n", err);
 		return err;
@@ -1455,13 +1513,21 @@ static void _rxvq_cb(struct virtqueue *rxvq)
 	unsigned int msg_cnt = 0;
 	struct tipc_virtio_dev *vds = rxvq->vdev->priv;
 
-	while ((mb = virtqueue_get_buf(rxvq, &len)) != NULL) {
-		if (_handle_rxbuf(vds, mb, len))
-			break;
-		msg_cnt++;
-	}
+	/*
+	 * handle everything Trusty has published, including buffers
+	 * that show up while we re-enable callbacks
+	 */
+	do {
+		virtqueue_disable_cb(rxvq);
+		while ((mb = virtqueue_get_buf(rxvq, &len)) != NULL) {
+			if (_handle_rxbuf(vds, rxvq, mb, len))
+				goto done;
+			msg_cnt++;
+		}
+	} while (!virtqueue_enable_cb(rxvq));
 
-	/* tell the other size that we added rx buffers */
+done:
+	/* tell the other size that we added rx buffers (once per batch) */
 	if (msg_cnt)
 		virtqueue_kick(rxvq);
 }
@@ -1477,8 +1543,11 @@ static void _txvq_cb(struct virtqueue *txvq)
 
 	/* detach all buffers */
 	mutex_lock(&vds->lock);
-	while ((mb = virtqueue_get_buf(txvq, &len)) != NULL)
-		need_wakeup |= _put_txbuf_locked(vds, mb);
+	do {
+		virtqueue_disable_cb(txvq);
+		while ((mb = virtqueue_get_buf(txvq, &len)) != NULL)
+			need_wakeup |= _put_txbuf_locked(vds, mb);
+	} while (!virtqueue_enable_cb(txvq));
 	mutex_unlock(&vds->lock);
 
 	if (need_wakeup) {
@@ -1489,12 +1558,19 @@ static void _txvq_cb(struct virtqueue *txvq)
 
 static int tipc_virtio_probe(struct virtio_device *vdev)
 {
-	int err, i;
+	int err, i, q;
+	uint vq_pairs = 1;
+	uint desc_cnt;
 	struct tipc_virtio_dev *vds;
 	struct tipc_dev_config config;
-	struct virtqueue *vqs[2];
-	vq_callback_t *vq_cbs[] = {_rxvq_cb, _txvq_cb};
-	const char *vq_names[] = { "rx", "tx" };
+	struct virtqueue *vqs[TIPC_MAX_VQ_PAIRS * 2];
+	vq_callback_t *vq_cbs[TIPC_MAX_VQ_PAIRS * 2];
+	const char *vq_names[TIPC_MAX_VQ_PAIRS * 2];
+	static const char * const rx_names[] = { "rx0", "rx1", "rx2", "rx3" };
+	static const char * const tx_names[] = { "tx0", "tx1", "tx2", "tx3" };
+
+	BUILD_BUG_ON(ARRAY_SIZE(rx_names) != TIPC_MAX_VQ_PAIRS);
+	BUILD_BUG_ON(ARRAY_SIZE(tx_names) != TIPC_MAX_VQ_PAIRS);
 
 	dev_dbg(&vdev->dev, "%s:\n", __func__);
 
@@ -1515,40 +1591,82 @@ static int tipc_virtio_probe(struct virtio_device *vdev)
 	config.msg_buf_max_size  = DEFAULT_MSG_BUF_SIZE;
 	config.msg_buf_alignment = DEFAULT_MSG_BUF_ALIGN;
 
-	/* get configuration if present */
-	vdev->config->get(vdev, 0, &config, sizeof(config));
+	/* get configuration if present (without fields added by features) */
+	vdev->config->get(vdev, 0, &config,
+			  offsetof(struct tipc_dev_config, num_vq_pairs));
 
 	/* copy dev name */
 	strncpy(vds->cdev_name, config.dev_name, sizeof(vds->cdev_name));
 	vds->cdev_name[sizeof(vds->cdev_name)-1] = '\0';
 
-	/* find tx virtqueues (rx and tx and in this order) */
-	err = vdev->config->find_vqs(vdev, 2, vqs, vq_cbs, vq_names);
+	/* use one vq pair per cpu if device supports it */
+	if (virtio_has_feature(vdev, VIRTIO_TIPC_F_MULTIQUEUE)) {
+		vdev->config->get(vdev,
+				  offsetof(struct tipc_dev_config, num_vq_pairs),
+				  &config.num_vq_pairs,
+				  sizeof(config.num_vq_pairs));
+		vq_pairs = min3(config.num_vq_pairs, num_online_cpus(),
+				(uint)TIPC_MAX_VQ_PAIRS);
+		if (!vq_pairs)
+			vq_pairs = 1;
+	}
+
+	/* find virtqueues (rx and tx and in this order for each pair) */
+	for (q = 0; q < vq_pairs; q++) {
+		vq_cbs[2 * q] = _rxvq_cb;
+		vq_cbs[2 * q + 1] = _txvq_cb;
+		vq_names[2 * q] = rx_names[q];
+		vq_names[2 * q + 1] = tx_names[q];
+	}
+	err = vdev->config->find_vqs(vdev, 2 * vq_pairs, vqs, vq_cbs, vq_names);
 	if (err)
 		goto err_find_vqs;
 
-	vds->rxvq = vqs[0];
-	vds->txvq = vqs[1];
+	vds->vq_pairs = vq_pairs;
+	for (q = 0; q < vq_pairs; q++) {
+		vds->rxvqs[q] = vqs[2 * q];
+		vds->txvqs[q] = vqs[2 * q + 1];
+	}
 
-	/* save max buffer size and count */
-	vds->msg_buf_max_sz = config.msg_buf_max_size;
-	vds->msg_buf_max_cnt = virtqueue_get_vring_size(vds->txvq);
+	dev_dbg(&vdev->dev, "%s: using %u vq pairs\n", __func__, vq_pairs);
+
+	/*
+	 * save max buffer size and count: tx buffers come from a shared
+	 * pool, size it so it can never overflow any of the tx vqs
+	 * (a buffer larger than a page takes a descriptor per page)
+	 */
+	vds->msg_buf_max_sz = min_t(size_t, config.msg_buf_max_size,
+				    MAX_MSG_BUF_SIZE);
+	desc_cnt = _msg_buf_desc_cnt(vds->msg_buf_max_sz);
+	vds->msg_buf_max_cnt = virtqueue_get_vring_size(vds->txvqs[0]);
+	for (q = 1; q < vq_pairs; q++)
+		vds->msg_buf_max_cnt = min(vds->msg_buf_max_cnt,
+				virtqueue_get_vring_size(vds->txvqs[q]));
+	vds->msg_buf_max_cnt /= desc_cnt;
 
 	/* set up the receive buffers */
-	for (i = 0; i < virtqueue_get_vring_size(vds->rxvq); i++) {
-		struct scatterlist sg;
-		struct tipc_msg_buf *rxbuf;
-
-		rxbuf = _alloc_msg_buf(vds->msg_buf_max_sz);
-		if (!rxbuf) {
-			dev_err(&vdev->dev, "failed to allocate rx buffer\n");
-			err = -ENOMEM;
-			goto err_free_rx_buffers;
-		}
+	for (q = 0; q < vq_pairs; q++) {
+		struct virtqueue *rxvq = vds->rxvqs[q];
+		uint rxbuf_cnt = virtqueue_get_vring_size(rxvq) / desc_cnt;
+
+		for (i = 0; i < rxbuf_cnt; i++) {
+			int nents;
+			struct scatterlist sg[MAX_MSG_BUF_PAGES];
+			struct tipc_msg_buf *rxbuf;
+
+			rxbuf = _alloc_msg_buf(vds->msg_buf_max_sz);
+			if (!rxbuf) {
+				dev_err(&vdev->dev,
+					"failed to allocate rx buffer\n");
+				err = -ENOMEM;
+				goto err_free_rx_buffers;
+			}
 
-		sg_init_one(&sg, rxbuf->buf_va, rxbuf->buf_sz);
-		err = virtqueue_add_inbuf(vds->rxvq, &sg, 1, rxbuf, GFP_KERNEL);
-		WARN_ON(err); /* sanity check; this can't really happen */
+			nents = _mb_to_sg(rxbuf, rxbuf->buf_sz, sg);
+			err = virtqueue_add_inbuf(rxvq, sg, nents, rxbuf,
+						  GFP_KERNEL);
+			WARN_ON(err); /* sanity check; this can't really happen */
+		}
 	}
 
 	vdev->priv = vds;
@@ -1558,7 +1676,8 @@ static int tipc_virtio_probe(struct virtio_device *vdev)
 	return 0;
 
 err_free_rx_buffers:
-	_cleanup_vq(vds->rxvq);
+	for (q = 0; q < vq_pairs; q++)
+		_cleanup_vq(vds->rxvqs[q]);
 err_find_vqs:
 	kref_put(&vds->refcount, _free_vds);
 	return err;
@@ -1566,6 +1685,7 @@ err_find_vqs:
 
 static void tipc_virtio_remove(struct virtio_device *vdev)
 {
+	uint q;
 	struct tipc_virtio_dev *vds = vdev->priv;
 
 	_go_offline(vds);
@@ -1579,8 +1699,10 @@ static void tipc_virtio_remove(struct virtio_device *vdev)
 
 	idr_destroy(&vds->addr_idr);
 
-	_cleanup_vq(vds->rxvq);
-	_cleanup_vq(vds->txvq);
+	for (q = 0; q < vds->vq_pairs; q++) {
+		_cleanup_vq(vds->rxvqs[q]);
+		_cleanup_vq(vds->txvqs[q]);
+	}
 	_free_msg_buf_list(&vds->free_buf_list);
 
 	vdev->config->del_vqs(vds->vdev);
@@ -1594,7 +1716,7 @@ static struct virtio_device_id tipc_virtio_id_table[] = {
 };
 
 static unsigned int features[] = {
-	0,
+	VIRTIO_TIPC_F_MULTIQUEUE,
 };
 
 static struct virtio_driver virtio_tipc_driver = {
@@ -83,8 +83,11 @@ static void check_all_vqs(struct work_struct *work)
 	struct trusty_vdev *tvdev;
 
 	list_for_each_entry(tvdev, &tctx->vdev_list, node) {
-		for (i = 0; i < tvdev->vring_num; i++)
-			vring_interrupt(0, tvdev->vrings[i].vq);
+		for (i = 0; i < tvdev->vring_num; i++) {
+			/* vrings not requested by the driver have no vq */
+			if (tvdev->vrings[i].vq)
+				vring_interrupt(0, tvdev->vrings[i].vq);
+		}
 	}
 }
 
@@ -217,6 +220,10 @@ static u32 trusty_virtio_get_features(struct virtio_device *vdev)
 static void trusty_virtio_finalize_features(struct virtio_device *vdev)
 {
 	struct trusty_vdev *tvdev = vdev_to_tvdev(vdev);
+
+	/* keep ring features we support (event indexes) */
+	vring_transport_features(vdev);
+
 	tvdev->vdev_descr->gfeatures = vdev->features[0];
 }
 
@@ -270,6 +277,9 @@ static void _del_vqs(struct virtio_device *vdev)
 		if (tvr->vaddr) {
 			free_pages_exact(tvr->vaddr, tvr->size);
 			tvr->vaddr = NULL;
+			/* tell Trusty this vring is not set up anymore */
+			tvr->vr_descr->da = 0;
+			tvr->vr_descr->reserved = 0;
 		}
 	}
 }
@@ -18,18 +18,55 @@
 #include <linux/of_platform.h>
 #include <linux/platform_device.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/stat.h>
 #include <linux/string.h>
+#include <linux/wait.h>
 #include <linux/trusty/smcall.h>
 #include <linux/trusty/sm_err.h>
 #include <linux/trusty/trusty.h>
 
+/*
+ * Std call slot definitions that <linux/trusty/smcall.h> does not have yet.
+ * The values match lib/sm/smcall.h on the secure side.
+ */
+#ifndef SMC_STDCALL_SET_SLOT
+#define SMC_STDCALL_SLOT_SHIFT	16
+#define SMC_STDCALL_SLOT_MASK	0x00FF0000
+#define SMC_STDCALL_SET_SLOT(smc_nr, slot) \
+	(((smc_nr) & ~SMC_STDCALL_SLOT_MASK) | \
+	 (((slot) << SMC_STDCALL_SLOT_SHIFT) & SMC_STDCALL_SLOT_MASK))
+#endif
+
+#ifndef SMC_FC_STDCALL_SLOTS
+#define SMC_FC_STDCALL_SLOTS	SMC_FASTCALL_NR(SMC_ENTITY_SECURE_MONITOR, 12)
+#endif
+
+#ifndef TRUSTY_API_VERSION_MULTI_STDCALL
+#define TRUSTY_API_VERSION_MULTI_STDCALL	(3)
+#endif
+
+/* Highest api version implemented by this driver */
+#define TRUSTY_DRIVER_API_VERSION	TRUSTY_API_VERSION_MULTI_STDCALL
+
+#define TRUSTY_MAX_STDCALL_SLOTS	8
+
+/*
+ * Std call slot 0 is used by callers serialized by smc_lock. The other
+ * slots are handed out to calls that may run concurrently, see
+ * trusty_std_call_concurrent().
+ */
 struct trusty_state {
 	struct mutex smc_lock;
 	struct atomic_notifier_head notifier;
 	struct completion cpu_idle_completion;
 	char *version_str;
 	u32 api_version;
+	u32 stdcall_slots;
+	spinlock_t slot_lock;
+	unsigned long slots_inuse;
+	wait_queue_head_t slot_wait;
+	struct completion slot_idle_completion[TRUSTY_MAX_STDCALL_SLOTS];
 };
 
 #ifdef CONFIG_ARM64
@@ -161,48 +198,140 @@ static ulong trusty_std_call_helper(struct device *dev, ulong smcnr,
 	return ret;
 }
 
-static void trusty_std_call_cpu_idle(struct trusty_state *s)
+static void trusty_std_call_cpu_idle(struct completion *idle_completion)
 {
 	int ret;
 
-	ret = wait_for_completion_timeout(&s->cpu_idle_completion, HZ * 10);
+	ret = wait_for_completion_timeout(idle_completion, HZ * 10);
 	if (!ret) {
 		pr_warn("%s: timed out waiting for cpu idle to clear, retry anyway\n",
 			__func__);
 	}
 }
 
-s32 trusty_std_call32(struct device *dev, u32 smcnr, u32 a0, u32 a1, u32 a2)
+/*
+ * Calls that trusty allows on any std call slot. They do not need to be
+ * serialized with other std calls and skip smc_lock.
+ */
+static bool trusty_std_call_concurrent(struct trusty_state *s, u32 smcnr)
 {
-	int ret;
-	struct trusty_state *s = platform_get_drvdata(to_platform_device(dev));
+	if (s->stdcall_slots < 2)
+		return false;
+
+	switch (smcnr) {
+	case SMC_SC_VDEV_KICK_VQ:
+		return true;
+	default:
+		return false;
+	}
+}
 
-	BUG_ON(SMC_IS_FASTCALL(smcnr));
-	BUG_ON(SMC_IS_SMC64(smcnr));
+static bool trusty_try_get_slot(struct trusty_state *s, u32 *slot)
+{
+	u32 i;
+	bool found = false;
+
+	spin_lock(&s->slot_lock);
+	for (i = 1; i < s->stdcall_slots; i++) {
+		if (!test_bit(i, &s->slots_inuse)) {
+			__set_bit(i, &s->slots_inuse);
+			*slot = i;
+			found = true;
+			break;
+		}
+	}
+	spin_unlock(&s->slot_lock);
 
-	if (smcnr != SMC_SC_NOP) {
-		mutex_lock(&s->smc_lock);
-		reinit_completion(&s->cpu_idle_completion);
+	return found;
+}
+
+static u32 trusty_get_slot(struct trusty_state *s)
+{
+	u32 slot;
+
+	wait_event(s->slot_wait, trusty_try_get_slot(s, &slot));
+	return slot;
+}
+
+static void trusty_put_slot(struct trusty_state *s, u32 slot)
+{
+	spin_lock(&s->slot_lock);
+	__clear_bit(slot, &s->slots_inuse);
+	spin_unlock(&s->slot_lock);
+	wake_up(&s->slot_wait);
+}
+
+/* a cpu returned from SMC_SC_NOP, retry calls that found their cpu idle */
+static void trusty_complete_cpu_idle(struct trusty_state *s)
+{
+	u32 i;
+
+	complete(&s->cpu_idle_completion);
+
+	spin_lock(&s->slot_lock);
+	for (i = 1; i < s->stdcall_slots; i++) {
+		if (test_bit(i, &s->slots_inuse))
+			complete(&s->slot_idle_completion[i]);
 	}
+	spin_unlock(&s->slot_lock);
+}
 
-	dev_dbg(dev, "%s(0x%x 0x%x 0x%x 0x%x) started\n",
-		__func__, smcnr, a0, a1, a2);
+static s32 trusty_std_call_slot(struct device *dev, u32 smcnr,
+				u32 a0, u32 a1, u32 a2, u32 slot,
+				struct completion *idle_completion)
+{
+	int ret;
 
-	ret = trusty_std_call_helper(dev, smcnr, a0, a1, a2);
+	dev_dbg(dev, "%s(0x%x 0x%x 0x%x 0x%x) started on slot %u\n",
+		__func__, smcnr, a0, a1, a2, slot);
+
+	ret = trusty_std_call_helper(dev, SMC_STDCALL_SET_SLOT(smcnr, slot),
+				     a0, a1, a2);
 	while (ret == SM_ERR_INTERRUPTED || ret == SM_ERR_CPU_IDLE) {
 		dev_dbg(dev, "%s(0x%x 0x%x 0x%x 0x%x) interrupted\n",
 			__func__, smcnr, a0, a1, a2);
 		if (ret == SM_ERR_CPU_IDLE)
-			trusty_std_call_cpu_idle(s);
-		ret = trusty_std_call_helper(dev, SMC_SC_RESTART_LAST, 0, 0, 0);
+			trusty_std_call_cpu_idle(idle_completion);
+		ret = trusty_std_call_helper(dev,
+				SMC_STDCALL_SET_SLOT(SMC_SC_RESTART_LAST, slot),
+				0, 0, 0);
 	}
 	dev_dbg(dev, "%s(0x%x 0x%x 0x%x 0x%x) returned 0x%x\n",
 		__func__, smcnr, a0, a1, a2, ret);
 
 	WARN_ONCE(ret == SM_ERR_PANIC, "trusty crashed");
 
+	return ret;
+}
+
+s32 trusty_std_call32(struct device *dev, u32 smcnr, u32 a0, u32 a1, u32 a2)
+{
+	int ret;
+	u32 slot;
+	struct trusty_state *s = platform_get_drvdata(to_platform_device(dev));
+
+	BUG_ON(SMC_IS_FASTCALL(smcnr));
+	BUG_ON(SMC_IS_SMC64(smcnr));
+
+	if (trusty_std_call_concurrent(s, smcnr)) {
+		slot = trusty_get_slot(s);
+		reinit_completion(&s->slot_idle_completion[slot]);
+		ret = trusty_std_call_slot(dev, smcnr, a0, a1, a2, slot,
+					   &s->slot_idle_completion[slot]);
+		trusty_put_slot(s, slot);
+		return ret;
+	}
+
+	if (smcnr != SMC_SC_NOP) {
+		mutex_lock(&s->smc_lock);
+		reinit_completion(&s->cpu_idle_completion);
+	}
+
+	ret = trusty_std_call_slot(dev, smcnr, a0, a1, a2, 0,
+				   &s->cpu_idle_completion);
+
 	if (smcnr == SMC_SC_NOP)
-		complete(&s->cpu_idle_completion);
+		trusty_complete_cpu_idle(s);
 	else
 		mutex_unlock(&s->smc_lock);
 
@@ -299,26 +428,44 @@ static int trusty_init_api_version(struct trusty_state *s, struct device *dev)
 {
 	u32 api_version;
 	api_version = trusty_fast_call32(dev, SMC_FC_API_VERSION,
-					 TRUSTY_API_VERSION_CURRENT, 0, 0);
+					 TRUSTY_DRIVER_API_VERSION, 0, 0);
 	if (api_version == SM_ERR_UNDEFINED_SMC)
 		api_version = 0;
 
-	if (api_version > TRUSTY_API_VERSION_CURRENT) {
+	if (api_version > TRUSTY_DRIVER_API_VERSION) {
 		dev_err(dev, "unsupported api version %u > %u\n",
-			api_version, TRUSTY_API_VERSION_CURRENT);
+			api_version, TRUSTY_DRIVER_API_VERSION);
 		return -EINVAL;
 	}
 
 	dev_info(dev, "selected api version: %u (requested %u)\n",
-		 api_version, TRUSTY_API_VERSION_CURRENT);
+		 api_version, TRUSTY_DRIVER_API_VERSION);
 	s->api_version = api_version;
 
 	return 0;
 }
 
+static void trusty_init_stdcall_slots(struct trusty_state *s,
+				      struct device *dev)
+{
+	s32 slots = 1;
+
+	if (s->api_version >= TRUSTY_API_VERSION_MULTI_STDCALL)
+		slots = trusty_fast_call32(dev, SMC_FC_STDCALL_SLOTS, 0, 0, 0);
+
+	if (slots < 1)
+		slots = 1;
+	if (slots > TRUSTY_MAX_STDCALL_SLOTS)
+		slots = TRUSTY_MAX_STDCALL_SLOTS;
+
+	dev_info(dev, "std call slots: %d\n", slots);
+	s->stdcall_slots = slots;
+}
+
 static int trusty_probe(struct platform_device *pdev)
 {
 	int ret;
+	int i;
 	struct trusty_state *s;
 	struct device_node *node = pdev->dev.of_node;
 
@@ -335,6 +482,11 @@ static int trusty_probe(struct platform_device *pdev)
 	mutex_init(&s->smc_lock);
 	ATOMIC_INIT_NOTIFIER_HEAD(&s->notifier);
 	init_completion(&s->cpu_idle_completion);
+	spin_lock_init(&s->slot_lock);
+	init_waitqueue_head(&s->slot_wait);
+	for (i = 0; i < TRUSTY_MAX_STDCALL_SLOTS; i++)
+		init_completion(&s->slot_idle_completion[i]);
+	s->stdcall_slots = 1;
 	platform_set_drvdata(pdev, s);
 
 	trusty_init_version(s, &pdev->dev);
@@ -343,6 +495,8 @@ static int trusty_probe(struct platform_device *pdev)
 	if (ret < 0)
 		goto err_api_version;
 
+	trusty_init_stdcall_slots(s, &pdev->dev);
+
 	ret = of_platform_populate(pdev->dev.of_node, NULL, NULL, &pdev->dev);
 	if (ret < 0) {
 		dev_err(&pdev->dev, "Failed to add children: %d\n", ret);